@@ -0,0 +1,108 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "alert_writer.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+alert_writer::alert_writer(const std::filesystem::path& fname_) : fname(fname_) {
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0666);
+    if (fd < 0) throw std::runtime_error("cannot open " + fname.string() + ": " + strerror(errno));
+    thread = std::thread(&alert_writer::run, this);
+}
+
+alert_writer::~alert_writer() {
+    {
+        const std::lock_guard<std::mutex> lock(Mwake);
+        stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
+    const std::lock_guard<std::mutex> lock(Mfile);
+    write_queue();
+    ::close(fd);
+}
+
+void alert_writer::enqueue(const pos0_t& pos, std::string_view feature, std::string_view recorder) {
+    std::string line;
+    line.reserve(pos.path.size() + feature.size() + recorder.size() + 24);
+    pos.append_str(line);
+    line.push_back('\t');
+    line.append(feature);
+    line.push_back('\t');
+    line.append(recorder);
+    line.push_back('\n');
+    hit_t* hit = new hit_t(std::move(line));
+    hit->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(hit->next, hit, std::memory_order_release, std::memory_order_relaxed)) {}
+    if (++queued % NOTIFY_HITS == 0) wake.notify_one();
+}
+
+void alert_writer::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(Mwake);
+            wake.wait_for(lock, LATENCY, [this] { return stopping || queued >= NOTIFY_HITS; });
+            if (stopping) return; // the destructor takes what is left
+        }
+        if (head.load(std::memory_order_relaxed) == nullptr) continue;
+        const std::lock_guard<std::mutex> lock(Mfile);
+        write_queue();
+    }
+}
+
+void alert_writer::write_queue() {
+    hit_t* list = head.exchange(nullptr, std::memory_order_acquire);
+    hit_t* oldest = nullptr; // reverse the list, so that the hits are written in the order they were found
+    size_t n = 0;
+    size_t bytes = 0;
+    while (list) {
+        hit_t* next = list->next;
+        list->next = oldest;
+        oldest = list;
+        bytes += list->line.size();
+        n++;
+        list = next;
+    }
+    if (n == 0) return;
+    std::string batch;
+    batch.reserve(bytes);
+    while (oldest) {
+        hit_t* next = oldest->next;
+        batch.append(oldest->line);
+        delete oldest;
+        oldest = next;
+    }
+    queued -= n;
+    const char* p = batch.data();
+    size_t left = batch.size();
+    while (left > 0) {
+        const ssize_t w = ::write(fd, p, left);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            /* carry on: losing alerts is better than blocking the scanners */
+            if (!failed) std::cerr << "alert_writer: cannot write " << fname << ": " << strerror(errno) << "\n";
+            failed = true;
+            return;
+        }
+        p += w;
+        left -= w;
+    }
+    hits += n;
+    batches++;
+}
+
+void alert_writer::drain() {
+    const std::lock_guard<std::mutex> lock(Mfile);
+    write_queue();
+}
@@ -0,0 +1,72 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * alert_writer - writes the features that are on the alert list to {outdir}/ALERTS_found.txt.
+ *
+ * feature_recorder::write() checks every feature against the feature_recorder_set's alert_list (after the
+ * stop list) and hands each hit to the set's alert_writer. enqueue() formats the line and pushes it onto a
+ * lock-free list; a writer thread takes the whole list at once and appends it to the file, which is kept
+ * open, with one write(). The writer wakes when NOTIFY_HITS hits are waiting, and otherwise every LATENCY,
+ * so hits are in the file within about LATENCY of being found.
+ *
+ * Each line is pos0 \t feature \t the name of the feature recorder that found it.
+ */
+
+#ifndef ALERT_WRITER_H
+#define ALERT_WRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "pos0.h"
+
+class alert_writer {
+public:
+    static inline const std::string FILENAME{"ALERTS_found.txt"};
+    static inline const std::chrono::milliseconds LATENCY{100};
+    static inline const size_t NOTIFY_HITS = 1024;
+
+    explicit alert_writer(const std::filesystem::path& fname); // throws std::runtime_error
+    ~alert_writer();                                           // writes whatever is queued
+
+    void enqueue(const pos0_t& pos, std::string_view feature, std::string_view recorder); // threadsafe; never blocks
+    void drain();                                              // returns when every queued hit is written
+    uint64_t hits_written() const { return hits; }
+    uint64_t batches_written() const { return batches; }
+
+private:
+    alert_writer(const alert_writer&) = delete;
+    alert_writer& operator=(const alert_writer&) = delete;
+
+    struct hit_t {
+        explicit hit_t(std::string&& line_) : line(std::move(line_)) {}
+        hit_t* next{nullptr};
+        const std::string line;
+    };
+    std::atomic<hit_t*> head{nullptr}; // most recent first; pushed by the producers, emptied by the writer
+    std::atomic<size_t> queued{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> batches{0};
+
+    const std::filesystem::path fname;
+    std::mutex Mfile{};                // protects fd; held while writing
+    int fd{-1};
+    bool failed{false};                // a write failed; reported once
+
+    std::mutex Mwake{};                // only for sleeping; producers never take it
+    std::condition_variable wake{};
+    bool stopping{false};              // protected by Mwake
+    std::thread thread{};
+
+    void run();                        // the writer thread
+    void write_queue();                // Mfile must be held
+};
+
+#endif
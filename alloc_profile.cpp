@@ -0,0 +1,101 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "alloc_profile.h"
+
+/* Nothing here may allocate while counting, since operator new may be what is counting: the per-thread
+ * counts are plain thread-locals and the per-tag counts are fixed arrays.
+ */
+namespace {
+thread_local uint32_t tl_tag{0};
+thread_local uint64_t tl_allocs{0};
+thread_local uint64_t tl_bytes{0};
+thread_local uint64_t tl_untagged_allocs{0};
+thread_local uint64_t tl_untagged_bytes{0};
+
+std::atomic<uint64_t> tag_allocs[alloc_profile::MAX_TAGS]{};
+std::atomic<uint64_t> tag_bytes[alloc_profile::MAX_TAGS]{};
+
+std::mutex& names_mutex() {
+    static std::mutex M;
+    return M;
+}
+std::vector<std::string>& names() { // protected by names_mutex()
+    static std::vector<std::string> v{""};
+    return v;
+}
+} // namespace
+
+void alloc_profile::record_enabled(size_t bytes) {
+    tl_allocs++;
+    tl_bytes += bytes;
+    if (tl_tag == 0) {
+        tl_untagged_allocs++;
+        tl_untagged_bytes += bytes;
+        return;
+    }
+    tag_allocs[tl_tag].fetch_add(1, std::memory_order_relaxed);
+    tag_bytes[tl_tag].fetch_add(bytes, std::memory_order_relaxed);
+}
+
+alloc_profile::counts_t alloc_profile::thread_total() { return counts_t{tl_allocs, tl_bytes}; }
+alloc_profile::counts_t alloc_profile::thread_untagged() { return counts_t{tl_untagged_allocs, tl_untagged_bytes}; }
+
+uint32_t alloc_profile::intern(const std::string& name) {
+    const std::lock_guard<std::mutex> lock(names_mutex());
+    auto& v = names();
+    for (size_t i = 1; i < v.size(); i++) {
+        if (v[i] == name) return i;
+    }
+    if (v.size() >= MAX_TAGS) return 0;
+    v.push_back(name);
+    return v.size() - 1;
+}
+
+alloc_profile::tag_scope::tag_scope(uint32_t tag) : saved(tl_tag) { tl_tag = tag; }
+alloc_profile::tag_scope::~tag_scope() { tl_tag = saved; }
+
+std::map<std::string, alloc_profile::counts_t> alloc_profile::get_tagged() {
+    std::map<std::string, counts_t> ret;
+    const std::lock_guard<std::mutex> lock(names_mutex());
+    const auto& v = names();
+    for (size_t i = 1; i < v.size(); i++) {
+        const counts_t c{tag_allocs[i].load(std::memory_order_relaxed), tag_bytes[i].load(std::memory_order_relaxed)};
+        if (c.allocs > 0) ret[v[i]] = c;
+    }
+    return ret;
+}
+
+#ifdef BE13_ALLOC_PROFILE
+/* The replaceable global allocation functions; the aligned ones are left to the library */
+void* operator new(size_t n) {
+    alloc_profile::record(n);
+    while (true) {
+        if (void* p = malloc(n > 0 ? n : 1)) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) throw std::bad_alloc();
+        handler();
+    }
+}
+void* operator new[](size_t n) { return operator new(n); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(n);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { return operator new(n, std::nothrow); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+#endif
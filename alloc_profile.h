@@ -0,0 +1,80 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * alloc_profile - counts heap allocations, so that they can be charged to the scanners and feature
+ * recorders that made them.
+ *
+ * With scanner_config::alloc_profile, the scanner_set turns the counting on for the scan, and:
+ *
+ * - each scanner's stats (scanner_set::stats_t) get the allocations made during its calls, less those
+ *   of the scanners of its children and those of the feature recorders it wrote to, as ns and features are;
+ * - each feature recorder's write() and carve() charge what they allocate to the recorder's tag, and the
+ *   DFXML gets an <alloc_profile> with those totals;
+ * - each sbuf's "process_sbuf() END" log entry gets the allocations made while it and the children
+ *   scanned on its thread were scanned.
+ *
+ * What is counted is whatever calls record(). sbuf_pool reports every buffer and sbuf_t that it hands
+ * out. Configured with --enable-alloc-profile (BE13_ALLOC_PROFILE), this file also replaces the global
+ * operator new and delete, so that every C++ allocation is counted; that is a build option because a
+ * program can only have one operator new. malloc() itself is not interposed.
+ *
+ * Counting is off unless a scan asked for it, and then costs a thread-local increment per allocation,
+ * plus an atomic one while a tag is set.
+ */
+
+#ifndef ALLOC_PROFILE_H
+#define ALLOC_PROFILE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+class alloc_profile {
+public:
+    static inline const uint32_t MAX_TAGS = 1024;
+
+    struct counts_t {
+        uint64_t allocs{0};
+        uint64_t bytes{0};
+        counts_t operator-(const counts_t& b) const { return counts_t{allocs - b.allocs, bytes - b.bytes}; }
+        bool operator==(const counts_t& b) const { return allocs == b.allocs && bytes == b.bytes; }
+    };
+
+    /* Counting is on while any scan has enabled it */
+    static void enable() { users++; }
+    static void disable() { users--; }
+    static bool enabled() { return users.load(std::memory_order_relaxed) > 0; }
+
+    static void record(size_t bytes) {
+        if (enabled()) record_enabled(bytes);
+    }
+
+    /* The calling thread's allocations since it started, and those of them made while no tag was set */
+    static counts_t thread_total();
+    static counts_t thread_untagged();
+
+    /* Tags name who allocations are charged to. intern() takes a lock, so names are interned once; past
+     * MAX_TAGS, every name gets tag 0, which is never reported.
+     */
+    static uint32_t intern(const std::string& name);
+    class tag_scope {
+    public:
+        explicit tag_scope(uint32_t tag);     // charges the calling thread's allocations to tag
+        ~tag_scope();
+
+    private:
+        tag_scope(const tag_scope&) = delete;
+        tag_scope& operator=(const tag_scope&) = delete;
+        uint32_t saved;
+    };
+    static std::map<std::string, counts_t> get_tagged(); // the tags that were charged, by name; process-wide
+
+private:
+    static inline std::atomic<int> users{0};
+    static void record_enabled(size_t bytes);
+};
+
+#endif
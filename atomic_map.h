@@ -5,6 +5,9 @@
  * This is a nice lightweight atomic set when not much else is needed.
  *
  * 2020-07-06 - slg - Upgraded to to C++17.
+ *
+ * begin(), end() and find() return iterators that are used after the lock is released, so they are only
+ * safe when nothing else is changing the map. New code should use concurrent_map (concurrent_map.h).
  */
 
 #ifndef ATOMIC_MAP_H
@@ -81,6 +84,10 @@ public:
         AMReportElement(T1 key_, T2 value_) : key(key_), value(value_){};
         AMReportElement(T1 key_) : key(key_){};
         AMReportElement(){};
+        AMReportElement(const AMReportElement&) = default;
+        AMReportElement(AMReportElement&&) = default; // so that sorting a report moves the keys
+        AMReportElement& operator=(const AMReportElement&) = default;
+        AMReportElement& operator=(AMReportElement&&) = default;
         T1 key{};
         T2 value{};
         bool operator==(const AMReportElement& a) const { return (this->key == a.key) && (this->value == a.value); }
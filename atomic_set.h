@@ -10,40 +10,9 @@
 #ifndef ATOMIC_SET_H
 #define ATOMIC_SET_H
 
-#include <algorithm>
-#include <map>
-#include <mutex>
-#include <set>
-#include <unordered_map>
-#include <unordered_set>
-#include <vector>
+#include "concurrent_map.h"
 
-template <class TYPE> class atomic_set {
-    // Mutex M protects myset.
-    // It is mutable to allow modification in const methods
-    mutable std::mutex M{};
-    std::unordered_set<TYPE> myset{};
-
-public:
-    atomic_set() {}
-    bool contains(const TYPE& s) const {
-        const std::lock_guard<std::mutex> lock(M);
-        return myset.find(s) != myset.end();
-    }
-    void insert(const TYPE& s) {
-        const std::lock_guard<std::mutex> lock(M);
-        myset.insert(s);
-    }
-    bool check_for_presence_and_insert(const TYPE& s) {
-        const std::lock_guard<std::mutex> lock(M);
-        if (myset.find(s) != myset.end()) return true; // in the set
-        myset.insert(s);                               // otherwise insert it
-        return false;                                  // and return that it wasn't
-    }
-    size_t size() const {
-        const std::lock_guard<std::mutex> lock(M);
-        return myset.size();
-    }
-};
+/* Now a concurrent_set; new code should use concurrent_set directly */
+template <class TYPE> class atomic_set : public concurrent_set<TYPE> {};
 
 #endif
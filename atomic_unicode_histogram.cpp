@@ -10,6 +10,7 @@
 #include "unicode_escape.h"
 #include "utf8.h"
 
+#include <algorithm>
 #include <cwctype>
 #include <fstream>
 #include <iostream>
@@ -17,6 +18,7 @@
 #include <string>
 
 #include "atomic_unicode_histogram.h"
+#include "memory_counter.h"
 
 std::ostream& operator<<(std::ostream& os, const AtomicUnicodeHistogram::FrequencyReportVector& rep) {
     for (const auto& it : rep) { os << it; }
@@ -27,22 +29,122 @@ std::ostream& operator<<(std::ostream& os, const AtomicUnicodeHistogram::Frequen
 std::ostream& operator<<(std::ostream& os, const AtomicUnicodeHistogram::auh_t::AMReportElement& e) {
     os << "n=" << e.value.count << "\t" << validateOrEscapeUTF8(e.key, true, false, false);
     if (e.value.count16 > 0) os << "\t(utf16=" << e.value.count16 << ")";
+    if (e.value.error > 0) os << "\t(error<=" << e.value.error << ")";
     os << "\n";
     return os;
 }
 
+/* By count, then by UTF-16 count; equal tallies are in key order, so a report does not depend on how
+ * the histogram was built (for example, whether it was spilled).
+ */
+bool AtomicUnicodeHistogram::rank_order(const auh_t::AMReportElement& a, const auh_t::AMReportElement& b) {
+    if (a.value.count != b.value.count) return a.value.count > b.value.count;
+    if (a.value.count16 != b.value.count16) return a.value.count16 > b.value.count16;
+    return a.key < b.key;
+}
+
 /* Create a histogram report.
  * @param topN - if >0, return only this many.
  * Return only the topN.
  */
-AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::makeReport(size_t topN) {
-    auh_t::report rep = h.dump(true);
+AtomicUnicodeHistogram::AtomicUnicodeHistogram(const struct histogram_def& def_) : def(def_) {
+    if (def.flags.approximate > 0) {
+        sketch = std::make_unique<heavy_hitters>(def.flags.approximate);
+        tracked_bytes = sketch->bytes();
+    }
+}
+
+AtomicUnicodeHistogram::~AtomicUnicodeHistogram() {
+    if (memory) memory->sub(tracked_bytes);
+}
+
+void AtomicUnicodeHistogram::set_memory_counter(memory_counter* counter) {
+    memory = counter;
+    if (memory) memory->add(tracked_bytes);
+}
 
-    /* If we only want some of them, delete the extra */
-    if ((topN > 0) && (topN < rep.size())) { rep.resize(topN); }
+/* Merges the threads' tables first */
+AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::sketch_report() {
+    merge_locals();
+    auh_t::report rep;
+    const std::lock_guard<std::mutex> lock(Msketch);
+    for (const auto& it : sketch->entries()) {
+        auh_t::AMReportElement e(it.key);
+        e.value.count = std::min<uint64_t>(it.count, UINT32_MAX);
+        e.value.count16 = std::min<uint64_t>(it.count16, UINT32_MAX);
+        e.value.error = std::min<uint64_t>(it.error, UINT32_MAX);
+        rep.push_back(std::move(e));
+    }
     return rep;
 }
 
+AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::makeReport(size_t topN) {
+    if (sketch) {
+        auh_t::report rep;
+        for (auto& it : sketch_report()) select(rep, std::move(it), topN);
+        rank(rep, topN);
+        return rep;
+    }
+    merge_locals();
+    auh_t::report rep;
+    for (auto& shard : shards) {
+        const std::lock_guard<std::mutex> lock(shard.M);
+        for (const auto& it : shard.table) { select(rep, auh_t::AMReportElement(it.first, it.second), topN); }
+    }
+    rank(rep, topN);
+    return rep;
+}
+
+void AtomicUnicodeHistogram::takeReport(size_t topN, const std::function<void(const auh_t::AMReportElement&)>& emit) {
+    if (sketch) {
+        const auh_t::report rep = makeReport(topN);
+        clear();
+        for (const auto& it : rep) emit(it);
+        return;
+    }
+    merge_locals();
+    auh_t::report rep;
+    for (auto& shard : shards) {
+        table_t table;
+        size_t removed = 0;
+        {
+            const std::lock_guard<std::mutex> lock(shard.M);
+            table.swap(shard.table);
+            removed = shard.bytes;
+            shard.bytes = 0;
+        }
+        account(0, removed);
+        while (!table.empty()) {
+            auto node = table.extract(table.begin());
+            select(rep, auh_t::AMReportElement(std::move(node.key()), node.mapped()), topN);
+        }
+    }
+    rank(rep, topN);
+    for (const auto& it : rep) emit(it);
+}
+
+/* With a topN, rep is a heap of the best topN so far, with the worst of them on top */
+void AtomicUnicodeHistogram::select(auh_t::report& rep, auh_t::AMReportElement&& e, size_t topN) {
+    if (topN == 0) {
+        rep.push_back(std::move(e));
+    } else if (rep.size() < topN) {
+        rep.push_back(std::move(e));
+        std::push_heap(rep.begin(), rep.end(), rank_order);
+    } else if (rank_order(e, rep.front())) {
+        std::pop_heap(rep.begin(), rep.end(), rank_order);
+        rep.back() = std::move(e);
+        std::push_heap(rep.begin(), rep.end(), rank_order);
+    }
+}
+
+void AtomicUnicodeHistogram::rank(auh_t::report& rep, size_t topN) {
+    if (topN == 0) {
+        std::sort(rep.begin(), rep.end(), rank_order);
+    } else {
+        std::sort_heap(rep.begin(), rep.end(), rank_order);
+    }
+}
+
 /**
  * Takes a string (the key) passed in, figure out what it is, and add it to a unicode histogram.
  * Typically it is going to be UTF16 or UTF8.
@@ -59,26 +161,150 @@ AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::makeReport(size_t
 
 // debug_histogram_malloc_fail_frequency allows us to simulate low-memory situations for testing the code.
 uint32_t AtomicUnicodeHistogram::debug_histogram_malloc_fail_frequency = 0;
-void AtomicUnicodeHistogram::clear() { h.clear(); }
+void AtomicUnicodeHistogram::clear() {
+    merge_locals();
+    if (sketch) {
+        const std::lock_guard<std::mutex> lock(Msketch);
+        const size_t before = sketch->bytes();
+        sketch->clear();
+        account(sketch->bytes(), before);
+    }
+    for (auto& shard : shards) {
+        const std::lock_guard<std::mutex> lock(shard.M);
+        shard.table.clear();
+        account(0, shard.bytes);
+        shard.bytes = 0;
+    }
+}
 
-void AtomicUnicodeHistogram::add(const std::string& key_unknown_encoding) {
-    if (key_unknown_encoding.size() == 0) return; // don't deal with zero-length keys
+/* The key, its tally and the hash node, which holds a pointer and the cached hash */
+size_t AtomicUnicodeHistogram::entry_bytes(const std::string& key) {
+    return sizeof(table_t::value_type) + 2 * sizeof(void*) + (key.size() < sizeof(std::string) ? 0 : key.size() + 1);
+}
+
+void AtomicUnicodeHistogram::account(size_t added, size_t removed) {
+    tracked_bytes += added;
+    tracked_bytes -= removed;
+    if (memory) {
+        if (added > removed) {
+            memory->add(added - removed);
+        } else {
+            memory->sub(removed - added);
+        }
+    }
+}
+
+/* Each thread remembers its local_t for every histogram it has added to. Histogram ids are never reused,
+ * so an entry for a histogram that has been deleted is never looked up again.
+ */
+AtomicUnicodeHistogram::local_t& AtomicUnicodeHistogram::my_local() {
+    static thread_local std::unordered_map<uint64_t, local_t*> mine;
+    auto it = mine.find(id);
+    if (it != mine.end()) return *it->second;
+    const std::lock_guard<std::mutex> lock(Mlocals);
+    locals.push_back(std::make_unique<local_t>());
+    mine[id] = locals.back().get();
+    return *locals.back();
+}
+
+void AtomicUnicodeHistogram::merge(table_t& table) {
+    if (sketch) {
+        const std::lock_guard<std::mutex> lock(Msketch);
+        const size_t before = sketch->bytes();
+        for (auto& it : table) sketch->add(it.first, it.second.count, it.second.count16);
+        account(sketch->bytes(), before);
+        table.clear();
+        return;
+    }
+    /* Sort the keys by shard so that each shard is locked once */
+    std::vector<table_t::value_type*> by_shard[SHARDS];
+    for (auto& it : table) { by_shard[std::hash<std::string>{}(it.first) % SHARDS].push_back(&it); }
+    size_t added = 0;
+    for (size_t i = 0; i < SHARDS; i++) {
+        if (by_shard[i].empty()) continue;
+        const std::lock_guard<std::mutex> lock(shards[i].M);
+        for (auto* it : by_shard[i]) {
+            auto [where, inserted] = shards[i].table.try_emplace(it->first);
+            if (inserted) {
+                const size_t b = entry_bytes(it->first);
+                shards[i].bytes += b;
+                added += b;
+            }
+            where->second.count += it->second.count;
+            where->second.count16 += it->second.count16;
+        }
+    }
+    table.clear();
+    if (added) account(added, 0);
+}
+
+void AtomicUnicodeHistogram::add_tally(const std::string& key, const HistogramTally& tally) {
+    if (sketch) {
+        const std::lock_guard<std::mutex> lock(Msketch);
+        const size_t before = sketch->bytes();
+        sketch->add(key, tally.count, tally.count16);
+        account(sketch->bytes(), before);
+        return;
+    }
+    shard_t& shard = shards[std::hash<std::string>{}(key) % SHARDS];
+    size_t added = 0;
+    {
+        const std::lock_guard<std::mutex> lock(shard.M);
+        auto [where, inserted] = shard.table.try_emplace(key);
+        if (inserted) {
+            added = entry_bytes(key);
+            shard.bytes += added;
+        }
+        where->second.count += tally.count;
+        where->second.count16 += tally.count16;
+    }
+    if (added) account(added, 0);
+}
+
+AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::take_sorted() {
+    auh_t::report rep;
+    if (sketch) return rep; // its memory is fixed, so there is nothing to gain by spilling it
+    merge_locals();
+    for (auto& shard : shards) {
+        table_t table;
+        size_t removed = 0;
+        {
+            const std::lock_guard<std::mutex> lock(shard.M);
+            table.swap(shard.table);
+            removed = shard.bytes;
+            shard.bytes = 0;
+        }
+        account(0, removed);
+        for (auto& it : table) { rep.push_back(auh_t::AMReportElement(it.first, it.second)); }
+    }
+    std::sort(rep.begin(), rep.end()); // keys are unique, so this is by key
+    return rep;
+}
+
+void AtomicUnicodeHistogram::merge_locals() {
+    const std::lock_guard<std::mutex> lock(Mlocals);
+    for (auto& local : locals) {
+        const std::lock_guard<std::mutex> llock(local->M);
+        merge(local->table);
+    }
+}
+
+bool AtomicUnicodeHistogram::make_key(const histogram_def& def, const std::string& key_unknown_encoding,
+                                      std::string& displayString, bool& found_utf16) {
+    if (key_unknown_encoding.size() == 0) return false; // don't deal with zero-length keys
 
     /* On input, the key may be UTF8 or UTF16. See if we can figure it out */
-    bool found_utf16 = false;   // did we find a utf16?
+    found_utf16 = false;        // did we find a utf16?
     bool little_endian = false; // was it little_endian?
-    std::u32string u32key;      // u32key. Doesn't matter if LE or BE, because we never write it out.
+    std::string u8key;          // the key converted from UTF-16
 
     if (looks_like_utf16(key_unknown_encoding, little_endian)) {
-        // We have an endian-guessing implementation that converts from 16 to 8, so convert from 16 to 8
-        // and then convert it to utf32
-        u32key = convert_utf8_to_utf32(convert_utf16_to_utf8(key_unknown_encoding, little_endian));
+        // We have an endian-guessing implementation that converts from 16 to 8
+        u8key = convert_utf16_to_utf8(key_unknown_encoding, little_endian);
         found_utf16 = true;
-    } else {
-        u32key = convert_utf8_to_utf32(key_unknown_encoding);
     }
 
-    /* At this point we have UTF-32, which we treat as raw unicode characters.
+    /* At this point we have UTF-8. histogram_def::match() only goes to UTF-32 when it must.
      *
      * We would like to process lowercase, numeric and regular expressions in utf32 world.
      * Ideally this would be done with ICU, but we do not want to assume we have ICU.
@@ -95,34 +321,48 @@ void AtomicUnicodeHistogram::add(const std::string& key_unknown_encoding) {
      * https://www.moria.us/articles/wchar-is-a-historical-accident/?
      */
 
-    std::string u8key = convert_utf32_to_utf8(u32key);
-    std::string displayString;
+    if (!def.match(found_utf16 ? u8key : key_unknown_encoding, &displayString)) return false;
 
-    if (def.match(u8key, &displayString)) {
-        /* Escape as necessary */
-        displayString = validateOrEscapeUTF8(displayString, true, true, false);
+    /* Escape as necessary */
+    if (!is_printable_ascii(displayString, true)) displayString = validateOrEscapeUTF8(displayString, true, true, false);
+    return true;
+}
 
+void AtomicUnicodeHistogram::add(const std::string& key_unknown_encoding) {
+    std::string displayString;
+    bool found_utf16 = false;
+    if (make_key(def, key_unknown_encoding, displayString, found_utf16)) {
         /* For debugging low-memory handling logic,
          * specify DEBUG_MALLOC_FAIL to make malloc occasionally fail
          */
         if (debug_histogram_malloc_fail_frequency) {
-            if ((h.size() % debug_histogram_malloc_fail_frequency) == (debug_histogram_malloc_fail_frequency - 1)) {
+            if ((adds++ % debug_histogram_malloc_fail_frequency) == (debug_histogram_malloc_fail_frequency - 1)) {
                 throw std::bad_alloc();
             }
         }
 
-        /* Add the key to the histogram. Note that this is threadsafe */
-        h.insertIfNotContains(displayString, HistogramTally());
-        h[displayString].count++;
+        /* Count it in this thread's table, which is merged into the shards when it is full */
+        local_t& local = my_local();
+        const std::lock_guard<std::mutex> lock(local.M);
+        HistogramTally& t = local.table[displayString];
+        t.count++;
         if (found_utf16) {
-            h[displayString].count16++; // track how many UTF16s were converted
+            t.count16++; // track how many UTF16s were converted
         }
+        if (local.table.size() >= LOCAL_KEYS) merge(local.table);
     }
 }
 
-size_t AtomicUnicodeHistogram::bytes() // returns the total number of bytes of the histogram,.
-{
-    size_t count = sizeof(*this);
-    for (auto it : h) { count += sizeof(it.first) + it.first.size() + it.second.bytes(); }
+size_t AtomicUnicodeHistogram::size() {
+    merge_locals();
+    if (sketch) {
+        const std::lock_guard<std::mutex> lock(Msketch);
+        return sketch->size();
+    }
+    size_t count = 0;
+    for (auto& shard : shards) {
+        const std::lock_guard<std::mutex> lock(shard.M);
+        count += shard.table.size();
+    }
     return count;
 }
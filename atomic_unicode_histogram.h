@@ -15,32 +15,56 @@
  *
  * Note - case transitions and text extraction is performed in UTF-32.
  *      - regular expression are then run on the UTF-8. (Not the best, but it works for now.)
+ *
+ * Concurrency: each thread that calls add() counts into its own small table, LOCAL_KEYS keys at most,
+ * which takes only that table's (uncontended) mutex. When the table fills, it is merged into the shared
+ * histogram, which is split into SHARDS hash tables with a mutex each, taking each shard's mutex once.
+ * Anything that reads the histogram merges all of the threads' tables first.
+ *
+ * Memory: bytes() is maintained as keys reach the shards, rather than computed, and each change is also
+ * added to the memory counter, if one is set; the feature_recorder_set uses this to keep the total for all
+ * of its histograms. The threads' tables, which are bounded, are not counted.
+ *
+ * Approximate histograms: if def.flags.approximate is set, the threads' tables are merged into a
+ * heavy_hitters summary of that many keys instead of the shards. Its memory is fixed and it never spills.
+ * Reports have only the keys it kept, and each count may be up to its tally's error too high.
  */
 
 #include "atomic_map.h"
+#include "heavy_hitters.h"
 #include "histogram_def.h"
 #include "unicode_escape.h"
 #include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 struct AtomicUnicodeHistogram {
     static uint32_t debug_histogram_malloc_fail_frequency; // for debugging, make malloc fail sometimes
     struct HistogramTally {
         uint32_t count{0};   // total strings seen
         uint32_t count16{0}; // total utf16 strings seen
+        uint32_t error{0};   // approximate histograms only: count is at most this much too high
         HistogramTally(const HistogramTally& a) {
             this->count = a.count;
             this->count16 = a.count16;
+            this->error = a.error;
         }
         HistogramTally& operator=(const HistogramTally& a) {
             this->count = a.count;
             this->count16 = a.count16;
+            this->error = a.error;
             return *this;
         }
 
         HistogramTally(){};
         virtual ~HistogramTally(){};
 
-        bool operator==(const HistogramTally& a) const { return this->count == a.count && this->count16 == a.count16; };
+        bool operator==(const HistogramTally& a) const {
+            return this->count == a.count && this->count16 == a.count16 && this->error == a.error;
+        };
         bool operator!=(const HistogramTally& a) const { return !(*this == a); }
         bool operator<(const HistogramTally& a) const {
             return (this->count < a.count) || ((this->count == a.count && (this->count16 < a.count16)));
@@ -52,21 +76,73 @@ struct AtomicUnicodeHistogram {
     typedef atomic_map<std::string, struct AtomicUnicodeHistogram::HistogramTally> auh_t;
     typedef std::vector<auh_t::AMReportElement> FrequencyReportVector;
 
-    AtomicUnicodeHistogram(const struct histogram_def& def_) : def(def_) {}
-    virtual ~AtomicUnicodeHistogram(){};
+    static inline const size_t SHARDS = 64;
+    static inline const size_t LOCAL_KEYS = 1024; // keys a thread counts before merging them into the shards
+
+    AtomicUnicodeHistogram(const struct histogram_def& def_);
+    virtual ~AtomicUnicodeHistogram(); // takes its bytes off the memory counter
 
     void clear();                     // empties the histogram
     void add(const std::string& key); // adds Unicode string to the histogram count
-    size_t bytes();                   // returns the total number of bytes of the histogram,.
+    /* The histogram key that add() would count for a feature, if def matches it; also used by the SQL histograms */
+    static bool make_key(const histogram_def& def, const std::string& key, std::string& displayString, bool& found_utf16);
+    size_t bytes() const { return sizeof(*this) + tracked_bytes; } // estimated memory used by the histogram
+    size_t size();                    // number of distinct keys
+    void set_memory_counter(class memory_counter* counter); // adds bytes() to the counter
+    bool approximate() const { return sketch != nullptr; }
+
+    /* For spilling and merging */
+    auh_t::report take_sorted();      // empties the histogram and returns its contents sorted by key; not approximate
+    void add_tally(const std::string& key, const HistogramTally& tally); // add a key that was already made
 
     /** makeReport() makes a report and returns a
-     * FrequencyReportVector.
+     * FrequencyReportVector, ranked with rank_order().
+     * With a topN, only the topN are ever held (in a heap), rather than everything being copied and sorted.
+     * Each shard is locked only while it is copied.
      */
+    static bool rank_order(const auh_t::AMReportElement& a, const auh_t::AMReportElement& b); // most counted first
     auh_t::report makeReport(size_t topN = 0); // returns just the topN; 0 means all
+    /* takeReport() empties the histogram and calls emit for each element of makeReport(topN), in order.
+     * The keys are moved out of the shards, not copied, and each shard is freed as it is emptied, so the
+     * histogram is never in memory twice; emit can write the report out as it goes.
+     */
+    void takeReport(size_t topN, const std::function<void(const auh_t::AMReportElement&)>& emit);
     const struct histogram_def def;            // the definition we are making
 
 private:
-    auh_t h{}; // the histogram
+    AtomicUnicodeHistogram(const AtomicUnicodeHistogram&) = delete;
+    AtomicUnicodeHistogram& operator=(const AtomicUnicodeHistogram&) = delete;
+
+    typedef std::unordered_map<std::string, HistogramTally> table_t;
+    struct shard_t {
+        std::mutex M{};        // protects table and bytes
+        table_t table{};
+        size_t bytes{0};       // estimated memory used by table
+    };
+    struct local_t {
+        std::mutex M{};        // protects table; taken by other threads only to merge it
+        table_t table{};
+    };
+    shard_t shards[SHARDS]{};
+    std::mutex Msketch{};      // protects sketch
+    std::unique_ptr<heavy_hitters> sketch{}; // instead of the shards, if def.flags.approximate
+
+    std::mutex Mlocals{};      // protects locals
+    std::vector<std::unique_ptr<local_t>> locals{};
+    const uint64_t id{next_id++}; // distinguishes this histogram in each thread's table of its local_t's
+    static inline std::atomic<uint64_t> next_id{0};
+    std::atomic<uint64_t> adds{0};
+    std::atomic<size_t> tracked_bytes{0};
+    class memory_counter* memory{nullptr};
+    static size_t entry_bytes(const std::string& key); // estimated memory for a key in a shard
+    static void select(auh_t::report& rep, auh_t::AMReportElement&& e, size_t topN); // offer e for a report
+    static void rank(auh_t::report& rep, size_t topN); // puts what select() kept in rank order
+    void account(size_t added, size_t removed);        // updates tracked_bytes and *memory
+
+    local_t& my_local();        // this thread's table, created on first use
+    void merge(table_t& table); // adds table to the shards and empties it; the caller holds table's lock
+    void merge_locals();        // merge every thread's table
+    auh_t::report sketch_report(); // the approximate histogram's keys
 };
 
 std::ostream& operator<<(std::ostream& os, const AtomicUnicodeHistogram::FrequencyReportVector& rep);
@@ -11,11 +11,45 @@ AC_C_BIGENDIAN([AC_DEFINE(BE13_API_BIGENDIAN, 1, [Big Endian aarchitecutre - lik
 
 AC_CHECK_HEADERS([dirent.h dlfcn.h err.h errno.h fcntl.h limits.h limits/limits.h linux/if_ether.h net/ethernet.h netinet/if_ether.h netinet/in.h pcap.h pcap/pcap.h pthread.h sqlite3.h stdint.h stdio.h stdlib.h string.h sys/cdefs.h sys/mman.h sys/stat.h sys/time.h sys/types.h unistd.h windows.h windows.h windowsx.h winsock2.h wpcap/pcap.h mach-o/dyld.h])
 
-AC_CHECK_FUNCS([gmtime_r ishexnumber isxdigit localtime_r unistd.h mmap err errx warn warnx pread64 pread strptime _lseeki64 utimes ])
+AC_CHECK_FUNCS([gmtime_r ishexnumber isxdigit localtime_r unistd.h mmap err errx warn warnx pread64 pread strptime _lseeki64 utimes posix_fadvise posix_memalign madvise ])
+
+# scanner plugins; see scanner_set::add_scanner_file()
+AC_SEARCH_LIBS([dlopen],[dl])
 
 AC_CHECK_LIB([sqlite3],[sqlite3_libversion])
 AC_CHECK_FUNCS([sqlite3_create_function_v2])
 
+# compressed feature files; see frame_codec.h
+AC_CHECK_HEADERS([zlib.h zstd.h lz4frame.h])
+AC_CHECK_LIB([z],[deflate])
+AC_CHECK_LIB([zstd],[ZSTD_compress])
+AC_CHECK_LIB([lz4],[LZ4F_compressFrame])
+
+# zero-copy writing of carved files; see carve_writer.h
+AC_CHECK_HEADERS([sys/sendfile.h sys/uio.h])
+AC_CHECK_FUNCS([copy_file_range sendfile])
+
+# allocation profiling, which replaces the global operator new; see alloc_profile.h
+AC_ARG_ENABLE([alloc-profile],
+  [AS_HELP_STRING([--enable-alloc-profile],[count every operator new, for scanner_config::alloc_profile])],
+  [if test "x$enableval" = "xyes"; then
+     AC_DEFINE(BE13_ALLOC_PROFILE,1,[define 1 to replace operator new with one that alloc_profile counts])
+   fi])
+
+# NUMA placement; see numa.h
+AC_CHECK_HEADERS([sched.h sys/syscall.h])
+AC_CHECK_FUNCS([sched_setaffinity sched_getcpu])
+
+# RE2 for regex_vector and histogram_def; see regex_engine.h
+AC_LANG_PUSH([C++])
+AC_CHECK_HEADERS([re2/re2.h])
+be13_saved_LIBS="$LIBS"
+LIBS="-lre2 $LIBS"
+AC_LINK_IFELSE([AC_LANG_PROGRAM([[#include <re2/re2.h>]],[[RE2 re("a+"); return RE2::PartialMatch("aa", re) ? 0 : 1;]])],
+  [AC_DEFINE(HAVE_LIBRE2,1,[define 1 if RE2 can be linked])],
+  [LIBS="$be13_saved_LIBS"])
+AC_LANG_POP([C++])
+
 AC_COMPILE_IFELSE([AC_LANG_PROGRAM(
 [[#pragma GCC diagnostic ignored "-Wredundant-decls"
   int a=3;
@@ -0,0 +1,357 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * bench_be13_api - benchmarks of the be13_api hot paths.
+ *
+ * Every benchmark runs once to warm up and then -r times; the results are the minimum and median time
+ * per operation, and the rate in MB/s for the benchmarks that process bytes. The inputs are made with
+ * fixed seeds, so two runs (or two versions of be13_api) benchmark exactly the same work.
+ *
+ * Usage: bench_be13_api [-o results.json] [-f filter] [-r repeats] [-t max_threads] [-q]
+ *   -o  also write the results as JSON
+ *   -f  only run the benchmarks whose names contain filter
+ *   -r  timed runs per benchmark (default 5)
+ *   -t  the most threads for the threaded benchmarks (default: the number of cores)
+ *   -q  don't print the table
+ *
+ * "make bench" builds this and writes bench_be13_api.json.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "atomic_unicode_histogram.h"
+#include "fast_hash.h"
+#include "feature_recorder_set.h"
+#include "histogram_def.h"
+#include "regex_vector.h"
+#include "sbuf.h"
+#include "scan_sha1_test.h"
+#include "scanner_config.h"
+#include "scanner_set.h"
+#include "utils.h"
+#include "word_and_context_list.h"
+
+namespace {
+
+struct bench_result {
+    std::string name{};
+    unsigned int threads{1};
+    uint64_t ops{0};   // operations per run
+    uint64_t bytes{0}; // bytes processed per run
+    double min_ns{0};  // per operation
+    double median_ns{0};
+    double mbps() const { return bytes && min_ns ? (bytes / (min_ns * ops)) * 1e9 / 1e6 : 0; }
+};
+
+struct bench_options {
+    std::string filter{};
+    unsigned int repeats{5};
+    unsigned int max_threads{1};
+    bool quiet{false};
+};
+
+bench_options opts;
+std::vector<bench_result> results;
+
+/* Time body(), which does ops operations over bytes bytes in all */
+void measure(const std::string& name, unsigned int threads, uint64_t ops, uint64_t bytes, std::function<void()> body) {
+    if (opts.filter.size() && name.find(opts.filter) == std::string::npos) return;
+    body(); // warm up
+    std::vector<double> ns;
+    for (unsigned int r = 0; r < opts.repeats; r++) {
+        const auto t0 = std::chrono::steady_clock::now();
+        body();
+        const auto t1 = std::chrono::steady_clock::now();
+        ns.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count() / ops);
+    }
+    std::sort(ns.begin(), ns.end());
+    bench_result res;
+    res.name = name;
+    res.threads = threads;
+    res.ops = ops;
+    res.bytes = bytes;
+    res.min_ns = ns.front();
+    res.median_ns = ns[ns.size() / 2];
+    results.push_back(res);
+    if (!opts.quiet) {
+        std::cout << std::left << std::setw(40) << name << std::right << std::setw(4) << threads << std::fixed
+                  << std::setprecision(1) << std::setw(14) << res.min_ns << std::setw(14) << res.median_ns;
+        if (bytes) std::cout << std::setw(12) << res.mbps();
+        std::cout << std::endl;
+    }
+}
+
+/* A buffer of n bytes made with a fixed seed */
+std::vector<uint8_t> random_bytes(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<uint8_t> v(n);
+    for (auto& b : v) b = static_cast<uint8_t>(rng());
+    return v;
+}
+
+/* n random lowercase words of 4..12 letters */
+std::vector<std::string> random_words(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::string> v;
+    for (size_t i = 0; i < n; i++) {
+        std::string w(4 + rng() % 9, 'a');
+        for (auto& c : w) c = static_cast<char>('a' + rng() % 26);
+        v.push_back(w);
+    }
+    return v;
+}
+
+std::filesystem::path tests_dir() {
+    const char* srcdir = getenv("srcdir");
+    if (srcdir) return std::filesystem::path(srcdir) / "tests";
+    char rpath[4096];
+    ssize_t ret = readlink("/proc/self/exe", rpath, sizeof(rpath) - 1);
+    if (ret < 0) return "tests";
+    rpath[ret] = 0;
+    return std::filesystem::path(rpath).parent_path() / "tests";
+}
+
+/****************************************************************
+ *** The benchmarks
+ ****************************************************************/
+
+void bench_sbuf() {
+    const size_t N = 1024 * 1024;
+    const auto data = random_bytes(N, 1);
+    sbuf_t sb(pos0_t("bench"), data.data(), data.size());
+
+    volatile size_t sink = 0;
+    const uint64_t SLICES = 100000;
+    measure("sbuf_slice", 1, SLICES, 0, [&]() {
+        for (uint64_t i = 0; i < SLICES; i++) sink = sink + sb.slice((i * 4099) % (N - 4096), 4096).bufsize;
+    });
+
+    /* Slices that don't cover the whole buffer have their own cache, so each op hashes */
+    const uint64_t PAGES = N / 4096 - 1;
+    measure("sbuf_hash_sha1_4k", 1, PAGES, PAGES * 4096, [&]() {
+        for (uint64_t i = 0; i < PAGES; i++) sink = sink + sb.slice(i * 4096, 4096).hash().size();
+    });
+    measure("sbuf_fast_hash_4k", 1, PAGES, PAGES * 4096, [&]() {
+        for (uint64_t i = 0; i < PAGES; i++) sink = sink + sb.slice(i * 4096, 4096).fast_hash().lo;
+    });
+    measure("fast_hash128_1m", 1, 1, N, [&]() { sink = sink + fast_hash128(data.data(), N).lo; });
+
+    /* A repeating 8-gram is only found by looking at every candidate size */
+    std::vector<uint8_t> ng(N);
+    for (size_t i = 0; i < N; i++) ng[i] = "bench13!"[i % 8];
+    sbuf_t nsb(pos0_t("ngram"), ng.data(), ng.size());
+
+    /* Neither is found, so both scan the whole buffer */
+    measure("sbuf_find_char", 1, 1, N, [&]() { sink = sink + nsb.find(static_cast<uint8_t>('z'), 0); });
+    measure("sbuf_find_str", 1, 1, N, [&]() { sink = sink + sb.find("be13_api bench", 0); });
+    measure("sbuf_classify_page_ngram", 1, PAGES, PAGES * 4096, [&]() {
+        for (uint64_t i = 0; i < PAGES; i++) sink = sink + nsb.slice(i * 4096, 4096).classify_page(32).ngram_size;
+    });
+    measure("sbuf_classify_page_random", 1, PAGES, PAGES * 4096, [&]() {
+        for (uint64_t i = 0; i < PAGES; i++) sink = sink + sb.slice(i * 4096, 4096).classify_page(32).ngram_size;
+    });
+}
+
+void bench_feature_recorder(const std::filesystem::path& outdir) {
+    const uint64_t FEATURES = 100000;
+    const auto words = random_words(FEATURES, 2);
+    std::vector<std::string> contexts;
+    for (const auto& w : words) contexts.push_back("before " + w + " after the feature");
+    uint64_t bytes = 0;
+    for (const auto& w : words) bytes += w.size();
+
+    scanner_config sc;
+    sc.outdir = outdir / "feature_recorder";
+    std::filesystem::create_directory(sc.outdir);
+    feature_recorder_set frs(feature_recorder_set::flags_t(), sc);
+    feature_recorder& ctx = frs.create_feature_recorder("bench_context");
+    feature_recorder_def::flags_t nc;
+    nc.no_context = true;
+    feature_recorder& noctx = frs.create_feature_recorder(feature_recorder_def("bench_no_context", nc));
+
+    const pos0_t p0("bench");
+    measure("feature_recorder_write_context", 1, FEATURES, bytes, [&]() {
+        for (uint64_t i = 0; i < FEATURES; i++) ctx.write(p0.at(i * 16), words[i], contexts[i]);
+    });
+    measure("feature_recorder_write_no_context", 1, FEATURES, bytes, [&]() {
+        for (uint64_t i = 0; i < FEATURES; i++) noctx.write(p0.at(i * 16), words[i], contexts[i]);
+    });
+}
+
+void bench_histogram() {
+    const uint64_t KEYS = 200000;
+    const auto words = random_words(KEYS, 3);
+    const histogram_def def("bench", "bench", "", "", "", histogram_def::flags_t());
+    std::vector<unsigned int> counts; // 1, 2, 4, ... and max_threads
+    for (unsigned int t = 1; t < opts.max_threads; t *= 2) counts.push_back(t);
+    counts.push_back(opts.max_threads);
+    for (const unsigned int threads : counts) {
+        measure("atomic_unicode_histogram_add", threads, KEYS, 0, [&]() {
+            AtomicUnicodeHistogram h(def);
+            std::vector<std::thread> workers;
+            for (unsigned int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    for (uint64_t i = t; i < KEYS; i += threads) h.add(words[i]);
+                });
+            }
+            for (auto& w : workers) w.join();
+        });
+    }
+}
+
+void bench_word_and_context() {
+    const auto words = random_words(20000, 4);
+    word_and_context_list wcl;
+    for (size_t i = 0; i < words.size() / 2; i++) {
+        if (i % 2) {
+            wcl.add_fc(words[i], "");
+        } else {
+            wcl.add_fc(words[i], "before " + words[i] + " after");
+        }
+    }
+    wcl.add_regex("^zz[a-z]*q$");
+    /* half are in the list, and half are not */
+    std::vector<std::string> contexts;
+    for (const auto& w : words) contexts.push_back("before " + w + " after");
+    volatile size_t sink = 0;
+    measure("word_and_context_check_feature_context", 1, words.size(), 0, [&]() {
+        for (size_t i = 0; i < words.size(); i++) sink = sink + wcl.check_feature_context(words[i], contexts[i]);
+    });
+}
+
+void bench_regex_vector() {
+    regex_vector rv;
+    const auto words = random_words(64, 5);
+    for (const auto& w : words) rv.push_back(w);
+    rv.push_back("[0-9]{3}-[0-9]{2}-[0-9]{4}");
+    rv.push_back("[a-z]+@[a-z]+\\.com");
+
+    /* 4KiB lines of text with no matches, each of which has to be searched to the end */
+    const auto text = random_words(4096, 6);
+    std::vector<std::string> lines;
+    std::string line;
+    for (const auto& w : text) {
+        line += w + " ";
+        if (line.size() > 4096) {
+            lines.push_back(line);
+            line.clear();
+        }
+    }
+    uint64_t bytes = 0;
+    for (const auto& l : lines) bytes += l.size();
+    volatile size_t sink = 0;
+    measure("regex_vector_search_all", 1, lines.size(), bytes, [&]() {
+        std::string found;
+        for (const auto& l : lines) sink = sink + rv.search_all(l, &found);
+    });
+}
+
+void bench_process_sbuf(const std::filesystem::path& outdir) {
+    const auto fname = tests_dir() / "random.dat";
+    std::unique_ptr<sbuf_t> random(sbuf_t::map_file(fname));
+    if (!random) {
+        std::cerr << "bench_be13_api: cannot map " << fname << "; skipping process_sbuf" << std::endl;
+        return;
+    }
+    scanner_config sc;
+    sc.outdir = outdir / "process_sbuf";
+    std::filesystem::create_directory(sc.outdir);
+    sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    ss.add_scanner(scan_sha1_test);
+    ss.apply_scanner_commands();
+    ss.phase_scan();
+
+    /* Every buffer starts with a different counter, so that none is skipped as a duplicate */
+    const uint64_t BUFFERS = 16;
+    uint64_t counter = 0;
+    measure("scanner_set_process_sbuf_sha1", 1, BUFFERS, BUFFERS * random->bufsize, [&]() {
+        for (uint64_t i = 0; i < BUFFERS; i++, counter++) {
+            auto sbuf = sbuf_t::sbuf_malloc(pos0_t("random", counter * random->bufsize), random->bufsize);
+            uint8_t* buf = static_cast<uint8_t*>(sbuf->malloc_buf());
+            memcpy(buf, random->get_buf(), random->bufsize);
+            memcpy(buf, &counter, std::min(sizeof(counter), random->bufsize));
+            ss.process_sbuf(sbuf);
+        }
+    });
+    ss.shutdown();
+}
+
+void write_json(std::ostream& os) {
+    os << "{\n  \"version\": \"" << PACKAGE_VERSION << "\",\n"
+       << "  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n"
+       << "  \"repeats\": " << opts.repeats << ",\n"
+       << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        os << "    {\"name\": \"" << r.name << "\", \"threads\": " << r.threads << ", \"ops\": " << r.ops
+           << ", \"bytes\": " << r.bytes << std::fixed << std::setprecision(1) << ", \"min_ns_per_op\": " << r.min_ns
+           << ", \"median_ns_per_op\": " << r.median_ns << ", \"mb_per_sec\": " << r.mbps() << "}"
+           << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+void usage() {
+    std::cerr << "usage: bench_be13_api [-o results.json] [-f filter] [-r repeats] [-t max_threads] [-q]" << std::endl;
+    exit(1);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string json_file;
+    opts.max_threads = std::max(1u, std::thread::hardware_concurrency());
+    int ch;
+    while ((ch = getopt(argc, argv, "o:f:r:t:qh")) != -1) {
+        switch (ch) {
+        case 'o': json_file = optarg; break;
+        case 'f': opts.filter = optarg; break;
+        case 'r': opts.repeats = std::max(1, atoi(optarg)); break;
+        case 't': opts.max_threads = std::max(1, atoi(optarg)); break;
+        case 'q': opts.quiet = true; break;
+        default: usage();
+        }
+    }
+    if (optind != argc) usage();
+
+    const auto outdir = NamedTemporaryDirectory();
+    if (!opts.quiet) {
+        std::cout << std::left << std::setw(40) << "benchmark" << std::right << std::setw(4) << "thr" << std::setw(14)
+                  << "min ns/op" << std::setw(14) << "median ns/op" << std::setw(12) << "MB/s" << std::endl;
+    }
+    bench_sbuf();
+    bench_feature_recorder(outdir);
+    bench_histogram();
+    bench_word_and_context();
+    bench_regex_vector();
+    bench_process_sbuf(outdir);
+    std::filesystem::remove_all(outdir);
+
+    if (json_file.size()) {
+        std::ofstream of(json_file);
+        if (!of.is_open()) {
+            std::cerr << "bench_be13_api: cannot write " << json_file << std::endl;
+            return 1;
+        }
+        write_json(of);
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * byte_order - fixed little-endian integers for the files that be13_api writes and maps (compiled stop
+ * lists, digest sets, the page cache, feature file offset indexes), so that they read the same on any host.
+ * len is the width of the integer in bytes, at most 8.
+ */
+
+#ifndef BYTE_ORDER_H
+#define BYTE_ORDER_H
+
+#include <cstdint>
+#include <string>
+
+inline void put_le(uint8_t* p, uint64_t v, int len) {
+    for (int i = 0; i < len; i++, v >>= 8) p[i] = v & 0xff;
+}
+
+inline void put_le(std::string& out, uint64_t v, int len) {
+    for (int i = 0; i < len; i++, v >>= 8) out.push_back(static_cast<char>(v & 0xff));
+}
+
+inline uint64_t get_le(const uint8_t* p, int len) {
+    uint64_t v = 0;
+    for (int i = len - 1; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+#endif
@@ -0,0 +1,240 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include "carve_writer.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+carve_writer::job_t::job_t(job_t&& that) noexcept
+    : dir(std::move(that.dir)), fname(std::move(that.fname)), header_buf(that.header_buf),
+      header_len(that.header_len), data_buf(that.data_buf), data_len(that.data_len), src_fd(that.src_fd),
+      owns_src_fd(that.owns_src_fd), src_offset(that.src_offset), src_len(that.src_len), copy(std::move(that.copy)),
+      copied(that.copied), mtime(that.mtime) {
+    that.owns_src_fd = false;
+}
+
+carve_writer::job_t::~job_t() {
+    if (owns_src_fd) ::close(src_fd);
+}
+
+carve_writer::carve_writer(size_t threads_, size_t max_queued_bytes_) : max_queued_bytes(max_queued_bytes_) {
+    for (size_t i = 0; i < threads_; i++) { threads.emplace_back(&carve_writer::run, this); }
+}
+
+carve_writer::~carve_writer() {
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    not_empty.notify_all();
+    for (auto& t : threads) { t.join(); } // the threads empty the queue before they stop
+    if (failures) std::cerr << "carve_writer: " << failures << " carved files not written: " << first_error << "\n";
+}
+
+carve_writer::job_t carve_writer::make_job(const std::filesystem::path& dir, const std::string& fname,
+                                           const sbuf_t& header, const sbuf_t& data, time_t mtime) const {
+    job_t job;
+    job.dir = dir;
+    job.fname = fname;
+    job.mtime = mtime;
+    job.header_buf = header.get_buf();
+    job.header_len = header.bufsize;
+
+    int fd = -1;
+    uint64_t offset = 0;
+    if (data.bufsize > 0 && data.file_extent(fd, offset)) {
+        job.src_fd = fd;
+        job.src_offset = offset;
+        job.src_len = data.bufsize;
+        if (async()) {
+            job.src_fd = ::dup(fd); // the sbuf's descriptor is closed when it is deleted
+            job.owns_src_fd = job.src_fd >= 0;
+            if (job.src_fd < 0) job.src_len = 0; // fall back to copying the data
+        }
+    }
+    if (job.src_len == 0) {
+        job.data_buf = data.get_buf();
+        job.data_len = data.bufsize;
+    }
+    if (async()) {
+        job.copy.reserve(job.header_len + job.data_len);
+        job.copy.append(reinterpret_cast<const char*>(job.header_buf), job.header_len);
+        if (job.data_len) job.copy.append(reinterpret_cast<const char*>(job.data_buf), job.data_len);
+        job.copied = true;
+    }
+    return job;
+}
+
+void carve_writer::submit(job_t&& job) {
+    if (!async()) {
+        write(job);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(M);
+    not_full.wait(lock, [&] { return queued_bytes == 0 || queued_bytes + job.bytes() <= max_queued_bytes; });
+    queued_bytes += job.bytes();
+    queue.emplace_back(std::move(job));
+    lock.unlock();
+    not_empty.notify_one();
+}
+
+void carve_writer::drain() {
+    std::unique_lock<std::mutex> lock(M);
+    idle.wait(lock, [&] { return queue.empty() && active == 0; });
+    if (failures) {
+        const std::string msg = std::to_string(failures) + " carved files could not be written: " + first_error;
+        failures = 0;
+        first_error.clear();
+        throw std::runtime_error(msg);
+    }
+}
+
+void carve_writer::run() {
+    std::unique_lock<std::mutex> lock(M);
+    while (true) {
+        not_empty.wait(lock, [&] { return stopping || !queue.empty(); });
+        if (queue.empty()) return; // stopping, and nothing left to write
+        job_t job(std::move(queue.front()));
+        queue.pop_front();
+        active++;
+        lock.unlock();
+        std::string error;
+        try {
+            write(job);
+        } catch (const std::exception& e) { error = e.what(); }
+        lock.lock();
+        if (!error.empty() && failures++ == 0) first_error = error;
+        queued_bytes -= job.bytes();
+        active--;
+        not_full.notify_all();
+        if (queue.empty() && active == 0) idle.notify_all();
+    }
+}
+
+size_t carve_writer::queue_bytes() const {
+    const std::lock_guard<std::mutex> lock(M);
+    return queued_bytes;
+}
+
+size_t carve_writer::directories_created() const {
+    const std::lock_guard<std::mutex> lock(Mdirs);
+    return dirs.size();
+}
+
+/* The carving directories are created once each; after that, no system call is needed */
+void carve_writer::make_dir(const std::filesystem::path& dir) {
+    const std::lock_guard<std::mutex> lock(Mdirs);
+    if (dirs.find(dir.string()) != dirs.end()) return;
+    std::filesystem::create_directories(dir);
+    dirs.insert(dir.string());
+}
+
+static void write_all(int fd, const uint8_t* buf, size_t len, const std::filesystem::path& path) {
+    while (len > 0) {
+        const ssize_t n = ::write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error("error writing file " + path.string() + ": " + strerror(errno));
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Copy the job's range of its source file, by the kernel if possible */
+void carve_writer::copy_range(int out_fd, const job_t& job) {
+    off_t in_off = job.src_offset;
+    uint64_t left = job.src_len;
+#ifdef HAVE_COPY_FILE_RANGE
+    while (left > 0) {
+        const ssize_t n = copy_file_range(job.src_fd, &in_off, out_fd, nullptr, left, 0);
+        if (n <= 0) break; // not supported here (EXDEV, ENOSYS...): try the next way
+        left -= n;
+        zero_copy += n;
+    }
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    while (left > 0) {
+        const ssize_t n = sendfile(out_fd, job.src_fd, &in_off, left);
+        if (n <= 0) break;
+        left -= n;
+        zero_copy += n;
+    }
+#endif
+    /* Read it ourselves */
+    std::vector<uint8_t> buf(std::min<uint64_t>(left, 1024 * 1024));
+    const std::filesystem::path path = job.dir / job.fname;
+    while (left > 0) {
+        const ssize_t n = ::pread(job.src_fd, buf.data(), std::min<uint64_t>(left, buf.size()), in_off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error("error reading carved data for " + path.string());
+        write_all(out_fd, buf.data(), n, path);
+        in_off += n;
+        left -= n;
+    }
+}
+
+void carve_writer::write(job_t& job) {
+    make_dir(job.dir);
+    const std::filesystem::path path = job.dir / job.fname;
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        perror(path.c_str());
+        throw std::runtime_error("cannot open file for writing:" + path.string());
+    }
+    const uint8_t* header = job.copied ? reinterpret_cast<const uint8_t*>(job.copy.data()) : job.header_buf;
+    const uint8_t* data = job.copied ? header + job.header_len : job.data_buf;
+    try {
+#ifdef HAVE_SYS_UIO_H
+        if (job.header_len > 0 && job.data_len > 0) {
+            struct iovec iov[2] = {{const_cast<uint8_t*>(header), job.header_len},
+                                   {const_cast<uint8_t*>(data), job.data_len}};
+            ssize_t n = ::writev(fd, iov, 2);
+            if (n < 0 && errno != EINTR) throw std::runtime_error("error writing file " + path.string());
+            if (n < 0) n = 0;
+            /* finish a short write the simple way */
+            const size_t h = std::min<size_t>(n, job.header_len);
+            write_all(fd, header + h, job.header_len - h, path);
+            const size_t d = n - h;
+            write_all(fd, data + d, job.data_len - d, path);
+        } else
+#endif
+        {
+            write_all(fd, header, job.header_len, path);
+            write_all(fd, data, job.data_len, path);
+        }
+        if (job.src_len > 0) copy_range(fd, job);
+    } catch (const std::exception&) {
+        ::close(fd);
+        throw;
+    }
+    if (::close(fd) != 0) throw std::runtime_error("error writing file " + path.string());
+
+    /* Set timestamp if necessary. Note that we do not use std::filesystem::last_write_time()
+     * as there seems to be no portable way to use it.
+     */
+    if (job.mtime > 0) {
+        const struct timeval times[2] = {{job.mtime, 0}, {job.mtime, 0}};
+        utimes(path.c_str(), times);
+    }
+    files++;
+}
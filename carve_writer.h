@@ -0,0 +1,111 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * carve_writer - writes carved files for the feature recorders of a feature_recorder_set.
+ *
+ * feature_recorder::carve() records the feature line and hands the file to the carve_writer.
+ * With no threads, the file is written before carve() returns. With threads, it goes onto a queue
+ * that holds at most max_queued_bytes of carved data (submit() waits when it is full) and the
+ * writer threads create it, so the scanners are not held up by slow storage. drain() waits for the
+ * queue to empty; the feature recorder set drains it when it shuts down.
+ *
+ * Data in memory is written with a single writev() along with any header. Data that is part of a
+ * mapped file (see sbuf_t::file_extent()) is copied from the file by the kernel with
+ * copy_file_range() or sendfile(), so it never passes through the writer's memory or the queue.
+ *
+ * The directories that carved files go in are created once and remembered.
+ */
+
+#ifndef CARVE_WRITER_H
+#define CARVE_WRITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sbuf.h"
+
+class carve_writer {
+public:
+    static inline const size_t DEFAULT_THREADS = 2;
+    static inline const size_t DEFAULT_MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+    struct job_t {
+        job_t() {}
+        job_t(job_t&& that) noexcept;
+        job_t& operator=(job_t&&) = delete;
+        job_t(const job_t&) = delete;
+        ~job_t();                        // closes src_fd if the job owns it
+
+        std::filesystem::path dir{};     // created if necessary
+        std::string fname{};             // within dir
+        const uint8_t* header_buf{nullptr}; // written first
+        size_t header_len{0};
+        const uint8_t* data_buf{nullptr};   // the data, if it is in memory, or ...
+        size_t data_len{0};
+        int src_fd{-1};                  // ... src_len bytes of this file from src_offset
+        bool owns_src_fd{false};
+        uint64_t src_offset{0};
+        uint64_t src_len{0};
+        std::string copy{};              // if copied, the header followed by the data; the _buf pointers are unused
+        bool copied{false};
+        time_t mtime{0};                 // if >0, the carved file's modification time
+        size_t bytes() const { return copy.size(); } // memory the job holds
+    };
+
+    explicit carve_writer(size_t threads = 0, size_t max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES);
+    ~carve_writer();                     // writes whatever is queued
+
+    /* A job for header followed by data. If the writer has threads, the data is copied or, if it is in a
+     * mapped file, the file descriptor is dup()ed, so the sbufs can be freed when this returns.
+     */
+    job_t make_job(const std::filesystem::path& dir, const std::string& fname, const sbuf_t& header,
+                   const sbuf_t& data, time_t mtime) const;
+    void submit(job_t&& job);            // throws std::runtime_error if there are no threads and the write fails
+    void drain();                        // throws std::runtime_error if any queued write failed
+    bool async() const { return !threads.empty(); }
+
+    uint64_t files_written() const { return files; }
+    uint64_t zero_copy_bytes() const { return zero_copy; } // copied from a mapped file by the kernel
+    size_t queue_bytes() const;          // carved data waiting to be written
+    size_t directories_created() const;
+
+private:
+    carve_writer(const carve_writer&) = delete;
+    carve_writer& operator=(const carve_writer&) = delete;
+
+    const size_t max_queued_bytes;
+    mutable std::mutex M{};              // protects everything below
+    std::condition_variable not_empty{};
+    std::condition_variable not_full{};
+    std::condition_variable idle{};
+    std::deque<job_t> queue{};
+    size_t queued_bytes{0};
+    size_t active{0};                    // jobs being written
+    bool stopping{false};
+    size_t failures{0};
+    std::string first_error{};
+    std::vector<std::thread> threads{};
+
+    mutable std::mutex Mdirs{};
+    std::set<std::string> dirs{};        // directories that are known to exist
+
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> zero_copy{0};
+
+    void run();
+    void make_dir(const std::filesystem::path& dir);
+    void write(job_t& job);              // throws std::runtime_error
+    void copy_range(int out_fd, const job_t& job);
+};
+
+#endif
@@ -7,6 +7,52 @@
 
 #ifndef CHAR_CLASS_H
 #define CHAR_CLASS_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * byte_counts() adds the number of times each byte value occurs in buf to counts.
+ * Incrementing one table serializes on the bins of repeated bytes (each increment waits for the last
+ * store to the same bin), so the bytes are counted into four tables in turn, eight bytes per 64-bit
+ * load, and the tables are summed at the end. Scatter-increments don't vectorize, so this is the fast
+ * way to do it on every instruction set.
+ */
+inline void byte_counts(const uint8_t* buf, size_t len, uint64_t counts[256]) {
+    static const size_t SMALL = 256; // below this, counting the bytes directly beats clearing the tables
+    if (len < SMALL) {
+        for (size_t i = 0; i < len; i++) counts[buf[i]]++;
+        return;
+    }
+    uint32_t tables[4][256];
+    memset(tables, 0, sizeof(tables));
+    size_t i = 0;
+    /* a uint32_t bin holds 1<<32 counts; count at most that much between flushes */
+    static const size_t FLUSH = (size_t(1) << 31);
+    while (i + 8 <= len) {
+        const size_t stop = len - i > FLUSH ? i + FLUSH : len;
+        for (; i + 8 <= stop; i += 8) {
+            uint64_t w;
+            memcpy(&w, buf + i, 8);
+            tables[0][w & 0xff]++;
+            tables[1][(w >> 8) & 0xff]++;
+            tables[2][(w >> 16) & 0xff]++;
+            tables[3][(w >> 24) & 0xff]++;
+            tables[0][(w >> 32) & 0xff]++;
+            tables[1][(w >> 40) & 0xff]++;
+            tables[2][(w >> 48) & 0xff]++;
+            tables[3][w >> 56]++;
+        }
+        for (size_t b = 0; b < 256; b++) {
+            counts[b] += uint64_t(tables[0][b]) + tables[1][b] + tables[2][b] + tables[3][b];
+        }
+        memset(tables, 0, sizeof(tables));
+    }
+    for (; i < len; i++) counts[buf[i]]++;
+}
+
 struct CharClass {
     uint32_t range_0_9{0};  // a range_0_9 character
     uint32_t range_A_Fi{0}; // a-f or A-F
@@ -21,7 +67,63 @@ struct CharClass {
         if (ch >= '0' && ch <= '9') range_0_9++;
     }
     void add(const uint8_t* buf, size_t len) {
-        for (size_t i = 0; i < len; i++) { add(buf[i]); }
+        uint64_t counts[256]{};
+        byte_counts(buf, len, counts);
+        add(counts);
+    }
+    void add(const uint64_t counts[256]) { // a histogram from byte_counts()
+        for (int ch = '0'; ch <= '9'; ch++) range_0_9 += counts[ch];
+        for (int ch = 'a'; ch <= 'f'; ch++) range_A_Fi += counts[ch] + counts[ch - 'a' + 'A'];
+        for (int ch = 'g'; ch <= 'z'; ch++) range_g_z += counts[ch];
+        for (int ch = 'G'; ch <= 'Z'; ch++) range_G_Z += counts[ch];
+    }
+};
+
+/**
+ * \class byte_profile_t
+ * The byte histogram of a buffer, its class totals and its Shannon entropy: what a scanner looks at
+ * to decide whether a buffer is worth parsing. sbuf_t::byte_profile() computes it once per sbuf.
+ * Encrypted and well-compressed data have an entropy close to 8 bits per byte; text has few bytes
+ * outside of printable ASCII.
+ */
+struct byte_profile_t {
+    static inline constexpr double RANDOM_ENTROPY = 7.5;  // bits per byte at which data looks random
+    static inline constexpr double TEXT_FRACTION = 0.95;  // fraction of text bytes at which data looks like text
+
+    uint64_t counts[256]{};
+    uint64_t total{0};
+    uint64_t zero{0};      // NUL bytes
+    uint64_t text{0};      // printable ASCII, tab, CR and LF
+    uint64_t high{0};      // 0x80 and above
+    CharClass classes{};
+    double entropy{0};     // bits per byte, 0 to 8
+
+    byte_profile_t() {}
+    byte_profile_t(const uint8_t* buf, size_t len) { add(buf, len); }
+    void add(const uint8_t* buf, size_t len) {
+        byte_counts(buf, len, counts);
+        finish();
+    }
+    bool looks_random() const { return total > 0 && entropy >= RANDOM_ENTROPY; }
+    bool looks_text() const { return total > 0 && text >= TEXT_FRACTION * total; }
+
+    /* The class totals and the entropy, from counts */
+    void finish() {
+        total = zero = text = high = 0;
+        entropy = 0;
+        for (size_t b = 0; b < 256; b++) total += counts[b];
+        if (total == 0) return;
+        classes = CharClass();
+        classes.add(counts);
+        for (size_t b = 0x20; b < 0x7f; b++) text += counts[b];
+        text += counts['\t'] + counts['\n'] + counts['\r'];
+        for (size_t b = 0x80; b < 256; b++) high += counts[b];
+        zero = counts[0];
+        for (size_t b = 0; b < 256; b++) {
+            if (counts[b] == 0) continue;
+            const double p = double(counts[b]) / total;
+            entropy -= p * std::log2(p);
+        }
     }
 };
 
@@ -0,0 +1,231 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * concurrent_map and concurrent_set - hash containers for many threads, to replace atomic_map and atomic_set.
+ *
+ * Each container is split into SHARDS std::unordered_maps (or sets) chosen by the key's hash, each with a
+ * std::shared_mutex. Lookups take a shard's lock shared, so readers never wait for each other, and writers
+ * only contend when they hit the same shard at the same time. size() is an atomic count and takes no lock.
+ *
+ * Nothing returns an iterator or a reference into the container, because either would be used after the
+ * lock is released. Instead:
+ *   find() returns a copy of the value, and visit() calls a function on it while the shard is locked.
+ *   upsert() finds or value-initializes the key's value and calls a function on it under the same lock,
+ *       so a counter is incremented with one probe: m.upsert(key, [](int& v) { v++; });
+ *   snapshot() copies the contents, one shard at a time; sorted_snapshot() also sorts them by key.
+ *   for_each() calls a function on every entry, holding each shard's lock shared while it is visited.
+ * The functions given to visit(), upsert() and for_each() must not call back into the container.
+ *
+ * A snapshot is consistent within each shard but not across shards: entries added or removed while it is
+ * being taken may or may not be in it.
+ */
+
+#ifndef CONCURRENT_MAP_H
+#define CONCURRENT_MAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/* The shard for a hash. The hash is mixed first, because std::hash is often the identity and the
+ * low bits are also the ones that unordered_map uses to choose a bucket.
+ */
+inline size_t concurrent_shard(size_t h, size_t shards) {
+    uint64_t x = h;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x & (shards - 1);
+}
+
+template <class K, class V, class Hash = std::hash<K>, class KeyEqual = std::equal_to<K>> class concurrent_map {
+public:
+    static inline const size_t SHARDS = 32; // must be a power of 2
+    typedef std::vector<std::pair<K, V>> snapshot_t;
+
+    concurrent_map() {}
+
+    bool contains(const K& key) const {
+        const shard_t& s = shard(key);
+        const std::shared_lock<std::shared_mutex> lock(s.M);
+        return s.map.find(key) != s.map.end();
+    }
+    std::optional<V> find(const K& key) const {
+        const shard_t& s = shard(key);
+        const std::shared_lock<std::shared_mutex> lock(s.M);
+        auto it = s.map.find(key);
+        if (it == s.map.end()) return std::nullopt;
+        return it->second;
+    }
+    /* Call f(const V&) on key's value with the shard locked shared; false if key is not present */
+    template <class F> bool visit(const K& key, F f) const {
+        const shard_t& s = shard(key);
+        const std::shared_lock<std::shared_mutex> lock(s.M);
+        auto it = s.map.find(key);
+        if (it == s.map.end()) return false;
+        f(static_cast<const V&>(it->second));
+        return true;
+    }
+    /* Insert key if it is not present; true if it was inserted. An existing value is not changed. */
+    bool insert(const K& key, const V& val) {
+        shard_t& s = shard(key);
+        const std::unique_lock<std::shared_mutex> lock(s.M);
+        if (!s.map.try_emplace(key, val).second) return false;
+        count++;
+        return true;
+    }
+    void insert_or_assign(const K& key, const V& val) {
+        shard_t& s = shard(key);
+        const std::unique_lock<std::shared_mutex> lock(s.M);
+        if (s.map.insert_or_assign(key, val).second) count++;
+    }
+    /* Call f(V&) on key's value, which is value-initialized first if key is not present; true if it was not */
+    template <class F> bool upsert(const K& key, F f) {
+        shard_t& s = shard(key);
+        const std::unique_lock<std::shared_mutex> lock(s.M);
+        auto [it, inserted] = s.map.try_emplace(key);
+        if (inserted) count++;
+        f(it->second);
+        return inserted;
+    }
+    bool erase(const K& key) {
+        shard_t& s = shard(key);
+        const std::unique_lock<std::shared_mutex> lock(s.M);
+        if (s.map.erase(key) == 0) return false;
+        count--;
+        return true;
+    }
+    void clear() {
+        for (auto& s : shards) {
+            const std::unique_lock<std::shared_mutex> lock(s.M);
+            count -= s.map.size();
+            s.map.clear();
+        }
+    }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    /* Call f(const K&, const V&) on every entry, a shard at a time */
+    template <class F> void for_each(F f) const {
+        for (const auto& s : shards) {
+            const std::shared_lock<std::shared_mutex> lock(s.M);
+            for (const auto& it : s.map) f(it.first, it.second);
+        }
+    }
+    snapshot_t snapshot() const {
+        snapshot_t ret;
+        ret.reserve(size());
+        for_each([&ret](const K& key, const V& val) { ret.emplace_back(key, val); });
+        return ret;
+    }
+    snapshot_t sorted_snapshot() const {
+        snapshot_t ret = snapshot();
+        std::sort(ret.begin(), ret.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        return ret;
+    }
+    /* Move everything out, leaving the map empty. Each shard is freed as it is emptied. */
+    snapshot_t take() {
+        snapshot_t ret;
+        for (auto& s : shards) {
+            std::unordered_map<K, V, Hash, KeyEqual> map;
+            {
+                const std::unique_lock<std::shared_mutex> lock(s.M);
+                map.swap(s.map);
+                count -= map.size();
+            }
+            while (!map.empty()) {
+                auto node = map.extract(map.begin());
+                ret.emplace_back(std::move(node.key()), std::move(node.mapped()));
+            }
+        }
+        return ret;
+    }
+
+private:
+    concurrent_map(const concurrent_map&) = delete;
+    concurrent_map& operator=(const concurrent_map&) = delete;
+
+    struct shard_t {
+        mutable std::shared_mutex M{}; // protects map
+        std::unordered_map<K, V, Hash, KeyEqual> map{};
+    };
+    shard_t shards[SHARDS]{};
+    std::atomic<size_t> count{0};
+    shard_t& shard(const K& key) { return shards[concurrent_shard(Hash{}(key), SHARDS)]; }
+    const shard_t& shard(const K& key) const { return shards[concurrent_shard(Hash{}(key), SHARDS)]; }
+};
+
+template <class K, class Hash = std::hash<K>, class KeyEqual = std::equal_to<K>> class concurrent_set {
+public:
+    static inline const size_t SHARDS = 32; // must be a power of 2
+
+    concurrent_set() {}
+
+    bool contains(const K& key) const {
+        const shard_t& s = shard(key);
+        const std::shared_lock<std::shared_mutex> lock(s.M);
+        return s.set.find(key) != s.set.end();
+    }
+    /* true if key was inserted, false if it was already present */
+    bool insert(const K& key) {
+        shard_t& s = shard(key);
+        const std::unique_lock<std::shared_mutex> lock(s.M);
+        if (!s.set.insert(key).second) return false;
+        count++;
+        return true;
+    }
+    /* the opposite sense: true if key was already present; otherwise it is inserted */
+    bool check_for_presence_and_insert(const K& key) { return !insert(key); }
+    bool erase(const K& key) {
+        shard_t& s = shard(key);
+        const std::unique_lock<std::shared_mutex> lock(s.M);
+        if (s.set.erase(key) == 0) return false;
+        count--;
+        return true;
+    }
+    void clear() {
+        for (auto& s : shards) {
+            const std::unique_lock<std::shared_mutex> lock(s.M);
+            count -= s.set.size();
+            s.set.clear();
+        }
+    }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    template <class F> void for_each(F f) const {
+        for (const auto& s : shards) {
+            const std::shared_lock<std::shared_mutex> lock(s.M);
+            for (const auto& it : s.set) f(it);
+        }
+    }
+    std::vector<K> snapshot() const {
+        std::vector<K> ret;
+        ret.reserve(size());
+        for_each([&ret](const K& key) { ret.push_back(key); });
+        return ret;
+    }
+
+private:
+    concurrent_set(const concurrent_set&) = delete;
+    concurrent_set& operator=(const concurrent_set&) = delete;
+
+    struct shard_t {
+        mutable std::shared_mutex M{}; // protects set
+        std::unordered_set<K, Hash, KeyEqual> set{};
+    };
+    shard_t shards[SHARDS]{};
+    std::atomic<size_t> count{0};
+    shard_t& shard(const K& key) { return shards[concurrent_shard(Hash{}(key), SHARDS)]; }
+    const shard_t& shard(const K& key) const { return shards[concurrent_shard(Hash{}(key), SHARDS)]; }
+};
+
+#endif
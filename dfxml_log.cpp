@@ -0,0 +1,95 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <ctime>
+#include <unordered_map>
+
+#include "dfxml_log.h"
+
+#include "dfxml_cpp/src/dfxml_writer.h"
+
+dfxml_log::dfxml_log(dfxml_writer& writer_) : writer(writer_) { thread = std::thread(&dfxml_log::run, this); }
+
+dfxml_log::~dfxml_log() {
+    {
+        const std::lock_guard<std::mutex> lock(Mwake);
+        stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
+    flush();
+}
+
+dfxml_log::local_t& dfxml_log::my_local() {
+    static thread_local std::unordered_map<uint64_t, local_t*> mine;
+    auto it = mine.find(id);
+    if (it != mine.end()) return *it->second;
+    const std::lock_guard<std::mutex> lock(Mlocals);
+    locals.push_back(std::make_unique<local_t>());
+    mine[id] = locals.back().get();
+    return *locals.back();
+}
+
+void dfxml_log::write(std::string_view tag, std::string_view message) {
+    local_t& local = my_local();
+    bool notify = false;
+    {
+        const std::lock_guard<std::mutex> lock(local.M);
+        std::string& buf = local.buf;
+        buf.push_back('<');
+        buf.append(tag);
+        buf.append(" t='");
+        buf.append(std::to_string(time(0)));
+        buf.append("'>");
+        buf.append(message);
+        buf.append("</");
+        buf.append(tag);
+        buf.append(">\n");
+        notify = buf.size() >= BUFFER_BYTES;
+    }
+    entry_count++;
+    if (notify) {
+        {
+            const std::lock_guard<std::mutex> lock(Mwake);
+            full = true;
+        }
+        wake.notify_one();
+    }
+}
+
+void dfxml_log::flush() {
+    const std::lock_guard<std::mutex> flock(Mflush);
+    std::vector<local_t*> all;
+    {
+        const std::lock_guard<std::mutex> lock(Mlocals);
+        for (auto& it : locals) all.push_back(it.get());
+    }
+    bool wrote = false;
+    for (auto* local : all) {
+        std::string buf;
+        {
+            const std::lock_guard<std::mutex> lock(local->M);
+            buf.swap(local->buf);
+        }
+        if (buf.empty()) continue;
+        writer.writexml(buf);
+        wrote = true;
+    }
+    if (wrote) {
+        writer.flush();
+        flush_count++;
+    }
+}
+
+void dfxml_log::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(Mwake);
+            wake.wait_for(lock, LATENCY, [this] { return stopping || full; });
+            if (stopping) return; // the destructor flushes what is left
+            full = false;
+        }
+        flush();
+    }
+}
@@ -0,0 +1,72 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * dfxml_log - buffered DFXML log entries for the scanner_set.
+ *
+ * scanner_set::process_sbuf() logs the start and end of every sbuf at depth <= log_depth. Writing each of
+ * those entries through the dfxml_writer would take the writer's mutex twice per sbuf on every worker.
+ * Instead each thread appends its entries to its own buffer, which only that thread and the flusher ever
+ * lock, and a background thread hands all of the buffers to the writer every LATENCY, or sooner when a
+ * buffer reaches BUFFER_BYTES, with one writexml() each. flush() does the same immediately.
+ *
+ * Entries from one thread stay in order; entries from different threads are interleaved a buffer at a
+ * time, and each carries its time.
+ */
+
+#ifndef DFXML_LOG_H
+#define DFXML_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class dfxml_writer;
+class dfxml_log {
+public:
+    static inline const size_t BUFFER_BYTES = 64 * 1024;
+    static inline const std::chrono::milliseconds LATENCY{250};
+
+    explicit dfxml_log(dfxml_writer& writer);
+    ~dfxml_log(); // flushes
+
+    /* Append <tag t='time'>message</tag> to this thread's buffer. message is not escaped. */
+    void write(std::string_view tag, std::string_view message);
+    void flush(); // every buffer to the writer, now
+    uint64_t entries() const { return entry_count; }
+    uint64_t flushes() const { return flush_count; }
+
+private:
+    dfxml_log(const dfxml_log&) = delete;
+    dfxml_log& operator=(const dfxml_log&) = delete;
+
+    struct local_t {
+        std::mutex M{};    // protects buf; taken by other threads only to flush it
+        std::string buf{};
+    };
+    dfxml_writer& writer;
+    std::mutex Mlocals{};  // protects locals
+    std::vector<std::unique_ptr<local_t>> locals{};
+    std::mutex Mflush{};   // one flush at a time, so that each thread's entries reach the writer in order
+    const uint64_t id{next_id++}; // distinguishes this log in each thread's table of its local_t's
+    static inline std::atomic<uint64_t> next_id{0};
+    std::atomic<uint64_t> entry_count{0};
+    std::atomic<uint64_t> flush_count{0};
+
+    std::mutex Mwake{};
+    std::condition_variable wake{};
+    bool stopping{false};  // protected by Mwake
+    bool full{false};      // a buffer reached BUFFER_BYTES; protected by Mwake
+    std::thread thread{};
+
+    local_t& my_local();   // this thread's buffer, created on first use
+    void run();            // the flusher thread
+};
+
+#endif
@@ -0,0 +1,259 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "byte_order.h"
+#include "digest_set.h"
+#include "sbuf.h"
+
+digest_set::digest_t digest_set::from_bytes(const uint8_t* buf, size_t len) {
+    digest_t d;
+    for (size_t i = 0; i < 16; i++) {
+        uint64_t v = (i < len) ? buf[i] : 0;
+        if (i < 8) {
+            d.hi = (d.hi << 8) | v;
+        } else {
+            d.lo = (d.lo << 8) | v;
+        }
+    }
+    return d;
+}
+
+digest_set::digest_t digest_set::from_hex(const std::string& hex) {
+    uint8_t buf[16]{};
+    for (size_t i = 0; i < 32 && i < hex.size(); i++) {
+        char ch = hex[i];
+        uint8_t nibble = 0;
+        if (ch >= '0' && ch <= '9') nibble = ch - '0';
+        else if (ch >= 'a' && ch <= 'f') nibble = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F') nibble = ch - 'A' + 10;
+        else throw std::runtime_error("digest_set::from_hex: invalid hex digest: " + hex);
+        buf[i / 2] |= (i % 2 == 0) ? (nibble << 4) : nibble;
+    }
+    return from_bytes(buf, sizeof(buf));
+}
+
+/****************************************************************
+ *** EXACT mode
+ ****************************************************************/
+
+/* The digests are already uniformly distributed, so the low bits index the table directly. */
+bool digest_set::shard_t::find_slot(const digest_t& d, size_t& slot) const {
+    const digest_t empty{};
+    const size_t mask = slots.size() - 1;
+    size_t i = d.lo & mask;
+    while (true) {
+        if (slots[i] == d) {
+            slot = i;
+            return true;
+        }
+        if (slots[i] == empty) {
+            slot = i;
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+void digest_set::shard_t::grow() {
+    const digest_t empty{};
+    std::vector<digest_t> old;
+    old.swap(slots);
+    slots.resize(old.size() ? old.size() * 2 : 64);
+    for (const auto& it : old) {
+        if (it != empty) {
+            size_t slot = 0;
+            find_slot(it, slot);
+            slots[slot] = it;
+        }
+    }
+}
+
+bool digest_set::check_for_presence_and_insert(const digest_t& d) {
+    if (mode == BOUNDED) {
+        bool present = bloom_check_and_insert(d, true);
+        if (!present) bloom_count++;
+        return present;
+    }
+    if (attached_count && attached_contains(d)) return true;
+    shard_t& shard = shards[d.hi >> 58];
+    const std::lock_guard<std::mutex> lock(shard.M);
+    if (d == digest_t{}) {
+        bool present = shard.has_zero;
+        shard.has_zero = true;
+        return present;
+    }
+    if ((shard.count + 1) * 10 > shard.slots.size() * 7) { // keep the load under 70%
+        const size_t before = shard.slots.size();
+        shard.grow();
+        table_bytes += (shard.slots.size() - before) * sizeof(digest_t);
+    }
+    size_t slot = 0;
+    if (shard.find_slot(d, slot)) return true; // in the set
+    shard.slots[slot] = d;                     // otherwise insert it
+    shard.count++;
+    return false;                              // and return that it wasn't
+}
+
+void digest_set::insert(const digest_t& d) { check_for_presence_and_insert(d); }
+
+bool digest_set::contains(const digest_t& d) const {
+    if (mode == BOUNDED) { return bloom_check_and_insert(d, false); }
+    if (attached_count && attached_contains(d)) return true;
+    const shard_t& shard = shards[d.hi >> 58];
+    const std::lock_guard<std::mutex> lock(shard.M);
+    if (d == digest_t{}) return shard.has_zero;
+    if (shard.slots.empty()) return false;
+    size_t slot = 0;
+    return shard.find_slot(d, slot);
+}
+
+size_t digest_set::size() const {
+    if (mode == BOUNDED) return bloom_count;
+    size_t ret = attached_count;
+    for (const auto& shard : shards) {
+        const std::lock_guard<std::mutex> lock(shard.M);
+        ret += shard.count + (shard.has_zero ? 1 : 0);
+    }
+    return ret;
+}
+
+/* kept as the tables grow, so that it can be read on every sbuf without taking the shard locks */
+size_t digest_set::bytes() const { return table_bytes; }
+
+/****************************************************************
+ *** BOUNDED mode
+ ****************************************************************/
+
+void digest_set::set_bounded(size_t bytes_) {
+    if (size() > 0) { throw std::runtime_error("digest_set::set_bounded: the set is not empty"); }
+    if (attached) { throw std::runtime_error("digest_set::set_bounded: a file is attached"); }
+    for (auto& shard : shards) {
+        const std::lock_guard<std::mutex> lock(shard.M);
+        std::vector<digest_t>().swap(shard.slots);
+    }
+    bloom_blocks = std::max(bytes_ / (BLOCK_WORDS * sizeof(uint64_t)), size_t(1));
+    table_bytes = bloom_blocks * BLOCK_WORDS * sizeof(uint64_t);
+    bloom.reset(new std::atomic<uint64_t>[bloom_blocks * BLOCK_WORDS]);
+    for (size_t i = 0; i < bloom_blocks * BLOCK_WORDS; i++) { bloom[i] = 0; }
+    mode = BOUNDED;
+}
+
+/* hi picks the block; each 9-bit group of lo picks a bit in the block. */
+bool digest_set::bloom_check_and_insert(const digest_t& d, bool insert) const {
+    std::atomic<uint64_t>* words = &bloom[(d.hi % bloom_blocks) * BLOCK_WORDS];
+    uint64_t bits = d.lo;
+    bool present = true;
+    for (unsigned int k = 0; k < HASHES; k++, bits >>= 9) {
+        const unsigned int b = bits & 511;
+        const uint64_t mask = uint64_t(1) << (b & 63);
+        if (insert) {
+            if ((words[b >> 6].fetch_or(mask, std::memory_order_relaxed) & mask) == 0) present = false;
+        } else {
+            if ((words[b >> 6].load(std::memory_order_relaxed) & mask) == 0) return false;
+        }
+    }
+    return present;
+}
+
+double digest_set::false_positive_rate() const {
+    if (mode == EXACT) return 0.0;
+    const double m = bloom_blocks * BLOCK_WORDS * 64;
+    return std::pow(1.0 - std::exp(-double(HASHES) * bloom_count / m), HASHES);
+}
+
+/****************************************************************
+ *** Persistence
+ ****************************************************************/
+
+static uint64_t get_be64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static void put_be64(uint8_t* p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = v & 0xff;
+}
+
+digest_set::~digest_set() {}
+
+bool digest_set::attached_contains(const digest_t& d) const {
+    size_t lo = 0;
+    size_t hi = attached_count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const uint8_t* p = attached_digests + mid * 16;
+        const uint64_t h = get_be64(p);
+        const uint64_t l = get_be64(p + 8);
+        if (h == d.hi && l == d.lo) return true;
+        if (h < d.hi || (h == d.hi && l < d.lo)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return false;
+}
+
+void digest_set::attach(const std::filesystem::path& fname) {
+    if (mode != EXACT) { throw std::runtime_error("digest_set::attach: only EXACT sets can be attached"); }
+    if (attached || size() > 0) { throw std::runtime_error("digest_set::attach: the set is not empty"); }
+    std::unique_ptr<sbuf_t> map;
+    try {
+        map.reset(sbuf_t::map_file(fname));
+    } catch (const std::exception& e) {
+        throw std::runtime_error("digest_set::attach: cannot map " + fname.string() + ": " + e.what());
+    }
+    const uint8_t* buf = map->get_buf();
+    const size_t count = map->bufsize >= FILE_HEADER_SIZE ? get_le(buf + 16, 8) : 0;
+    if (map->bufsize < FILE_HEADER_SIZE || memcmp(buf, FILE_MAGIC, 8) != 0 || get_le(buf + 8, 4) != FILE_VERSION ||
+        get_le(buf + 12, 4) != 16 || map->bufsize != FILE_HEADER_SIZE + count * 16) {
+        throw std::runtime_error("digest_set::attach: " + fname.string() + " is not a saved digest_set");
+    }
+    attached = std::move(map);
+    attached_digests = buf + FILE_HEADER_SIZE;
+    attached_count = count;
+}
+
+/* Written to a temporary file that is renamed over fname, so fname can be the attached file */
+void digest_set::save(const std::filesystem::path& fname) const {
+    if (mode != EXACT) { throw std::runtime_error("digest_set::save: only EXACT sets can be saved"); }
+    std::vector<digest_t> all;
+    all.reserve(size());
+    for (size_t i = 0; i < attached_count; i++) {
+        const uint8_t* p = attached_digests + i * 16;
+        all.push_back(digest_t{get_be64(p), get_be64(p + 8)});
+    }
+    const digest_t empty{};
+    for (const auto& shard : shards) {
+        const std::lock_guard<std::mutex> lock(shard.M);
+        if (shard.has_zero) all.push_back(empty);
+        for (const auto& it : shard.slots) {
+            if (it != empty) all.push_back(it);
+        }
+    }
+    std::sort(all.begin(), all.end(),
+              [](const digest_t& a, const digest_t& b) { return a.hi != b.hi ? a.hi < b.hi : a.lo < b.lo; });
+    all.erase(std::unique(all.begin(), all.end()), all.end());
+
+    std::vector<uint8_t> out(FILE_HEADER_SIZE + all.size() * 16);
+    memcpy(out.data(), FILE_MAGIC, 8);
+    put_le(out.data() + 8, FILE_VERSION, 4);
+    put_le(out.data() + 12, 16, 4);
+    put_le(out.data() + 16, all.size(), 8);
+    for (size_t i = 0; i < all.size(); i++) {
+        put_be64(out.data() + FILE_HEADER_SIZE + i * 16, all[i].hi);
+        put_be64(out.data() + FILE_HEADER_SIZE + i * 16 + 8, all[i].lo);
+    }
+    const std::filesystem::path tmp = fname.string() + ".tmp";
+    std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+    os.write(reinterpret_cast<const char*>(out.data()), out.size());
+    os.close();
+    if (!os) { throw std::runtime_error("digest_set::save: cannot write " + tmp.string()); }
+    std::filesystem::rename(tmp, fname);
+}
@@ -0,0 +1,115 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * digest_set - a concurrent set of 128-bit digests, used by the scanner_set to remember which
+ * pages it has already seen.
+ *
+ * Digests are stored in binary rather than as hex strings. Longer digests (e.g. SHA1) are truncated
+ * to their first 16 bytes, which for a cryptographic hash is still far beyond any realistic collision.
+ *
+ * There are two modes:
+ *
+ * EXACT (the default) - the set is split into SHARDS shards chosen by the top bits of the digest,
+ *     each an open-addressed table with its own mutex. Threads only contend when they hit the same
+ *     shard at the same time. Memory is about 23 bytes per digest.
+ *
+ * BOUNDED - set_bounded(bytes) replaces the table with a blocked Bloom filter of fixed size. Each
+ *     digest sets HASHES bits within a single 64-byte block, so every operation touches one cache
+ *     line, and the bits are set with atomic fetch_or, so no locks are taken. The filter never
+ *     forgets a digest, but it can report a digest that was never inserted (a false positive).
+ *     With b bits per inserted digest the false positive rate is about (1-e^(-HASHES/b))^HASHES:
+ *     roughly 0.1% at 16 bits (2 bytes) per digest and 2% at 8 bits per digest.
+ *     false_positive_rate() reports the estimate for the current fill. Note that for dedup a false
+ *     positive means a page is treated as already seen, and scanners that don't want seen-before
+ *     data won't be run on it.
+ *
+ * An EXACT set can be saved to a file with save() and, in a later run, attach()ed: the file is
+ * mapped and binary-searched in place, underneath the digests inserted since, so a large set costs
+ * nothing to reload. The file is a 32-byte header {"BE13DIGS", u32 version, u32 16, u64 count,
+ * u64 0} followed by the digests, sorted, each as its 16 bytes (hi then lo, most significant byte
+ * first).
+ */
+
+#ifndef DIGEST_SET_H
+#define DIGEST_SET_H
+
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class digest_set {
+public:
+    struct digest_t {
+        uint64_t hi{0};
+        uint64_t lo{0};
+        bool operator==(const digest_t& b) const { return hi == b.hi && lo == b.lo; }
+        bool operator!=(const digest_t& b) const { return !(*this == b); }
+    };
+    static digest_t from_bytes(const uint8_t* buf, size_t len); // first 16 bytes; zero-padded if shorter
+    static digest_t from_hex(const std::string& hex);           // first 32 hex digits
+
+    enum mode_t { EXACT, BOUNDED };
+    static inline const size_t SHARDS = 64;
+    static inline const unsigned int HASHES = 7; // bits set per digest in BOUNDED mode
+
+private:
+    digest_set(const digest_set&) = delete;
+    digest_set& operator=(const digest_set&) = delete;
+
+    struct shard_t {
+        mutable std::mutex M{};          // protects everything in the shard
+        std::vector<digest_t> slots{};   // open addressing; the zero digest marks an empty slot
+        size_t count{0};                 // digests in slots
+        bool has_zero{false};            // the zero digest itself is stored here
+        bool find_slot(const digest_t& d, size_t& slot) const; // true if found; else slot is where it goes
+        void grow();
+    };
+    shard_t shards[SHARDS]{};
+
+    static inline const size_t BLOCK_WORDS = 8; // 512-bit blocks
+    mode_t mode{EXACT};
+    std::unique_ptr<std::atomic<uint64_t>[]> bloom{};
+    size_t bloom_blocks{0};
+    std::atomic<uint64_t> bloom_count{0};   // insertions that were not reported present
+    std::atomic<size_t> table_bytes{0};     // the size of the shards' slots, or of the Bloom filter
+
+    bool bloom_check_and_insert(const digest_t& d, bool insert) const; // true if all bits were set
+
+    /* the attached file */
+    std::unique_ptr<class sbuf_t> attached{}; // mapped
+    const uint8_t* attached_digests{nullptr};
+    size_t attached_count{0};
+    bool attached_contains(const digest_t& d) const;
+
+public:
+    static inline const char FILE_MAGIC[9] = "BE13DIGS";
+    static inline const uint32_t FILE_VERSION = 1;
+    static inline const size_t FILE_HEADER_SIZE = 32;
+
+    digest_set() {}
+    ~digest_set();
+
+    /* Switch to BOUNDED mode, using about bytes of memory. Must be called while the set is empty. */
+    void set_bounded(size_t bytes);
+    mode_t get_mode() const { return mode; }
+
+    bool check_for_presence_and_insert(const digest_t& d); // true if it was already present
+    bool contains(const digest_t& d) const;
+    void insert(const digest_t& d);
+    size_t size() const;                                   // digests inserted (approximate when BOUNDED)
+    size_t bytes() const;                                  // memory used by the tables
+    double false_positive_rate() const;                    // 0 when EXACT
+
+    /* Persistence; EXACT mode only. Both throw std::runtime_error. */
+    void attach(const std::filesystem::path& fname);       // use a saved set; call before inserting
+    void save(const std::filesystem::path& fname) const;   // the attached digests and the inserted ones
+    size_t attached_size() const { return attached_count; }
+};
+
+#endif
@@ -0,0 +1,98 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "fast_hash.h"
+
+static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t P3 = 0x165667B19E3779F9ULL;
+static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); // unaligned-safe; compiles to a single load
+#ifdef BE13_API_BIGENDIAN
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t v) {
+    acc += v * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+fast_hasher::fast_hasher(uint64_t seed) : v{seed + P1 + P2, seed + P2, seed, seed - P1} {}
+
+void fast_hasher::update(const uint8_t* buf, size_t len) {
+    if (tail_seen) { throw std::runtime_error("fast_hasher::update: only the last piece may be a partial block"); }
+    const uint8_t* p = buf;
+    const uint8_t* const end = buf + len;
+    while (p + BLOCK <= end) {
+        v[0] = round64(v[0], read64(p));
+        v[1] = round64(v[1], read64(p + 8));
+        v[2] = round64(v[2], read64(p + 16));
+        v[3] = round64(v[3], read64(p + 24));
+        p += BLOCK;
+    }
+    if (p < end) {
+        tail_len = end - p;
+        memcpy(tail, p, tail_len);
+        tail_seen = true;
+    }
+    total += len;
+}
+
+hash128_t fast_hasher::digest() const {
+    uint64_t w[4] = {v[0], v[1], v[2], v[3]};
+
+    /* Fold the tail into the lanes a word at a time; the length, mixed in below, disambiguates the padding */
+    unsigned int lane = 0;
+    const uint8_t* p = tail;
+    const uint8_t* const end = tail + tail_len;
+    while (p + 8 <= end) {
+        w[lane] = round64(w[lane], read64(p));
+        lane = (lane + 1) & 3;
+        p += 8;
+    }
+    if (p < end) {
+        uint8_t last[8]{};
+        memcpy(last, p, end - p);
+        w[lane] = round64(w[lane], read64(last));
+    }
+
+    hash128_t h;
+    h.hi = avalanche(rotl(w[0], 1) + rotl(w[1], 7) + rotl(w[2], 12) + rotl(w[3], 18) + total * P5);
+    h.lo = avalanche((w[0] ^ rotl(w[2], 29)) + (w[1] ^ rotl(w[3], 41)) * P4 + total * P3);
+    return h;
+}
+
+hash128_t fast_hash128(const uint8_t* buf, size_t len, uint64_t seed) {
+    fast_hasher h(seed);
+    h.update(buf, len);
+    return h.digest();
+}
+
+std::string hash128_t::hexdigest() const {
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016" PRIx64 "%016" PRIx64, hi, lo);
+    return std::string(buf);
+}
@@ -0,0 +1,57 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * fast_hash - a fast, non-cryptographic 128-bit hash used to detect sbufs that have been seen before.
+ *
+ * It is built from the xxHash64 round function: four independent 64-bit lanes consume 32 bytes per
+ * iteration, and are folded into two differently-mixed 64-bit halves at the end. It runs at memory
+ * bandwidth on current hardware, several times faster than SHA1.
+ *
+ * It is NOT a cryptographic hash and must not be used where an adversary could choose colliding
+ * inputs to hide data from an examiner's report. Use the feature_recorder_set hasher (MD5/SHA1/SHA256)
+ * for anything that is reported or carved. Results are the same on big- and little-endian hosts.
+ *
+ * It has not had the collision analysis of xxHash's XXH128, so nothing that would silently lose data on a
+ * collision relies on it by default: seen-before detection uses the SHA1 unless scanner_config::
+ * dedup_hash_algorithm is "fast", and the page cache is keyed by the SHA1. It is used where a collision
+ * only costs time: the compiled stop list's index (a hit is compared with the feature), heavy hitters
+ * and flow sharding.
+ */
+
+#ifndef FAST_HASH_H
+#define FAST_HASH_H
+
+#include <cinttypes>
+#include <cstddef>
+#include <string>
+
+struct hash128_t {
+    uint64_t hi{0};
+    uint64_t lo{0};
+    bool operator==(const hash128_t& b) const { return hi == b.hi && lo == b.lo; }
+    bool operator!=(const hash128_t& b) const { return !(*this == b); }
+    std::string hexdigest() const;
+};
+
+hash128_t fast_hash128(const uint8_t* buf, size_t len, uint64_t seed = 0);
+
+/* Incremental version, for hashing a buffer in pieces along with other digests.
+ * Every call to update() except the last must be a multiple of BLOCK bytes.
+ * The result is the same as fast_hash128() over the concatenated pieces.
+ */
+class fast_hasher {
+    uint64_t v[4];
+    uint64_t total{0};
+    bool tail_seen{false};  // update() was called with a partial block
+    uint8_t tail[32]{};
+    size_t tail_len{0};
+
+public:
+    static inline const size_t BLOCK = 32;
+    explicit fast_hasher(uint64_t seed = 0);
+    void update(const uint8_t* buf, size_t len);
+    hash128_t digest() const;
+};
+
+#endif
@@ -8,16 +8,27 @@
 #include <sys/times.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
 #include <cstdarg>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <regex>
 #include <sstream>
 
+#include "alert_writer.h"
+#include "alloc_profile.h"
+#include "byte_order.h"
+#include "carve_writer.h"
 #include "feature_recorder.h"
 #include "feature_recorder_set.h"
 #include "formatter.h"
+#include "histogram_run.h"
+#include "page_cache.h"
+#include "trace.h"
 #include "unicode_escape.h"
 #include "utils.h"
 #include "word_and_context_list.h"
@@ -55,7 +66,8 @@ static inline int hexval(char ch) {
 
 /* These are all overridden in the subclass */
 feature_recorder::feature_recorder(class feature_recorder_set& fs_, const struct feature_recorder_def def_)
-    : fs(fs_), name(def_.name), def(def_) {}
+    : fs(fs_), name(def_.name), trace_name(tracer::intern(def_.name)), alloc_tag(alloc_profile::intern(def_.name)),
+      def(def_) {}
 feature_recorder::~feature_recorder() {}
 void feature_recorder::flush() {}
 
@@ -118,19 +130,99 @@ const std::filesystem::path feature_recorder::fname_in_outdir(std::string suffix
     if (suffix.size() > 0) { base_path = base_path.string() + "_" + suffix; }
     if (count == NO_COUNT) return base_path.string() + ".txt";
     if (count != NEXT_COUNT) { return base_path.string() + "_" + std::to_string(count) + ".txt"; }
-    /* Probe for a file that we can create. When we create it, return the name.
-     * Yes, this created a TOCTOU error. We should return the open file descriptor.
-     */
-    for (int i = 0; i < 1000000; i++) {
-        std::filesystem::path fname = base_path.string() + (i > 0 ? "_" + std::to_string(i) : "") + ".txt";
-        int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-        if (fd >= 0) {
-            /* Created the file. close it. and return.*/
-            close(fd);
-            return fname;
+    std::filesystem::path fname;
+    close(create_next_in_outdir(suffix, fname));
+    return fname;
+}
+
+/*
+ * The counter for a suffix starts after the highest-numbered file already in the outdir.
+ */
+std::atomic<int>& feature_recorder::next_count_for(const std::string& suffix) const {
+    const std::lock_guard<std::mutex> lock(Mnext_count);
+    auto it = next_count.find(suffix);
+    if (it != next_count.end()) return it->second;
+
+    const std::string base = this->name + (suffix.size() > 0 ? "_" + suffix : "");
+    int next = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(fs.get_outdir())) {
+        const std::string fn = entry.path().filename().string();
+        if (fn.size() < base.size() + 4 || fn.compare(0, base.size(), base) != 0 ||
+            fn.compare(fn.size() - 4, 4, ".txt") != 0) {
+            continue;
+        }
+        const std::string rest = fn.substr(base.size(), fn.size() - base.size() - 4);
+        if (rest.empty()) {
+            next = std::max(next, 1);
+        } else if (rest.size() > 1 && rest[0] == '_' && rest.find_first_not_of("0123456789", 1) == std::string::npos &&
+                   rest.size() < 10) {
+            next = std::max(next, std::stoi(rest.substr(1)) + 1);
+        }
+    }
+    return next_count.try_emplace(suffix, next).first->second;
+}
+
+/* Writes a histogram report a chunk at a time as its elements are given to add() */
+class histogram_report_file {
+public:
+    static inline const std::streamoff CHUNK = 1024 * 1024;
+    histogram_report_file(int fd, const std::filesystem::path& fname_) : fname(fname_), f(fdopen(fd, "w")) {
+        if (f == nullptr) {
+            ::close(fd);
+            throw std::runtime_error("Cannot open feature histogram file " + fname.string());
+        }
+    }
+    ~histogram_report_file() {
+        if (f) fclose(f);
+    }
+    void add(const AtomicUnicodeHistogram::auh_t::AMReportElement& e) {
+        ss << e;
+        if (ss.tellp() >= CHUNK) write();
+    }
+    void close() { // throws std::runtime_error
+        write();
+        FILE* f_ = f;
+        f = nullptr;
+        if (fclose(f_) != 0 || !ok) { throw std::runtime_error("Cannot write feature histogram file " + fname.string()); }
+    }
+
+private:
+    histogram_report_file(const histogram_report_file&) = delete;
+    histogram_report_file& operator=(const histogram_report_file&) = delete;
+    void write() {
+        const std::string s = ss.str();
+        ok = ok && fwrite(s.data(), 1, s.size(), f) == s.size();
+        ss.str("");
+    }
+    const std::filesystem::path fname;
+    FILE* f{nullptr};
+    std::ostringstream ss{};
+    bool ok{true};
+};
+
+void feature_recorder::write_histogram_report(AtomicUnicodeHistogram& h) const {
+    std::filesystem::path fname;
+    const int fd = create_next_in_outdir(h.def.suffix, fname);
+    histogram_report_file out(fd, fname);
+    h.takeReport(0, [&out](const AtomicUnicodeHistogram::auh_t::AMReportElement& e) { out.add(e); }); // sorted and clear
+    out.close();
+}
+
+int feature_recorder::create_next_in_outdir(const std::string& suffix, std::filesystem::path& fname) const {
+    if (fs.get_outdir() == scanner_config::NO_OUTDIR) {
+        throw std::runtime_error("create_next_in_outdir called, but outdir==NO_OUTDIR");
+    }
+    std::atomic<int>& counter = next_count_for(suffix);
+    const std::string base = (fs.get_outdir() / this->name).string() + (suffix.size() > 0 ? "_" + suffix : "");
+    while (true) {
+        const int i = counter++;
+        fname = base + (i > 0 ? "_" + std::to_string(i) : "") + ".txt";
+        const int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        if (fd >= 0) return fd;
+        if (errno != EEXIST) { // EEXIST: created by someone else since the scan, so try the next number
+            throw std::runtime_error("cannot create " + fname.string() + ": " + strerror(errno));
         }
     }
-    throw std::runtime_error("it is unlikely that there are a million files, so this is probably a logic error.");
 }
 
 /**
@@ -171,37 +263,52 @@ void feature_recorder::write0(const std::string& str) {}
 /*
  * Write: keep track of count of features written.
  */
-void feature_recorder::write0(const pos0_t& pos0, const std::string& feature, const std::string& context) {
+void feature_recorder::write0(const pos0_t& pos0, std::string_view feature, std::string_view context) {
     if (fs.flags.disabled) { return; }
     features_written += 1;
+    thread_features_written += 1;
 }
 
 /**
  * write() is the main entry point for writing a feature at a given position with context.
  * write() checks the stoplist and escapes non-UTF8 characters, then calls write0().
  */
-void feature_recorder::write(const pos0_t& pos0, const std::string& feature_, const std::string& context_) {
+void feature_recorder::write(const pos0_t& pos0, std::string_view feature, std::string_view context) {
     if (fs.flags.disabled) return; // disabled
+    const trace_span span(tracer::WRITE, trace_name, feature.size());
+    const alloc_profile::tag_scope alloc_scope(alloc_tag);
+    if (page_cache::capturing) page_cache::capturing->add(name, pos0, feature, context); // see page_cache.h
 
     if (fs.flags.pedantic) {
-        if (feature_.size() > def.max_feature_size) {
+        if (feature.size() > def.max_feature_size) {
             throw std::runtime_error(std::string("feature_recorder::write : feature_.size()=") +
-                                     std::to_string(feature_.size()));
+                                     std::to_string(feature.size()));
         }
-        if (context_.size() > def.max_context_size) {
+        if (context.size() > def.max_context_size) {
             throw std::runtime_error(std::string("feature_recorder::write : context_.size()=") +
-                                     std::to_string(context_.size()));
+                                     std::to_string(context.size()));
         }
     }
+    if (def.flags.no_context) context = std::string_view();
 
-    /* TODO: This needs to be change to do all processing in utf32 and not utf8 */
-
-    std::string feature = feature_;
-    std::string context = def.flags.no_context ? "" : context_;
-    std::string feature_utf8 = make_utf8(feature);
+    /* Printable ASCII is left alone by quote_if_necessary(), so it can be written without a copy.
+     * Backslashes are quoted unless no_quote or xml is set.
+     */
+    const bool quote_backslash = !def.flags.no_quote && !def.flags.xml;
+    if (is_printable_ascii(feature, quote_backslash) && is_printable_ascii(context, quote_backslash)) {
+        write_quoted(pos0, feature, feature.substr(0, def.max_feature_size), context.substr(0, def.max_context_size));
+        return;
+    }
 
-    quote_if_necessary(feature, context);
+    /* TODO: This needs to be change to do all processing in utf32 and not utf8 */
+    std::string quoted_feature(feature);
+    std::string quoted_context(context);
+    quote_if_necessary(quoted_feature, quoted_context);
+    write_quoted(pos0, feature, quoted_feature, quoted_context);
+}
 
+void feature_recorder::write_quoted(const pos0_t& pos0, std::string_view unquoted_feature, std::string_view feature,
+                                    std::string_view context) {
     if (feature.size() == 0) {
         std::cerr << name << ": zero length feature at " << pos0 << "\n";
         if (fs.flags.pedantic) assert(0);
@@ -225,30 +332,28 @@ void feature_recorder::write(const pos0_t& pos0, const std::string& feature_, co
      * Only do this if we have a stop_list_recorder (the stop list recorder itself
      * does not have a stop list recorder. If it did we would infinitely recurse.
      */
-    if (def.flags.no_stoplist == false && fs.stop_list && fs.stop_list_recorder &&
-        fs.stop_list->check_feature_context(feature_utf8, context)) {
-        fs.stop_list_recorder->write(pos0, feature, context);
-        return;
+    std::string feature_utf8; // made when the stop list or the alert list needs it
+    if (def.flags.no_stoplist == false && fs.stop_list && fs.stop_list_recorder) {
+        feature_utf8 = make_utf8(std::string(unquoted_feature));
+        if (fs.stop_list->check_feature_context(feature_utf8, context)) {
+            const page_cache::capture_t::pause pause; // replaying the feature writes it again
+            fs.stop_list_recorder->write(pos0, feature, context);
+            return;
+        }
     }
 
     /* The alert list is a special features that are called out.
-     * If we have one of those, write it to the redlist.
+     * If we have one of those, queue it for ALERTS_found.txt.
      */
-#if 0
-    if (flags.no_alertlist==false
-        && fs.alert_list
-        && fs.alert_list->check_feature_context(*feature_utf8,context)) {
-        std::filesystem::path alert_fn = fs.get_outdir() + "/ALERTS_found.txt";
-        const std::lock_guard<std::mutex> lock(Mr);                // notice we are locking the alert list
-        std::ofstream rf(alert_fn.c_str(),std::ios_base::app);
-        if(rf.is_open()){
-            rf << pos0.shift(fs.offset_add).str() << '\t' << feature << '\t' << "\n";
+    if (def.flags.no_alertlist == false && fs.alert_list && fs.alerts) {
+        if (feature_utf8.empty()) feature_utf8 = make_utf8(std::string(unquoted_feature));
+        if (fs.alert_list->check_feature_context(feature_utf8, context)) {
+            fs.alerts->enqueue(fs.offset_add != 0 ? pos0.shift(fs.offset_add) : pos0, feature, name);
         }
     }
-#endif
 
     /* add the feature to any histograms; the regex is applied in the histogram */
-    this->histograms_add_feature(feature);
+    if (!histograms.empty() && !histograms_deferred()) this->histograms_add_feature(std::string(feature));
 
     /* Finally write out the feature and the context */
     this->write0(pos0, feature, context);
@@ -284,8 +389,10 @@ void feature_recorder::write_buf(const sbuf_t& sbuf, size_t pos, size_t len) {
     /* Asked to write beyond bufsize; bring it in */
     if (pos + len > sbuf.bufsize) { len = sbuf.bufsize - pos; }
 
-    std::string feature = sbuf.substr(pos, len);
-    std::string context;
+    /* The feature and context are views into the sbuf; write() copies them only if they need quoting */
+    const char* base = reinterpret_cast<const char*>(sbuf.get_buf());
+    std::string_view feature(base + pos, len);
+    std::string_view context;
 
     if (def.flags.no_context == false) {
         /* Context write; create a clean context */
@@ -294,7 +401,7 @@ void feature_recorder::write_buf(const sbuf_t& sbuf, size_t pos, size_t len) {
 
         if (p1 > sbuf.bufsize) p1 = sbuf.bufsize;
         assert(p0 <= p1);
-        context = sbuf.substr(p0, p1 - p0);
+        context = std::string_view(base + p0, p1 - p0);
     }
     this->write(sbuf.pos0 + pos, feature, context);
 }
@@ -373,6 +480,8 @@ std::string valid_dosname(std::string in) {
 
 #include <iomanip>
 std::string feature_recorder::carve(const sbuf_t& header, const sbuf_t& data, std::string ext, time_t mtime) {
+    const trace_span span(tracer::CARVE, trace_name, data.bufsize);
+    const alloc_profile::tag_scope alloc_scope(alloc_tag);
     switch (carve_mode) {
     case feature_recorder_def::CARVE_NONE:
         return NO_CARVED_FILE; // carve nothing
@@ -385,11 +494,13 @@ std::string feature_recorder::carve(const sbuf_t& header, const sbuf_t& data, st
         break;
     }
 
+    if (page_cache::capturing) page_cache::capturing->complete = false; // a replay would not carve it
+
     /* See if we have previously carved this object, in which case do not carve it again */
     std::string carved_hash_hexvalue = hash(data);
-    bool in_cache = carve_cache.check_for_presence_and_insert(carved_hash_hexvalue);
+    bool in_cache = fs.carve_index.check_for_presence_and_insert(digest_set::from_hex(carved_hash_hexvalue));
     std::string carved_relative_path; // carved path reported in feature file, relative to outdir
-    std::filesystem::path carved_absolute_path; // used for opening
+    std::optional<carve_writer::job_t> job;
 
     if (in_cache) {
         carved_relative_path = CACHED;
@@ -405,24 +516,16 @@ std::string feature_recorder::carve(const sbuf_t& header, const sbuf_t& data, st
         //num << std::setw(8) << std::setfill('0') << int(myfileNumber);
         //const std::string units{num.str()};
 
-        /* Create the directory.
-         * If it exists, the call fails.
-         * (That's faster than checking to see if it exists and then creating the directory)
-         */
-        std::filesystem::create_directory(fs.get_outdir() / name);
-        std::filesystem::create_directory(fs.get_outdir() / name / thousands);
-
         // const std::filesystem::path scannerDir { fs.get_outdir() / name};
 
         std::string fname  = data.pos0.str() + ext;
+        std::replace(fname.begin(), fname.end(), '/', '_'); // the path of a mapped file is not a subdirectory
 
         // carved relative path goes in the feature file
         carved_relative_path = name + "/" + thousands + "/" + fname;
 
-        // carved absolute path is used for actually opening
-        carved_absolute_path = fs.get_outdir() / name / thousands / fname;
-
-        // fname_feature = fname.string().substr(fs.get_outdir().string().size()+1);
+        // the directory and the file are created by the carve_writer, which only creates a directory once
+        job.emplace(fs.get_carve_writer().make_job(fs.get_outdir() / name / thousands, fname, header, data, mtime));
     }
 
     // write to the feature file
@@ -435,31 +538,13 @@ std::string feature_recorder::carve(const sbuf_t& header, const sbuf_t& data, st
     xml << "</fileobject>";
     this->write(data.pos0, carved_relative_path, xml.str());
 
-    if (!in_cache) {
-        /* Write the data */
-        std::ofstream os;
-        os.open(carved_absolute_path, std::ios::out | std::ios::binary | std::ios::trunc);
-        if (!os.is_open()) {
-            perror(carved_absolute_path.c_str());
-            throw std::runtime_error(Formatter() << "cannot open file for writing:" << carved_absolute_path);
-        }
-        header.write(os);
-        data.write(os);
-        os.close();
-        if (os.bad()) { throw std::runtime_error(Formatter() << "error writing file " << carved_absolute_path); }
-
-        /* Set timestamp if necessary. Note that we do not use std::filesystem::last_write_time()
-         * as there seems to be no portable way to use it.
-         */
-        if (mtime > 0) {
-            const struct timeval times[2] = {{mtime, 0}, {mtime, 0}};
-            utimes(carved_absolute_path.c_str(), times);
-        }
-    }
+    /* Write the data, now or on a carve_writer thread */
+    if (job) fs.get_carve_writer().submit(std::move(*job));
     return carved_relative_path;
 }
 
 const std::string feature_recorder::hash(const sbuf_t& sbuf) const {
+    if (fs.hasher.algorithm != sbuf_t::DIGEST_NONE) return sbuf.hexdigest(fs.hasher.algorithm);
     return sbuf.hash(fs.hasher.func);
 }
 
@@ -479,6 +564,7 @@ void feature_recorder::histogram_add(const struct histogram_def& hdef) {
         throw std::runtime_error("Cannot add histograms after features have been written.");
     }
     histograms.push_back(std::make_unique<AtomicUnicodeHistogram>(hdef));
+    histograms.back()->set_memory_counter(&fs.histogram_memory);
 }
 
 /**
@@ -487,8 +573,15 @@ void feature_recorder::histogram_add(const struct histogram_def& hdef) {
  */
 void feature_recorder::histograms_add_feature(const std::string& feature) {
     for (auto& h : histograms) {
-        h->add(feature); // add the original feature
+        try {
+            h->add(feature); // add the original feature
+        } catch (const std::bad_alloc&) {
+            /* low-memory mode: make some room and try once more */
+            if (!fs.histograms_spill_largest()) throw;
+            h->add(feature);
+        }
     }
+    fs.histograms_check_memory();
 }
 
 /**
@@ -506,28 +599,357 @@ void feature_recorder::histogram_flush(AtomicUnicodeHistogram& h) {
 }
 
 bool feature_recorder::histogram_flush_largest() {
-    /* TODO - implement */
-    return false;
+    AtomicUnicodeHistogram* h = largest_histogram();
+    return h ? histogram_spill(*h) : false;
 }
 
 void feature_recorder::histogram_flush_all() {
-    for (auto& h : histograms) { this->histogram_flush(*h); }
+    for (auto& h : histograms) { histogram_generate(*h, feature_recorder_set::HISTOGRAM_MERGE_MEMORY); }
+}
+
+/* deferred is decided once, after the recorder is constructed (feature_file() is virtual) */
+bool feature_recorder::histograms_deferred() const {
+    /* With a journal the histograms must come from the feature files, which keep the features of earlier runs */
+    if (deferred < 0) deferred = (fs.flags.deferred_histograms || fs.get_journal()) && !feature_file().empty();
+    return deferred > 0;
+}
+
+void feature_recorder::histogram_generate(AtomicUnicodeHistogram& h, size_t merge_memory) {
+    const trace_span span(tracer::HISTOGRAM, trace_name, h.bytes());
+    if (histogram_runs(h).empty()) {
+        this->histogram_flush(h);
+    } else {
+        histogram_merge(h, merge_memory);
+    }
+}
+
+AtomicUnicodeHistogram* feature_recorder::largest_histogram() const {
+    AtomicUnicodeHistogram* largest = nullptr;
+    for (auto& h : histograms) {
+        if (h->approximate()) continue; // cannot be spilled
+        if (largest == nullptr || h->bytes() > largest->bytes()) largest = h.get();
+    }
+    return largest;
+}
+
+bool feature_recorder::histogram_spill(AtomicUnicodeHistogram& h) {
+    const AtomicUnicodeHistogram::auh_t::report rep = h.take_sorted();
+    if (rep.empty()) return false;
+    std::filesystem::path fname;
+    const int fd = create_next_in_outdir(h.def.suffix.empty() ? "run" : h.def.suffix + "_run", fname);
+    histogram_run::write(fd, rep, fname);
+    const std::lock_guard<std::mutex> lock(Mhistogram_runs);
+    spilled_runs[&h].push_back(fname);
+    return true;
+}
+
+std::vector<std::filesystem::path> feature_recorder::histogram_runs(const AtomicUnicodeHistogram& h) const {
+    const std::lock_guard<std::mutex> lock(Mhistogram_runs);
+    auto it = spilled_runs.find(&h);
+    return it == spilled_runs.end() ? std::vector<std::filesystem::path>() : it->second;
 }
 
-#if 0
 /*
  * histogram_merge:
- * If possible, read all histogram files into memory and write them
- * out as a single histogram file. If we run out of memory during the process, fail.
- *
+ * An external sort: nothing larger than one batch of merge_memory bytes is ever in memory.
  */
-void feature_recorder::histogram_merge(const struct histogram_def &def)
-{
-    throw std::runtime_error("Implement histogram_merge");
+void feature_recorder::histogram_merge(AtomicUnicodeHistogram& h, size_t merge_memory) {
+    histogram_spill(h);
+    std::vector<std::filesystem::path> runs;
+    {
+        const std::lock_guard<std::mutex> lock(Mhistogram_runs);
+        runs.swap(spilled_runs[&h]);
+    }
+    const std::string prefix = h.def.suffix.empty() ? "" : h.def.suffix + "_";
+    auto new_run = [this, prefix](std::filesystem::path& fname) { return create_next_in_outdir(prefix + "run", fname); };
+    auto new_rank = [this, prefix](std::filesystem::path& fname) { return create_next_in_outdir(prefix + "rank", fname); };
+
+    /* Merge by key, ranking a batch at a time */
+    histogram_run::reduce(runs, histogram_run::BY_KEY, new_run);
+    std::vector<std::filesystem::path> ranked;
+    AtomicUnicodeHistogram::auh_t::report batch;
+    size_t batch_bytes = 0;
+    auto rank_batch = [&]() {
+        std::sort(batch.begin(), batch.end(), AtomicUnicodeHistogram::rank_order);
+        std::filesystem::path fname;
+        const int fd = new_rank(fname);
+        histogram_run::write(fd, batch, fname);
+        ranked.push_back(fname);
+        batch.clear();
+        batch_bytes = 0;
+    };
+    histogram_run::merge(runs, histogram_run::BY_KEY, [&](const histogram_run::element_t& e) {
+        batch.push_back(e);
+        batch_bytes += sizeof(e) + e.key.size();
+        if (batch_bytes >= merge_memory) rank_batch();
+    });
+    for (const auto& it : runs) std::filesystem::remove(it);
+
+    /* Write the report, merging the ranked batches if there was more than one */
+    std::filesystem::path fname;
+    const int fd = create_next_in_outdir(h.def.suffix, fname);
+    histogram_report_file out(fd, fname);
+    auto emit = [&out](const histogram_run::element_t& e) { out.add(e); };
+    if (ranked.empty()) {
+        std::sort(batch.begin(), batch.end(), AtomicUnicodeHistogram::rank_order);
+        for (const auto& it : batch) emit(it);
+    } else {
+        if (!batch.empty()) rank_batch();
+        histogram_run::reduce(ranked, histogram_run::BY_RANK, new_rank);
+        histogram_run::merge(ranked, histogram_run::BY_RANK, emit);
+        for (const auto& it : ranked) std::filesystem::remove(it);
+    }
+    out.close();
 }
 
-void feature_recorder::histogram_merge_all()
-{
-    throw std::runtime_error("Implement histogram_merge_all");
+/****************************************************************
+ *** FeatureReader
+ ****************************************************************/
+
+FeatureReader::FeatureReader(const std::filesystem::path& fname_) : fname(fname_) {
+    infile.open(fname, std::ios_base::in | std::ios_base::binary);
+    if (!infile.is_open()) { throw std::runtime_error("FeatureReader: cannot open " + fname.string()); }
+    uint8_t magic[4]{0, 0, 0, 0};
+    infile.read(reinterpret_cast<char*>(magic), sizeof(magic));
+    codec = frame_codec::detect(magic, infile.gcount());
+    infile.clear();
+    infile.seekg(0);
+    if (codec == frame_codec::NONE) {
+        read_index();
+        return;
+    }
+    if (!frame_codec::available(codec)) {
+        throw std::runtime_error(std::string("FeatureReader: ") + fname.string() + " uses " + frame_codec::name(codec) +
+                                 ", which was not compiled in");
+    }
+
+    /* Use the frame index if it describes the file. A recorder that didn't shut down may have indexed
+     * a frame it didn't finish writing; drop any frame that runs past the end of the file.
+     */
+    std::ifstream fi(fname.string() + FRAMES_EXTENSION);
+    const uint64_t file_size = std::filesystem::file_size(fname);
+    frame_t f;
+    uint64_t expected = 0;
+    while (fi >> f.offset >> f.compressed_len >> f.uncompressed_len) {
+        if (f.offset != expected || f.offset + f.compressed_len > file_size) break;
+        frames.push_back(f);
+        expected = f.offset + f.compressed_len;
+    }
+    if (expected != file_size) frames.clear(); // not the index for this file
+    read_index();
+}
+
+FeatureReader::index_entry_t FeatureReader::index_entry_t::from_bytes(const uint8_t* p) {
+    return index_entry_t{get_le(p, 8), get_le(p + 8, 8), get_le(p + 16, 8), get_le(p + 24, 8)};
+}
+
+void FeatureReader::index_entry_t::to_bytes(uint8_t* p) const {
+    put_le(p, min_offset, 8);
+    put_le(p + 8, max_offset, 8);
+    put_le(p + 16, file_offset, 8);
+    put_le(p + 24, len, 8);
+}
+
+/* The entries that describe blocks of this file become blocks; the rest of the file becomes blocks that
+ * may have any offset. A compressed file's blocks must be its frames, so it needs its frame index.
+ */
+void FeatureReader::read_index() {
+    const std::filesystem::path idx = fname.string() + INDEX_EXTENSION;
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(idx, ec)) return;
+    if (codec != frame_codec::NONE && frames.empty()) return;
+    std::unique_ptr<sbuf_t> sbuf;
+    try {
+        sbuf.reset(sbuf_t::map_file(idx));
+    } catch (const std::filesystem::filesystem_error&) {
+        return;
+    }
+    if (!sbuf || sbuf->bufsize < INDEX_MAGIC.size() || (sbuf->bufsize - INDEX_MAGIC.size()) % INDEX_ENTRY_SIZE != 0 ||
+        sbuf->substr(0, INDEX_MAGIC.size()) != INDEX_MAGIC) {
+        return;
+    }
+    std::vector<index_entry_t> entries;
+    for (size_t at = INDEX_MAGIC.size(); at < sbuf->bufsize; at += INDEX_ENTRY_SIZE) {
+        entries.push_back(index_entry_t::from_bytes(sbuf->get_buf() + at));
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const index_entry_t& a, const index_entry_t& b) { return a.file_offset < b.file_offset; });
+
+    const uint64_t file_size = std::filesystem::file_size(fname);
+    uint64_t covered = 0;
+    auto entry = entries.begin();
+    auto next_entry = [&entry, &entries, &covered, file_size]() -> const index_entry_t* {
+        while (entry != entries.end() &&
+               (entry->file_offset < covered || entry->file_offset + entry->len > file_size || entry->len == 0)) {
+            ++entry;             // overlaps one already used, or describes something that isn't there
+        }
+        return entry == entries.end() ? nullptr : &*entry;
+    };
+    if (codec == frame_codec::NONE) {
+        while (covered < file_size) {
+            const index_entry_t* e = next_entry();
+            const uint64_t gap_end = e ? e->file_offset : file_size;
+            if (gap_end > covered) blocks.push_back(index_entry_t{0, UINT64_MAX, covered, gap_end - covered});
+            if (!e) break;
+            blocks.push_back(*e);
+            covered = e->file_offset + e->len;
+            ++entry;
+        }
+        return;
+    }
+    for (const auto& f : frames) {
+        const index_entry_t* e = next_entry();
+        if (e && e->file_offset == f.offset && e->len == f.compressed_len) {
+            blocks.push_back(*e);
+            ++entry;
+        } else {
+            blocks.push_back(index_entry_t{0, UINT64_MAX, f.offset, f.compressed_len});
+        }
+        covered = f.offset + f.compressed_len;
+    }
+}
+
+std::string FeatureReader::read_block(std::ifstream& in, const index_entry_t& b) const {
+    std::string data(b.len, '\0');
+    in.clear();
+    in.seekg(b.file_offset);
+    in.read(&data[0], b.len);
+    if (uint64_t(in.gcount()) != b.len) throw std::runtime_error("FeatureReader: short read in " + fname.string());
+    if (codec == frame_codec::NONE) return data;
+    return frame_codec::decompress(codec, data.data(), data.size());
+}
+
+void FeatureReader::seek(const pos0_t& pos0) {
+    seeking = true;
+    seek_offset = pos0.imageOffset();
+    text.clear();
+    text_pos = 0;
+    next_frame = 0;
+    next_block = 0;
+    seek_blocks.clear();
+    for (const auto& b : blocks) {
+        if (b.max_offset >= seek_offset) seek_blocks.push_back(b);
+    }
+    infile.clear();
+    infile.seekg(0);
+}
+
+std::vector<Feature> FeatureReader::read_range(uint64_t start, uint64_t end) const {
+    std::vector<Feature> ret;
+    auto in_range = [start, end](const Feature& f) {
+        const uint64_t offset = f.pos.imageOffset();
+        return offset >= start && offset < end;
+    };
+    if (blocks.empty()) { // no index: read the whole file
+        FeatureReader reader(fname);
+        while (auto f = reader.next()) {
+            if (in_range(*f)) ret.push_back(*f);
+        }
+        return ret;
+    }
+    std::ifstream in(fname, std::ios_base::in | std::ios_base::binary);
+    for (const auto& b : blocks) {
+        if (b.max_offset < start || b.min_offset >= end) continue;
+        const std::string block_text = read_block(in, b);
+        const std::string_view sv(block_text);
+        for (size_t pos = 0; pos < sv.size();) {
+            size_t nl = sv.find('\n', pos);
+            if (nl == std::string_view::npos) nl = sv.size();
+            auto feature = parse_line(sv.substr(pos, nl - pos));
+            if (feature && in_range(*feature)) ret.push_back(*feature);
+            pos = nl + 1;
+        }
+    }
+    return ret;
+}
+
+bool FeatureReader::fill() {
+    text.erase(0, text_pos);
+    text_pos = 0;
+    if (seeking && !blocks.empty()) {
+        if (next_block >= seek_blocks.size()) return false;
+        text.append(read_block(infile, seek_blocks[next_block++]));
+        return true;
+    }
+    if (codec == frame_codec::NONE) {
+        std::string line;
+        if (!std::getline(infile, line)) return false;
+        text.append(line);
+        text.push_back('\n');
+        return true;
+    }
+    if (frames.empty()) { // no index: the whole file is decompressed at once
+        if (next_frame > 0) return false;
+        next_frame = 1;
+        std::string compressed((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+        text.append(frame_codec::decompress(codec, compressed.data(), compressed.size()));
+        return true;
+    }
+    if (next_frame >= frames.size()) return false;
+    const frame_t& f = frames[next_frame++];
+    std::string compressed(f.compressed_len, '\0');
+    infile.seekg(f.offset);
+    infile.read(&compressed[0], f.compressed_len);
+    text.append(frame_codec::decompress(codec, compressed.data(), compressed.size()));
+    return true;
+}
+
+std::optional<Feature> FeatureReader::next() {
+    while (true) {
+        size_t nl = text.find('\n', text_pos);
+        while (nl == std::string::npos) {
+            if (!fill()) {
+                if (text_pos == text.size()) return std::nullopt;
+                nl = text.size(); // the last line has no newline
+                break;
+            }
+            nl = text.find('\n', text_pos);
+        }
+        const std::string_view line(text.data() + text_pos, nl - text_pos);
+        text_pos = std::min(nl + 1, text.size());
+        auto feature = parse_line(line);
+        if (feature && (!seeking || feature->pos.imageOffset() >= seek_offset)) return feature;
+    }
+}
+
+std::vector<Feature> FeatureReader::read_frame(size_t i) const {
+    const frame_t& f = frames.at(i);
+    std::ifstream in(fname, std::ios_base::in | std::ios_base::binary);
+    std::string compressed(f.compressed_len, '\0');
+    in.seekg(f.offset);
+    in.read(&compressed[0], f.compressed_len);
+    if (uint64_t(in.gcount()) != f.compressed_len) {
+        throw std::runtime_error("FeatureReader: short read in " + fname.string());
+    }
+    const std::string frame_text = frame_codec::decompress(codec, compressed.data(), compressed.size());
+    std::vector<Feature> ret;
+    const std::string_view sv(frame_text);
+    for (size_t start = 0; start < sv.size();) {
+        size_t nl = sv.find('\n', start);
+        if (nl == std::string_view::npos) nl = sv.size();
+        auto feature = parse_line(sv.substr(start, nl - start));
+        if (feature) ret.push_back(*feature);
+        start = nl + 1;
+    }
+    return ret;
+}
+
+/* A feature line is pos0 \t feature [\t context]; pos0 is the forensic path, '-', and the offset */
+std::optional<Feature> FeatureReader::parse_line(std::string_view line) {
+    if (line.empty() || line[0] == '#') return std::nullopt;
+    if (line.back() == '\r') line.remove_suffix(1);
+    const size_t tab1 = line.find('\t');
+    if (tab1 == std::string_view::npos) return std::nullopt;
+    const size_t tab2 = line.find('\t', tab1 + 1);
+    const std::string_view pos = line.substr(0, tab1);
+    const std::string_view feature =
+        line.substr(tab1 + 1, (tab2 == std::string_view::npos ? line.size() : tab2) - tab1 - 1);
+    const std::string_view context = tab2 == std::string_view::npos ? std::string_view() : line.substr(tab2 + 1);
+
+    const size_t dash = pos.rfind('-');
+    const std::string_view offset_str = dash == std::string_view::npos ? pos : pos.substr(dash + 1);
+    const std::string path(dash == std::string_view::npos ? std::string_view() : pos.substr(0, dash));
+    uint64_t offset = 0;
+    std::from_chars(offset_str.data(), offset_str.data() + offset_str.size(), offset);
+    return Feature(pos0_t(path, offset), std::string(feature), std::string(context));
 }
-#endif
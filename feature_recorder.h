@@ -5,17 +5,23 @@
 #include <cinttypes>
 
 #include <atomic>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 #include <ctime>
 
 #include "atomic_set.h"
 #include "atomic_unicode_histogram.h"
+#include "frame_codec.h"
 #include "histogram_def.h"
 #include "pos0.h"
 #include "sbuf.h"
@@ -136,17 +142,69 @@ struct Feature {
     const std::string context;
 };
 
-/* Given an open feature_recorder, returns a class that iterates through it */
+/**
+ * Reads the features in a feature file, skipping the banner and other comments.
+ * Compressed files (see frame_codec.h) are recognized by their magic number and decompressed a
+ * frame at a time. If the recorder wrote a frame index ({file}.frames) next to the file,
+ * frame_count() and read_frame() allow several threads to read different frames at once.
+ *
+ * With fs.flags.offset_index, the recorder also writes an offset index ({file}.idx): for each block of
+ * lines that it writes (each frame, if the file is compressed), the lowest and highest image offset
+ * (pos0_t::imageOffset()) of the features in it. seek() and read_range() then read only the blocks that
+ * may have the offsets asked for. Blocks are in the order they were written, which is not offset order,
+ * so a range may be in several of them. Parts of the file that the index doesn't cover (a recorder that
+ * didn't shut down) are always read.
+ */
 class FeatureReader {
-    friend class feature_recorder;
-    FeatureReader(const class feature_recorder& fr);
-
 public:
-    std::fstream infile;
-    FeatureReader& operator++();
-    FeatureReader begin();
-    FeatureReader end();
-    Feature operator*();
+    static inline const std::string FRAMES_EXTENSION{".frames"};
+    static inline const std::string INDEX_EXTENSION{".idx"};
+    static inline const std::string INDEX_MAGIC{"BE13IDX1"}; // followed by the entries
+    static inline const size_t INDEX_ENTRY_SIZE = 32;         // the four fields of index_entry_t, little-endian
+    struct frame_t {
+        uint64_t offset{0};           // where the frame starts in the file
+        uint64_t compressed_len{0};
+        uint64_t uncompressed_len{0};
+    };
+    struct index_entry_t {
+        uint64_t min_offset{0};       // image offsets of the features in the block
+        uint64_t max_offset{0};
+        uint64_t file_offset{0};      // where the block is in the file
+        uint64_t len{0};
+        static index_entry_t from_bytes(const uint8_t* p); // INDEX_ENTRY_SIZE bytes
+        void to_bytes(uint8_t* p) const;
+    };
+
+    explicit FeatureReader(const std::filesystem::path& fname); // throws std::runtime_error if it can't be read
+    frame_codec::codec_t get_codec() const { return codec; }
+
+    std::optional<Feature> next(); // the next feature, or nothing at the end of the file
+    size_t frame_count() const { return frames.size(); } // 0 if the file is not compressed or has no frame index
+    std::vector<Feature> read_frame(size_t i) const;    // threadsafe; throws std::out_of_range
+    static std::optional<Feature> parse_line(std::string_view line); // nothing for comments and blank lines
+
+    bool has_index() const { return !blocks.empty(); }
+    /* After seek(), next() returns only the features at pos0's image offset or after, in file order */
+    void seek(const pos0_t& pos0);
+    /* The features at image offsets [start,end), in file order; threadsafe, so readers can split a file by offset */
+    std::vector<Feature> read_range(uint64_t start, uint64_t end) const;
+
+private:
+    const std::filesystem::path fname;
+    frame_codec::codec_t codec{frame_codec::NONE};
+    std::vector<frame_t> frames{};
+    std::vector<index_entry_t> blocks{}; // from the offset index; covers the file, in order. Empty if there is none
+    void read_index();
+    std::string read_block(std::ifstream& in, const index_entry_t& b) const; // decompressed
+    std::vector<index_entry_t> seek_blocks{};
+    size_t next_block{0};
+    bool seeking{false};
+    uint64_t seek_offset{0};
+    std::ifstream infile{};
+    std::string text{};      // decompressed text not yet returned
+    size_t text_pos{0};
+    size_t next_frame{0};
+    bool fill();             // decompress more of the file into text; false at the end
 };
 
 class feature_recorder {
@@ -158,6 +216,17 @@ class feature_recorder {
 protected:
     class feature_recorder_set& fs;                         // the set in which this feature_recorder resides
     virtual const std::filesystem::path get_outdir() const; // cannot be inline because it accesses fs
+    /* the rest of write(), once the feature and context have been quoted */
+    void write_quoted(const pos0_t& pos0, std::string_view unquoted_feature, std::string_view feature,
+                      std::string_view context);
+    /* write h's report (which clears it) to the next {name}_{suffix} file; throws std::runtime_error */
+    void write_histogram_report(AtomicUnicodeHistogram& h) const;
+
+private:
+    mutable std::atomic<int> deferred{-1}; // histograms_deferred(); -1 until it is known
+    mutable std::mutex Mnext_count{};
+    mutable std::map<std::string, std::atomic<int>> next_count{}; // suffix -> next file number; see create_next_in_outdir()
+    std::atomic<int>& next_count_for(const std::string& suffix) const;
 
 public:
     ;
@@ -169,6 +238,8 @@ public:
     virtual void flush();
 
     const std::string name{}; // name of this feature recorder (copied out of def)
+    const uint32_t trace_name{0}; // name's tracer::intern() id, for the write, carve and histogram spans
+    const uint32_t alloc_tag{0};  // what write() and carve() allocate is charged to; see alloc_profile.h
     feature_recorder_def def{"<NONAME>"};
     bool validateOrEscapeUTF8_validate{true}; // should we validate or escape UTF8?
 
@@ -177,6 +248,7 @@ public:
      */
     std::atomic<size_t> context_window{0};
     std::atomic<int64_t> features_written{0};
+    inline static thread_local uint64_t thread_features_written{0}; // by all recorders on this thread; for scanner stats
 
     /* Special tokens written into the file */
     static inline const std::string MAX_DEPTH_REACHED_ERROR_FEATURE {"process_extract: MAX DEPTH REACHED"};
@@ -204,14 +276,21 @@ public:
     /* fname_in_outdir(suffix, count):
      * returns a filename in the outdir in the format {feature_recorder}_{suffix}{count}.txt,
      * If count==NO_COUNT, count is omitted.
-     * If count==NEXT_COUNT, create a zero-length file and return that file's name (we use the file system for atomic
-     * locks)
+     * If count==NEXT_COUNT, create a zero-length file with create_next_in_outdir() and return that file's name.
      */
 
     // returns the name of a dir in the outdir for this feature recorder
     const std::filesystem::path fname_in_outdir(std::string suffix, int count) const;
     enum count_mode_t { NO_COUNT = 0, NEXT_COUNT = -1 };
 
+    /* create_next_in_outdir(suffix, fname):
+     * creates the next unused {feature_recorder}_{suffix}_{n}.txt (n=0 is omitted), sets fname to its name and
+     * returns it open for writing; the caller closes it. The numbers come from an atomic counter for each suffix,
+     * seeded by a single scan of the outdir the first time the suffix is used, so each file costs one open().
+     * Threadsafe; throws std::runtime_error.
+     */
+    int create_next_in_outdir(const std::string& suffix, std::filesystem::path& fname) const;
+
     /* Writing features */
 
     /**
@@ -221,7 +300,7 @@ public:
      * It is only implemented in the subclasses.
      */
     virtual void write0(const std::string& str);
-    virtual void write0(const pos0_t& pos0, const std::string& feature, const std::string& context);
+    virtual void write0(const pos0_t& pos0, std::string_view feature, std::string_view context);
 
     /* Methods used by scanners to write.
      * write() is the basic write - you say where, and it does it.
@@ -231,8 +310,11 @@ public:
      *
      * higher-level write a feature and its context; the feature may be in the context, but doesn't need to be.
      * entries processed by write below will be processed by histogram system
+     *
+     * If the feature and context are printable ASCII they need no quoting, and they are passed to write0()
+     * as they are, without being copied.
      */
-    virtual void write(const pos0_t& pos0, const std::string& feature, const std::string& context);
+    virtual void write(const pos0_t& pos0, std::string_view feature, std::string_view context);
 
     /* write_buf():
      * write a feature located at a given place within an sbuf.
@@ -244,8 +326,6 @@ public:
     std::atomic<size_t> min_carve_size {200};
     std::atomic<size_t> max_carve_size {16*1024*1024};
     std::atomic<int64_t> carved_file_count{0}; // starts at 0; gets incremented by carve();
-    atomic_set<std::string>
-        carve_cache{};                   // hashes of files that have been cached, so the same file is not carved twice
     std::string do_not_carve_encoding{}; // do not carve files with this encoding.
     static inline const std::string CARVE_MODE_DESCRIPTION {"0=carve none; 1=carve encoded; 2=carve all"};
     static inline const std::string NO_CARVED_FILE {""};
@@ -288,8 +368,30 @@ public:
     virtual bool
     histogram_flush_largest();          // flushes largest histogram. returns false if no histogram could be flushed.
     virtual void histogram_flush_all(); // flushes all histograms
-    // virtual void histogram_merge(const struct histogram_def &def); // merge sort on this histogram
-    // virtual void histogram_merge_all();                            // merge sort on all histograms
+
+    /* Spilling. When the histograms use more than the feature_recorder_set's histogram_memory_limit, the
+     * largest is written to a run file, {name}_{suffix}_run_{n}.txt sorted by key (see histogram_run.h),
+     * and emptied.
+     *
+     * histogram_merge() makes the histogram file of a histogram that was spilled: it spills what is left,
+     * k-way merges the runs by key, sorts the merged tallies by rank in batches of merge_memory bytes into
+     * {name}_{suffix}_rank_{n}.txt, and merges those into the report. The runs are deleted.
+     */
+    AtomicUnicodeHistogram* largest_histogram() const;       // nullptr if no histogram can be spilled
+    virtual bool histogram_spill(AtomicUnicodeHistogram& h); // false if h was empty; throws std::runtime_error
+    std::vector<std::filesystem::path> histogram_runs(const AtomicUnicodeHistogram& h) const;
+    virtual void histogram_merge(AtomicUnicodeHistogram& h, size_t merge_memory); // throws std::runtime_error
+    void histogram_generate(AtomicUnicodeHistogram& h, size_t merge_memory); // histogram_merge() or histogram_flush()
+
+    /* Deferred histograms (see histogram_engine.h) are made from the feature file, if the recorder writes one */
+    virtual std::filesystem::path feature_file() const { return std::filesystem::path(); } // empty if none
+    /* After flush(), the length to record in a scan_journal checkpoint; false if the recorder can't resume */
+    virtual bool journal_length(uint64_t&) { return false; }
+    bool histograms_deferred() const;
+
+private:
+    mutable std::mutex Mhistogram_runs{};
+    std::map<const AtomicUnicodeHistogram*, std::vector<std::filesystem::path>> spilled_runs{};
 };
 
 #endif
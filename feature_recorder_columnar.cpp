@@ -0,0 +1,337 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "feature_recorder_columnar.h"
+#include "feature_recorder_set.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef feature_columnar_format fmt;
+
+namespace {
+size_t pad8(size_t n) { return (n + 7) & ~size_t(7); }
+
+void put32(std::string& s, uint32_t v) {
+    for (int i = 0; i < 4; i++) s.push_back(char(v >> (8 * i)));
+}
+void put64(std::string& s, uint64_t v) {
+    for (int i = 0; i < 8; i++) s.push_back(char(v >> (8 * i)));
+}
+void put_padded(std::string& s, const std::string& bytes) {
+    s.append(bytes);
+    s.resize(pad8(s.size()), '\0');
+}
+void put_column(std::string& s, const std::vector<uint32_t>& col) {
+    for (auto v : col) put32(s, v);
+    s.resize(pad8(s.size()), '\0');
+}
+
+uint32_t load32(const uint8_t* p) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+uint64_t load64(const uint8_t* p) { return uint64_t(load32(p)) | uint64_t(load32(p + 4)) << 32; }
+
+[[noreturn]] void corrupt(const std::string& why) {
+    throw std::runtime_error("feature_columnar_reader: corrupt file: " + why);
+}
+} // namespace
+
+/****************************************************************
+ *** feature_recorder_columnar
+ ****************************************************************/
+
+feature_recorder_columnar::feature_recorder_columnar(class feature_recorder_set& fs_, const feature_recorder_def def_)
+    : feature_recorder(fs_, def_), fname(fs_.get_outdir() / (def_.name + fmt::FILE_EXTENSION)) {
+    if (fs.flags.disabled) return;
+
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        throw std::runtime_error("feature_recorder_columnar: cannot create " + fname.string() + ": " + strerror(errno));
+    }
+    std::string header;
+    put32(header, fmt::FORMAT_VERSION);
+    put32(header, name.size());
+    put_padded(header, name);
+    const std::lock_guard<std::mutex> lock(M);
+    append_chunk(fmt::HEADER, header);
+}
+
+feature_recorder_columnar::~feature_recorder_columnar() {
+    if (fd < 0) return;
+    try {
+        shutdown();
+    } catch (const std::exception& e) {
+        std::cerr << "feature_recorder_columnar: " << fname << ": " << e.what() << "\n";
+    }
+    ::close(fd);
+}
+
+void feature_recorder_columnar::flush() {
+    const std::lock_guard<std::mutex> lock(M);
+    write_block();
+}
+
+void feature_recorder_columnar::shutdown() {
+    const std::lock_guard<std::mutex> lock(M);
+    write_block();
+    if (!index_current) write_index();
+}
+
+void feature_recorder_columnar::block_t::clear() {
+    offsets.clear();
+    path_ids.clear();
+    feature_ends.clear();
+    context_ends.clear();
+    features.clear();
+    contexts.clear();
+    path_ends.clear();
+    paths.clear();
+    path_table.clear();
+}
+
+size_t feature_recorder_columnar::block_t::bytes() const {
+    return offsets.size() * 20 + path_ends.size() * 4 + features.size() + contexts.size() + paths.size();
+}
+
+uint32_t feature_recorder_columnar::path_id(const std::string& path) {
+    auto it = block.path_table.find(path);
+    if (it != block.path_table.end()) return it->second;
+    const uint32_t id = block.path_ends.size();
+    block.paths.append(path);
+    block.path_ends.push_back(block.paths.size());
+    block.path_table.emplace(path, id);
+    return id;
+}
+
+void feature_recorder_columnar::write0(const pos0_t& pos0_, std::string_view feature, std::string_view context) {
+    feature_recorder::write0(pos0_, feature, context); // call super to increment counter
+    if (fs.flags.disabled || fd < 0) return;
+    const pos0_t pos0 = fs.offset_add != 0 ? pos0_.shift(fs.offset_add) : pos0_;
+    if (def.flags.no_context) context = std::string_view();
+
+    const std::lock_guard<std::mutex> lock(M);
+    if (block.offsets.empty() || pos0.offset < block.min_offset) block.min_offset = pos0.offset;
+    if (block.offsets.empty() || pos0.offset > block.max_offset) block.max_offset = pos0.offset;
+    block.offsets.push_back(pos0.offset);
+    block.path_ids.push_back(path_id(pos0.path));
+    block.features.append(feature);
+    block.feature_ends.push_back(block.features.size());
+    block.contexts.append(context);
+    block.context_ends.push_back(block.contexts.size());
+    index_current = false;
+    if (block.bytes() >= BLOCK_BYTES || block.offsets.size() >= BLOCK_FEATURES) write_block();
+}
+
+void feature_recorder_columnar::append_chunk(fmt::chunk_type_t type, const std::string& payload) {
+    std::string chunk;
+    chunk.reserve(fmt::CHUNK_HEADER_SIZE + payload.size());
+    put32(chunk, fmt::MAGIC);
+    put32(chunk, type);
+    put64(chunk, payload.size());
+    chunk.append(payload);
+    for (size_t done = 0; done < chunk.size();) {
+        const ssize_t n = ::write(fd, chunk.data() + done, chunk.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { throw std::runtime_error("Disk full. Free up space and re-restart."); }
+        done += n;
+    }
+    file_pos += chunk.size();
+}
+
+void feature_recorder_columnar::write_block() {
+    const uint32_t count = block.offsets.size();
+    if (count == 0) return;
+    std::string payload;
+    payload.reserve(fmt::BLOCK_HEADER_SIZE + block.bytes() + 64);
+    put64(payload, features_in_file);
+    put32(payload, count);
+    put32(payload, block.path_ends.size());
+    put64(payload, block.min_offset);
+    put64(payload, block.max_offset);
+    for (auto v : block.offsets) put64(payload, v);
+    put_column(payload, block.path_ids);
+    put_column(payload, block.feature_ends);
+    put_column(payload, block.context_ends);
+    put_column(payload, block.path_ends);
+    put_padded(payload, block.features);
+    put_padded(payload, block.contexts);
+    put_padded(payload, block.paths);
+
+    index.push_back(fmt::index_entry_t{file_pos, features_in_file, block.min_offset, block.max_offset});
+    append_chunk(fmt::BLOCK, payload);
+    features_in_file += count;
+    block.clear();
+}
+
+void feature_recorder_columnar::write_index() {
+    std::string payload;
+    put32(payload, index.size());
+    put32(payload, 0);
+    for (const auto& it : index) {
+        put64(payload, it.chunk_pos);
+        put64(payload, it.first_feature);
+        put64(payload, it.min_offset);
+        put64(payload, it.max_offset);
+    }
+    const uint64_t index_pos = file_pos;
+    append_chunk(fmt::INDEX, payload);
+    std::string trailer;
+    put64(trailer, index_pos);
+    append_chunk(fmt::TRAILER, trailer);
+    index_current = true;
+}
+
+void feature_recorder_columnar::histogram_flush(AtomicUnicodeHistogram& h) { write_histogram_report(h); }
+
+/****************************************************************
+ *** feature_columnar_reader
+ ****************************************************************/
+
+feature_columnar_reader::feature_columnar_reader(const std::filesystem::path& fname) {
+    sbuf = sbuf_t::map_file(fname);
+    const uint8_t* base = sbuf->get_buf();
+    const uint64_t size = sbuf->bufsize;
+
+    auto chunk_at = [&](uint64_t pos, uint32_t& type, uint64_t& len) {
+        if (pos + fmt::CHUNK_HEADER_SIZE > size || load32(base + pos) != fmt::MAGIC) return false;
+        type = load32(base + pos + 4);
+        len = load64(base + pos + 8);
+        return len <= size - pos - fmt::CHUNK_HEADER_SIZE;
+    };
+
+    try {
+        uint32_t type = 0;
+        uint64_t len = 0;
+        if (!chunk_at(0, type, len) || type != fmt::HEADER || len < 8) {
+            throw std::runtime_error("feature_columnar_reader: not a columnar feature file: " + fname.string());
+        }
+        const uint8_t* h = base + fmt::CHUNK_HEADER_SIZE;
+        if (load32(h) != fmt::FORMAT_VERSION) corrupt("unknown version");
+        if (load32(h + 4) > len - 8) corrupt("header");
+        name.assign(reinterpret_cast<const char*>(h + 8), load32(h + 4));
+        const uint64_t first_chunk = fmt::CHUNK_HEADER_SIZE + len;
+
+        /* Use the index if the file ends with one; otherwise walk the chunks */
+        const uint64_t trailer_size = fmt::CHUNK_HEADER_SIZE + 8;
+        if (size >= first_chunk + trailer_size && chunk_at(size - trailer_size, type, len) && type == fmt::TRAILER &&
+            len == 8) {
+            const uint64_t index_pos = load64(base + size - 8);
+            if (!chunk_at(index_pos, type, len) || type != fmt::INDEX || len < 8) corrupt("index");
+            const uint8_t* p = base + index_pos + fmt::CHUNK_HEADER_SIZE;
+            const uint32_t nblocks = load32(p);
+            if (len < 8 + uint64_t(nblocks) * fmt::INDEX_ENTRY_SIZE) corrupt("index");
+            for (uint32_t i = 0; i < nblocks; i++) {
+                blocks.push_back(parse_block(load64(p + 8 + i * fmt::INDEX_ENTRY_SIZE)));
+            }
+            indexed = true;
+        } else {
+            for (uint64_t pos = first_chunk; chunk_at(pos, type, len); pos += fmt::CHUNK_HEADER_SIZE + len) {
+                if (type == fmt::BLOCK) blocks.push_back(parse_block(pos));
+            }
+        }
+        for (const auto& b : blocks) {
+            if (b.first_feature != nfeatures) corrupt("feature numbers");
+            nfeatures += b.count;
+        }
+    } catch (...) {
+        delete sbuf;
+        throw;
+    }
+}
+
+feature_columnar_reader::~feature_columnar_reader() { delete sbuf; }
+
+feature_columnar_reader::block_ref_t feature_columnar_reader::parse_block(uint64_t pos) const {
+    const uint8_t* base = sbuf->get_buf();
+    if (pos + fmt::CHUNK_HEADER_SIZE + fmt::BLOCK_HEADER_SIZE > sbuf->bufsize) corrupt("block position");
+    if (load32(base + pos) != fmt::MAGIC || load32(base + pos + 4) != fmt::BLOCK) corrupt("block header");
+    const uint64_t len = load64(base + pos + 8);
+    if (len > sbuf->bufsize - pos - fmt::CHUNK_HEADER_SIZE) corrupt("block length");
+
+    const uint8_t* p = base + pos + fmt::CHUNK_HEADER_SIZE;
+    block_ref_t b;
+    b.first_feature = load64(p);
+    b.count = load32(p + 8);
+    b.npaths = load32(p + 12);
+    b.min_offset = load64(p + 16);
+    b.max_offset = load64(p + 24);
+
+    uint64_t off = fmt::BLOCK_HEADER_SIZE;
+    auto column = [&](uint64_t bytes) {
+        if (bytes > len || off > len - bytes) corrupt("block columns");
+        const uint8_t* ret = p + off;
+        off += pad8(bytes);
+        return ret;
+    };
+    b.offsets = column(uint64_t(b.count) * 8);
+    b.path_ids = column(uint64_t(b.count) * 4);
+    b.feature_ends = column(uint64_t(b.count) * 4);
+    b.context_ends = column(uint64_t(b.count) * 4);
+    b.path_ends = column(uint64_t(b.npaths) * 4);
+    b.features = reinterpret_cast<const char*>(column(b.count ? load32(b.feature_ends + 4 * (b.count - 1)) : 0));
+    b.contexts = reinterpret_cast<const char*>(column(b.count ? load32(b.context_ends + 4 * (b.count - 1)) : 0));
+    b.paths = reinterpret_cast<const char*>(column(b.npaths ? load32(b.path_ends + 4 * (b.npaths - 1)) : 0));
+    return b;
+}
+
+feature_columnar_reader::feature_t feature_columnar_reader::get(const block_ref_t& b, uint32_t i) const {
+    feature_t ft;
+    ft.offset = load64(b.offsets + 8 * i);
+    const uint32_t f0 = i ? load32(b.feature_ends + 4 * (i - 1)) : 0;
+    const uint32_t c0 = i ? load32(b.context_ends + 4 * (i - 1)) : 0;
+    const uint32_t f1 = load32(b.feature_ends + 4 * i);
+    const uint32_t c1 = load32(b.context_ends + 4 * i);
+    const uint32_t pid = load32(b.path_ids + 4 * i);
+    if (f1 < f0 || c1 < c0 || pid >= b.npaths) corrupt("feature columns");
+    const uint32_t p0 = pid ? load32(b.path_ends + 4 * (pid - 1)) : 0;
+    const uint32_t p1 = load32(b.path_ends + 4 * pid);
+    if (p1 < p0) corrupt("path table");
+    ft.feature = std::string_view(b.features + f0, f1 - f0);
+    ft.context = std::string_view(b.contexts + c0, c1 - c0);
+    ft.path = std::string_view(b.paths + p0, p1 - p0);
+    return ft;
+}
+
+feature_columnar_reader::feature_t feature_columnar_reader::at(uint64_t i) const {
+    if (i >= nfeatures) throw std::out_of_range("feature_columnar_reader::at");
+    auto it = std::upper_bound(blocks.begin(), blocks.end(), i,
+                               [](uint64_t n, const block_ref_t& b) { return n < b.first_feature; });
+    --it;
+    return get(*it, i - it->first_feature);
+}
+
+std::string feature_columnar_reader::feature_t::pos_str() const {
+    if (path.empty()) return std::to_string(offset);
+    return std::string(path) + "-" + std::to_string(offset);
+}
+
+void feature_columnar_reader::write_text(std::ostream& os) const {
+    for_each([&os](const feature_t& ft) {
+        os << ft.pos_str() << '\t' << ft.feature;
+        if (ft.context.size() > 0) os << '\t' << ft.context;
+        os << '\n';
+    });
+}
+
+void feature_columnar_reader::convert_to_text(const std::filesystem::path& src, const std::filesystem::path& dst) {
+    feature_columnar_reader reader(src);
+    std::ofstream os(dst);
+    if (!os.is_open()) { throw std::runtime_error("feature_columnar_reader: cannot create " + dst.string()); }
+    os << "# Feature-Recorder: " << reader.get_name() << "\n";
+    os << "# Feature-File-Version: 1.1\n";
+    reader.write_text(os);
+    if (os.fail()) { throw std::runtime_error("Disk full. Free up space and re-restart."); }
+}
@@ -0,0 +1,178 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * feature_recorder_columnar - a feature recorder that writes a binary, column-oriented feature file
+ * that can be memory-mapped and read without parsing or unquoting.
+ *
+ * Features are collected in memory and appended to {outdir}/{name}.fcol a block at a time. Each
+ * block holds its features as columns: the offsets, an index into the block's table of forensic
+ * paths, and the feature and context bytes (exactly as they would appear in the text file). A block
+ * header records the block's first feature number and its lowest and highest offsets; the headers
+ * are the sparse index. When the recorder shuts down it also appends a copy of the index, so a
+ * reader can find every block without walking the file.
+ *
+ * File layout. All integers are little-endian and every column starts on an 8-byte boundary.
+ * The file is a sequence of chunks, each a 16-byte header {u32 magic "FCOL", u32 type, u64 length}
+ * followed by length bytes:
+ *
+ *   HEADER   u32 version, u32 name_len, name
+ *   BLOCK    u64 first_feature, u32 count, u32 npaths, u64 min_offset, u64 max_offset,
+ *            u64 offset[count], u32 path_id[count], u32 feature_end[count], u32 context_end[count],
+ *            u32 path_end[npaths], feature bytes, context bytes, path bytes
+ *   INDEX    u32 nblocks, u32 0, then per block {u64 chunk_pos, u64 first_feature, u64 min_offset, u64 max_offset}
+ *   TRAILER  u64 position of the INDEX chunk; always the last chunk of a finished file
+ *
+ * feature_columnar_reader maps a file and returns features as string_views into it. write_text()
+ * converts it to the tab-separated feature file format that feature_recorder_file writes.
+ */
+
+#ifndef FEATURE_RECORDER_COLUMNAR_H
+#define FEATURE_RECORDER_COLUMNAR_H
+
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "feature_recorder.h"
+#include "pos0.h"
+#include "sbuf.h"
+
+struct feature_columnar_format {
+    static inline const uint32_t MAGIC = 0x4c4f4346; // "FCOL"
+    static inline const uint32_t FORMAT_VERSION = 1;
+    enum chunk_type_t : uint32_t { HEADER = 1, BLOCK = 2, INDEX = 3, TRAILER = 4 };
+    static inline const size_t CHUNK_HEADER_SIZE = 16;
+    static inline const size_t BLOCK_HEADER_SIZE = 32;          // first_feature .. max_offset
+    static inline const size_t INDEX_ENTRY_SIZE = 32;
+    static inline const std::string FILE_EXTENSION{".fcol"};
+
+    struct index_entry_t {
+        uint64_t chunk_pos{0};   // where the BLOCK chunk starts in the file
+        uint64_t first_feature{0};
+        uint64_t min_offset{0};
+        uint64_t max_offset{0};
+    };
+};
+
+class feature_recorder_columnar : public feature_recorder {
+public:
+    static inline const size_t BLOCK_BYTES = 1024 * 1024; // a block is written when its columns reach this size
+    static inline const uint32_t BLOCK_FEATURES = 65536;  // or when it has this many features
+
+    feature_recorder_columnar(class feature_recorder_set& fs, const feature_recorder_def def); // throws if the file can't be created
+    virtual ~feature_recorder_columnar();
+    virtual void flush() override;    // write the current block
+    virtual void shutdown() override; // write the current block and the index
+
+    virtual void write0(const pos0_t& pos0, std::string_view feature, std::string_view context) override;
+    virtual void histogram_flush(AtomicUnicodeHistogram& h) override;
+
+    const std::filesystem::path get_fname() const { return fname; }
+
+private:
+    const std::filesystem::path fname;
+    std::mutex M{};                // protects everything below
+    int fd{-1};
+    uint64_t file_pos{0};          // where the next chunk goes
+    uint64_t features_in_file{0};  // features in blocks already written
+    bool index_current{false};     // the file ends with an index of every block
+
+    /* the block being filled */
+    struct block_t {
+        std::vector<uint64_t> offsets{};
+        std::vector<uint32_t> path_ids{};
+        std::vector<uint32_t> feature_ends{};
+        std::vector<uint32_t> context_ends{};
+        std::string features{};
+        std::string contexts{};
+        std::vector<uint32_t> path_ends{};
+        std::string paths{};
+        std::unordered_map<std::string, uint32_t> path_table{};
+        uint64_t min_offset{0};
+        uint64_t max_offset{0};
+        void clear();
+        size_t bytes() const;
+    } block{};
+    std::vector<feature_columnar_format::index_entry_t> index{};
+
+    uint32_t path_id(const std::string& path);
+    void append_chunk(feature_columnar_format::chunk_type_t type, const std::string& payload);
+    void write_block();           // M must be held
+    void write_index();           // M must be held
+};
+
+class feature_columnar_reader {
+public:
+    struct feature_t {
+        std::string_view path{};   // forensic path, without the offset
+        uint64_t offset{0};
+        std::string_view feature{};
+        std::string_view context{};
+        std::string pos_str() const; // path and offset as they appear in a text feature file
+    };
+
+    explicit feature_columnar_reader(const std::filesystem::path& fname); // throws std::runtime_error if not a columnar file
+    ~feature_columnar_reader();
+
+    const std::string& get_name() const { return name; }
+    uint64_t size() const { return nfeatures; }
+    feature_t at(uint64_t i) const;      // throws std::out_of_range
+    bool has_index() const { return indexed; } // false if the recorder didn't shut down
+
+    /* Call f(const feature_t&) for every feature, in file order */
+    template <typename F> void for_each(F f) const {
+        for (const auto& b : blocks) {
+            for (uint32_t i = 0; i < b.count; i++) { f(get(b, i)); }
+        }
+    }
+    /* Call f(const feature_t&) for every feature with lo <= offset <= hi, skipping blocks outside the range */
+    template <typename F> void for_each_in_range(uint64_t lo, uint64_t hi, F f) const {
+        for (const auto& b : blocks) {
+            if (b.max_offset < lo || b.min_offset > hi) continue;
+            for (uint32_t i = 0; i < b.count; i++) {
+                const feature_t ft = get(b, i);
+                if (ft.offset >= lo && ft.offset <= hi) f(ft);
+            }
+        }
+    }
+
+    void write_text(std::ostream& os) const; // the legacy tab-separated format, without the banner
+    static void convert_to_text(const std::filesystem::path& src, const std::filesystem::path& dst);
+
+private:
+    feature_columnar_reader(const feature_columnar_reader&) = delete;
+    feature_columnar_reader& operator=(const feature_columnar_reader&) = delete;
+
+    struct block_ref_t {
+        uint64_t first_feature{0};
+        uint32_t count{0};
+        uint32_t npaths{0};
+        uint64_t min_offset{0};
+        uint64_t max_offset{0};
+        const uint8_t* offsets{nullptr};
+        const uint8_t* path_ids{nullptr};
+        const uint8_t* feature_ends{nullptr};
+        const uint8_t* context_ends{nullptr};
+        const uint8_t* path_ends{nullptr};
+        const char* features{nullptr};
+        const char* contexts{nullptr};
+        const char* paths{nullptr};
+    };
+
+    sbuf_t* sbuf{nullptr};        // the mapped file
+    std::string name{};
+    uint64_t nfeatures{0};
+    bool indexed{false};
+    std::vector<block_ref_t> blocks{};
+
+    block_ref_t parse_block(uint64_t pos) const;
+    feature_t get(const block_ref_t& b, uint32_t i) const;
+};
+
+#endif
@@ -6,11 +6,15 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdarg>
 #include <regex>
+#include <sstream>
+#include <unordered_map>
 
 #include "feature_recorder_file.h"
 #include "feature_recorder_set.h"
+#include "scan_journal.h"
 #include "unicode_escape.h"
 #include "utils.h"
 #include "word_and_context_list.h"
@@ -45,7 +49,7 @@
  */
 // TODO - make it register itself with the feature recorder set. and do the stuff that's in init.
 feature_recorder_file::feature_recorder_file(class feature_recorder_set& fs_, const feature_recorder_def def_)
-    : feature_recorder(fs_, def_) {
+    : feature_recorder(fs_, def_), codec(fs_.feature_file_compression) {
     /* If the feature recorder set is disabled, just return. */
     if (fs.flags.disabled) return;
 
@@ -59,26 +63,69 @@ feature_recorder_file::feature_recorder_file(class feature_recorder_set& fs_, co
      */
     const std::lock_guard<std::mutex> lock(Mios);
     std::filesystem::path fname = fname_in_outdir("", NO_COUNT);
-    ios.open(fname.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::ate);
-    if (ios.is_open()) { // opened existing file
-        ios.seekg(0L, std::ios_base::end);
-        while (ios.is_open()) {
-            /* Get current position.
-             * If we are at the beginning, just return.
-             */
-            if (int(ios.tellg()) == 0) {
-                ios.seekp(0L, std::ios_base::beg);
+    auto index_from = [this, &fname](uint64_t keep) {
+        if (fs.flags.offset_index) open_index(fname.string() + FeatureReader::INDEX_EXTENSION, keep);
+    };
+    if (codec != frame_codec::NONE) {
+        if (!frame_codec::available(codec)) {
+            throw std::runtime_error(std::string("feature file compression not available: ") + frame_codec::name(codec));
+        }
+        if (fs.get_journal() && fs.get_journal()->resumed()) {
+            throw std::runtime_error("compressed feature files cannot be resumed from a scan journal");
+        }
+        fname += frame_codec::extension(codec);
+        ios.open(fname.c_str(), std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+        frames_index.open(fname.string() + FeatureReader::FRAMES_EXTENSION, std::ios_base::out | std::ios_base::trunc);
+        if (!ios.is_open() || !frames_index.is_open()) {
+            throw std::invalid_argument("cannot open feature file for writing: " + fname.string());
+        }
+        index_from(0);
+        return;
+    }
+    /* Resuming from a journal: the file is cut to the length of the last checkpoint, since everything after
+     * it came from pages that will be scanned again.
+     */
+    const scan_journal* journal = fs.get_journal();
+    if (journal && journal->resumed()) {
+        uint64_t committed = 0;
+        journal->committed_length(name, committed); // 0 if the recorder was created after the checkpoint
+        std::error_code ec;
+        const uintmax_t size = std::filesystem::file_size(fname, ec);
+        if (!ec && size < committed) {
+            throw std::runtime_error("feature file " + fname.string() + " is shorter than the scan journal says");
+        }
+        if (!ec) {
+            std::filesystem::resize_file(fname, committed);
+            ios.open(fname.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::ate);
+            if (ios.is_open()) {
+                index_from(committed);
                 return;
             }
-            /* backup one character and see if the next character is a newline */
-            ios.seekg(-1, std::ios_base::cur);              // backup to once less than the end of the file
-            if (ios.peek() == '\n') {                       // we are finally on the \n
-                ios.seekg(1L, std::ios_base::cur);          // move the getting one forward
-                ios.seekp(ios.tellg(), std::ios_base::beg); // put the putter at the getter location
-                // count_ = 1;                            // greater than zero
+        }
+    }
+
+    ios.open(fname.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::ate);
+    if (ios.is_open()) { // opened existing file
+        /* Continue after the last complete line, looking for it a block at a time from the end */
+        static const std::streamoff BLOCK = 64 * 1024;
+        std::streamoff pos = ios.seekg(0L, std::ios_base::end).tellg();
+        std::string block;
+        while (pos > 0) {
+            const std::streamoff n = std::min(pos, BLOCK);
+            pos -= n;
+            block.resize(n);
+            ios.seekg(pos, std::ios_base::beg);
+            ios.read(&block[0], n);
+            const size_t nl = block.rfind('\n');
+            if (nl != std::string::npos) {
+                ios.seekp(pos + nl + 1, std::ios_base::beg);
+                index_from(pos + nl + 1);
                 return;
             }
         }
+        ios.seekp(0L, std::ios_base::beg);
+        index_from(0);
+        return;
     }
     /* Just open the stream for output */
     ios.open(fname.c_str(), std::ios_base::out);
@@ -87,11 +134,49 @@ feature_recorder_file::feature_recorder_file(class feature_recorder_set& fs_, co
                   << strerror(errno) << "\n";
         throw std::invalid_argument("cannot open feature file for writing");
     }
+    index_from(0);
+}
+
+/* The index is rewritten with only the entries inside the part of the file being kept, then appended to */
+void feature_recorder_file::open_index(const std::filesystem::path& idx, uint64_t keep) {
+    std::vector<FeatureReader::index_entry_t> kept;
+    if (keep > 0) {
+        std::ifstream in(idx, std::ios_base::in | std::ios_base::binary);
+        std::string magic(FeatureReader::INDEX_MAGIC.size(), '\0');
+        uint8_t buf[FeatureReader::INDEX_ENTRY_SIZE];
+        if (in.read(&magic[0], magic.size()) && magic == FeatureReader::INDEX_MAGIC) {
+            while (in.read(reinterpret_cast<char*>(buf), sizeof(buf))) {
+                const auto e = FeatureReader::index_entry_t::from_bytes(buf);
+                if (e.file_offset + e.len <= keep) kept.push_back(e);
+            }
+        }
+    }
+    offset_index.open(idx, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+    if (!offset_index.is_open()) throw std::invalid_argument("cannot open feature file index for writing: " + idx.string());
+    offset_index.write(FeatureReader::INDEX_MAGIC.data(), FeatureReader::INDEX_MAGIC.size());
+    for (const auto& e : kept) index_block(e);
+}
+
+void feature_recorder_file::index_block(const FeatureReader::index_entry_t& e) {
+    if (!offset_index.is_open() || e.len == 0) return;
+    uint8_t buf[FeatureReader::INDEX_ENTRY_SIZE];
+    e.to_bytes(buf);
+    offset_index.write(reinterpret_cast<const char*>(buf), sizeof(buf));
+    if (offset_index.fail()) throw std::runtime_error("Disk full. Free up space and re-restart.");
 }
 
 /* Exiting: make sure that the stream is closed.
+ * A write that fails here can only be reported; shutdown() is where it is thrown.
  */
 feature_recorder_file::~feature_recorder_file() {
+    try {
+        flush_buffers();
+        const std::lock_guard<std::mutex> lock(Mios);
+        index_block(pending);
+    } catch (const std::exception& e) {
+        std::cerr << "feature_recorder_file: " << name << ": " << e.what() << "\n";
+    }
+    const std::lock_guard<std::mutex> lock(Mios);
     if (ios.is_open()) { ios.close(); }
 }
 
@@ -117,6 +202,10 @@ void feature_recorder_file::banner_stamp(std::ostream& os, const std::string& he
     os << "# Feature-Recorder: " << name << "\n";
 
     if (!fs.get_input_fname().empty()) { os << "# Filename: " << fs.get_input_fname().string() << "\n"; }
+    if (fs.sc.shard.enabled()) {
+        os << "# Shard: " << fs.sc.shard.id << " of " << fs.sc.shard.count << " bytes " << fs.sc.shard.start << "-"
+           << fs.sc.shard.end << "\n";
+    }
     if (feature_recorder_file::debug != 0) {
         os << "# DEBUG: " << debug << " (";
         if (feature_recorder_file::debug & DEBUG_PEDANTIC) os << " DEBUG_PEDANTIC ";
@@ -131,8 +220,27 @@ const std::string feature_recorder_file::histogram_file_header("# Histogram-File
 const std::string feature_recorder_file::bulk_extractor_version_header("# " PACKAGE_NAME "-Version: " PACKAGE_VERSION
                                                                        "\n");
 
-void feature_recorder_file::flush()    { ios.flush(); }
-void feature_recorder_file::shutdown() { ios.flush(); }
+std::atomic<uint64_t> feature_recorder_file::next_recorder_id{0};
+
+void feature_recorder_file::flush() {
+    flush_buffers();
+    const std::lock_guard<std::mutex> lock(Mios);
+    index_block(pending);
+    pending = FeatureReader::index_entry_t{};
+    ios.flush();
+    if (frames_index.is_open()) frames_index.flush();
+    if (offset_index.is_open()) offset_index.flush();
+}
+
+void feature_recorder_file::shutdown() { flush(); }
+
+bool feature_recorder_file::journal_length(uint64_t& len) {
+    if (codec != frame_codec::NONE) return false; // compressed files are always started afresh
+    const std::lock_guard<std::mutex> lock(Mios);
+    if (!ios.is_open()) return false;
+    len = ios.tellp();
+    return true;
+}
 
 /**
  * We now have three kinds of histograms:
@@ -152,6 +260,10 @@ void feature_recorder_file::shutdown() { ios.flush(); }
  */
 void feature_recorder_file::write0(const std::string& str) {
     feature_recorder::write0(str); // call super class
+    write_line(str, NO_OFFSET);
+}
+
+void feature_recorder_file::write_line(const std::string& str, uint64_t image_offset) {
     if (fs.flags.pedantic && (utf8::find_invalid(str.begin(), str.end()) != str.end())) {
         std::cerr << "******************************************\n";
         std::cerr << "feature recorder: " << name << "\n";
@@ -162,11 +274,36 @@ void feature_recorder_file::write0(const std::string& str) {
     /* this is where the writing happens. lock the output and write */
     if (fs.flags.disabled) { return; }
 
+    if (fs.flags.buffered_writes || codec != frame_codec::NONE) {
+        thread_buffer_t& tb = thread_buffer();
+        const std::lock_guard<std::mutex> lock(tb.M);
+        tb.lines.append(str);
+        tb.lines.push_back('\n');
+        if (image_offset != NO_OFFSET) {
+            tb.min_offset = std::min(tb.min_offset, image_offset);
+            tb.max_offset = std::max(tb.max_offset, image_offset);
+        }
+        if (tb.lines.size() >= WRITE_BUFFER_BYTES) {
+            write_block(tb);
+            tb.clear();
+        }
+        return;
+    }
     const std::lock_guard<std::mutex> lock(Mios);
     if (ios.is_open()) {
         /* If there is no banner, add it */
-        if (ios.tellg() == 0) {
-            banner_stamp(ios, feature_file_header);
+        if (!banner_checked) {
+            if (ios.tellp() == 0) banner_stamp(ios, feature_file_header);
+            banner_checked = true;
+        }
+
+        /* The pending index entry starts at the first feature line after the last entry, and covers every line since */
+        const bool indexing = offset_index.is_open() && (pending.len > 0 || image_offset != NO_OFFSET);
+        if (indexing && pending.len == 0) {
+            pending = FeatureReader::index_entry_t{image_offset, image_offset, uint64_t(ios.tellp()), 0};
+        } else if (indexing && image_offset != NO_OFFSET) {
+            pending.min_offset = std::min(pending.min_offset, image_offset);
+            pending.max_offset = std::max(pending.max_offset, image_offset);
         }
 
         /* Output the feature */
@@ -174,6 +311,83 @@ void feature_recorder_file::write0(const std::string& str) {
         if (ios.fail()) {
             throw std::runtime_error("Disk full. Free up space and re-restart.");
         }
+        if (indexing) {
+            pending.len += str.size() + 1;
+            if (pending.len >= INDEX_BLOCK_BYTES) {
+                index_block(pending);
+                pending = FeatureReader::index_entry_t{};
+            }
+        }
+    }
+}
+
+feature_recorder_file::thread_buffer_t& feature_recorder_file::thread_buffer() {
+    /* ids are not reused, so an entry is only found by its own recorder; the weak_ptr tells when that is gone */
+    struct entry_t {
+        thread_buffer_t* tb;
+        std::weak_ptr<thread_buffer_t> owned;
+    };
+    thread_local std::unordered_map<uint64_t, entry_t> tl_buffers{};
+    auto it = tl_buffers.find(recorder_id);
+    if (it != tl_buffers.end()) return *it->second.tb;
+
+    for (auto i = tl_buffers.begin(); i != tl_buffers.end();) {
+        i = i->second.owned.expired() ? tl_buffers.erase(i) : std::next(i);
+    }
+    const std::lock_guard<std::mutex> lock(Mbuffers);
+    buffers.push_back(std::make_shared<thread_buffer_t>());
+    buffers.back()->lines.reserve(WRITE_BUFFER_BYTES + 4096);
+    tl_buffers[recorder_id] = entry_t{buffers.back().get(), buffers.back()};
+    return *buffers.back();
+}
+
+/* Append a block of whole lines to the file with a single write */
+void feature_recorder_file::write_block(const thread_buffer_t& tb) {
+    const char* data = tb.lines.data();
+    const size_t len = tb.lines.size();
+    if (len == 0) return;
+    if (codec != frame_codec::NONE) {
+        /* compress before taking Mios, so that threads compress in parallel */
+        const std::string frame = frame_codec::compress(codec, data, len, fs.feature_file_compression_level);
+        const std::lock_guard<std::mutex> lock(Mios);
+        if (!ios.is_open()) return;
+        if (!banner_checked) {
+            std::ostringstream banner;
+            banner_stamp(banner, feature_file_header);
+            const std::string b = banner.str();
+            write_frame(frame_codec::compress(codec, b.data(), b.size(), fs.feature_file_compression_level), b.size());
+            banner_checked = true;
+        }
+        const uint64_t start = file_pos;
+        write_frame(frame, len);
+        if (tb.min_offset != NO_OFFSET) index_block({tb.min_offset, tb.max_offset, start, file_pos - start});
+        return;
+    }
+    const std::lock_guard<std::mutex> lock(Mios);
+    if (!ios.is_open()) return;
+    if (!banner_checked) {
+        if (ios.tellp() == 0) banner_stamp(ios, feature_file_header);
+        banner_checked = true;
+    }
+    const uint64_t start = offset_index.is_open() ? uint64_t(ios.tellp()) : 0;
+    ios.write(data, len);
+    if (ios.fail()) { throw std::runtime_error("Disk full. Free up space and re-restart."); }
+    if (tb.min_offset != NO_OFFSET) index_block({tb.min_offset, tb.max_offset, start, len});
+}
+
+void feature_recorder_file::write_frame(const std::string& frame, size_t uncompressed_len) {
+    ios.write(frame.data(), frame.size());
+    if (ios.fail()) { throw std::runtime_error("Disk full. Free up space and re-restart."); }
+    frames_index << file_pos << ' ' << frame.size() << ' ' << uncompressed_len << '\n';
+    file_pos += frame.size();
+}
+
+void feature_recorder_file::flush_buffers() {
+    const std::lock_guard<std::mutex> lock(Mbuffers);
+    for (auto& tb : buffers) {
+        const std::lock_guard<std::mutex> block(tb->M);
+        write_block(*tb);
+        tb->clear();
     }
 }
 
@@ -187,15 +401,28 @@ void feature_recorder_file::write0(const std::string& str) {
  * Interlocking is done in write().
  */
 
-void feature_recorder_file::write0(const pos0_t& pos0, const std::string& feature, const std::string& context) {
+void feature_recorder_file::write0(const pos0_t& pos0, std::string_view feature, std::string_view context) {
     feature_recorder::write0(pos0, feature, context); // call super to increment counter
     if (fs.flags.disabled) { return; }
-    std::stringstream ss;
-    ss << pos0.shift(fs.offset_add).str() << '\t' << feature;
+    thread_local std::string line{};                  // reused, so that formatting a line doesn't allocate
+    line.clear();
+    uint64_t image_offset = NO_OFFSET;                // only wanted for the offset index
+    if (fs.offset_add != 0) {
+        const pos0_t shifted = pos0.shift(fs.offset_add);
+        shifted.append_str(line);
+        if (fs.flags.offset_index) image_offset = shifted.imageOffset();
+    } else {
+        pos0.append_str(line);
+        if (fs.flags.offset_index) image_offset = pos0.imageOffset();
+    }
+    line.push_back('\t');
+    line.append(feature);
     if ((def.flags.no_context == false) && (context.size() > 0)) {
-        ss << '\t' << context;
+        line.push_back('\t');
+        line.append(context);
     }
-    write0(ss.str());                                 // and do the actual write
+    feature_recorder::write0(line);                   // what write0(line) does, keeping the offset
+    write_line(line, image_offset);                   // and do the actual write
 }
 
 /****************************************************************
@@ -205,14 +432,10 @@ void feature_recorder_file::write0(const pos0_t& pos0, const std::string& featur
 /** Flush a specific histogram.
  * This is how the feature recorder triggers the histogram to be written.
  */
-void feature_recorder_file::histogram_flush(AtomicUnicodeHistogram& h) {
-    /* Get the next filename */
-    auto fname = fname_in_outdir(h.def.suffix, NEXT_COUNT);
-    std::fstream hfile;
-    hfile.open(fname.c_str(), std::ios_base::out);
-    if (!hfile.is_open()) {
-        throw std::runtime_error("Cannot open feature histogram file " + fname.string());
-    }
-    hfile << h.makeReport(0); // sorted and clear
-    hfile.close();
+void feature_recorder_file::histogram_flush(AtomicUnicodeHistogram& h) { write_histogram_report(h); }
+
+std::filesystem::path feature_recorder_file::feature_file() const {
+    std::filesystem::path fname = fname_in_outdir("", NO_COUNT);
+    if (codec != frame_codec::NONE) fname += frame_codec::extension(codec);
+    return fname;
 }
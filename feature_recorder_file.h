@@ -7,18 +7,43 @@
 #include <atomic>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "feature_recorder.h"
 #include "pos0.h"
 #include "sbuf.h"
 
+/**
+ * With fs.flags.buffered_writes, each thread appends its feature lines to a buffer of its own and
+ * the buffer is written to the feature file as one block when it reaches WRITE_BUFFER_BYTES, so
+ * Mios is taken once per block rather than once per feature. Blocks contain only whole lines, so
+ * lines from different threads never interleave. Lines are not in the file until their block is
+ * written: flush(), shutdown() and the destructor write every thread's buffer.
+ *
+ * If fs.feature_file_compression is set, lines are always buffered that way and each block is
+ * compressed into a frame of its own (the banner is the first frame) and written to
+ * {name}.txt.gz (or .zst, .lz4). Every frame can be decompressed without the others; the offset and
+ * sizes of each are appended to {name}.txt.gz.frames so that FeatureReader can read them in
+ * parallel. A compressed file is always started afresh, never continued after a restart.
+ *
+ * With fs.flags.offset_index, each block's range of image offsets is appended to {file}.idx (see
+ * FeatureReader). Unbuffered lines are indexed INDEX_BLOCK_BYTES at a time. A continued file keeps the index
+ * entries of the part of it that is kept.
+ */
 class feature_recorder_file : public feature_recorder {
 public:
+    static inline const size_t WRITE_BUFFER_BYTES = 256 * 1024;
+    static inline const size_t INDEX_BLOCK_BYTES = 64 * 1024;
+    static inline const uint64_t NO_OFFSET = std::numeric_limits<uint64_t>::max(); // a line that isn't a feature
+
     feature_recorder_file(class feature_recorder_set& fs, const feature_recorder_def def);
     virtual ~feature_recorder_file();
     virtual void flush() override;
@@ -27,6 +52,40 @@ private:
     std::mutex Mios{};  // mutex for IOS
     std::fstream ios{}; // where features are written
     bool debug{false};  // for debugging
+    bool banner_checked{false}; // protected by Mios
+    const frame_codec::codec_t codec;
+    std::ofstream frames_index{};   // protected by Mios
+    uint64_t file_pos{0};           // compressed bytes written; protected by Mios
+    std::ofstream offset_index{};   // protected by Mios
+    FeatureReader::index_entry_t pending{}; // unbuffered lines not yet indexed; protected by Mios
+
+    /* Per-thread buffers for buffered_writes. Each thread finds its own through a
+     * thread_local map keyed by recorder_id; the recorder owns them so it can write them all out,
+     * and a thread drops the entries of deleted recorders when it meets a new one.
+     */
+    struct thread_buffer_t {
+        std::mutex M{};          // only contended while the recorder is flushing
+        std::string lines{};
+        uint64_t min_offset{NO_OFFSET}; // of the features in lines
+        uint64_t max_offset{0};
+        void clear() {
+            lines.clear();
+            min_offset = NO_OFFSET;
+            max_offset = 0;
+        }
+    };
+    static std::atomic<uint64_t> next_recorder_id;
+    const uint64_t recorder_id{next_recorder_id++};
+    std::mutex Mbuffers{};
+    std::vector<std::shared_ptr<thread_buffer_t>> buffers{};
+
+    thread_buffer_t& thread_buffer();
+    void write_block(const thread_buffer_t& tb);  // call with tb locked
+    void write_line(const std::string& str, uint64_t image_offset);
+    void open_index(const std::filesystem::path& fname, uint64_t keep); // keeps the entries of the first keep bytes
+    void index_block(const FeatureReader::index_entry_t& e); // Mios must be held
+    void flush_buffers();
+    void write_frame(const std::string& frame, size_t uncompressed_len); // Mios must be held
 
     void banner_stamp(std::ostream& os, const std::string& header) const; // stamp banner, and header
 
@@ -49,7 +108,7 @@ public:
      */
     // virtual const std::string hash(const uint8_t *buf, size_t bufflen); // hash a block with the hasher
     virtual void write0(const std::string& str) override;
-    virtual void write0(const pos0_t& pos0, const std::string& feature, const std::string& context) override;
+    virtual void write0(const pos0_t& pos0, std::string_view feature, std::string_view context) override;
 
     /* feature file management */
 #if 0
@@ -63,6 +122,8 @@ public:
 #endif
 
     virtual void histogram_flush(AtomicUnicodeHistogram& h) override;
+    virtual std::filesystem::path feature_file() const override;
+    virtual bool journal_length(uint64_t& len) override;
 
     // virtual void dump_histogram_file(const histogram_def &def,void *user,feature_recorder::dump_callback_t cb) const;
     // virtual size_t count_histograms() const;
@@ -2,10 +2,16 @@
 
 #include "config.h" // needed for hash_t and feature_recorder_sql.h
 
+#include "alert_writer.h"
+#include "feature_recorder_columnar.h"
 #include "feature_recorder_file.h"
 #include "feature_recorder_set.h"
 #include "feature_recorder_sql.h"
+#include "histogram_engine.h"
+#include "scan_journal.h"
 #include "scanner_config.h"
+#include "shard_merge.h"
+#include "thread_pool.h"
 
 #include "dfxml_cpp/src/dfxml_writer.h"
 #include "dfxml_cpp/src/hash_t.h"
@@ -20,7 +26,7 @@
 /**
  * feature_recorder_set:
  * Manage the set of feature recorders.
- * Handles both file-based feature recorders and the SQLite3 feature recorder.
+ * Handles file-based feature recorders, columnar feature recorders and the SQLite3 feature recorder.
  */
 
 const std::string feature_recorder_set::ALERT_RECORDER_NAME = "alerts";
@@ -55,6 +61,7 @@ feature_recorder_set::hash_func_t feature_recorder_set::hash_def::hash_func_for_
 feature_recorder_set::feature_recorder_set(const flags_t& flags_, const scanner_config& sc_)
     : flags(flags_), sc(sc_), hasher(hash_def(sc_.hash_algorithm, hash_def::hash_func_for_name(sc_.hash_algorithm))) {
     namespace fs = std::filesystem;
+    carver = std::make_unique<carve_writer>(flags.async_carving ? carve_writer::DEFAULT_THREADS : 0);
     if (sc.outdir.empty()) {
         throw std::invalid_argument("feature_recorder_set::feature_recorder_set(): output directory not provided");
     }
@@ -74,6 +81,11 @@ feature_recorder_set::feature_recorder_set(const flags_t& flags_, const scanner_
         if (access(sc.outdir.c_str(), W_OK) != 0) {
             throw std::invalid_argument("output directory " + sc.outdir.string() + " not writable");
         }
+        /* Opened before any recorder, since the recorders truncate their files to the committed lengths */
+        if (!sc.journal_file.empty()) {
+            journal = std::make_unique<scan_journal>(sc.journal_file.is_relative() ? sc.outdir / sc.journal_file
+                                                                                    : sc.journal_file);
+        }
     }
 
 #if 0
@@ -85,14 +97,6 @@ feature_recorder_set::feature_recorder_set(const flags_t& flags_, const scanner_
 
     // message_enabled_scanners(scanner_params::PHASE_INIT); // tell all enabled scanners to init
 
-#if 0
-#if defined(HAVE_SQLITE3_H)
-    if (flag_set(ENABLE_SQLITE3_RECORDERS)) {
-        db_create();
-    }
-#endif
-#endif
-
 #if 0
     /* Create the requested feature files */
     for( auto it:feature_files){
@@ -105,12 +109,17 @@ feature_recorder_set::feature_recorder_set(const flags_t& flags_, const scanner_
  * deallocator
  */
 feature_recorder_set::~feature_recorder_set() {
-    frm.delete_all();
-#if 0
-#if defined(HAVE_SQLITE3_H)
-    db_close();
-#endif
-#endif
+    for (auto& it : frm.take()) { delete it.second; }
+    sql_writer.reset(); // after the SQL feature recorders that use it
+    alerts.reset();
+}
+
+/* The alert list hits are written by an alert_writer, so that the scanners never wait for the file */
+void feature_recorder_set::set_alert_list(const word_and_context_list* alist) {
+    alert_list = alist;
+    if (alert_list && !alerts && !flags.disabled && sc.outdir != scanner_config::NO_OUTDIR) {
+        alerts = std::make_unique<alert_writer>(get_outdir() / alert_writer::FILENAME);
+    }
 }
 
 /**
@@ -135,18 +144,19 @@ void feature_recorder_set::create_alert_recorder() {
  */
 
 feature_recorder& feature_recorder_set::create_feature_recorder(const feature_recorder_def def) {
-    if (flags.record_files and flags.record_sql) {
-        throw std::runtime_error("currently can only record to files or SQL, not both");
+    if (int(flags.record_files) + int(flags.record_sql) + int(flags.record_columnar) > 1) {
+        throw std::runtime_error("currently can only record to one of files, SQL or columnar files");
+    }
+    if (!flags.record_files and !flags.record_sql and !flags.record_columnar) {
+        throw std::runtime_error("Must record to either files, SQL or columnar files");
     }
-    if (!flags.record_files and !flags.record_sql) { throw std::runtime_error("Must record to either files or SQL"); }
     if (def.name.size() == 0) {
         throw FeatureRecorderNullName();
     }
 
-    auto it = frm.find(def.name);
-    if (it != frm.end()) {
+    if (auto it = frm.find(def.name)) {
         // we have a feature recorder with the same name. See if it has the same definition!
-        feature_recorder &fr = *it->second;
+        feature_recorder &fr = **it;
         if (fr.def == def){
             return fr;
         }
@@ -156,15 +166,33 @@ feature_recorder& feature_recorder_set::create_feature_recorder(const feature_re
 
     feature_recorder* fr = nullptr;
     if (flags.record_files) { fr = new feature_recorder_file(*this, def); }
-#ifdef HAVE_SQLITE3_H
+    if (flags.record_columnar) { fr = new feature_recorder_columnar(*this, def); }
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
     if (flags.record_sql) { fr = new feature_recorder_sql(*this, def); }
+#else
+    if (flags.record_sql) { throw std::runtime_error("SQLite3 support was not compiled in"); }
 #endif
     fr->context_window = sc.context_window_default;
     fr->carve_mode = def.default_carve_mode; // set the default
-    frm.insert(def.name, fr);
+    if (!frm.insert(def.name, fr)) {
+        /* another thread created it first */
+        delete fr;
+        return named_feature_recorder(def.name);
+    }
     return *fr; // as a courtesy
 }
 
+/* The database is opened by the first SQL feature recorder */
+besql_writer& feature_recorder_set::get_sql_writer() {
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
+    const std::lock_guard<std::mutex> lock(Msql_writer);
+    if (!sql_writer) { sql_writer = std::make_unique<besql_writer>(get_outdir() / besql_writer::DB_FILENAME); }
+    return *sql_writer;
+#else
+    throw std::runtime_error("SQLite3 support was not compiled in");
+#endif
+}
+
 /* convenience constructor for feature recorder with default def */
 feature_recorder& feature_recorder_set::create_feature_recorder(std::string name) {
     return create_feature_recorder(feature_recorder_def(name));
@@ -178,8 +206,8 @@ feature_recorder& feature_recorder_set::create_feature_recorder(std::string name
 feature_recorder& feature_recorder_set::named_feature_recorder(const std::string name) const
 {
     auto it = frm.find(name);
-    if (it == frm.end()) { throw NoSuchFeatureRecorder{std::string("No such feature recorder: ") + name}; }
-    return *it->second;
+    if (!it) { throw NoSuchFeatureRecorder{std::string("No such feature recorder: ") + name}; }
+    return **it;
 }
 
 /*
@@ -196,7 +224,7 @@ feature_recorder& feature_recorder_set::get_alert_recorder() const
  */
 void feature_recorder_set::set_carve_defaults()
 {
-    for (auto it : frm ) {
+    for (const auto& it : frm.sorted_snapshot()) {
         std::string option_name = it.first + "_carve_mode";
         auto val = sc.namevals.find(option_name);
         if (val != sc.namevals.end()) {
@@ -206,9 +234,44 @@ void feature_recorder_set::set_carve_defaults()
     }
 }
 
+void feature_recorder_set::journal_checkpoint() {
+    if (!journal) return;
+    std::map<std::string, uint64_t> lengths;
+    for (const auto& it : frm.sorted_snapshot()) {
+        it.second->flush();
+        uint64_t len = 0;
+        if (it.second->journal_length(len)) lengths[it.first] = len;
+    }
+    journal->checkpoint(lengths);
+}
+
+/* Called after the histograms are written, so that they are there to be listed */
+void feature_recorder_set::write_shard_manifest() const {
+    shard_merge::manifest_t m;
+    m.shard = sc.shard;
+    m.input_fname = get_input_fname().string();
+    for (const auto& it : frm.sorted_snapshot()) {
+        const std::filesystem::path ff = it.second->feature_file();
+        if (!ff.empty() && std::filesystem::exists(ff)) m.feature_files.push_back(ff.filename().string());
+        for (const auto& h : it.second->histograms) {
+            const std::filesystem::path hf = it.second->fname_in_outdir(h->def.suffix, feature_recorder::NO_COUNT);
+            if (std::filesystem::exists(hf)) m.histogram_files.push_back(hf.filename().string());
+        }
+    }
+    m.write(get_outdir());
+}
+
 // send every enabled scanner the phase message
 void feature_recorder_set::feature_recorders_shutdown() {
-    for (auto const& it : frm) { it.second->shutdown(); }
+    carver->drain();
+    for (auto const& it : frm.sorted_snapshot()) { it.second->shutdown(); }
+    if (alerts) alerts->drain();
+    if (!carve_index_fname.empty()) carve_index.save(carve_index_fname);
+}
+
+void feature_recorder_set::use_carve_index(const std::filesystem::path& fname) {
+    if (std::filesystem::exists(fname)) carve_index.attach(fname);
+    carve_index_fname = fname;
 }
 
 /****************************************************************
@@ -217,7 +280,7 @@ void feature_recorder_set::feature_recorders_shutdown() {
 
 void feature_recorder_set::dump_name_count_stats(dfxml_writer& writer) const {
     writer.push("feature_files");
-    for (auto ij : frm) {
+    for (const auto& ij : frm.sorted_snapshot()) {
         writer.set_oneline(true);
         writer.push("feature_file");
         writer.xmlout("name", ij.second->name);
@@ -228,6 +291,18 @@ void feature_recorder_set::dump_name_count_stats(dfxml_writer& writer) const {
     writer.pop();
 }
 
+std::map<std::string, uint64_t> feature_recorder_set::get_features_written() const {
+    std::map<std::string, uint64_t> ret;
+    for (const auto& it : frm.sorted_snapshot()) ret[it.second->name] = it.second->features_written;
+    return ret;
+}
+
+uint64_t feature_recorder_set::get_carved_file_count() const {
+    uint64_t ret = 0;
+    for (const auto& it : frm.sorted_snapshot()) ret += it.second->carved_file_count;
+    return ret;
+}
+
 /****************************************************************
  *** Histogram Support - Called during shutdown of scanner_set.
  ****************************************************************/
@@ -247,146 +322,72 @@ void feature_recorder_set::histogram_add(const histogram_def& def) {
 size_t feature_recorder_set::histogram_count() const {
     /* Ask each feature recorder to count the number of histograms it can produce */
     size_t count = 0;
-    for (auto it : frm) { count += it.second->histogram_count(); }
+    for (const auto& it : frm.sorted_snapshot()) { count += it.second->histogram_count(); }
     return count;
 }
 
-/**
- * Have every feature recorder generate all of its histograms.
- */
-void feature_recorder_set::histograms_generate() {
-    for (auto it : frm) { it.second->histogram_flush_all(); }
+void feature_recorder_set::histograms_check_memory() {
+    if (histogram_memory_limit == 0 || histogram_memory <= histogram_memory_limit) return;
+    std::unique_lock<std::mutex> lock(Mhistogram_spill, std::try_to_lock);
+    if (!lock.owns_lock()) return; // another thread is already spilling
+    while (histogram_memory > histogram_memory_limit / 2) {
+        if (!histograms_spill_largest()) break;
+    }
 }
 
-std::vector<std::string> feature_recorder_set::feature_file_list() const {
-    std::vector<std::string> ret;
-    for (auto it : frm) { ret.push_back(it.first); }
-    return ret;
+bool feature_recorder_set::histograms_spill_largest() {
+    feature_recorder* fr_largest = nullptr;
+    AtomicUnicodeHistogram* largest = nullptr;
+    for (const auto& it : frm.sorted_snapshot()) {
+        AtomicUnicodeHistogram* h = it.second->largest_histogram();
+        if (h && (largest == nullptr || h->bytes() > largest->bytes())) {
+            largest = h;
+            fr_largest = it.second;
+        }
+    }
+    return largest ? fr_largest->histogram_spill(*largest) : false;
 }
 
-#if 0
-
-/*** SQL Support ***/
-
-/*
- * Time results with ubnist1 on R4:
- * no SQL - 79 seconds
- * no pragmas - 651 seconds
- * "PRAGMA synchronous =  OFF", - 146 second
- * "PRAGMA synchronous =  OFF", "PRAGMA journal_mode=MEMORY", - 79 seconds
- *
- * Time with domexusers:
- * no SQL -
+/**
+ * Have every feature recorder generate all of its histograms.
+ * Deferred histograms are first made from the feature files, all of them at once.
+ * The histograms are independent, so they are generated in parallel, each merge with its share of the memory.
  */
-
-#define SQLITE_EXTENSION ".sqlite"
-#ifndef SQLITE_DETERMINISTIC
-#define SQLITE_DETERMINISTIC 0
-#endif
-
-static int debug  = 0;
-
-static const char *schema_db[] = {
-    "PRAGMA synchronous =  OFF",
-    "PRAGMA journal_mode=MEMORY",
-    //"PRAGMA temp_store=MEMORY",  // did not improve performance
-    "PRAGMA cache_size = 200000",
-    "CREATE TABLE IF NOT EXISTS db_info (schema_ver INTEGER, bulk_extractor_ver INTEGER)",
-    "INSERT INTO  db_info (schema_ver, bulk_extractor_ver) VALUES (1,1)",
-    "CREATE TABLE IF NOT EXISTS be_features (tablename VARCHAR,comment TEXT)",
-    "CREATE TABLE IF NOT EXISTS be_config (name VARCHAR,value VARCHAR)",
-    0};
-
-/* Create a feature table and note that it has been created in be_features */
-static const char *schema_tbl[] = {
-    "CREATE TABLE IF NOT EXISTS f_%s (offset INTEGER(12), path VARCHAR, feature_eutf8 TEXT, feature_utf8 TEXT, context_eutf8 TEXT)",
-    "CREATE INDEX IF NOT EXISTS f_%s_idx1 ON f_%s(offset)",
-    "CREATE INDEX IF NOT EXISTS f_%s_idx2 ON f_%s(feature_eutf8)",
-    "CREATE INDEX IF NOT EXISTS f_%s_idx3 ON f_%s(feature_utf8)",
-    "INSERT INTO be_features (tablename,comment) VALUES ('f_%s','')",
-    0};
-
-static const char *begin_transaction[] = {"BEGIN TRANSACTION",0};
-static const char *commit_transaction[] = {"COMMIT TRANSACTION",0};
-void feature_recorder_set::db_send_sql(sqlite3 *db,const char **stmts, ...)
-{
-    assert(db!=0);
-    for(int i=0;stmts[i];i++){
-        char *errmsg = 0;
-        char buf[65536];
-
-        va_list ap;
-        va_start(ap,stmts);
-        vsnprintf(buf,sizeof(buf),stmts[i],ap);
-        va_end(ap);
-        if(debug) std::cerr << "SQL: " << buf << "\n";
-        // Don't error on a PRAGMA
-        if((sqlite3_exec(db,buf,NULL,NULL,&errmsg) != SQLITE_OK)  && (strncmp(buf,"PRAGMA",6)!=0)) {
-            fprintf(stderr,"Error executing '%s' : %s\n",buf,errmsg);
-            exit(1);
+void feature_recorder_set::histograms_generate() {
+    if (flags.deferred_histograms) {
+        histogram_engine engine(std::max(1U, std::thread::hardware_concurrency()));
+        engine.after_piece = [this]() { histograms_check_memory(); };
+        for (const auto& it : frm.sorted_snapshot()) {
+            if (it.second->histograms.empty() || !it.second->histograms_deferred()) continue;
+            const std::filesystem::path fname = it.second->feature_file();
+            if (!std::filesystem::exists(fname)) continue; // nothing was recorded
+            histogram_engine::histograms_t histograms;
+            for (auto& h : it.second->histograms) histograms.push_back(h.get());
+            engine.add_file(fname, histograms);
         }
+        engine.wait();
     }
-}
-
-void feature_recorder_set::db_create_table(const std::string &name)
-{
-    std::cerr << "db_create_table\n";
-    assert(name.size()>0);
-    assert(db3!=NULL);
-    db_send_sql(db3,schema_tbl,name.c_str(),name.c_str());
-}
-
-sqlite3 *feature_recorder_set::db_create_empty(const std::string &name)
-{
-    assert(name.size()>0);
-    std::string dbfname  = sc.outdir + "/" + name +  SQLITE_EXTENSION;
-    if(debug) std::cerr << "create_feature_database " << dbfname << "\n";
-    sqlite3 *db=0;
-    if (sqlite3_open_v2(dbfname.c_str(), &db,
-                        SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_FULLMUTEX,
-                        0)!=SQLITE_OK) {
-        std::cerr << "Cannot create database '" << dbfname << "': " << sqlite3_errmsg(db) << "\n";
-        sqlite3_close(db);
-        exit(1);
+    std::vector<std::pair<feature_recorder*, AtomicUnicodeHistogram*>> work;
+    for (const auto& it : frm.sorted_snapshot()) {
+        for (auto& h : it.second->histograms) work.emplace_back(it.second, h.get());
     }
-    return db;
-}
-
-void feature_recorder_set::db_create()
-{
-    assert(db3==0);
-    db3 = db_create_empty("report");
-    db_send_sql(db3,schema_db);
-    std::cout << "in db_create called\n";
-}
-
-void feature_recorder_set::db_close()
-{
-    if(db3){
-        if(debug) std::cerr << "db_close()\n";
-        sqlite3_close(db3);
-        db3 = 0;
+    const size_t threads = std::min<size_t>(work.size(), std::max(1U, std::thread::hardware_concurrency()));
+    const size_t memory =
+        (histogram_memory_limit ? histogram_memory_limit : HISTOGRAM_MERGE_MEMORY) / std::max<size_t>(threads, 1);
+    if (threads <= 1) {
+        for (auto& it : work) it.first->histogram_generate(*it.second, memory);
+        return;
     }
-}
-
-void feature_recorder_set::db_transaction_begin()
-{
-    const std::lock_guard<std::mutex> lock(Min_transaction);
-    if(!in_transaction){
-        db_send_sql(db3,begin_transaction);
-        in_transaction = true;
+    thread_pool pool(threads);
+    for (auto& it : work) {
+        pool.submit([it, memory]() { it.first->histogram_generate(*it.second, memory); });
     }
+    pool.wait_idle(); // rethrows the first exception
+    pool.join();
 }
 
-void feature_recorder_set::db_transaction_commit()
-{
-    const std::lock_guard<std::mutex> lock(Min_transaction);
-    if(in_transaction){
-        db_send_sql(db3,commit_transaction);
-        in_transaction = false;
-    } else {
-        std::cerr << "No transaction to commit\n";
-    }
+std::vector<std::string> feature_recorder_set::feature_file_list() const {
+    std::vector<std::string> ret;
+    for (const auto& it : frm.sorted_snapshot()) { ret.push_back(it.first); }
+    return ret;
 }
-
-#endif
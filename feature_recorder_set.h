@@ -2,16 +2,22 @@
 #ifndef FEATURE_RECORDER_SET_H
 #define FEATURE_RECORDER_SET_H
 
+#include <atomic>
 #include <exception>
 #include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
 
 #if defined(HAVE_SQLITE3_H)
 #include <sqlite3.h>
 #endif
 
-#include "atomic_map.h"
-#include "atomic_set.h"
+#include "carve_writer.h"
+#include "concurrent_map.h"
+#include "digest_set.h"
 #include "feature_recorder.h"
+#include "memory_counter.h"
 #include "sbuf.h"
 #include "scanner_config.h"
 
@@ -33,9 +39,9 @@
 
 /* Define a map of feature recorders with atomic access. */
 /* TODO: This should probably be a unique_ptr */
-typedef atomic_map<std::string, class feature_recorder*> feature_recorder_map_t;
+typedef concurrent_map<std::string, class feature_recorder*> feature_recorder_map_t;
 inline std::ostream& operator<<(std::ostream& os, const feature_recorder_map_t& m) {
-    for (auto it : m) { os << " " << it.first << ": frm\n"; }
+    for (const auto& it : m.sorted_snapshot()) { os << " " << it.first << ": frm\n"; }
     return os;
 }
 
@@ -55,10 +61,14 @@ private:
     feature_recorder_map_t frm{};
 
     feature_recorder* stop_list_recorder{nullptr}; // where stopped features get written (if there is one)
-#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    /* If we are compiled with SQLite3, this is the handle to the open database */
-    sqlite3* db3{};
-#endif
+    /* the database for the SQL feature recorders; created with the first of them */
+    std::mutex Msql_writer{};
+    std::unique_ptr<class besql_writer> sql_writer{};
+    std::unique_ptr<carve_writer> carver{};
+    std::unique_ptr<class alert_writer> alerts{}; // writes the alert list hits; created by set_alert_list()
+    std::unique_ptr<class scan_journal> journal{}; // if sc.journal_file is set
+    std::filesystem::path carve_index_fname{}; // where carve_index is saved, if anywhere
+    std::mutex Mhistogram_spill{};             // one thread spills at a time
 
 public:
     size_t feature_recorder_count() const { return frm.size(); }
@@ -74,6 +84,11 @@ public:
         bool debug{false};                      // enable debug printing
         bool record_files{true};                // record to files
         bool record_sql{false};                 // record to SQL
+        bool record_columnar{false};            // record to binary columnar files; see feature_recorder_columnar
+        bool buffered_writes{false};           // file recorders buffer lines per thread; see feature_recorder_file
+        bool async_carving{false};             // carved files are written by background threads; see carve_writer
+        bool deferred_histograms{false};       // histograms are made from the feature files; see histogram_engine
+        bool offset_index{false};              // file recorders index their files by offset; see FeatureReader
     } flags;
 
     /** Constructor:
@@ -97,9 +112,11 @@ public:
     /* the feature recorder set automatically hashes all of the sbuf's that it processes. */
     typedef std::string (*hash_func_t)(const uint8_t* buf, size_t bufsize);
     struct hash_def {
-        hash_def(std::string name_, hash_func_t func_) : name(name_), func(func_){};
+        hash_def(std::string name_, hash_func_t func_)
+            : name(name_), func(func_), algorithm(sbuf_t::digest_algorithm_for_name(name_)){};
         std::string name; // name of hash
         hash_func_t func; // hash function
+        sbuf_t::digest_algorithm_t algorithm; // the memoized sbuf digest for this hash, or DIGEST_NONE
         static std::string md5_hasher(const uint8_t* buf, size_t bufsize);
         static std::string sha1_hasher(const uint8_t* buf, size_t bufsize);
         static std::string sha256_hasher(const uint8_t* buf, size_t bufsize);
@@ -116,7 +133,7 @@ public:
     // static const std::string   DISABLED_RECORDER_NAME; // the fake disabled feature recorder
 
     void set_stop_list(const word_and_context_list* alist) { stop_list = alist; }
-    void set_alert_list(const word_and_context_list* alist) { alert_list = alist; }
+    void set_alert_list(const word_and_context_list* alist); // hits go to {outdir}/ALERTS_found.txt
 
     /** Initialize a feature_recorder_set. Previously this was a constructor, but it turns out that
      * virtual functions for the create_name_factory aren't honored in constructors.
@@ -130,15 +147,38 @@ public:
 
     int64_t offset_add{0};         // added to every reported offset, for use with hadoop
     std::string banner_filename{}; // banner for top of every file
+    frame_codec::codec_t feature_file_compression{frame_codec::NONE}; // compress feature files; see feature_recorder_file
+    int feature_file_compression_level{0};                             // 0 is the codec's default
 
     /* histogram support */
     void histogram_add(const histogram_def& def); // adds it to a local set or to the specific feature recorder
     size_t histogram_count() const;               // counts histograms in all feature recorders
 
+    /* Histogram memory governor. When the in-memory histograms of all the feature recorders use more than
+     * histogram_memory_limit bytes, the largest histograms are spilled to run files until they use half of it.
+     */
+    static inline const size_t HISTOGRAM_MERGE_MEMORY = 64 * 1024 * 1024; // for merging, when there is no limit
+    size_t histogram_memory_limit{0};        // 0 for no limit
+    memory_counter histogram_memory{};       // bytes used by all of the histograms; kept by the histograms
+    void histograms_check_memory();          // called after features are added to the histograms
+    bool histograms_spill_largest();         // false if there was nothing to spill
+
     void set_carve_defaults();
 
+    /* Digests of everything carved by any of the feature recorders, so the same object is not carved twice.
+     * With use_carve_index(), it is loaded from fname (if it exists) and saved there at shutdown, so it also
+     * lasts from one run to the next.
+     */
+    digest_set carve_index{};
+    size_t carve_queue_bytes() const { return carver ? carver->queue_bytes() : 0; } // waiting to be written
+    void use_carve_index(const std::filesystem::path& fname); // call before carving; throws std::runtime_error
+
     // called when scanner_set shuts down:
     void feature_recorders_shutdown();
+    const class scan_journal* get_journal() const { return journal.get(); }
+    class scan_journal* get_journal() { return journal.get(); }
+    void journal_checkpoint(); // flushes the recorders and commits their lengths; nothing may be writing
+    void write_shard_manifest() const; // lists this shard's feature files and histograms; see shard_merge.h
     void histograms_generate(); // make the histograms in the output directory (and optionally in the database)
 
     //typedef  void (*xml_notifier_t)(const std::string &xmlstring);
@@ -182,22 +222,15 @@ public:
     virtual std::vector<std::string> feature_file_list() const; // returns a list of feature file names
 
     void dump_name_count_stats(class dfxml_writer& writer) const; // dumps the standard dfxml
+    std::map<std::string, uint64_t> get_features_written() const;  // by recorder; threadsafe
+    uint64_t get_carved_file_count() const;                         // by all of the recorders; threadsafe
 
     /****************************************************************
      *** DB interface
      ****************************************************************/
 
-#if 0
-#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    virtual  void db_send_sql(sqlite3 *db3,const char **stmts, ...) ;
-    virtual  sqlite3 *db_create_empty(const std::string &name) ;
-    void     db_create_table(const std::string &name) ;
-    void     db_create() ;
-    void     db_transaction_begin() ;
-    void     db_transaction_commit() ;               // commit current transaction
-    void     db_close() ;                            //
-#endif
-#endif
+    class besql_writer& get_sql_writer(); // opens {outdir}/report.sqlite; see feature_recorder_sql.h
+    carve_writer& get_carve_writer() { return *carver; }
     /****************************************************************
      *** External Functions
      ****************************************************************/
@@ -6,8 +6,7 @@
 
 #include "config.h"
 
-#ifdef HAVE_SQLITE3_H
-
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -16,77 +15,13 @@
 #include "feature_recorder_set.h"
 #include "feature_recorder_sql.h"
 #include "sbuf.h"
+#include "unicode_escape.h"
 
-feature_recorder_sql::feature_recorder_sql(class feature_recorder_set& fs_, const feature_recorder_def def_)
-    : feature_recorder(fs_, def_) {
-    /*
-     * If the feature recorder set is disabled, just return.
-     */
-    if (fs.flags.disabled) return;
-        /* write to a database? Create tables if necessary and create a prepared statement */
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
 
-#if 0
-    char buf[1024];
-    fs.db_create_table(name);
-    snprintf( buf, sizeof(buf), db_insert_stmt,name.c_str() );
-    bs = new besql_stmt( fs.db3, buf );
+#ifndef SQLITE_DETERMINISTIC
+#define SQLITE_DETERMINISTIC 0
 #endif
-}
-
-feature_recorder_sql::~feature_recorder_sql() {}
-
-#if 0
-#define DB_INSERT_STMT                                                                                                 \
-    "INSERT INTO f_%s (offset,path,feature_eutf8,feature_utf8,context_eutf8) VALUES (?1, ?2, ?3, ?4, ?5)"
-const char *feature_recorder::db_insert_stmt = DB_INSERT_STMT;
-
-void feature_recorder::besql_stmt::insert_feature(const pos0_t &pos,
-                                                        const std::string &feature,
-                                                        const std::string &feature8, const std::string &context)
-{
-    assert(stmt!=0);
-    const std::lock_guard<std::mutex> lock(Mstmt);           // grab a lock
-    const std::string &path = pos.str();
-    sqlite3_bind_int64(stmt, 1, pos.imageOffset()); // offset
-    sqlite3_bind_text(stmt, 2, path.data(), path.size(), SQLITE_STATIC); // path
-    sqlite3_bind_text(stmt, 3, feature.data(), feature.size(), SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 4, feature8.data(), feature8.size(), SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 5, context.data(), context.size(), SQLITE_STATIC);
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step failed\n");
-    }
-    sqlite3_reset(stmt);
-};
-
-feature_recorder::besql_stmt::besql_stmt(sqlite3 *db3,const char *sql):Mstmt(),stmt()
-{
-    assert(db3!=0);
-    assert(sql!=0);
-    sqlite3_prepare_v2(db3,sql, strlen(sql), &stmt, NULL);
-    assert(stmt!=0);
-}
-
-feature_recorder::besql_stmt::~besql_stmt()
-{
-    assert(stmt!=0);
-    sqlite3_finalize(stmt);
-    stmt = 0;
-}
-
-/* Hook for writing feature to SQLite3 database */
-void feature_recorder::write0_sqlite3(const pos0_t &pos0,const std::string &feature,const std::string &context)
-{
-    /**
-     * Note: this is not very efficient, passing through a quoted feature and then unquoting it.
-     * We could make this more efficient.
-     */
-    std::string *feature8 = AtomicUnicodeHistogram::convert_utf16_to_utf8(feature_recorder::unquote_string(feature));
-    assert(bs!=0);
-    bs->insert_feature(pos0,feature,
-                         feature8 ? *feature8 : feature,
-                         flag_set(feature_recorder::FLAG_NO_CONTEXT) ? "" : context);
-    if (feature8) delete feature8;
-}
 
 /*** SQL Routines Follow ***
  *
@@ -96,90 +31,336 @@ void feature_recorder::write0_sqlite3(const pos0_t &pos0,const std::string &feat
  * "PRAGMA synchronous =  OFF", - 146 second
  * "PRAGMA synchronous =  OFF", "PRAGMA journal_mode=MEMORY", - 79 seconds
  *
- * Time with domexusers:
- * no SQL -
+ * WAL gives the same speed as journal_mode=MEMORY, but the database survives a crash.
  */
 
-#define SQLITE_EXTENSION ".sqlite"
-#ifndef SQLITE_DETERMINISTIC
-#define SQLITE_DETERMINISTIC 0
-#endif
+static const char* schema_db[] = {
+    "PRAGMA synchronous = OFF",
+    "PRAGMA journal_mode = WAL",
+    "PRAGMA cache_size = 200000",
+    "CREATE TABLE IF NOT EXISTS db_info (schema_ver INTEGER, bulk_extractor_ver INTEGER)",
+    "INSERT INTO db_info (schema_ver, bulk_extractor_ver) VALUES (1,1)",
+    "CREATE TABLE IF NOT EXISTS be_features (tablename VARCHAR,comment TEXT)",
+    "CREATE TABLE IF NOT EXISTS be_config (name VARCHAR,value VARCHAR)",
+    nullptr};
 
-/* This creates the base histogram. Note that the SQL fails if the histogram exists */
-static const char *schema_hist[] = {
-    "CREATE TABLE h_%s (count INTEGER(12), feature_utf8 TEXT)",
-    "CREATE INDEX h_%s_idx1 ON h_%s(count)",
-    "CREATE INDEX h_%s_idx2 ON h_%s(feature_utf8)",
-    0};
+/* an SQL identifier or string literal, quoted */
+static std::string sql_quote(const std::string& s, char q) {
+    std::string ret(1, q);
+    for (char ch : s) {
+        ret.push_back(ch);
+        if (ch == q) ret.push_back(q);
+    }
+    ret.push_back(q);
+    return ret;
+}
 
-/* This performs the histogram operation */
-static const char *schema_hist1[] = {
-    "INSERT INTO h_%s select COUNT(*),feature_utf8 from f_%s GROUP BY feature_utf8",
-    0};
+/* BEHIST(feature_eutf8) is the histogram key for the feature, prefixed with '1' if it was UTF-16 and '0'
+ * if not, or NULL if the histogram doesn't count it
+ */
+static void behist(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    const histogram_def* def = static_cast<const histogram_def*>(sqlite3_user_data(ctx));
+    const char* text = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    std::string key;
+    bool found_utf16 = false;
+    if (text == nullptr ||
+        !AtomicUnicodeHistogram::make_key(*def, std::string(text, sqlite3_value_bytes(argv[0])), key, found_utf16)) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    key.insert(key.begin(), found_utf16 ? '1' : '0');
+    sqlite3_result_text(ctx, key.data(), key.size(), SQLITE_TRANSIENT);
+}
 
-static const char *schema_hist2[] = {
-    "INSERT INTO h_%s select sum(count),BEHIST(feature_utf8) from h_%s where BEHIST(feature_utf8)!='' GROUP BY BEHIST(feature_utf8)",
-    0};
+besql_writer::besql_writer(const std::filesystem::path& fname) {
+    /* Only one thread at a time uses the connection (under Mdb), so SQLite needn't lock it */
+    if (sqlite3_open_v2(fname.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+                        nullptr) != SQLITE_OK) {
+        const std::string msg = "Cannot create database " + fname.string() + ": " + sqlite3_errmsg(db);
+        sqlite3_close(db);
+        throw std::runtime_error(msg);
+    }
+    {
+        const std::lock_guard<std::mutex> lock(Mdb);
+        for (int i = 0; schema_db[i]; i++) { exec(schema_db[i]); }
+    }
+    thread = std::thread(&besql_writer::run, this);
+}
 
+besql_writer::~besql_writer() {
+    {
+        const std::lock_guard<std::mutex> lock(Mwake);
+        stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
 
+    const std::lock_guard<std::mutex> lock(Mdb);
+    try {
+        take_queue();
+        commit();
+        for (const auto& t : tables) {
+            const std::string f = "f_" + t.name;
+            exec("CREATE INDEX IF NOT EXISTS " + sql_quote(f + "_idx1", '"') + " ON " + sql_quote(f, '"') + "(offset)");
+            exec("CREATE INDEX IF NOT EXISTS " + sql_quote(f + "_idx2", '"') + " ON " + sql_quote(f, '"') +
+                 "(feature_eutf8)");
+            exec("CREATE INDEX IF NOT EXISTS " + sql_quote(f + "_idx3", '"') + " ON " + sql_quote(f, '"') +
+                 "(feature_utf8)");
+        }
+    } catch (const std::exception& e) { std::cerr << "besql_writer: " << e.what() << "\n"; }
+    for (auto& t : tables) {
+        sqlite3_finalize(t.multi);
+        sqlite3_finalize(t.single);
+    }
+    sqlite3_close(db);
+}
 
-void feature_recorder::dump_histogram_sqlite3(const histogram_def &def,void *user,feature_recorder::dump_callback_t cb) const
-{
-    /* First check to see if there exists a feature histogram summary. If not, make it */
-    std::string query = "SELECT name FROM sqlite_master WHERE type='table' AND name='h_" + def.feature +"'";
-    char *errmsg=0;
-    int rowcount=0;
-    if ( sqlite3_exec(fs.db3,query.c_str(),callback_counter,&rowcount,&errmsg)){
-        std::cerr << "sqlite3: " << errmsg << "\n";
-        return;
+void besql_writer::exec(const std::string& sql) {
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        const std::string msg = "Error executing '" + sql + "': " + (errmsg ? errmsg : "");
+        sqlite3_free(errmsg);
+        throw std::runtime_error(msg);
     }
-    if (rowcount==0){
-        const char *feature = def.feature.c_str();
-        fs.db_send_sql( fs.db3, schema_hist, feature, feature); // creates the histogram
-        fs.db_send_sql( fs.db3, schema_hist1, feature, feature); // creates the histogram
+}
+
+uint32_t besql_writer::create_table(const std::string& name) {
+    const std::lock_guard<std::mutex> lock(Mdb);
+    const std::string f = sql_quote("f_" + name, '"');
+    exec("CREATE TABLE IF NOT EXISTS " + f +
+         " (offset INTEGER(12), path VARCHAR, feature_eutf8 TEXT, feature_utf8 TEXT, context_eutf8 TEXT)");
+    exec("INSERT INTO be_features (tablename,comment) VALUES (" + sql_quote("f_" + name, '\'') + ",'')");
+
+    table_t t;
+    t.name = name;
+    const std::string insert = "INSERT INTO " + f + " (offset,path,feature_eutf8,feature_utf8,context_eutf8) VALUES ";
+    std::string multi = insert;
+    for (unsigned i = 0; i < ROWS_PER_INSERT; i++) { multi += (i ? ",(?,?,?,?,?)" : "(?,?,?,?,?)"); }
+    const std::string single = insert + "(?,?,?,?,?)";
+    if (sqlite3_prepare_v2(db, multi.c_str(), multi.size(), &t.multi, nullptr) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, single.c_str(), single.size(), &t.single, nullptr) != SQLITE_OK) {
+        sqlite3_finalize(t.multi);
+        throw std::runtime_error("Cannot prepare INSERT for " + f + ": " + sqlite3_errmsg(db));
     }
-    /* Now create the summarized histogram for the regex, if it is not existing, but only if we have
-     * sqlite3_create_function_v2
-     */
-    if (def.pattern.size()>0){
-        /* Create the database where we will add the histogram */
-        std::string hname = def.feature + "_" + def.suffix;
+    tables.push_back(std::move(t));
+    return tables.size() - 1;
+}
 
-        /* Remove any "-" characters if present */
-        for(size_t i=0;i<hname.size();i++){
-            if (hname[i]=='-') hname[i]='_';
+/* Push the row onto the queue. The consumer only ever takes the whole list, so there is no ABA problem. */
+void besql_writer::enqueue(uint32_t table, const pos0_t& pos, std::string_view feature, std::string_view context) {
+    auto check = [this] {
+        if (failed.load(std::memory_order_relaxed)) {
+            const std::lock_guard<std::mutex> lock(Merror);
+            throw std::runtime_error("besql_writer: " + error);
         }
+    };
+    check();
+    row_t* row = new row_t(table, pos, feature, context);
+    row->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(row->next, row, std::memory_order_release, std::memory_order_relaxed)) {}
+    const size_t n = ++queued;
+    if (n % NOTIFY_ROWS == 0) wake.notify_one();
+    while (queued > MAX_QUEUED) {
+        check();
+        wake.notify_one();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
 
-        if(debug) std::cerr << "CREATING TABLE = " << hname << "\n";
-        if (sqlite3_create_function_v2(fs.db3,"BEHIST",1,SQLITE_UTF8|SQLITE_DETERMINISTIC,
-                                       (void *)&def,dump_hist,0,0,0)) {
-            std::cerr << "could not register function BEHIST\n";
-            return;
+void besql_writer::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(Mwake);
+            wake.wait_for(lock, IDLE_COMMIT, [this] { return stopping || queued >= NOTIFY_ROWS; });
+            if (stopping) return; // the destructor takes what is left
         }
-        const char *fn = def.feature.c_str();
-        const char *hn = hname.c_str();
-        fs.db_send_sql(fs.db3,schema_hist, hn , hn); // create the table
-        fs.db_send_sql(fs.db3,schema_hist2, hn , fn); // select into it from a function of the old histogram table
-
-        /* erase the user defined function */
-        if (sqlite3_create_function_v2(fs.db3,"BEHIST",1,SQLITE_UTF8|SQLITE_DETERMINISTIC,
-                                       (void *)&def,0,0,0,0)) {
-            std::cerr << "could not remove function BEHIST\n";
-            return;
+        const std::lock_guard<std::mutex> lock(Mdb);
+        try {
+            if (head.load(std::memory_order_relaxed) != nullptr) {
+                take_queue();
+            } else {
+                commit(); // idle, so make what we have visible
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "besql_writer: " << e.what() << "\n";
+            fail(e.what());
         }
     }
 }
 
-void feature_recorder::write(const pos0_t &pos0, const std::string &feature, const std::string &context)
-{
-    if ( fs.flag_set(feature_recorder_set::ENABLE_SQLITE3_RECORDERS ) &&
-         this->flag_notset(feature_recorder::FLAG_NO_FEATURES_SQL) ) {
-        write0_sqlite3( pos0, feature, context);
+void besql_writer::fail(const std::string& msg) {
+    const std::lock_guard<std::mutex> lock(Merror);
+    if (!failed) error = msg;
+    failed = true;
+}
+
+void besql_writer::take_queue() {
+    row_t* list = head.exchange(nullptr, std::memory_order_acquire);
+    row_t* rows = nullptr; // oldest first
+    while (list) {
+        row_t* next = list->next;
+        list->next = rows;
+        rows = list;
+        list = next;
+    }
+    try {
+        while (rows) {
+            row_t* next = rows->next;
+            table_t& t = tables.at(rows->table);
+            t.pending.push_back(rows);
+            rows = next;
+            if (t.pending.size() == ROWS_PER_INSERT) {
+                std::vector<row_t*> batch;
+                batch.swap(t.pending); // insert() deletes them, even if it throws
+                insert(t, batch.data(), ROWS_PER_INSERT, t.multi);
+            }
+        }
+    } catch (...) {
+        /* The rows after the failed insert are lost too; they are counted out of the queue */
+        size_t lost = 0;
+        for (; rows; lost++) {
+            row_t* next = rows->next;
+            delete rows;
+            rows = next;
+        }
+        queued -= lost;
+        throw;
+    }
+    if (rows_in_transaction >= ROWS_PER_TRANSACTION) commit();
+}
+
+/* Insert n rows with stmt, which has n rows of parameters, and delete them */
+void besql_writer::insert(table_t& t, row_t* const* rows, unsigned n, sqlite3_stmt* stmt) {
+    struct release_t {                 // the rows are gone however insert() ends
+        besql_writer& w;
+        row_t* const* rows;
+        unsigned n;
+        ~release_t() {
+            for (unsigned i = 0; i < n; i++) { delete rows[i]; }
+            w.queued -= n;
+        }
+    } release{*this, rows, n};
+    if (!in_transaction) {
+        exec("BEGIN TRANSACTION");
+        in_transaction = true;
+    }
+    int p = 1;
+    for (unsigned i = 0; i < n; i++) {
+        const row_t& r = *rows[i];
+        const std::string path = r.pos.str();
+        const std::string feature_utf8 = make_utf8(feature_recorder::unquote_string(r.feature));
+        sqlite3_bind_int64(stmt, p++, r.pos.offset);
+        sqlite3_bind_text(stmt, p++, path.data(), path.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, p++, r.feature.data(), r.feature.size(), SQLITE_STATIC);
+        sqlite3_bind_text(stmt, p++, feature_utf8.data(), feature_utf8.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, p++, r.context.data(), r.context.size(), SQLITE_STATIC);
+    }
+    const int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    rows_in_transaction += n;
+    if (ret != SQLITE_DONE) {
+        throw std::runtime_error("INSERT into f_" + t.name + " failed: " + sqlite3_errmsg(db));
+    }
+    written += n;
+}
+
+void besql_writer::commit() {
+    for (auto& t : tables) {
+        std::vector<row_t*> batch;
+        batch.swap(t.pending);
+        for (size_t i = 0; i < batch.size(); i++) {
+            try {
+                insert(t, &batch[i], 1, t.single);
+            } catch (...) {
+                for (size_t j = i + 1; j < batch.size(); j++) { delete batch[j]; } // lost with it
+                queued -= batch.size() - i - 1;
+                throw;
+            }
+        }
+    }
+    if (in_transaction) {
+        in_transaction = false;
+        rows_in_transaction = 0;
+        exec("COMMIT TRANSACTION");
+    }
+}
+
+void besql_writer::drain() {
+    const std::lock_guard<std::mutex> lock(Mdb);
+    try {
+        take_queue();
+        commit();
+    } catch (const std::exception& e) {
+        fail(e.what());
+        throw;
+    }
+}
+
+/* The histogram is computed by SQLite from the feature table, with the same keys as AtomicUnicodeHistogram */
+void besql_writer::build_histogram(uint32_t table, const histogram_def& def) {
+    const std::lock_guard<std::mutex> lock(Mdb);
+    take_queue();
+    commit();
+
+    const std::string f = sql_quote("f_" + tables.at(table).name, '"');
+    std::string hname = "h_" + tables.at(table).name + (def.suffix.empty() ? "" : "_" + def.suffix);
+    std::replace(hname.begin(), hname.end(), '-', '_');
+    const std::string h = sql_quote(hname, '"');
+
+    if (sqlite3_create_function_v2(db, "BEHIST", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                   const_cast<histogram_def*>(&def), behist, nullptr, nullptr, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("could not register function BEHIST");
+    }
+    try {
+        exec("DROP TABLE IF EXISTS " + h);
+        exec("CREATE TABLE " + h + " (count INTEGER(12), count16 INTEGER(12), feature_utf8 TEXT)");
+        exec("INSERT INTO " + h + " SELECT COUNT(*), SUM(substr(k,1,1)='1'), substr(k,2) FROM (SELECT BEHIST(feature_eutf8) AS k FROM " +
+             f + ") WHERE k IS NOT NULL GROUP BY substr(k,2)");
+        exec("CREATE INDEX " + sql_quote(hname + "_idx1", '"') + " ON " + h + "(count)");
+    } catch (const std::exception&) {
+        sqlite3_create_function_v2(db, "BEHIST", 1, SQLITE_UTF8, nullptr, nullptr, nullptr, nullptr, nullptr);
+        throw;
+    }
+    sqlite3_create_function_v2(db, "BEHIST", 1, SQLITE_UTF8, nullptr, nullptr, nullptr, nullptr, nullptr);
+}
+
+/****************************************************************
+ *** feature_recorder_sql
+ ****************************************************************/
+
+feature_recorder_sql::feature_recorder_sql(class feature_recorder_set& fs_, const feature_recorder_def def_)
+    : feature_recorder(fs_, def_) {
+    /*
+     * If the feature recorder set is disabled, just return.
+     */
+    if (fs.flags.disabled) return;
+
+    /* write to a database? Create tables if necessary and create a prepared statement */
+    db = &fs.get_sql_writer();
+    table = db->create_table(name);
+}
+
+feature_recorder_sql::~feature_recorder_sql() {}
+
+void feature_recorder_sql::flush() {
+    if (db) db->drain();
+}
+
+void feature_recorder_sql::shutdown() { flush(); }
+
+/* Queue the feature for the writer thread, which does the UTF-8 conversion and the insert */
+void feature_recorder_sql::write0(const pos0_t& pos0, std::string_view feature, std::string_view context) {
+    feature_recorder::write0(pos0, feature, context); // call super to increment counter
+    if (db == nullptr) return;
+    if (def.flags.no_context) context = std::string_view();
+    if (fs.offset_add != 0) {
+        db->enqueue(table, pos0.shift(fs.offset_add), feature, context);
+    } else {
+        db->enqueue(table, pos0, feature, context);
     }
 }
-#endif
 
 void feature_recorder_sql::histogram_flush(AtomicUnicodeHistogram& h) {
-    /* SQL histograms don't need flushing. This is a stub function */
+    if (db) db->build_histogram(table, h.def);
 }
 #endif
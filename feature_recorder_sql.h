@@ -1,36 +1,122 @@
+#ifndef FEATURE_RECORDER_SQL_H
+#define FEATURE_RECORDER_SQL_H
+
 #include <cassert>
 #include <cinttypes>
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
 #include <map>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 #include "feature_recorder.h"
 #include "pos0.h"
 
-#ifdef HAVE_SQLITE3_H
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
 #include <sqlite3.h>
 
-class feature_recorder_sql : public feature_recorder {
-    struct besql_stmt {
-        besql_stmt(const besql_stmt&) = delete;
-        besql_stmt& operator=(const besql_stmt&) = delete;
-        std::mutex Mstmt{};
-        sqlite3_stmt* stmt{}; // the prepared statement
-        besql_stmt(sqlite3* db3, const char* sql);
-        virtual ~besql_stmt();
-        void insert_feature(const pos0_t& pos, // insert it into this table!
-                            const std::string& feature, const std::string& feature8, const std::string& context);
+/**
+ * besql_writer - the SQLite3 database shared by the SQL feature recorders of a feature_recorder_set.
+ *
+ * Scanner threads never wait for the database. feature_recorder_sql::write0() pushes each feature onto
+ * a lock-free queue and a single writer thread takes everything on the queue at once and inserts it,
+ * ROWS_PER_INSERT rows per INSERT and up to ROWS_PER_TRANSACTION rows per transaction, using two
+ * statements prepared once for each feature table (one multi-row, one single-row for the remainder).
+ * The database runs with journal_mode=WAL and synchronous=OFF, and the feature tables are indexed
+ * when the database is closed rather than while they are being filled.
+ *
+ * If the writer falls more than MAX_QUEUED features behind, write0() waits for it to catch up. If the
+ * writer thread fails to insert, the rows being inserted are lost and every later enqueue() throws the
+ * error, rather than queueing features that will never be written.
+ */
+class besql_writer {
+public:
+    static inline const unsigned ROWS_PER_INSERT = 64;       // 5 parameters per row stays under SQLite's old limit of 999
+    static inline const size_t ROWS_PER_TRANSACTION = 100000;
+    static inline const size_t MAX_QUEUED = 1000000;
+    static inline const size_t NOTIFY_ROWS = 4096;           // wake the writer every this many features
+    static inline const std::chrono::milliseconds IDLE_COMMIT{100}; // commit if nothing arrives for this long
+    static inline const std::string DB_FILENAME{"report.sqlite"};
+
+    explicit besql_writer(const std::filesystem::path& fname); // throws std::runtime_error
+    ~besql_writer();                                           // drains the queue, indexes the tables and closes
+
+    uint32_t create_table(const std::string& name);            // creates f_{name}; returns its id for enqueue()
+    void enqueue(uint32_t table, const pos0_t& pos, std::string_view feature, std::string_view context);
+    void drain();                                              // returns when every queued feature is committed
+    void build_histogram(uint32_t table, const histogram_def& def); // creates h_{name}[_{suffix}] from f_{name}
+    uint64_t rows_written() const { return written; }
+
+private:
+    besql_writer(const besql_writer&) = delete;
+    besql_writer& operator=(const besql_writer&) = delete;
+
+    struct row_t {
+        row_t(uint32_t table_, const pos0_t& pos_, std::string_view feature_, std::string_view context_)
+            : table(table_), pos(pos_), feature(feature_), context(context_) {}
+        row_t* next{nullptr};
+        const uint32_t table;
+        const pos0_t pos;
+        const std::string feature;
+        const std::string context;
     };
-#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    // virtual void dump_histogram_sqlite3(const histogram_def &def,void *user,feature_recorder::dump_callback_t cb)
-    // const;
-#endif
+    struct table_t {
+        std::string name{};
+        sqlite3_stmt* multi{nullptr};   // ROWS_PER_INSERT rows
+        sqlite3_stmt* single{nullptr};  // one row
+        std::vector<row_t*> pending{};  // fewer than ROWS_PER_INSERT rows waiting for the multi-row statement
+    };
+
+    std::atomic<row_t*> head{nullptr}; // most recent first; pushed by the producers, emptied by the consumer
+    std::atomic<size_t> queued{0};
+    std::atomic<uint64_t> written{0};
+    std::atomic<bool> failed{false};   // the writer thread could not insert; see error
+    std::mutex Merror{};
+    std::string error{};               // protected by Merror
+    void fail(const std::string& msg); // records msg for the producers
+
+    std::mutex Mdb{};                  // protects db, tables and the transaction; held while taking the queue
+    sqlite3* db{nullptr};
+    std::vector<table_t> tables{};
+    bool in_transaction{false};
+    size_t rows_in_transaction{0};
+
+    std::mutex Mwake{};                // only for sleeping; producers never take it
+    std::condition_variable wake{};
+    bool stopping{false};              // protected by Mwake
+    std::thread thread{};
+
+    void run();                        // the writer thread
+    void exec(const std::string& sql); // Mdb must be held; throws std::runtime_error
+    void take_queue();                 // Mdb must be held; the rows are inserted or deleted, even if it throws
+    void insert(table_t& t, row_t* const* rows, unsigned n, sqlite3_stmt* stmt); // deletes the rows, even if it throws
+    void commit();                     // insert the pending rows and commit; Mdb must be held
+};
+
+class feature_recorder_sql : public feature_recorder {
 public:
     feature_recorder_sql(class feature_recorder_set& fs, feature_recorder_def def);
     virtual ~feature_recorder_sql();
-    virtual void histogram_flush(AtomicUnicodeHistogram& h) override; // flush a specific histogram
+    virtual void flush() override;    // commits everything written so far
+    virtual void shutdown() override;
+
+    virtual void write0(const pos0_t& pos0, std::string_view feature, std::string_view context) override;
+    virtual void histograms_add_feature(const std::string&) override {} // built in SQL instead
+    virtual void histogram_flush(AtomicUnicodeHistogram& h) override;          // creates the h_ table
+
+private:
+    besql_writer* db{nullptr};       // owned by fs; nullptr if fs is disabled
+    uint32_t table{0};
 };
+#else
+class besql_writer {}; // SQLite3 was not compiled in
+#endif
+
 #endif
@@ -0,0 +1,176 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include "fast_hash.h"
+#include "flow_sharder.h"
+#include "pcap_reader.h"
+
+#include "dfxml_cpp/src/dfxml_writer.h"
+
+flow_sharder::flow_sharder(size_t nshards, handler_t handler_, size_t ring_packets) : handler(handler_) {
+    if (nshards == 0) throw std::invalid_argument("flow_sharder: must have at least one shard");
+    for (size_t i = 0; i < nshards; i++) shards.push_back(std::make_unique<shard_t>(ring_packets));
+    for (size_t i = 0; i < nshards; i++) shards[i]->thread = std::thread(&flow_sharder::run, this, i);
+}
+
+flow_sharder::~flow_sharder() {
+    try {
+        finish();
+    } catch (...) {
+        /* the exception can only be reported by calling finish() */
+    }
+}
+
+uint64_t flow_sharder::flow_hash(const be13::packet_info& pi) {
+    const uint8_t* ip = pi.ip_data;
+    const size_t len = pi.ip_datalen;
+    size_t alen = 0;
+    size_t ports = 0; // offset of the ports, or 0 if there are none
+    uint8_t proto = 0;
+    switch (pi.ip_version()) {
+    case 4: {
+        const size_t hl = (ip[0] & 0x0f) * 4;
+        if (len < 20 || hl < 20) return 0;
+        proto = ip[9];
+        alen = 4;
+        const bool fragment = (be13::packet_info::nshort(ip, 6) & (IP_MF | IP_OFFMASK)) != 0;
+        if (!fragment && len >= hl + 4) ports = hl;
+        break;
+    }
+    case 6:
+        if (len < 40) return 0;
+        proto = ip[6];
+        alen = 16;
+        if (len >= 44) ports = 40;
+        break;
+    default: return 0;
+    }
+    if (proto != 6 && proto != 17 && proto != 132) ports = 0; // TCP, UDP and SCTP
+    const uint8_t* src = ip + (alen == 4 ? 12 : 8);
+    const uint8_t* dst = src + alen;
+    uint8_t sport[2] = {0, 0};
+    uint8_t dport[2] = {0, 0};
+    if (ports) {
+        memcpy(sport, ip + ports, 2);
+        memcpy(dport, ip + ports + 2, 2);
+    }
+    /* Put the lower endpoint first, so that both directions hash the same */
+    int cmp = memcmp(src, dst, alen);
+    if (cmp == 0) cmp = memcmp(sport, dport, 2);
+    uint8_t key[1 + 2 * (16 + 2)];
+    size_t k = 0;
+    key[k++] = proto;
+    const uint8_t* a = cmp <= 0 ? src : dst;
+    const uint8_t* b = cmp <= 0 ? dst : src;
+    const uint8_t* pa = cmp <= 0 ? sport : dport;
+    const uint8_t* pb = cmp <= 0 ? dport : sport;
+    memcpy(key + k, a, alen);
+    k += alen;
+    memcpy(key + k, pa, 2);
+    k += 2;
+    memcpy(key + k, b, alen);
+    k += alen;
+    memcpy(key + k, pb, 2);
+    k += 2;
+    return fast_hash128(key, k).hi;
+}
+
+void flow_sharder::add(const be13::packet_info& pi) {
+    if (finished) throw std::runtime_error("flow_sharder::add: called after finish()");
+    shard_t& s = *shards[shard_for(pi)];
+    item_t item;
+    item.hdr = *pi.pcap_hdr;
+    item.ts = pi.ts;
+    item.data = pi.pcap_data;
+    item.ip_off = pi.ip_data - pi.pcap_data;
+    item.ip_len = pi.ip_datalen;
+    item.dlt = pi.pcap_dlt;
+    if (!s.ring.try_push(std::move(item))) {
+        s.stalls++;
+        while (!s.ring.try_push(std::move(item))) std::this_thread::yield();
+    }
+    const uint64_t waiting = s.ring.size();
+    if (waiting > s.high_water.load(std::memory_order_relaxed)) s.high_water.store(waiting, std::memory_order_relaxed);
+}
+
+void flow_sharder::add(const pcap_batch_t& batch) {
+    for (const auto& pi : batch.packets) add(pi);
+}
+
+void flow_sharder::run(size_t i) {
+    shard_t& s = *shards[i];
+    item_t item;
+    unsigned int idle = 0;
+    while (true) {
+        if (!s.ring.try_pop(item)) {
+            if (done.load(std::memory_order_acquire) && s.ring.empty()) return;
+            /* spin briefly, then back off, so an idle shard doesn't take a core */
+            if (++idle < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            continue;
+        }
+        idle = 0;
+        s.packets.fetch_add(1, std::memory_order_relaxed);
+        s.bytes.fetch_add(item.hdr.caplen, std::memory_order_relaxed);
+        if (failed.load(std::memory_order_relaxed)) continue;
+        const be13::packet_info pi(item.dlt, &item.hdr, item.data, item.ts, item.data + item.ip_off, item.ip_len);
+        try {
+            handler(i, pi);
+        } catch (...) {
+            const std::lock_guard<std::mutex> lock(Mexception);
+            if (!first_exception) first_exception = std::current_exception();
+            failed = true;
+        }
+    }
+}
+
+void flow_sharder::finish() {
+    if (!finished) {
+        finished = true;
+        done.store(true, std::memory_order_release);
+        for (auto& s : shards) s->thread.join();
+    }
+    const std::lock_guard<std::mutex> lock(Mexception);
+    if (first_exception) {
+        std::exception_ptr e = first_exception;
+        first_exception = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+std::vector<flow_sharder::shard_stats_t> flow_sharder::stats() const {
+    std::vector<shard_stats_t> ret;
+    for (const auto& s : shards) {
+        shard_stats_t st;
+        st.packets = s->packets;
+        st.bytes = s->bytes;
+        st.stalls = s->stalls;
+        st.high_water = s->high_water;
+        ret.push_back(st);
+    }
+    return ret;
+}
+
+void flow_sharder::dump_stats(dfxml_writer& writer) const {
+    const auto st = stats();
+    writer.push("packet_shards");
+    for (size_t i = 0; i < st.size(); i++) {
+        writer.set_oneline(true);
+        writer.push("shard", "id='" + std::to_string(i) + "'");
+        writer.xmlout("packets", st[i].packets);
+        writer.xmlout("bytes", st[i].bytes);
+        writer.xmlout("stalls", st[i].stalls);
+        writer.xmlout("high_water", st[i].high_water);
+        writer.pop("shard");
+        writer.set_oneline(false);
+    }
+    writer.pop("packet_shards");
+}
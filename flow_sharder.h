@@ -0,0 +1,96 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * flow_sharder - processes packets on several threads, keeping each flow on one thread.
+ *
+ * One thread (usually the one walking a pcap_reader) calls add() for each packet. The packet's flow is
+ * hashed to one of a fixed number of shards, and the packet is pushed onto that shard's spsc_ring; each
+ * shard has a worker thread that pops its packets and calls the handler with the shard number. So:
+ *   - all of a flow's packets are handled by the same thread, in capture order, and
+ *   - a handler can keep per-flow state in a per-shard table without any locking.
+ *
+ * The flow is the IPv4 or IPv6 5-tuple {proto, addresses, ports}, ordered so that both directions of a
+ * connection are one flow. Ports are used for TCP, UDP and SCTP; IPv4 fragments are hashed without
+ * them, since only the first fragment has them, and IPv6 extension headers are not followed. Packets
+ * that are not IP go to shard 0.
+ *
+ * The queued packets refer to the capture's data (e.g. a pcap_reader's mapping), which must stay valid
+ * until finish() returns. When a ring is full, add() waits; stats() counts those stalls per shard, and
+ * dump_stats() writes everything to DFXML.
+ */
+
+#ifndef FLOW_SHARDER_H
+#define FLOW_SHARDER_H
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "packet_info.h"
+#include "spsc_ring.h"
+
+struct pcap_batch_t;
+class dfxml_writer;
+class flow_sharder {
+public:
+    static inline const size_t RING_PACKETS = 4096;
+    typedef std::function<void(size_t shard, const be13::packet_info& pi)> handler_t;
+
+    struct shard_stats_t {
+        uint64_t packets{0};
+        uint64_t bytes{0};     // captured bytes
+        uint64_t stalls{0};    // times add() found the ring full
+        uint64_t high_water{0}; // the most packets that were waiting
+    };
+
+    flow_sharder(size_t shards, handler_t handler, size_t ring_packets = RING_PACKETS);
+    ~flow_sharder(); // calls finish()
+
+    void add(const be13::packet_info& pi); // from one thread only
+    void add(const pcap_batch_t& batch);
+    void finish(); // waits until every packet has been handled; rethrows the first exception from the handler
+
+    size_t shard_count() const { return shards.size(); }
+    size_t shard_for(const be13::packet_info& pi) const { return flow_hash(pi) % shards.size(); }
+    static uint64_t flow_hash(const be13::packet_info& pi); // the same for both directions of a flow
+    std::vector<shard_stats_t> stats() const;
+    void dump_stats(dfxml_writer& writer) const;            // <packet_shards><shard>...</shard></packet_shards>
+
+private:
+    flow_sharder(const flow_sharder&) = delete;
+    flow_sharder& operator=(const flow_sharder&) = delete;
+
+    /* A copy of what is needed to remake the packet_info on the worker */
+    struct item_t {
+        struct pcap_pkthdr hdr{};
+        struct timeval ts{};
+        const uint8_t* data{nullptr};
+        size_t ip_off{0};
+        size_t ip_len{0};
+        int dlt{0};
+    };
+    struct shard_t {
+        explicit shard_t(size_t ring_packets) : ring(ring_packets) {}
+        spsc_ring<item_t> ring;
+        std::thread thread{};
+        std::atomic<uint64_t> packets{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> stalls{0};
+        std::atomic<uint64_t> high_water{0};
+    };
+    std::vector<std::unique_ptr<shard_t>> shards{};
+    const handler_t handler;
+    std::atomic<bool> done{false};
+    bool finished{false};
+    std::mutex Mexception{};            // protects first_exception
+    std::exception_ptr first_exception{};
+    std::atomic<bool> failed{false};    // a handler threw; the rest of the packets are dropped
+    void run(size_t i);                 // shard i's worker
+};
+
+#endif
@@ -0,0 +1,215 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define FRAME_CODEC_GZIP
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define FRAME_CODEC_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(HAVE_LZ4FRAME_H) && defined(HAVE_LIBLZ4)
+#define FRAME_CODEC_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "frame_codec.h"
+
+frame_codec::codec_t frame_codec::codec_for_name(const std::string& name_) {
+    if (name_ == "none" || name_ == "") return NONE;
+    if (name_ == "gzip" || name_ == "gz") return GZIP;
+    if (name_ == "zstd") return ZSTD;
+    if (name_ == "lz4") return LZ4;
+    throw std::invalid_argument("unknown compression: " + name_);
+}
+
+const char* frame_codec::name(codec_t codec) {
+    switch (codec) {
+    case GZIP: return "gzip";
+    case ZSTD: return "zstd";
+    case LZ4: return "lz4";
+    default: return "none";
+    }
+}
+
+const char* frame_codec::extension(codec_t codec) {
+    switch (codec) {
+    case GZIP: return ".gz";
+    case ZSTD: return ".zst";
+    case LZ4: return ".lz4";
+    default: return "";
+    }
+}
+
+bool frame_codec::available(codec_t codec) {
+    switch (codec) {
+    case NONE: return true;
+#ifdef FRAME_CODEC_GZIP
+    case GZIP: return true;
+#endif
+#ifdef FRAME_CODEC_ZSTD
+    case ZSTD: return true;
+#endif
+#ifdef FRAME_CODEC_LZ4
+    case LZ4: return true;
+#endif
+    default: return false;
+    }
+}
+
+frame_codec::codec_t frame_codec::detect(const uint8_t* buf, size_t len) {
+    if (len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b) return GZIP;
+    if (len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5 && buf[2] == 0x2f && buf[3] == 0xfd) return ZSTD;
+    if (len >= 4 && buf[0] == 0x04 && buf[1] == 0x22 && buf[2] == 0x4d && buf[3] == 0x18) return LZ4;
+    return NONE;
+}
+
+std::string frame_codec::compress(codec_t codec, const char* buf, size_t len, int level) {
+    switch (codec) {
+    case NONE: return std::string(buf, len);
+#ifdef FRAME_CODEC_GZIP
+    case GZIP: {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+            Z_OK) {
+            throw std::runtime_error("frame_codec: deflateInit2 failed");
+        }
+        std::string out(deflateBound(&zs, len), '\0');
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf));
+        zs.avail_in = len;
+        zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        zs.avail_out = out.size();
+        const int r = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+        if (r != Z_STREAM_END) throw std::runtime_error("frame_codec: deflate failed");
+        return out;
+    }
+#endif
+#ifdef FRAME_CODEC_ZSTD
+    case ZSTD: {
+        std::string out(ZSTD_compressBound(len), '\0');
+        const size_t n = ZSTD_compress(&out[0], out.size(), buf, len, level ? level : ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(n)) throw std::runtime_error(std::string("frame_codec: ") + ZSTD_getErrorName(n));
+        out.resize(n);
+        return out;
+    }
+#endif
+#ifdef FRAME_CODEC_LZ4
+    case LZ4: {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = level;
+        prefs.frameInfo.contentSize = len;
+        std::string out(LZ4F_compressFrameBound(len, &prefs), '\0');
+        const size_t n = LZ4F_compressFrame(&out[0], out.size(), buf, len, &prefs);
+        if (LZ4F_isError(n)) throw std::runtime_error(std::string("frame_codec: ") + LZ4F_getErrorName(n));
+        out.resize(n);
+        return out;
+    }
+#endif
+    default: break;
+    }
+    throw std::runtime_error(std::string("frame_codec: ") + name(codec) + " is not available");
+}
+
+std::string frame_codec::decompress(codec_t codec, const char* buf, size_t len) {
+    const size_t CHUNK = 256 * 1024;
+    std::string out;
+    switch (codec) {
+    case NONE: return std::string(buf, len);
+#ifdef FRAME_CODEC_GZIP
+    case GZIP: {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 15 + 16) != Z_OK) throw std::runtime_error("frame_codec: inflateInit2 failed");
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf));
+        zs.avail_in = len;
+        bool in_member = true; // until its end is seen
+        while (in_member || zs.avail_in > 0) {
+            if (!in_member) {
+                inflateReset(&zs); // the next gzip member
+                in_member = true;
+            }
+            const size_t have = out.size();
+            out.resize(have + CHUNK);
+            zs.next_out = reinterpret_cast<Bytef*>(&out[have]);
+            zs.avail_out = CHUNK;
+            const int r = inflate(&zs, Z_NO_FLUSH);
+            out.resize(have + CHUNK - zs.avail_out);
+            if (r == Z_STREAM_END) {
+                in_member = false;
+                continue;
+            }
+            if (r != Z_OK) {
+                inflateEnd(&zs);
+                throw std::runtime_error(r == Z_BUF_ERROR ? "frame_codec: truncated gzip data"
+                                                          : "frame_codec: corrupt gzip data");
+            }
+        }
+        inflateEnd(&zs);
+        return out;
+    }
+#endif
+#ifdef FRAME_CODEC_ZSTD
+    case ZSTD: {
+        ZSTD_DStream* ds = ZSTD_createDStream();
+        ZSTD_initDStream(ds);
+        ZSTD_inBuffer in{buf, len, 0};
+        size_t r = 1; // 0 once a frame is decoded and flushed
+        while (in.pos < in.size || r != 0) {
+            const size_t have = out.size();
+            out.resize(have + CHUNK);
+            ZSTD_outBuffer ob{&out[have], CHUNK, 0};
+            r = ZSTD_decompressStream(ds, &ob, &in);
+            out.resize(have + ob.pos);
+            const bool truncated = !ZSTD_isError(r) && r != 0 && in.pos == in.size && ob.pos < ob.size;
+            if (ZSTD_isError(r) || truncated) {
+                ZSTD_freeDStream(ds);
+                throw std::runtime_error(std::string("frame_codec: ") +
+                                         (truncated ? "truncated zstd data" : ZSTD_getErrorName(r)));
+            }
+        }
+        ZSTD_freeDStream(ds);
+        return out;
+    }
+#endif
+#ifdef FRAME_CODEC_LZ4
+    case LZ4: {
+        LZ4F_dctx* dctx = nullptr;
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+            throw std::runtime_error("frame_codec: LZ4F_createDecompressionContext failed");
+        }
+        size_t pos = 0;
+        size_t r = 1; // 0 once a frame is decoded and flushed
+        while (pos < len || r != 0) {
+            const size_t have = out.size();
+            out.resize(have + CHUNK);
+            size_t out_len = CHUNK;
+            size_t in_len = len - pos;
+            r = LZ4F_decompress(dctx, &out[have], &out_len, buf + pos, &in_len, nullptr);
+            out.resize(have + out_len);
+            pos += in_len;
+            const bool truncated = !LZ4F_isError(r) && r != 0 && pos == len && out_len < CHUNK;
+            if (LZ4F_isError(r) || truncated) {
+                LZ4F_freeDecompressionContext(dctx);
+                throw std::runtime_error(std::string("frame_codec: ") +
+                                         (truncated ? "truncated lz4 data" : LZ4F_getErrorName(r)));
+            }
+        }
+        LZ4F_freeDecompressionContext(dctx);
+        return out;
+    }
+#endif
+    default: break;
+    }
+    throw std::runtime_error(std::string("frame_codec: ") + name(codec) + " is not available");
+}
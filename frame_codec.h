@@ -0,0 +1,38 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * frame_codec - compress data as a sequence of independent frames.
+ *
+ * Each call to compress() returns one complete frame in the codec's standard format (a gzip member,
+ * a zstd frame or an LZ4 frame). Frames can be concatenated: the result is still a valid .gz, .zst
+ * or .lz4 file that the usual command-line tools can read, and because no frame depends on another,
+ * any frame can be decompressed on its own if its position is known.
+ *
+ * gzip needs zlib; zstd and lz4 need libzstd and liblz4. available() tells which were compiled in.
+ */
+
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class frame_codec {
+public:
+    enum codec_t { NONE = 0, GZIP, ZSTD, LZ4 };
+
+    static codec_t codec_for_name(const std::string& name); // "none", "gzip", "zstd" or "lz4"; throws std::invalid_argument
+    static const char* name(codec_t codec);
+    static const char* extension(codec_t codec);             // ".gz", ".zst", ".lz4", or "" for NONE
+    static bool available(codec_t codec);
+    static codec_t detect(const uint8_t* buf, size_t len);   // by magic number; NONE if not compressed
+
+    /* Both throw std::runtime_error if the codec is not available or the data is corrupt */
+    static std::string compress(codec_t codec, const char* buf, size_t len, int level = 0); // 0 is the codec's default
+    static std::string decompress(codec_t codec, const char* buf, size_t len);           // one or more whole frames;
+                                                                                         // a frame cut short is corrupt
+};
+
+#endif
@@ -0,0 +1,129 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "fast_hash.h"
+#include "heavy_hitters.h"
+
+heavy_hitters::heavy_hitters(size_t capacity_) : cap(capacity_), width(1) {
+    if (cap == 0) throw std::invalid_argument("heavy_hitters: capacity must be >0");
+    while (width < cap * WIDTH_PER_KEY) width <<= 1;
+    sketch.resize(DEPTH * width);
+    heap.reserve(cap);
+    where.reserve(cap);
+}
+
+void heavy_hitters::clear() {
+    std::fill(sketch.begin(), sketch.end(), 0);
+    heap.clear();
+    where.clear();
+    added = 0;
+    key_bytes = 0;
+}
+
+size_t heavy_hitters::bytes() const {
+    return sizeof(*this) + sketch.size() * sizeof(uint64_t) + heap.capacity() * sizeof(entry_t) +
+           where.bucket_count() * sizeof(void*) + where.size() * (sizeof(std::pair<std::string, size_t>) + sizeof(void*)) +
+           2 * key_bytes;
+}
+
+/* Double hashing: row i uses hi + i*lo */
+static inline size_t column(const hash128_t& h, size_t row, size_t width) {
+    return (h.hi + row * (h.lo | 1)) & (width - 1);
+}
+
+/* A conservative update: only the counters that would otherwise be below the new estimate are raised */
+uint64_t heavy_hitters::sketch_add(const std::string& key, uint64_t count) {
+    const hash128_t h = fast_hash128(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+    uint64_t est = UINT64_MAX;
+    for (size_t i = 0; i < DEPTH; i++) est = std::min(est, sketch[i * width + column(h, i, width)]);
+    est += count;
+    for (size_t i = 0; i < DEPTH; i++) {
+        uint64_t& c = sketch[i * width + column(h, i, width)];
+        if (c < est) c = est;
+    }
+    return est;
+}
+
+uint64_t heavy_hitters::sketch_estimate(const std::string& key) const {
+    const hash128_t h = fast_hash128(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+    uint64_t est = UINT64_MAX;
+    for (size_t i = 0; i < DEPTH; i++) est = std::min(est, sketch[i * width + column(h, i, width)]);
+    return est;
+}
+
+void heavy_hitters::add(const std::string& key, uint64_t count, uint64_t count16) {
+    added += count;
+    const uint64_t est = sketch_add(key, count);
+    auto it = where.find(key);
+    if (it != where.end()) {
+        entry_t& e = heap[it->second];
+        e.count += count;
+        e.count16 += count16;
+        sift_down(it->second);
+        return;
+    }
+    if (heap.size() < cap) {
+        where[key] = heap.size();
+        heap.push_back(entry_t{key, count, count16, 0});
+        key_bytes += key.size();
+        sift_up(heap.size() - 1);
+        return;
+    }
+    /* Replace the smallest. Either bound on the new key's count will do; the sketch's is often much lower. */
+    entry_t& e = heap[0];
+    const uint64_t bound = std::min(e.count + count, est);
+    where.erase(e.key);
+    key_bytes += key.size();
+    key_bytes -= e.key.size();
+    e.key = key;
+    e.count = bound;
+    e.count16 = count16;
+    e.error = bound - count;
+    where[key] = 0;
+    sift_down(0);
+}
+
+std::vector<heavy_hitters::entry_t> heavy_hitters::entries() const {
+    std::vector<entry_t> ret(heap);
+    for (auto& e : ret) {
+        const uint64_t est = sketch_estimate(e.key);
+        if (est < e.count) {
+            const uint64_t less = e.count - est;
+            e.count = est;
+            e.error = e.error > less ? e.error - less : 0;
+        }
+    }
+    return ret;
+}
+
+void heavy_hitters::swap_entries(size_t i, size_t j) {
+    std::swap(heap[i], heap[j]);
+    where[heap[i].key] = i;
+    where[heap[j].key] = j;
+}
+
+void heavy_hitters::sift_up(size_t i) {
+    while (i > 0) {
+        const size_t parent = (i - 1) / 2;
+        if (heap[parent].count <= heap[i].count) return;
+        swap_entries(i, parent);
+        i = parent;
+    }
+}
+
+void heavy_hitters::sift_down(size_t i) {
+    while (true) {
+        size_t smallest = i;
+        const size_t l = 2 * i + 1;
+        const size_t r = l + 1;
+        if (l < heap.size() && heap[l].count < heap[smallest].count) smallest = l;
+        if (r < heap.size() && heap[r].count < heap[smallest].count) smallest = r;
+        if (smallest == i) return;
+        swap_entries(i, smallest);
+        i = smallest;
+    }
+}
@@ -0,0 +1,70 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * heavy_hitters - the most frequent keys of a stream, approximately, in a fixed amount of memory.
+ *
+ * This is what an AtomicUnicodeHistogram keeps instead of counting every key when its histogram_def has
+ * flags.approximate set: for features such as URLs or random-looking strings, there are too many distinct
+ * keys to count them exactly, even with spilling, and only the most frequent ones are wanted anyway.
+ *
+ * Two structures are kept:
+ * - A Space-Saving summary of `capacity` keys. A key that is not in the summary when it arrives replaces
+ *   the key with the smallest count, and inherits that count as its possible error. Every key that
+ *   occurs more than total/capacity times is in the summary.
+ * - A count-min sketch, DEPTH rows of `capacity * WIDTH_PER_KEY` counters, which never underestimates a
+ *   key's count. It tightens the Space-Saving count of keys that take over a slot.
+ *
+ * For every key reported, count is an upper bound on the number of times it was added and
+ * count - error is a lower bound. count16 counts only the UTF-16 keys that were added while the key
+ * was in the summary.
+ *
+ * add() finds a key with one hash lookup and keeps the summary as a min-heap on count, so it never searches
+ * for the smallest. It is not thread-safe; AtomicUnicodeHistogram locks it and gives it batches of keys.
+ */
+
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class heavy_hitters {
+public:
+    static inline const size_t DEPTH = 4;
+    static inline const size_t WIDTH_PER_KEY = 8;
+    struct entry_t {
+        std::string key{};
+        uint64_t count{0};   // at least the true count
+        uint64_t count16{0};
+        uint64_t error{0};   // count - error is at most the true count
+    };
+
+    explicit heavy_hitters(size_t capacity);
+    void add(const std::string& key, uint64_t count, uint64_t count16);
+    void clear();
+    std::vector<entry_t> entries() const; // the summary, in no particular order, with the sketch applied
+    size_t size() const { return heap.size(); }
+    size_t capacity() const { return cap; }
+    uint64_t total() const { return added; } // the sum of every count added
+    size_t bytes() const;                    // estimated memory; fixed once the summary is full
+
+private:
+    const size_t cap;
+    size_t width;                            // counters per row of the sketch; a power of 2
+    std::vector<uint64_t> sketch;            // DEPTH rows of width
+    std::vector<entry_t> heap{};             // the summary; a min-heap on count
+    std::unordered_map<std::string, size_t> where{}; // key to place in heap
+    uint64_t added{0};
+    size_t key_bytes{0};                     // bytes in the keys of the summary
+
+    uint64_t sketch_add(const std::string& key, uint64_t count); // returns the new estimate
+    uint64_t sketch_estimate(const std::string& key) const;
+    void sift_up(size_t i);
+    void sift_down(size_t i);
+    void swap_entries(size_t i, size_t j);
+};
+
+#endif
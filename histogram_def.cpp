@@ -1,4 +1,7 @@
+#include <algorithm>
+
 #include "histogram_def.h"
+#include "utf8.h"
 
 bool histogram_def::match(std::u32string u32key, std::string* displayString) const {
     if (flags.lowercase) { u32key = utf32_lowercase(u32key); }
@@ -7,32 +10,49 @@ bool histogram_def::match(std::u32string u32key, std::string* displayString) con
 
     /* TODO: When we have the ability to do regular expressions in utf32, do that here.
      * We don't have that, so do the rest in utf8 */
+    return match_transformed(convert_utf32_to_utf8(u32key), displayString);
+}
 
-    /* Convert match string to u8key */
-    std::string u8key = convert_utf32_to_utf8(u32key);
-
+bool histogram_def::match_transformed(const std::string& u8key, std::string* displayString) const {
     /* If a string is required and it is not present, return */
-    if (require.size() > 0 && u8key.find_first_of(require) == std::string::npos) {
-        std::cerr << "fail1\n";
-        return false;
-    }
+    if (require.size() > 0 && u8key.find_first_of(require) == std::string::npos) { return false; }
 
     /* Check for pattern */
     if (pattern.size() > 0) {
-        std::smatch m{};
-        std::regex_search(u8key, m, this->reg);
-        if (m.empty() == true) { // match does not exist
-            return false;        // regex not found
+        size_t offset = 0;
+        size_t len = 0;
+        if (!engine->search(u8key, nullptr, &offset, &len)) { // match does not exist
+            return false;                                    // regex not found
         }
-        u8key = m.str();
+        if (displayString) { *displayString = u8key.substr(offset, len); }
+        return true;
     }
 
     if (displayString) { *displayString = u8key; }
     return true;
 }
 
-bool histogram_def::match(std::string u32key, std::string* displayString) const {
-    return match(convert_utf8_to_utf32(u32key), displayString);
+bool histogram_def::match(const std::string& u8key, std::string* displayString) const {
+    const bool ascii = std::all_of(u8key.begin(), u8key.end(), [](char ch) { return (ch & 0x80) == 0; });
+    if (!ascii && !utf8::is_valid(u8key.begin(), u8key.end())) {
+        return match(convert_utf8_to_utf32(u8key), displayString); // the converter decides what to do with it
+    }
+    if (flags.numeric) { // lowercasing digits does nothing
+        std::string digits;
+        for (char ch : u8key) {
+            if (ch >= '0' && ch <= '9') digits.push_back(ch);
+        }
+        return match_transformed(digits, displayString);
+    }
+    if (flags.lowercase) {
+        if (!ascii) return match_transformed(convert_utf32_to_utf8(utf32_lowercase(convert_utf8_to_utf32(u8key))), displayString);
+        std::string lower(u8key);
+        for (char& ch : lower) {
+            if (ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+        }
+        return match_transformed(lower, displayString);
+    }
+    return match_transformed(u8key, displayString);
 }
 
 std::ostream& operator<<(std::ostream& os, const histogram_def& hd) {
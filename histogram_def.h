@@ -3,9 +3,11 @@
 
 #include <cstdio>
 #include <iostream>
+#include <memory>
 #include <regex>
 #include <string>
 
+#include "regex_engine.h"
 #include "unicode_escape.h"
 
 /**
@@ -19,11 +21,13 @@ struct histogram_def {
         flags_t(const flags_t& a) {
             this->lowercase = a.lowercase;
             this->numeric = a.numeric;
+            this->approximate = a.approximate;
         };
 
         flags_t& operator=(const flags_t& a) {
             this->lowercase = a.lowercase;
             this->numeric = a.numeric;
+            this->approximate = a.approximate;
             return *this;
         };
 
@@ -31,17 +35,21 @@ struct histogram_def {
             if (this->lowercase < a.lowercase) return true;
             if (this->lowercase > a.lowercase) return false;
             if (this->numeric < a.numeric) return true;
+            if (this->numeric > a.numeric) return false;
+            if (this->approximate < a.approximate) return true;
             return false;
         }
 
         bool operator==(const flags_t& a) const {
-            return (this->lowercase == a.lowercase) && (this->numeric == a.numeric);
+            return (this->lowercase == a.lowercase) && (this->numeric == a.numeric) &&
+                   (this->approximate == a.approximate);
         }
 
         flags_t(){};
         flags_t(bool lowercase_, bool numeric_) : lowercase(lowercase_), numeric(numeric_) {}
         bool lowercase{false}; // make all flags lowercase
         bool numeric{false};   // extract digits only
+        size_t approximate{0}; // if >0, keep only this many of the most frequent keys (see heavy_hitters.h)
     };
 
     /**
@@ -60,13 +68,21 @@ struct histogram_def {
                   const struct flags_t& flags_)
         : // flags - see below
           name(name_), feature(feature_), pattern(pattern_), reg(pattern_), require(require_), suffix(suffix_),
-          flags(flags_) {}
+          flags(flags_) {
+        if (pattern.size() > 0) {
+            auto e = std::make_shared<regex_engine>();
+            e->add(pattern, false);
+            e->compile();
+            engine = e;
+        }
+    }
 
     std::string name{};    // name of the hsitogram
     std::string feature{}; // feature file to extract
     std::string
         pattern{}; // regular expression used to extract feature substring from feature. "" means use the entire feature
     mutable std::regex reg{}; // the compiled regular expression.
+    std::shared_ptr<const regex_engine> engine{}; // what match() uses for pattern; shared by copies
     std::string require{};    // text required somewhere on the feature line. Sort of like grep. used for IP histograms
     std::string suffix{};     // suffix to append to histogram report name
 
@@ -79,6 +95,7 @@ struct histogram_def {
         this->feature = a.feature;
         this->pattern = a.pattern;
         this->reg = a.reg;
+        this->engine = a.engine;
         this->require = a.require;
         this->suffix = a.suffix;
         this->flags = a.flags;
@@ -90,6 +107,7 @@ struct histogram_def {
         this->feature = a.feature;
         this->pattern = a.pattern;
         this->reg = a.reg;
+        this->engine = a.engine;
         this->require = a.require;
         this->suffix = a.suffix;
         this->flags = a.flags;
@@ -124,10 +142,17 @@ struct histogram_def {
     /* Match and extract:
      * If the string matches this histogram, return true and optionally
      * set match to Extract and match: Does this string match
+     *
+     * The UTF-8 version works on the UTF-8 directly: it is not converted at all unless lowercase is set and
+     * it has non-ASCII characters, when it is converted to UTF-32 and back once. (Only ASCII digits are
+     * numeric, so numeric never needs UTF-32.) Strings that are not valid UTF-8 take the UTF-32 path.
      */
 
     bool match(std::u32string u32key, std::string* displayString = nullptr) const;
-    bool match(std::string u32key, std::string* displayString = nullptr) const;
+    bool match(const std::string& u8key, std::string* displayString = nullptr) const;
+
+private:
+    bool match_transformed(const std::string& u8key, std::string* displayString) const; // require and pattern
 };
 
 std::ostream& operator<<(std::ostream& os, const histogram_def& hd);
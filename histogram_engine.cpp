@@ -0,0 +1,119 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include "feature_recorder.h"
+#include "histogram_engine.h"
+#include "sbuf.h"
+
+histogram_engine::histogram_engine(size_t threads) : pool(std::max<size_t>(threads, 1)) {}
+
+histogram_engine::~histogram_engine() { pool.join(); }
+
+void histogram_engine::wait() { pool.wait_idle(); }
+
+/* A feature line is pos0 \t feature [\t context] */
+std::string_view histogram_engine::feature_field(std::string_view line) {
+    if (line.empty() || line[0] == '#') return std::string_view();
+    if (line.back() == '\r') line.remove_suffix(1);
+    const size_t tab1 = line.find('\t');
+    if (tab1 == std::string_view::npos) return std::string_view();
+    const size_t tab2 = line.find('\t', tab1 + 1);
+    return line.substr(tab1 + 1, (tab2 == std::string_view::npos ? line.size() : tab2) - tab1 - 1);
+}
+
+/* Count the distinct features first, so that each histogram_def is applied once to each of them */
+template <typename F> static void count_features(F each_feature, const histogram_engine::histograms_t& histograms) {
+    std::unordered_map<std::string_view, uint32_t> counts;
+    each_feature([&counts](std::string_view feature) { counts[feature]++; });
+    for (const auto& it : counts) {
+        const std::string feature(it.first);
+        for (auto* h : histograms) {
+            std::string key;
+            bool found_utf16 = false;
+            if (!AtomicUnicodeHistogram::make_key(h->def, feature, key, found_utf16)) continue;
+            AtomicUnicodeHistogram::HistogramTally tally;
+            tally.count = it.second;
+            tally.count16 = found_utf16 ? it.second : 0;
+            h->add_tally(key, tally);
+        }
+    }
+}
+
+void histogram_engine::count(std::string_view text, const histograms_t& histograms) {
+    uint64_t n = 0;
+    count_features(
+        [text, &n](auto&& add) {
+            for (size_t start = 0; start < text.size();) {
+                size_t nl = text.find('\n', start);
+                if (nl == std::string_view::npos) nl = text.size();
+                const std::string_view feature = feature_field(text.substr(start, nl - start));
+                if (!feature.empty()) {
+                    add(feature);
+                    n++;
+                }
+                start = nl + 1;
+            }
+        },
+        histograms);
+    features_read += n;
+    pieces_done++;
+    if (after_piece) after_piece();
+}
+
+void histogram_engine::add_file(const std::filesystem::path& fname, const histograms_t& histograms) {
+    if (histograms.empty()) return;
+    auto reader = std::make_shared<FeatureReader>(fname); // throws if it can't be read
+    if (reader->get_codec() == frame_codec::NONE) {
+        const uint64_t size = std::filesystem::file_size(fname);
+        if (size == 0) return;
+        std::shared_ptr<const sbuf_t> map(sbuf_t::map_file(fname));
+        if (!map) throw std::runtime_error("histogram_engine: cannot read " + fname.string());
+        const char* buf = reinterpret_cast<const char*>(map->get_buf());
+        for (uint64_t start = 0; start < size;) {
+            uint64_t end = std::min<uint64_t>(start + std::max<size_t>(range_bytes, 1), size);
+            if (end < size) {
+                const void* nl = memchr(buf + end, '\n', size - end);
+                end = nl ? static_cast<const char*>(nl) - buf + 1 : size;
+            }
+            const std::string_view text(buf + start, end - start);
+            pool.submit([this, map, text, histograms]() { count(text, histograms); });
+            start = end;
+        }
+        return;
+    }
+    if (reader->frame_count() > 0) {
+        for (size_t i = 0; i < reader->frame_count(); i++) {
+            pool.submit([this, reader, i, histograms]() {
+                const std::vector<Feature> features = reader->read_frame(i);
+                count_features(
+                    [&features](auto&& add) {
+                        for (const auto& it : features) add(it.feature);
+                    },
+                    histograms);
+                features_read += features.size();
+                pieces_done++;
+                if (after_piece) after_piece();
+            });
+        }
+        return;
+    }
+    /* No frame index: the file has to be decompressed from the start, so it is one piece */
+    pool.submit([this, reader, histograms]() {
+        std::vector<std::string> features;
+        while (auto f = reader->next()) features.push_back(f->feature);
+        count_features(
+            [&features](auto&& add) {
+                for (const auto& it : features) add(it);
+            },
+            histograms);
+        features_read += features.size();
+        pieces_done++;
+        if (after_piece) after_piece();
+    });
+}
@@ -0,0 +1,64 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * histogram_engine - makes histograms from feature files after the scanners have run.
+ *
+ * With feature_recorder_set::flags_t::deferred_histograms, the feature recorders that write feature files
+ * do not add features to their histograms as they are written; that work is taken off the scanners'
+ * threads altogether. Instead, feature_recorder_set::histograms_generate() gives each such recorder's
+ * feature file and histograms to a histogram_engine before the histograms are written.
+ *
+ * An uncompressed feature file is mapped and cut into range_bytes pieces that end on line boundaries. A
+ * compressed file is read a frame at a time if it has a frame index (see FeatureReader), and otherwise
+ * all at once. Each piece is a task for the engine's threads: it counts the distinct features in the piece
+ * (as views of the mapped file, so nothing is copied), applies each histogram_def once to each distinct
+ * feature, and adds the resulting keys and counts to the AtomicUnicodeHistogram, which merges them into
+ * its shards. These partial histograms are bounded by the size of a piece.
+ *
+ * after_piece, if set, is called after each piece is added; the feature_recorder_set uses it to spill
+ * histograms when they are over its memory limit.
+ */
+
+#ifndef HISTOGRAM_ENGINE_H
+#define HISTOGRAM_ENGINE_H
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "atomic_unicode_histogram.h"
+#include "thread_pool.h"
+
+class histogram_engine {
+public:
+    static inline const size_t RANGE_BYTES = 16 * 1024 * 1024;
+    typedef std::vector<AtomicUnicodeHistogram*> histograms_t;
+
+    explicit histogram_engine(size_t threads);
+    ~histogram_engine();
+
+    /* Queue the pieces of fname for histograms; throws std::runtime_error if it can't be read */
+    void add_file(const std::filesystem::path& fname, const histograms_t& histograms);
+    void wait();                         // returns when every piece is done; rethrows the first exception
+    std::function<void()> after_piece{};
+    size_t range_bytes{RANGE_BYTES};     // the size of the pieces of uncompressed files
+
+    uint64_t pieces() const { return pieces_done; }
+    uint64_t features() const { return features_read; }
+    static std::string_view feature_field(std::string_view line); // empty for comments and blank lines
+
+private:
+    histogram_engine(const histogram_engine&) = delete;
+    histogram_engine& operator=(const histogram_engine&) = delete;
+
+    thread_pool pool;
+    std::atomic<uint64_t> pieces_done{0};
+    std::atomic<uint64_t> features_read{0};
+    void count(std::string_view text, const histograms_t& histograms);
+};
+
+#endif
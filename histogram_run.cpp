@@ -0,0 +1,105 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+#include "histogram_run.h"
+
+histogram_run::writer::writer(int fd, const std::filesystem::path& fname_) : fname(fname_) {
+    f = fdopen(fd, "w");
+    if (f == nullptr) {
+        ::close(fd);
+        throw std::runtime_error("Cannot open histogram run " + fname.string());
+    }
+}
+
+histogram_run::writer::~writer() {
+    if (f) fclose(f);
+}
+
+void histogram_run::writer::add(const element_t& e) {
+    ok = ok && fprintf(f, "%u\t%u\t%zu\t", e.value.count, e.value.count16, e.key.size()) > 0;
+    ok = ok && fwrite(e.key.data(), 1, e.key.size(), f) == e.key.size() && fputc('\n', f) != EOF;
+}
+
+void histogram_run::writer::close() {
+    const bool closed = fclose(f) == 0;
+    f = nullptr;
+    if (!closed || !ok) throw std::runtime_error("Cannot write histogram run " + fname.string());
+}
+
+void histogram_run::write(int fd, const AtomicUnicodeHistogram::auh_t::report& rep,
+                          const std::filesystem::path& fname) {
+    writer w(fd, fname);
+    for (const auto& it : rep) w.add(it);
+    w.close();
+}
+
+histogram_run::reader::reader(const std::filesystem::path& fname_) : fname(fname_) {
+    in.open(fname, std::ios_base::in | std::ios_base::binary);
+    if (!in.is_open()) throw std::runtime_error("Cannot open histogram run " + fname.string());
+}
+
+bool histogram_run::reader::next(element_t& e) {
+    size_t len = 0;
+    if (!(in >> e.value.count)) {
+        if (in.eof()) return false;
+        throw std::runtime_error("corrupt histogram run " + fname.string());
+    }
+    if (!(in >> e.value.count16 >> len) || in.get() != '\t') {
+        throw std::runtime_error("corrupt histogram run " + fname.string());
+    }
+    e.key.resize(len);
+    if (!in.read(&e.key[0], len) || in.get() != '\n') throw std::runtime_error("corrupt histogram run " + fname.string());
+    return true;
+}
+
+void histogram_run::merge(const std::vector<std::filesystem::path>& runs, order_t order,
+                          const std::function<void(const element_t&)>& out) {
+    std::vector<std::unique_ptr<reader>> readers;
+    std::vector<element_t> heads(runs.size()); // the next element of each run
+    for (const auto& fname : runs) readers.push_back(std::make_unique<reader>(fname));
+
+    /* A min-heap of the runs, by their next element */
+    auto after = [&](size_t a, size_t b) {
+        if (order == BY_KEY) return heads[b].key < heads[a].key;
+        return AtomicUnicodeHistogram::rank_order(heads[b], heads[a]);
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(after)> queue(after);
+    for (size_t i = 0; i < readers.size(); i++) {
+        if (readers[i]->next(heads[i])) queue.push(i);
+    }
+    while (!queue.empty()) {
+        const size_t i = queue.top();
+        queue.pop();
+        element_t e = heads[i];
+        if (readers[i]->next(heads[i])) queue.push(i);
+        while (order == BY_KEY && !queue.empty() && heads[queue.top()].key == e.key) {
+            const size_t j = queue.top();
+            queue.pop();
+            e.value.count += heads[j].value.count;
+            e.value.count16 += heads[j].value.count16;
+            if (readers[j]->next(heads[j])) queue.push(j);
+        }
+        out(e);
+    }
+}
+
+void histogram_run::reduce(std::vector<std::filesystem::path>& runs, order_t order,
+                           const std::function<int(std::filesystem::path&)>& create) {
+    while (runs.size() > MAX_FAN_IN) {
+        const std::vector<std::filesystem::path> group(runs.begin(), runs.begin() + MAX_FAN_IN);
+        std::filesystem::path fname;
+        const int fd = create(fname);
+        writer w(fd, fname);
+        merge(group, order, [&w](const element_t& e) { w.add(e); });
+        w.close();
+        for (const auto& it : group) std::filesystem::remove(it);
+        runs.erase(runs.begin(), runs.begin() + MAX_FAN_IN);
+        runs.push_back(fname);
+    }
+}
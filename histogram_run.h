@@ -0,0 +1,77 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * histogram_run - the run files that an AtomicUnicodeHistogram is spilled to when the histograms
+ * use more memory than the feature_recorder_set allows (see feature_recorder::histogram_spill()),
+ * and the streaming k-way merge that turns them into the histogram report.
+ *
+ * A run holds keys in order (by key when spilled, by rank while the report is being sorted), one per line:
+ *
+ *     {count}\t{count16}\t{key length}\t{key}\n
+ *
+ * The key length makes the format safe for keys that contain tabs and newlines.
+ */
+
+#ifndef HISTOGRAM_RUN_H
+#define HISTOGRAM_RUN_H
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "atomic_unicode_histogram.h"
+
+class histogram_run {
+public:
+    typedef AtomicUnicodeHistogram::auh_t::AMReportElement element_t;
+    enum order_t { BY_KEY, BY_RANK }; // BY_RANK is AtomicUnicodeHistogram::rank_order()
+    static inline const size_t MAX_FAN_IN = 128; // runs merged at once; more are merged in passes
+
+    /* Writes a run to fd, which it closes */
+    class writer {
+        writer(const writer&) = delete;
+        writer& operator=(const writer&) = delete;
+        FILE* f{nullptr};
+        const std::filesystem::path fname;
+        bool ok{true};
+
+    public:
+        writer(int fd, const std::filesystem::path& fname); // throws std::runtime_error
+        ~writer();
+        void add(const element_t& e);
+        void close(); // throws std::runtime_error if anything could not be written
+    };
+
+    /* Reads a run file in order */
+    class reader {
+        reader(const reader&) = delete;
+        reader& operator=(const reader&) = delete;
+        std::ifstream in{};
+        const std::filesystem::path fname;
+
+    public:
+        explicit reader(const std::filesystem::path& fname); // throws std::runtime_error
+        bool next(element_t& e);                             // false at the end; throws if the run is corrupt
+    };
+
+    /* Write rep, which is in order, to fd, and close it. Throws std::runtime_error. */
+    static void write(int fd, const AtomicUnicodeHistogram::auh_t::report& rep, const std::filesystem::path& fname);
+
+    /* Merge runs that are each in order, calling out() with every element in order. BY_KEY adds together the
+     * tallies of equal keys. Only one element of each run is in memory at a time.
+     */
+    static void merge(const std::vector<std::filesystem::path>& runs, order_t order,
+                      const std::function<void(const element_t&)>& out);
+
+    /* Merge runs in passes of MAX_FAN_IN into new runs made by create(fname), which returns an open fd,
+     * until there are at most MAX_FAN_IN. The runs that are merged are deleted.
+     */
+    static void reduce(std::vector<std::filesystem::path>& runs, order_t order,
+                       const std::function<int(std::filesystem::path&)>& create);
+};
+
+#endif
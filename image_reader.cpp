@@ -0,0 +1,167 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "formatter.h"
+#include "image_reader.h"
+#include "numa.h"
+
+static void advise(int fd, uint64_t offset, uint64_t len, int advice) {
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(fd, offset, len, advice); // only a hint; errors are ignored
+#else
+    (void)fd; (void)offset; (void)len; (void)advice;
+#endif
+}
+
+#ifndef HAVE_POSIX_FADVISE
+#define POSIX_FADV_SEQUENTIAL 0
+#define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_DONTNEED 0
+#endif
+
+image_reader::image_reader(const std::filesystem::path& fname_, const config_t& config_)
+    : fname(fname_), config(config_) {
+    if (config.pagesize == 0) { throw std::runtime_error("image_reader: pagesize must be > 0"); }
+
+#ifdef O_DIRECT
+    if (config.direct_io && config.pagesize % DIRECT_IO_ALIGNMENT == 0 &&
+        config.marginsize % DIRECT_IO_ALIGNMENT == 0) {
+        fd = ::open(fname.c_str(), O_RDONLY | O_DIRECT);
+        direct = (fd >= 0);
+    }
+#endif
+    if (fd < 0) { fd = ::open(fname.c_str(), O_RDONLY); }
+    if (fd < 0) {
+        throw std::filesystem::filesystem_error("image_reader", fname, std::error_code(errno, std::generic_category()));
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        int err = errno;
+        ::close(fd);
+        throw std::filesystem::filesystem_error("image_reader", fname, std::error_code(err, std::generic_category()));
+    }
+    size = st.st_size;
+    next_offset = config.start;
+    advise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (config.prefetch_depth > 0) { prefetcher = std::thread(&image_reader::prefetch_loop, this); }
+}
+
+image_reader::~image_reader() {
+    if (prefetcher.joinable()) {
+        {
+            const std::lock_guard<std::mutex> lock(M);
+            stopping = true;
+        }
+        cv.notify_all();
+        prefetcher.join();
+    }
+    for (auto* sbuf : ready) { delete sbuf; }
+    ::close(fd);
+}
+
+/* Read the page at offset, with its margin. The next pages are requested before we block on this one. */
+sbuf_t* image_reader::read_page(uint64_t offset) {
+    if (offset >= size || (config.end > 0 && offset >= config.end)) return nullptr;
+    const size_t len = std::min(uint64_t(config.pagesize + config.marginsize), size - offset);
+    const size_t pagesize = std::min(config.pagesize, len);
+
+    if (!direct) {
+        advise(fd, offset + len, uint64_t(config.pagesize) * config.prefetch_depth, POSIX_FADV_WILLNEED);
+    }
+    sbuf_t* sbuf = sbuf_t::sbuf_malloc(pos0_t("", offset), len, pagesize, direct ? DIRECT_IO_ALIGNMENT : 0);
+    uint8_t* buf = static_cast<uint8_t*>(sbuf->malloc_buf());
+    if (config.numa_placement) {
+        const numa_topology& numa = numa_topology::system();
+        if (numa.node_count() > 1) {
+            const size_t node = numa_topology::page_node(offset, config.pagesize, numa.node_count());
+            numa_topology::bind_memory(buf, len, numa.nodes[node].id); // before the read first touches it
+        }
+    }
+
+    /* With O_DIRECT the request must be a whole number of blocks; the read stops short at the end of the file. */
+    const size_t want = direct ? (len + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT : len;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = ::pread(fd, buf + got, want - got, offset + got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && direct && errno == EINVAL && got == 0) {
+            /* The file system accepted O_DIRECT but won't do it; fall back to ordinary reads */
+#ifdef O_DIRECT
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+#endif
+            direct = false;
+            continue;
+        }
+        if (r <= 0) {
+            int err = (r < 0) ? errno : EIO;
+            delete sbuf;
+            throw std::runtime_error(Formatter() << "image_reader: read failed on " << fname.string() << " at "
+                                                 << offset + got << ": " << strerror(err));
+        }
+        got += r;
+    }
+    if (config.drop_behind && !direct && offset > config.start) {
+        /* Everything before this page has been read for the last time (the previous margin is our page) */
+        advise(fd, config.start, offset - config.start, POSIX_FADV_DONTNEED);
+    }
+    pages_read++;
+    return sbuf;
+}
+
+void image_reader::prefetch_loop() {
+    try {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(M);
+                cv.wait(lock, [this] { return stopping || ready.size() < config.prefetch_depth; });
+                if (stopping) return;
+            }
+            sbuf_t* sbuf = read_page(next_offset);
+            const std::lock_guard<std::mutex> lock(M);
+            if (sbuf == nullptr) {
+                done = true;
+                cv.notify_all();
+                return;
+            }
+            next_offset += config.pagesize;
+            ready.push_back(sbuf);
+            cv.notify_all();
+        }
+    } catch (...) {
+        const std::lock_guard<std::mutex> lock(M);
+        error = std::current_exception();
+        done = true;
+        cv.notify_all();
+    }
+}
+
+sbuf_t* image_reader::next() {
+    if (config.prefetch_depth == 0) {
+        sbuf_t* sbuf = read_page(next_offset);
+        if (sbuf) next_offset += config.pagesize;
+        return sbuf;
+    }
+    std::unique_lock<std::mutex> lock(M);
+    cv.wait(lock, [this] { return !ready.empty() || done; });
+    if (!ready.empty()) {
+        sbuf_t* sbuf = ready.front();
+        ready.pop_front();
+        cv.notify_all();
+        return sbuf;
+    }
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+    return nullptr;
+}
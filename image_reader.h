@@ -0,0 +1,92 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * image_reader - read a disk image or other large file as a sequence of page+margin sbufs.
+ *
+ * Page n starts at offset n*pagesize and holds pagesize bytes of page data followed by up to
+ * marginsize bytes of the next page, so features that cross a page boundary can still be found.
+ * This is the sbuf_t pagesize/bufsize distinction: the caller scans the whole buffer but only
+ * reports features that start in the page.
+ *
+ * Unlike sbuf_t::map_file(), only a window of the file is in memory at a time, so images larger
+ * than the address space can be processed. The reader:
+ *
+ * - tells the kernel the file is read sequentially, asks it to start reading the next
+ *   prefetch_depth pages early, and (with drop_behind) tells it that pages already read won't be
+ *   needed again, so one pass over a large image doesn't push everything else out of the page cache;
+ * - reads prefetch_depth pages ahead on a background thread, so the scanner pool isn't left
+ *   waiting on I/O (slow on NFS);
+ * - optionally opens the file with O_DIRECT, bypassing the page cache entirely. This needs
+ *   pagesize and marginsize to be multiples of DIRECT_IO_ALIGNMENT. If the file system doesn't
+ *   support it, the reader falls back to ordinary reads; using_direct_io() reports which was used.
+ *
+ * With start and end, only the pages that start in that range are read (the last one still has its
+ * margin), which is how one shard of a sharded scan reads its part of the image.
+ *
+ * Each sbuf_t returned by next() belongs to the caller, who must delete or release() it.
+ */
+
+#ifndef IMAGE_READER_H
+#define IMAGE_READER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#include "sbuf.h"
+
+class image_reader {
+public:
+    struct config_t {
+        size_t pagesize{16 * 1024 * 1024};
+        size_t marginsize{1024 * 1024};
+        unsigned int prefetch_depth{2}; // pages read ahead on a background thread; 0 reads in next()
+        bool direct_io{false};          // open with O_DIRECT if possible
+        bool drop_behind{true};         // tell the kernel that pages already read can be dropped
+        uint64_t start{0};              // only the pages that start in [start,end) are read, with their margins;
+        uint64_t end{0};                //   0 for the end of the file. See scanner_config::shard_t
+        bool numa_placement{false};     // put page n's buffer on node numa_topology::page_node(n); see numa.h
+    };
+    static inline const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+    image_reader(const std::filesystem::path& fname, const config_t& config); // throws if the file can't be read
+    ~image_reader();
+
+    sbuf_t* next();                           // the next page, or nullptr at the end; rethrows read errors
+    uint64_t get_size() const { return size; }
+    bool using_direct_io() const { return direct; }
+    uint64_t get_pages_read() const { return pages_read; }
+
+private:
+    image_reader(const image_reader&) = delete;
+    image_reader& operator=(const image_reader&) = delete;
+
+    const std::filesystem::path fname;
+    const config_t config;
+    int fd{-1};
+    std::atomic<bool> direct{false};          // may be turned off by the prefetcher
+    uint64_t size{0};
+    uint64_t next_offset{0};                  // offset of the next page to read
+    std::atomic<uint64_t> pages_read{0};
+
+    /* The prefetch queue */
+    std::mutex M{};
+    std::condition_variable cv{};
+    std::deque<sbuf_t*> ready{};              // pages read ahead, in order
+    bool done{false};                         // no more pages will be added to ready
+    bool stopping{false};                     // the destructor is waiting for the thread
+    std::exception_ptr error{};
+    std::thread prefetcher{};
+
+    sbuf_t* read_page(uint64_t offset);       // nullptr if offset is at the end
+    void prefetch_loop();
+};
+
+#endif
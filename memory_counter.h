@@ -0,0 +1,39 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * memory_counter - a count of live bytes that is kept up to date as memory is allocated and freed.
+ *
+ * Whatever owns the memory calls add() and sub() as it grows and shrinks, so reading the count never
+ * walks a data structure. The counters are what scanner_set::memory_stats() reports, and they are also
+ * what the limits act on: the histogram spill governor reads feature_recorder_set::histogram_memory and
+ * the admission controller reads the scanner_set's in-flight counter.
+ */
+
+#ifndef MEMORY_COUNTER_H
+#define MEMORY_COUNTER_H
+
+#include <atomic>
+#include <cstdint>
+
+class memory_counter {
+public:
+    memory_counter() {}
+    void add(uint64_t n) {
+        const uint64_t now = count.fetch_add(n, std::memory_order_relaxed) + n;
+        uint64_t hw = high.load(std::memory_order_relaxed);
+        while (now > hw && !high.compare_exchange_weak(hw, now, std::memory_order_relaxed)) {}
+    }
+    void sub(uint64_t n) { count.fetch_sub(n, std::memory_order_relaxed); }
+    uint64_t bytes() const { return count.load(std::memory_order_relaxed); }
+    uint64_t high_water() const { return high.load(std::memory_order_relaxed); }
+    operator uint64_t() const { return bytes(); }
+
+private:
+    memory_counter(const memory_counter&) = delete;
+    memory_counter& operator=(const memory_counter&) = delete;
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> high{0};
+};
+
+#endif
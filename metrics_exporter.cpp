@@ -0,0 +1,211 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "metrics_exporter.h"
+#include "utils.h"
+
+metrics_exporter::format_t metrics_exporter::format_for(const std::filesystem::path& fname) {
+    return fname.extension() == ".json" ? JSON : PROMETHEUS;
+}
+
+namespace {
+/* The rate of a counter between two snapshots */
+double rate(uint64_t now, uint64_t before, double seconds) {
+    return seconds > 0 && now >= before ? (now - before) / seconds : 0.0;
+}
+
+/* A Prometheus label value: backslash, quote and newline are escaped */
+std::string label_escape(const std::string& s) {
+    std::string ret;
+    for (const char ch : s) {
+        if (ch == '\\' || ch == '"') ret.push_back('\\');
+        if (ch == '\n') {
+            ret += "\\n";
+        } else {
+            ret.push_back(ch);
+        }
+    }
+    return ret;
+}
+
+/* The memory counters, by name */
+std::vector<std::pair<std::string, uint64_t>> memory_counters(const scanner_set::memory_stats_t& ms) {
+    return {{"sbuf_mapped", ms.sbuf_mapped},       {"sbuf_malloced", ms.sbuf_malloced},
+            {"sbuf_in_flight", ms.sbuf_in_flight}, {"histograms", ms.histograms},
+            {"seen_set", ms.seen_set},             {"carve_index", ms.carve_index},
+            {"carve_queue", ms.carve_queue},       {"stop_list", ms.stop_list},
+            {"alert_list", ms.alert_list}};
+}
+} // namespace
+
+void metrics_exporter::write_prometheus(std::ostream& os, const scanner_set::metrics_t& m,
+                                        const scanner_set::metrics_t* prev) {
+    const double dt = prev ? m.seconds - prev->seconds : 0;
+    auto type = [&os](const std::string& name, const char* t) { os << "# TYPE be13_" << name << " " << t << "\n"; };
+    auto metric = [&os, &type](const std::string& name, const char* t, double v) {
+        type(name, t);
+        os << "be13_" << name << " " << v << "\n";
+    };
+    metric("uptime_seconds", "gauge", m.seconds);
+    metric("bytes_total", "counter", m.bytes_depth0);
+    metric("bytes_per_second", "gauge", prev ? rate(m.bytes_depth0, prev->bytes_depth0, dt) : 0);
+
+    type("sbufs_total", "counter");
+    for (size_t d = 0; d < m.sbufs_by_depth.size(); d++) {
+        if (m.sbufs_by_depth[d]) os << "be13_sbufs_total{depth=\"" << d << "\"} " << m.sbufs_by_depth[d] << "\n";
+    }
+    type("sbufs_per_second", "gauge");
+    for (size_t d = 0; d < m.sbufs_by_depth.size(); d++) {
+        if (m.sbufs_by_depth[d] == 0) continue;
+        const uint64_t before = prev && d < prev->sbufs_by_depth.size() ? prev->sbufs_by_depth[d] : m.sbufs_by_depth[d];
+        os << "be13_sbufs_per_second{depth=\"" << d << "\"} " << rate(m.sbufs_by_depth[d], before, dt) << "\n";
+    }
+
+    metric("dup_bytes_total", "counter", m.dup_bytes);
+    metric("max_depth_seen", "gauge", m.max_depth_seen);
+    metric("pages_skipped_total", "counter", m.pages_skipped);
+    metric("pages_replayed_total", "counter", m.pages_replayed);
+    metric("timeouts_total", "counter", m.timeouts);
+    metric("workers", "gauge", m.workers);
+    metric("queue_depth", "gauge", m.queue_depth);
+    metric("tasks_executed_total", "counter", m.tasks_executed);
+    metric("tasks_stolen_total", "counter", m.tasks_stolen);
+    metric("admission_waits_total", "counter", m.admission_waits);
+
+    type("features_total", "counter");
+    for (const auto& it : m.features) {
+        os << "be13_features_total{recorder=\"" << label_escape(it.first) << "\"} " << it.second << "\n";
+    }
+    type("features_per_second", "gauge");
+    for (const auto& it : m.features) {
+        uint64_t before = it.second;
+        if (prev) {
+            const auto p = prev->features.find(it.first);
+            before = p == prev->features.end() ? 0 : p->second;
+        }
+        os << "be13_features_per_second{recorder=\"" << label_escape(it.first) << "\"} "
+           << rate(it.second, before, dt) << "\n";
+    }
+    metric("carved_files_total", "counter", m.carved_files);
+    metric("carve_queue_bytes", "gauge", m.carve_queue_bytes);
+
+    type("memory_bytes", "gauge");
+    for (const auto& it : memory_counters(m.memory)) {
+        os << "be13_memory_bytes{kind=\"" << it.first << "\"} " << it.second << "\n";
+    }
+}
+
+void metrics_exporter::write_json(std::ostream& os, const scanner_set::metrics_t& m, const scanner_set::metrics_t* prev) {
+    const double dt = prev ? m.seconds - prev->seconds : 0;
+    os << "{\"uptime_seconds\":" << m.seconds;
+    os << ",\"bytes\":" << m.bytes_depth0;
+    os << ",\"bytes_per_second\":" << (prev ? rate(m.bytes_depth0, prev->bytes_depth0, dt) : 0);
+    os << ",\"sbufs\":[";
+    for (size_t d = 0; d < m.sbufs_by_depth.size(); d++) os << (d ? "," : "") << m.sbufs_by_depth[d];
+    os << "],\"sbufs_per_second\":[";
+    for (size_t d = 0; d < m.sbufs_by_depth.size(); d++) {
+        const uint64_t before = prev && d < prev->sbufs_by_depth.size() ? prev->sbufs_by_depth[d] : m.sbufs_by_depth[d];
+        os << (d ? "," : "") << rate(m.sbufs_by_depth[d], before, dt);
+    }
+    os << "],\"dup_bytes\":" << m.dup_bytes;
+    os << ",\"max_depth_seen\":" << m.max_depth_seen;
+    os << ",\"pages_skipped\":" << m.pages_skipped;
+    os << ",\"pages_replayed\":" << m.pages_replayed;
+    os << ",\"timeouts\":" << m.timeouts;
+    os << ",\"workers\":" << m.workers;
+    os << ",\"queue_depth\":" << m.queue_depth;
+    os << ",\"tasks_executed\":" << m.tasks_executed;
+    os << ",\"tasks_stolen\":" << m.tasks_stolen;
+    os << ",\"admission_waits\":" << m.admission_waits;
+    os << ",\"features\":{";
+    bool first = true;
+    for (const auto& it : m.features) {
+        os << (first ? "" : ",") << "\"" << json_escape(it.first) << "\":" << it.second;
+        first = false;
+    }
+    os << "},\"features_per_second\":{";
+    first = true;
+    for (const auto& it : m.features) {
+        uint64_t before = it.second;
+        if (prev) {
+            const auto p = prev->features.find(it.first);
+            before = p == prev->features.end() ? 0 : p->second;
+        }
+        os << (first ? "" : ",") << "\"" << json_escape(it.first) << "\":" << rate(it.second, before, dt);
+        first = false;
+    }
+    os << "},\"carved_files\":" << m.carved_files;
+    os << ",\"carve_queue_bytes\":" << m.carve_queue_bytes;
+    os << ",\"memory\":{";
+    first = true;
+    for (const auto& it : memory_counters(m.memory)) {
+        os << (first ? "" : ",") << "\"" << it.first << "\":" << it.second;
+        first = false;
+    }
+    os << "}}\n";
+}
+
+metrics_exporter::metrics_exporter(const std::filesystem::path& fname_, std::chrono::milliseconds interval_,
+                                   source_t source_)
+    : fname(fname_), format(format_for(fname_)), interval(interval_), source(source_),
+      thread(&metrics_exporter::run, this) {}
+
+metrics_exporter::~metrics_exporter() {
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+    try {
+        write_now();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+    }
+}
+
+uint64_t metrics_exporter::get_snapshots() const {
+    const std::lock_guard<std::mutex> lock(M);
+    return snapshots;
+}
+
+void metrics_exporter::write_now() {
+    const scanner_set::metrics_t m = source();
+    const std::lock_guard<std::mutex> lock(M);
+    const std::filesystem::path tmp = fname.string() + ".tmp";
+    std::ofstream of(tmp, std::ios::trunc);
+    if (!of.is_open()) throw std::runtime_error("metrics_exporter: cannot create " + tmp.string());
+    if (format == JSON) {
+        write_json(of, m, prev ? &*prev : nullptr);
+    } else {
+        write_prometheus(of, m, prev ? &*prev : nullptr);
+    }
+    of.close();
+    if (of.fail()) throw std::runtime_error("metrics_exporter: cannot write " + tmp.string());
+    std::filesystem::rename(tmp, fname);
+    prev = m;
+    snapshots++;
+}
+
+/* A snapshot that can't be written is reported and the scan goes on; the next one may succeed */
+void metrics_exporter::run() {
+    std::unique_lock<std::mutex> lock(M);
+    if (interval.count() == 0) {    // only the last snapshot
+        cv.wait(lock, [this] { return stopping; });
+        return;
+    }
+    while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+        lock.unlock();
+        try {
+            write_now();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+        }
+        lock.lock();
+    }
+}
@@ -0,0 +1,75 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * metrics_exporter - writes the scan's metrics to a file every few seconds while the scan runs.
+ *
+ * With scanner_config::metrics_file set, phase_scan() starts an exporter that takes a
+ * scanner_set::get_metrics() snapshot every scanner_config::metrics_seconds and writes it, with the rates
+ * since the last snapshot (bytes/s at depth 0, sbufs/s by depth, features/s by recorder), to the file.
+ * shutdown() writes a last snapshot. The file is written to a temporary file and renamed, so a reader
+ * never sees half of one.
+ *
+ * A file ending in .json gets a JSON object; any other file gets the Prometheus text exposition format,
+ * for node_exporter's textfile collector (name it *.prom in the collector's directory):
+ *
+ *     # TYPE be13_bytes_total counter
+ *     be13_bytes_total 268435456
+ *     # TYPE be13_bytes_per_second gauge
+ *     be13_bytes_per_second 2.68e+07
+ *     be13_sbufs_total{depth="1"} 5120
+ *     be13_features_per_second{recorder="email"} 12.5
+ *
+ * Counters are _total and only go up; the _per_second gauges are over the last interval, and are 0 in
+ * the first snapshot.
+ */
+
+#ifndef METRICS_EXPORTER_H
+#define METRICS_EXPORTER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <thread>
+
+#include "scanner_set.h"
+
+class metrics_exporter {
+    metrics_exporter(const metrics_exporter&) = delete;
+    metrics_exporter& operator=(const metrics_exporter&) = delete;
+
+public:
+    enum format_t { PROMETHEUS, JSON };
+    static format_t format_for(const std::filesystem::path& fname); // by its extension
+    typedef std::function<scanner_set::metrics_t()> source_t;
+
+    /* The rates are those since prev, or 0 if there is no prev */
+    static void write_prometheus(std::ostream& os, const scanner_set::metrics_t& m, const scanner_set::metrics_t* prev);
+    static void write_json(std::ostream& os, const scanner_set::metrics_t& m, const scanner_set::metrics_t* prev);
+
+    /* Starts a thread that writes a snapshot from source to fname every interval (if it isn't 0) */
+    metrics_exporter(const std::filesystem::path& fname, std::chrono::milliseconds interval, source_t source);
+    ~metrics_exporter();        // stops the thread and writes a last snapshot
+    void write_now();           // threadsafe; throws std::runtime_error
+    uint64_t get_snapshots() const;
+
+private:
+    const std::filesystem::path fname;
+    const format_t format;
+    const std::chrono::milliseconds interval;
+    const source_t source;
+
+    mutable std::mutex M{};     // protects everything below
+    std::optional<scanner_set::metrics_t> prev{};
+    uint64_t snapshots{0};
+    bool stopping{false};
+    std::condition_variable cv{};
+    std::thread thread;         // started last
+    void run();
+};
+
+#endif
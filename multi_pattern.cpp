@@ -0,0 +1,143 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+
+#include "multi_pattern.h"
+
+uint8_t multi_pattern::fold(uint8_t ch) const { return case_insensitive ? std::tolower(ch) : ch; }
+
+uint32_t multi_pattern::add(const std::string& literal) {
+    if (compiled) { throw std::runtime_error("multi_pattern::add: already compiled"); }
+    if (literal.empty()) { throw std::runtime_error("multi_pattern::add: empty pattern"); }
+    if (trie.empty()) {
+        trie.emplace_back();
+        terminal.push_back(0);
+    }
+    uint32_t node = 0;
+    for (uint8_t raw : literal) {
+        const uint8_t ch = fold(raw);
+        auto& edges = trie[node];
+        auto it = std::find_if(edges.begin(), edges.end(), [ch](const auto& e) { return e.first == ch; });
+        if (it != edges.end()) {
+            node = it->second;
+        } else {
+            const uint32_t next = trie.size();
+            edges.emplace_back(ch, next); // before trie grows, which invalidates edges
+            trie.emplace_back();
+            terminal.push_back(0);
+            node = next;
+        }
+    }
+    if (terminal[node] == 0) {
+        patterns.push_back(literal);
+        max_len = std::max(max_len, literal.size());
+        terminal[node] = patterns.size();
+    }
+    return terminal[node] - 1;
+}
+
+void multi_pattern::compile() {
+    if (compiled) return;
+    if (trie.empty()) {
+        trie.emplace_back();
+        terminal.push_back(0);
+    }
+
+    /* Every byte that appears in a pattern gets its own class (shared with its other case) */
+    memset(byte_class, 0, sizeof(byte_class));
+    nclasses = 1;
+    for (const auto& edges : trie) {
+        for (const auto& e : edges) {
+            if (byte_class[e.first] == 0) {
+                byte_class[e.first] = nclasses++;
+                if (case_insensitive) byte_class[std::toupper(e.first)] = byte_class[e.first];
+            }
+        }
+    }
+    for (const auto& it : patterns) {
+        starts[uint8_t(it[0])] = true;
+        if (case_insensitive) {
+            starts[std::tolower(uint8_t(it[0]))] = true;
+            starts[std::toupper(uint8_t(it[0]))] = true;
+        }
+    }
+    single_start = -1;
+    if (std::count(starts, starts + 256, true) == 1) single_start = std::find(starts, starts + 256, true) - starts;
+
+    /* Breadth-first, so that every node's failure node is finished before the node */
+    const size_t N = trie.size();
+    delta.assign(N * nclasses, 0);
+    std::vector<uint32_t> fail(N, 0);
+    std::vector<std::vector<uint32_t>> outputs(N);
+    std::deque<uint32_t> queue;
+    for (const auto& e : trie[0]) {
+        delta[byte_class[e.first]] = e.second;
+        queue.push_back(e.second);
+    }
+    while (!queue.empty()) {
+        const uint32_t u = queue.front();
+        queue.pop_front();
+        if (terminal[u]) outputs[u].push_back(terminal[u] - 1);
+        const auto& inherited = outputs[fail[u]];
+        outputs[u].insert(outputs[u].end(), inherited.begin(), inherited.end());
+        for (unsigned int c = 0; c < nclasses; c++) { delta[u * nclasses + c] = delta[fail[u] * nclasses + c]; }
+        for (const auto& e : trie[u]) {
+            const unsigned int c = byte_class[e.first];
+            fail[e.second] = delta[fail[u] * nclasses + c];
+            delta[u * nclasses + c] = e.second;
+            queue.push_back(e.second);
+        }
+    }
+
+    out_begin.assign(N + 1, 0);
+    out_ids.clear();
+    for (size_t s = 0; s < N; s++) {
+        out_begin[s] = out_ids.size();
+        out_ids.insert(out_ids.end(), outputs[s].begin(), outputs[s].end());
+    }
+    out_begin[N] = out_ids.size();
+
+    trie.clear();
+    trie.shrink_to_fit();
+    terminal.clear();
+    terminal.shrink_to_fit();
+    compiled = true;
+}
+
+void multi_pattern::search(const uint8_t* buf, size_t len, size_t page_len, std::vector<hit_t>& hits) const {
+    if (!compiled) { throw std::runtime_error("multi_pattern::search: not compiled"); }
+    if (patterns.empty() || page_len == 0) return;
+
+    /* No match that starts in the page can end after this */
+    const size_t end = std::min(len, page_len + max_len - 1);
+    const size_t first_hit = hits.size();
+    uint32_t s = 0;
+    size_t i = 0;
+    while (i < end) {
+        if (s == 0) {
+            if (single_start >= 0) {
+                const void* p = memchr(buf + i, single_start, end - i);
+                if (p == nullptr) break;
+                i = static_cast<const uint8_t*>(p) - buf;
+            } else {
+                while (i < end && !starts[buf[i]]) i++;
+                if (i == end) break;
+            }
+            if (i >= page_len) break; // nothing can start in the page any more
+        }
+        s = delta[s * nclasses + byte_class[buf[i]]];
+        i++;
+        for (uint32_t k = out_begin[s]; k < out_begin[s + 1]; k++) {
+            const uint32_t id = out_ids[k];
+            const size_t plen = patterns[id].size();
+            if (i - plen < page_len) hits.push_back(hit_t{i - plen, plen, id});
+        }
+    }
+    std::sort(hits.begin() + first_hit, hits.end(), [](const hit_t& a, const hit_t& b) {
+        return a.offset != b.offset ? a.offset < b.offset : a.pattern < b.pattern;
+    });
+}
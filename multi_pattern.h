@@ -0,0 +1,77 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * multi_pattern - find every occurrence of many literal strings in a buffer in a single pass.
+ *
+ * This is an Aho-Corasick automaton compiled to a dense DFA. Bytes are first mapped to equivalence
+ * classes (all bytes that appear in no pattern share one class), which keeps the transition table
+ * small enough to stay in cache with hundreds of patterns. While the automaton is in its start
+ * state, the search skips ahead to the next byte that can begin a pattern; with a single possible
+ * first byte this is memchr(), which the C library vectorizes.
+ *
+ * Patterns are added with add() and the automaton is built by compile(). After that the object is
+ * immutable and search() may be called from any number of threads at once.
+ *
+ * Use sbuf_t::find_all() to search an sbuf: it reports matches that start in the page and lets
+ * them run into the margin, the same rule write_buf() uses for features.
+ */
+
+#ifndef MULTI_PATTERN_H
+#define MULTI_PATTERN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class multi_pattern {
+public:
+    struct hit_t {
+        size_t offset{0};       // where the match starts
+        size_t len{0};          // length of the pattern
+        uint32_t pattern{0};    // the id returned by add()
+        bool operator==(const hit_t& b) const { return offset == b.offset && len == b.len && pattern == b.pattern; }
+    };
+
+    explicit multi_pattern(bool case_insensitive_ = false) : case_insensitive(case_insensitive_) {}
+
+    /* Returns the pattern's id; adding the same pattern twice returns the same id.
+     * Throws std::runtime_error for an empty pattern or after compile().
+     */
+    uint32_t add(const std::string& literal);
+    void compile(); // may be called more than once
+    bool is_compiled() const { return compiled; }
+
+    size_t size() const { return patterns.size(); }
+    const std::string& pattern(uint32_t id) const { return patterns.at(id); }
+    size_t max_length() const { return max_len; }
+
+    /* Append to hits every match in buf[0..len) that starts before page_len, in order of offset.
+     * Throws std::runtime_error if the matcher has not been compiled.
+     */
+    void search(const uint8_t* buf, size_t len, size_t page_len, std::vector<hit_t>& hits) const;
+
+private:
+    const bool case_insensitive;
+    bool compiled{false};
+    std::vector<std::string> patterns{};
+    size_t max_len{0};
+
+    /* The trie, while patterns are being added: sparse, one (byte, next) list per node */
+    std::vector<std::vector<std::pair<uint8_t, uint32_t>>> trie{};
+    std::vector<uint32_t> terminal{};        // node -> 1 + the id of the pattern ending there, or 0
+
+    /* The compiled DFA */
+    uint16_t byte_class[256]{};              // byte -> equivalence class
+    unsigned int nclasses{1};
+    std::vector<uint32_t> delta{};           // state * nclasses + class -> state
+    std::vector<uint32_t> out_begin{};       // outputs of state s are out_ids[out_begin[s]..out_begin[s+1])
+    std::vector<uint32_t> out_ids{};
+    bool starts[256]{};                      // bytes that can begin a pattern
+    int single_start{-1};                    // the only byte that can begin a pattern, or -1
+
+    uint8_t fold(uint8_t ch) const;
+};
+
+#endif
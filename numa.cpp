@@ -0,0 +1,138 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "numa.h"
+
+std::vector<unsigned int> numa_topology::parse_cpulist(const std::string& cpulist) {
+    std::vector<unsigned int> ret;
+    size_t pos = 0;
+    auto number = [&cpulist, &pos]() {
+        const size_t start = pos;
+        unsigned long n = 0;
+        while (pos < cpulist.size() && cpulist[pos] >= '0' && cpulist[pos] <= '9') n = n * 10 + (cpulist[pos++] - '0');
+        if (pos == start || n > 1u << 20) throw std::invalid_argument("numa_topology: bad cpulist: " + cpulist);
+        return static_cast<unsigned int>(n);
+    };
+    while (pos < cpulist.size() && cpulist[pos] != '\n') {
+        const unsigned int lo = number();
+        unsigned int hi = lo;
+        if (pos < cpulist.size() && cpulist[pos] == '-') {
+            pos++;
+            hi = number();
+            if (hi < lo) throw std::invalid_argument("numa_topology: bad cpulist: " + cpulist);
+        }
+        for (unsigned int cpu = lo; cpu <= hi; cpu++) ret.push_back(cpu);
+        if (pos < cpulist.size() && cpulist[pos] == ',') pos++;
+    }
+    return ret;
+}
+
+numa_topology numa_topology::single_node(unsigned int cpus) {
+    numa_topology t;
+    t.nodes.push_back(node_t{});
+    for (unsigned int cpu = 0; cpu < std::max(cpus, 1u); cpu++) t.nodes[0].cpus.push_back(cpu);
+    return t;
+}
+
+/* Nodes with no CPUs (memory-only nodes) are left out, since no worker can run on them */
+numa_topology numa_topology::from_sysfs(const std::filesystem::path& dir) {
+    numa_topology t;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.size() < 5 || name.compare(0, 4, "node") != 0 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos) {
+            continue;
+        }
+        std::ifstream in(entry.path() / "cpulist");
+        std::string cpulist;
+        if (!std::getline(in, cpulist)) continue;
+        node_t node;
+        node.id = std::stoul(name.substr(4));
+        try {
+            node.cpus = parse_cpulist(cpulist);
+        } catch (const std::invalid_argument&) {
+            continue;
+        }
+        if (!node.cpus.empty()) t.nodes.push_back(node);
+    }
+    if (t.nodes.empty()) return single_node(std::thread::hardware_concurrency());
+    std::sort(t.nodes.begin(), t.nodes.end(), [](const node_t& a, const node_t& b) { return a.id < b.id; });
+    return t;
+}
+
+const numa_topology& numa_topology::system() {
+    static const numa_topology t = from_sysfs("/sys/devices/system/node");
+    return t;
+}
+
+size_t numa_topology::node_index_of_cpu(unsigned int cpu) const {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (std::find(nodes[i].cpus.begin(), nodes[i].cpus.end(), cpu) != nodes[i].cpus.end()) return i;
+    }
+    return 0;
+}
+
+numa_topology::placement_t numa_topology::place_worker(unsigned int i) const {
+    const size_t node = i % nodes.size();
+    const auto& cpus = nodes[node].cpus;
+    return placement_t{cpus[(i / nodes.size()) % cpus.size()], node};
+}
+
+bool numa_topology::pin_thread(unsigned int cpu) {
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (cpu >= CPU_SETSIZE) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+/* mbind(2) works on whole pages, so only the pages inside [buf, buf+len) are bound */
+bool numa_topology::bind_memory(void* buf, size_t len, unsigned int node) {
+#if defined(HAVE_SYS_SYSCALL_H) && defined(SYS_mbind) && defined(HAVE_UNISTD_H)
+    const long pagesize = sysconf(_SC_PAGESIZE);
+    if (pagesize <= 0 || node >= 64) return false;
+    const uintptr_t start = (reinterpret_cast<uintptr_t>(buf) + pagesize - 1) & ~uintptr_t(pagesize - 1);
+    const uintptr_t end = (reinterpret_cast<uintptr_t>(buf) + len) & ~uintptr_t(pagesize - 1);
+    if (end <= start) return false;
+    static const int MPOL_PREFERRED_ = 1;    // from <numaif.h>, which comes with libnuma
+    static const int MPOL_MF_MOVE_ = 1 << 1;
+    const unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, start, end - start, MPOL_PREFERRED_, &mask, 64, MPOL_MF_MOVE_) == 0;
+#else
+    (void)buf;
+    (void)len;
+    (void)node;
+    return false;
+#endif
+}
+
+size_t numa_topology::current_node() const {
+    if (nodes.size() < 2) return 0;
+#ifdef HAVE_SCHED_GETCPU
+    const int cpu = sched_getcpu();
+    if (cpu >= 0) return node_index_of_cpu(cpu);
+#endif
+    return 0;
+}
@@ -0,0 +1,73 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * numa_topology - which CPUs are on which NUMA node, and placing threads and memory on a node.
+ *
+ * On a multi-socket host, memory is attached to one socket (node), and reading it from another costs
+ * a trip across the interconnect. With scanner_config::numa_placement, the scan keeps each top-level
+ * page on one node:
+ *
+ * - thread_pool pins each worker to one CPU, spreading the workers over the nodes, and gives each node
+ *   its own injection queue. Workers take work from their own deque, then their node's queue, then
+ *   their node's other workers, and only then from other nodes;
+ * - page n goes to node page_node(n): image_reader binds the page's buffer to that node before reading
+ *   into it, and scanner_set::schedule_sbuf() queues it there. The children that scanners make are
+ *   pushed onto the worker's own deque, so they stay on the node too;
+ * - sbuf_pool keeps a depot of free buffers for each node, so recycled buffers stay on their node.
+ *
+ * The topology comes from /sys/devices/system/node on Linux. Elsewhere, or if it can't be read, there
+ * is one node with every CPU, and pinning and binding do nothing. No NUMA library is needed: the
+ * placement calls are sched_setaffinity(), sched_getcpu() and the mbind system call, where they exist.
+ */
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class numa_topology {
+public:
+    struct node_t {
+        unsigned int id{0};
+        std::vector<unsigned int> cpus{};
+    };
+    std::vector<node_t> nodes{};                  // never empty
+
+    /* The topology of this host, read once */
+    static const numa_topology& system();
+    /* Read from a sysfs node directory (node0/cpulist, node1/cpulist, ...); one node if there is none */
+    static numa_topology from_sysfs(const std::filesystem::path& dir);
+    static numa_topology single_node(unsigned int cpus);
+
+    /* "0-3,8,10-11" -> {0,1,2,3,8,10,11}; throws std::invalid_argument */
+    static std::vector<unsigned int> parse_cpulist(const std::string& cpulist);
+
+    size_t node_count() const { return nodes.size(); }
+    size_t node_index_of_cpu(unsigned int cpu) const; // 0 if the cpu is not in any node
+
+    /* The CPU for worker i of count: consecutive workers on different nodes, each on a CPU of its own
+     * while there are CPUs left on its node.
+     */
+    struct placement_t {
+        unsigned int cpu{0};
+        size_t node{0};                          // index in nodes
+    };
+    placement_t place_worker(unsigned int i) const;
+
+    /* The node of a top-level page; pages are dealt out to the nodes in turn */
+    static size_t page_node(uint64_t offset, size_t pagesize, size_t node_count) {
+        return node_count > 1 && pagesize > 0 ? (offset / pagesize) % node_count : 0;
+    }
+
+    /* Placement. Each returns false if it isn't supported or fails; the scan goes on either way. */
+    static bool pin_thread(unsigned int cpu);                        // the calling thread
+    static bool bind_memory(void* buf, size_t len, unsigned int node); // prefer node for [buf, buf+len), moving it there
+    size_t current_node() const;                                     // index of the calling thread's node
+};
+
+#endif
@@ -225,7 +225,8 @@ public:
     const int pcap_dlt;                 // data link type; needed by libpcap, not provided
     const struct pcap_pkthdr* pcap_hdr; // provided by libpcap
     const u_char* pcap_data;            // provided by libpcap; where the MAC layer begins
-    const struct timeval& ts;           // when packet received; possibly modified before packet_info created
+    const struct timeval ts;            // when packet received; possibly modified before packet_info created.
+                                        // a copy, since pcap_pkthdr may be packed
     const uint8_t* const ip_data;       // pointer to where ip data begins
     const size_t ip_datalen;            // length of ip data
 
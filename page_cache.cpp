@@ -0,0 +1,180 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "byte_order.h"
+#include "dfxml_cpp/src/hash_t.h"
+#include "page_cache.h"
+#include "sbuf.h"
+
+static void put_string(std::string& out, std::string_view s) {
+    put_le(out, s.size(), 4);
+    out.append(s);
+}
+
+void page_cache::capture_t::add(const std::string& recorder, const pos0_t& pos0, std::string_view feature,
+                                std::string_view context) {
+    const pos0_t rel = pos0.shift(-static_cast<int64_t>(page.offset));
+    features.push_back(feature_t{recorder, rel.path, rel.offset, std::string(feature), std::string(context)});
+}
+
+page_cache::page_cache(const std::filesystem::path& fname_)
+    : fname(fname_), data_fname(fname_.string() + DATA_EXTENSION) {
+    if (std::filesystem::exists(fname) && std::filesystem::file_size(fname) > 0) {
+        try {
+            index.reset(sbuf_t::map_file(fname));
+        } catch (const std::exception& e) {
+            throw std::runtime_error("page_cache: cannot map " + fname.string() + ": " + e.what());
+        }
+        const uint8_t* buf = index->get_buf();
+        const size_t count = index->bufsize >= FILE_HEADER_SIZE ? get_le(buf + 16, 8) : 0;
+        if (index->bufsize < FILE_HEADER_SIZE || memcmp(buf, FILE_MAGIC, 8) != 0 ||
+            get_le(buf + 8, 4) != FILE_VERSION || get_le(buf + 12, 4) != ENTRY_SIZE ||
+            index->bufsize != FILE_HEADER_SIZE + count * ENTRY_SIZE) {
+            throw std::runtime_error("page_cache: " + fname.string() + " is not a page cache index");
+        }
+        attached_count = count;
+    }
+    if (std::filesystem::exists(data_fname) && std::filesystem::file_size(data_fname) > 0) {
+        try {
+            data.reset(sbuf_t::map_file(data_fname));
+        } catch (const std::exception& e) {
+            throw std::runtime_error("page_cache: cannot map " + data_fname.string() + ": " + e.what());
+        }
+    }
+    data_fd = ::open(data_fname.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (data_fd < 0) {
+        throw std::runtime_error("page_cache: cannot open " + data_fname.string() + ": " + strerror(errno));
+    }
+    data_size = lseek(data_fd, 0, SEEK_END);
+}
+
+page_cache::~page_cache() {
+    if (data_fd >= 0) ::close(data_fd);
+}
+
+digest_set::digest_t page_cache::key(const digest_set::digest_t& contents, const digest_set::digest_t& fingerprint) {
+    uint8_t words[32];
+    put_le(words, contents.hi, 8);
+    put_le(words + 8, contents.lo, 8);
+    put_le(words + 16, fingerprint.hi, 8);
+    put_le(words + 24, fingerprint.lo, 8);
+    return digest_set::from_hex(dfxml::sha1_generator::hash_buf(words, sizeof(words)).hexdigest());
+}
+
+page_cache::entry_t page_cache::attached_entry(size_t i) const {
+    const uint8_t* p = index->get_buf() + FILE_HEADER_SIZE + i * ENTRY_SIZE;
+    return entry_t{digest_set::digest_t{get_le(p, 8), get_le(p + 8, 8)}, get_le(p + 16, 8), get_le(p + 24, 8)};
+}
+
+static bool key_less(const digest_set::digest_t& a, const digest_set::digest_t& b) {
+    return a.hi != b.hi ? a.hi < b.hi : a.lo < b.lo;
+}
+
+/* The index and the data it points to were both written before the cache was opened, so no lock is needed */
+bool page_cache::lookup(const digest_set::digest_t& key, features_t& features) const {
+    size_t lo = 0, hi = attached_count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (key_less(attached_entry(mid).key, key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == attached_count) return false;
+    const entry_t e = attached_entry(lo);
+    if (e.key != key || data == nullptr || e.offset + e.length > data->bufsize || e.length < 4) return false;
+
+    /* Every read is checked against the end of the entry, so a damaged data file is a miss */
+    const uint8_t* p = data->get_buf() + e.offset;
+    const uint8_t* const end = p + e.length;
+    auto get_string = [&p, end](std::string& s) {
+        if (end - p < 4) return false;
+        const size_t len = get_le(p, 4);
+        p += 4;
+        if (static_cast<size_t>(end - p) < len) return false;
+        s.assign(reinterpret_cast<const char*>(p), len);
+        p += len;
+        return true;
+    };
+    const size_t count = get_le(p, 4);
+    p += 4;
+    features_t ret;
+    for (size_t i = 0; i < count; i++) {
+        feature_t f;
+        if (!get_string(f.recorder) || !get_string(f.path) || end - p < 8) return false;
+        f.offset = get_le(p, 8);
+        p += 8;
+        if (!get_string(f.feature) || !get_string(f.context)) return false;
+        ret.push_back(std::move(f));
+    }
+    features = std::move(ret);
+    return true;
+}
+
+void page_cache::store(const digest_set::digest_t& key, const features_t& features) {
+    std::string rec;
+    put_le(rec, features.size(), 4);
+    for (const auto& f : features) {
+        put_string(rec, f.recorder);
+        put_string(rec, f.path);
+        put_le(rec, f.offset, 8);
+        put_string(rec, f.feature);
+        put_string(rec, f.context);
+    }
+    const std::lock_guard<std::mutex> lock(M);
+    size_t done = 0;
+    while (done < rec.size()) {
+        const ssize_t r = ::write(data_fd, rec.data() + done, rec.size() - done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) throw std::runtime_error("page_cache: cannot write " + data_fname.string() + ": " + strerror(errno));
+        done += r;
+    }
+    stored.push_back(entry_t{key, data_size, rec.size()});
+    data_size += rec.size();
+}
+
+size_t page_cache::stored_size() const {
+    const std::lock_guard<std::mutex> lock(M);
+    return stored.size();
+}
+
+/* Written to a temporary file that is renamed over fname, so fname can be the mapped index */
+void page_cache::save() {
+    const std::lock_guard<std::mutex> lock(M);
+    std::vector<entry_t> all;
+    all.reserve(attached_count + stored.size());
+    for (size_t i = 0; i < attached_count; i++) all.push_back(attached_entry(i));
+    all.insert(all.end(), stored.begin(), stored.end());
+    std::stable_sort(all.begin(), all.end(), [](const entry_t& a, const entry_t& b) { return key_less(a.key, b.key); });
+    all.erase(std::unique(all.begin(), all.end(), [](const entry_t& a, const entry_t& b) { return a.key == b.key; }),
+              all.end());
+
+    std::string out(FILE_MAGIC, 8);
+    put_le(out, FILE_VERSION, 4);
+    put_le(out, ENTRY_SIZE, 4);
+    put_le(out, all.size(), 8);
+    put_le(out, 0, 8);
+    for (const auto& e : all) {
+        put_le(out, e.key.hi, 8);
+        put_le(out, e.key.lo, 8);
+        put_le(out, e.offset, 8);
+        put_le(out, e.length, 8);
+    }
+    const std::filesystem::path tmp = fname.string() + ".tmp";
+    std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+    os.write(out.data(), out.size());
+    os.close();
+    if (!os) throw std::runtime_error("page_cache: cannot write " + tmp.string());
+    std::filesystem::rename(tmp, fname);
+}
@@ -0,0 +1,125 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * page_cache - remembers, from one run to the next, the features that each top-level page produced,
+ * so that a page that was scanned before is replayed instead of scanned again.
+ *
+ * Re-acquisitions of a device share most of their pages. With scanner_config::page_cache_file set, the
+ * scanner_set looks up each top-level page by the key of its contents (the SHA1 of the page and its
+ * margin) and the fingerprint of the scan (the enabled scanners and their versions, and the
+ * configuration), hashed together with SHA1. On a hit, the features that were recorded for the page are written again, at the
+ * page's new offset, and no scanner is run; on a miss, the features written while the page and all of
+ * its children are scanned are captured on the scanning thread and stored under the key.
+ *
+ * Replaying assumes that what the scanners find depends only on the page's contents. Pages whose scan
+ * carved a file are not stored, since replaying their features would not write the carved file, and
+ * neither are pages that had been seen earlier in the same run (which not every scanner is run on).
+ * While pages are being captured their children are scanned on the page's thread, so parallelism
+ * comes from scanning many pages at once.
+ *
+ * The cache is two files. {fname}.dat holds the features of each page, appended as pages are stored:
+ * a u32 count, then for each feature the recorder name, the path of its pos0 (made relative to the
+ * page with pos0_t::shift()), its u64 offset, the feature and the context, each string as a u32 length
+ * and its bytes. fname is the index, written by save(): a 32-byte header {"BE13PGCH", u32 version,
+ * u32 32, u64 count, u64 0} and then, sorted by key, {u64 key.hi, u64 key.lo, u64 data offset, u64
+ * data length} for each page. Integers are little-endian. The index is mapped and binary-searched in
+ * place, and the data file is mapped when the cache is opened; pages stored during the run are only
+ * found by the next run.
+ */
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "digest_set.h"
+#include "pos0.h"
+
+class page_cache {
+public:
+    static inline const char FILE_MAGIC[9] = "BE13PGCH";
+    static inline const uint32_t FILE_VERSION = 2;  // 2: keys are SHA1, not fast_hash128()
+    static inline const size_t FILE_HEADER_SIZE = 32;
+    static inline const size_t ENTRY_SIZE = 32;
+    static inline const std::string DATA_EXTENSION = ".dat";
+
+    struct feature_t {
+        std::string recorder{};
+        std::string path{};       // relative to the page
+        uint64_t offset{0};
+        std::string feature{};
+        std::string context{};
+        pos0_t pos0(const pos0_t& page) const { return pos0_t(path, offset).shift(page.offset); }
+    };
+    typedef std::vector<feature_t> features_t;
+
+    /* While a capture_t is alive, feature_recorder::write() adds what is written on its thread */
+    class capture_t {
+    public:
+        explicit capture_t(const pos0_t& page_) : page(page_), saved(capturing) { capturing = this; }
+        ~capture_t() { capturing = saved; }
+        void add(const std::string& recorder, const pos0_t& pos0, std::string_view feature, std::string_view context);
+        const pos0_t page;
+        features_t features{};
+        bool complete{true};      // false if the page's features can't be replayed
+
+        /* Suspends capturing while it is alive, for a write that another write makes */
+        class pause {
+        public:
+            pause() : saved(capturing) { capturing = nullptr; }
+            ~pause() { capturing = saved; }
+
+        private:
+            capture_t* const saved;
+        };
+
+    private:
+        capture_t(const capture_t&) = delete;
+        capture_t& operator=(const capture_t&) = delete;
+        capture_t* const saved;
+    };
+    static inline thread_local capture_t* capturing{nullptr};
+
+    /* Opens the cache, loading fname and fname.dat if they exist; throws std::runtime_error */
+    explicit page_cache(const std::filesystem::path& fname);
+    ~page_cache();
+
+    static digest_set::digest_t key(const digest_set::digest_t& contents, const digest_set::digest_t& fingerprint);
+    bool lookup(const digest_set::digest_t& key, features_t& features) const; // threadsafe
+    void store(const digest_set::digest_t& key, const features_t& features);  // threadsafe; throws std::runtime_error
+    void save();                                                              // throws std::runtime_error
+
+    size_t attached_size() const { return attached_count; }
+    size_t stored_size() const;
+
+private:
+    page_cache(const page_cache&) = delete;
+    page_cache& operator=(const page_cache&) = delete;
+
+    struct entry_t {
+        digest_set::digest_t key{};
+        uint64_t offset{0};
+        uint64_t length{0};
+    };
+    const std::filesystem::path fname;
+    const std::filesystem::path data_fname;
+
+    std::unique_ptr<class sbuf_t> index{}; // mapped
+    size_t attached_count{0};
+    std::unique_ptr<class sbuf_t> data{};  // mapped; what was in the data file when the cache was opened
+    entry_t attached_entry(size_t i) const;
+
+    mutable std::mutex M{};                // protects everything below
+    int data_fd{-1};                       // appended to
+    uint64_t data_size{0};
+    std::vector<entry_t> stored{};
+};
+
+#endif
@@ -0,0 +1,136 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cstring>
+
+#include "pcap_reader.h"
+
+#ifndef DLT_LINUX_SLL
+#define DLT_LINUX_SLL 113
+#endif
+
+static inline uint32_t swap32(uint32_t x) {
+    return ((x & 0xff000000) >> 24) | ((x & 0x00ff0000) >> 8) | ((x & 0x0000ff00) << 8) | ((x & 0x000000ff) << 24);
+}
+
+uint32_t pcap_reader::get32(size_t off) const {
+    uint32_t v;
+    memcpy(&v, buf + off, sizeof(v));
+    return swapped ? swap32(v) : v;
+}
+
+pcap_reader::pcap_reader(const std::filesystem::path& fname) {
+    std::error_code ec;
+    const uintmax_t fsize = std::filesystem::file_size(fname, ec);
+    if (ec) throw std::runtime_error("pcap_reader: cannot read " + fname.string() + ": " + ec.message());
+    if (fsize < FILE_HEADER_BYTES) throw std::runtime_error("pcap_reader: " + fname.string() + " is too short");
+    map.reset(sbuf_t::map_file(fname));
+    if (!map) throw std::runtime_error("pcap_reader: cannot map " + fname.string());
+    buf = map->get_buf();
+    size = map->bufsize;
+
+    uint32_t magic;
+    memcpy(&magic, buf, sizeof(magic));
+    if (magic == swap32(MAGIC_USEC) || magic == swap32(MAGIC_NSEC)) {
+        swapped = true;
+        magic = swap32(magic);
+    }
+    if (magic != MAGIC_USEC && magic != MAGIC_NSEC) {
+        throw std::runtime_error("pcap_reader: " + fname.string() + " is not a pcap file");
+    }
+    nsec = (magic == MAGIC_NSEC);
+    uint16_t major;
+    memcpy(&major, buf + 4, sizeof(major));
+    if (swapped) major = static_cast<uint16_t>((major >> 8) | (major << 8));
+    if (major != PCAP_VERSION_MAJOR) {
+        throw std::runtime_error("pcap_reader: " + fname.string() + " has pcap version " + std::to_string(major));
+    }
+    snaplen = get32(16);
+    linktype = static_cast<int>(get32(20) & 0x0fffffff); // the upper bits are the FCS length
+}
+
+pcap_reader::~pcap_reader() {}
+
+void pcap_reader::rewind() {
+    pos = FILE_HEADER_BYTES;
+    packets = 0;
+    bytes = 0;
+    short_record = false;
+}
+
+size_t pcap_reader::ip_offset(int dlt, const uint8_t* data, size_t caplen) {
+    size_t off = 0;
+    uint16_t type = 0;
+    switch (dlt) {
+    case DLT_NULL: off = 4; break;
+    case DLT_RAW:
+    case 12:  // LINKTYPE_RAW on OpenBSD
+    case 14:  // DLT_RAW on OpenBSD
+    case 228: // LINKTYPE_IPV4
+    case 229: // LINKTYPE_IPV6
+        return 0;
+    case DLT_LINUX_SLL:
+        off = 16;
+        if (caplen < off) return caplen;
+        type = be13::packet_info::nshort(data, 14);
+        return (type == ETHERTYPE_IP || type == ETHERTYPE_IPV6) ? off : caplen;
+    case DLT_EN10MB:
+        off = sizeof(struct be13::ether_header);
+        if (caplen < off) return caplen;
+        type = be13::packet_info::nshort(data, off - 2);
+        while ((type == ETHERTYPE_VLAN || type == 0x88a8) && caplen >= off + 4) { // 802.1Q and 802.1ad tags
+            type = be13::packet_info::nshort(data, off + 2);
+            off += 4;
+        }
+        return (type == ETHERTYPE_IP || type == ETHERTYPE_IPV6) ? off : caplen;
+    default: return caplen; // not a link type that we know carries IP
+    }
+    return off < caplen ? off : caplen;
+}
+
+bool pcap_reader::next_batch(batch_t& batch, size_t max_packets) {
+    batch.packets.clear();
+    batch.hdrs.clear();
+    batch.first_packet = packets;
+    if (max_packets == 0) max_packets = 1;
+    batch.hdrs.reserve(max_packets); // packet_info refers to the headers, so they must not move
+    batch.packets.reserve(max_packets);
+    while (batch.hdrs.size() < max_packets && pos + RECORD_HEADER_BYTES <= size) {
+        struct timeval ts;
+        ts.tv_sec = get32(pos);
+        ts.tv_usec = nsec ? get32(pos + 4) / 1000 : get32(pos + 4);
+        struct pcap_pkthdr hdr;
+        hdr.ts = ts;
+        hdr.caplen = get32(pos + 8);
+        hdr.len = get32(pos + 12);
+        const size_t data = pos + RECORD_HEADER_BYTES;
+        if (hdr.caplen > size - data) {
+            short_record = true;
+            pos = size;
+            break;
+        }
+        batch.hdrs.push_back(hdr);
+        const uint8_t* d = buf + data;
+        const size_t ip = ip_offset(linktype, d, hdr.caplen);
+        batch.packets.emplace_back(linktype, &batch.hdrs.back(), d, ts, d + ip, hdr.caplen - ip);
+        pos = data + hdr.caplen;
+        packets++;
+        bytes += hdr.caplen;
+    }
+    if (pos < size && pos + RECORD_HEADER_BYTES > size) {
+        short_record = true; // a partial record header
+        pos = size;
+    }
+    return !batch.packets.empty();
+}
+
+uint64_t pcap_reader::run(const batch_handler_t& handler, size_t batch_packets) {
+    batch_t batch;
+    uint64_t count = 0;
+    while (next_batch(batch, batch_packets)) {
+        handler(batch);
+        count += batch.size();
+    }
+    return count;
+}
@@ -0,0 +1,92 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * pcap_reader - reads a pcap capture file by mapping it, without copying the packets.
+ *
+ * pcap_fake's pcap_loop() freads each record header and packet into one packet buffer and makes one
+ * callback per packet. pcap_reader instead maps the whole capture (see sbuf_t::map_file) and walks the
+ * records in place: next_batch() fills a batch_t with up to BATCH_PACKETS be13::packet_info records whose
+ * pcap_data and ip_data point straight into the mapping. A batch can then be handed to every packet
+ * handler at once (see scanner_set::process_packets).
+ *
+ * Both byte orders and both the microsecond (a1b2c3d4) and nanosecond (a1b23c4d) formats are read; pcapng
+ * is not. A record that runs past the end of the file ends the capture and sets truncated().
+ *
+ * The packet_info records in a batch refer to the batch's headers and to the mapping, so they are only
+ * valid until the batch is refilled or the reader is deleted.
+ */
+
+#ifndef PCAP_READER_H
+#define PCAP_READER_H
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "packet_info.h"
+#include "sbuf.h"
+
+/* A batch of packets; see pcap_reader::next_batch() */
+struct pcap_batch_t {
+    pcap_batch_t() {}
+    pcap_batch_t(const pcap_batch_t&) = delete; // the packets would refer to the original's headers
+    pcap_batch_t& operator=(const pcap_batch_t&) = delete;
+    std::vector<struct pcap_pkthdr> hdrs{};     // native headers; packets[i].pcap_hdr is &hdrs[i]
+    std::vector<be13::packet_info> packets{};
+    uint64_t first_packet{0};                   // the number of packets[0] in the capture
+    size_t size() const { return packets.size(); }
+    bool empty() const { return packets.empty(); }
+    const be13::packet_info& operator[](size_t i) const { return packets[i]; }
+};
+
+class pcap_reader {
+public:
+    static inline const size_t BATCH_PACKETS = 256;
+    static inline const uint32_t MAGIC_USEC = 0xa1b2c3d4;
+    static inline const uint32_t MAGIC_NSEC = 0xa1b23c4d;
+    static inline const size_t FILE_HEADER_BYTES = 24;
+    static inline const size_t RECORD_HEADER_BYTES = 16;
+
+    typedef pcap_batch_t batch_t;
+    typedef std::function<void(const batch_t& batch)> batch_handler_t;
+
+    explicit pcap_reader(const std::filesystem::path& fname); // throws std::runtime_error
+    ~pcap_reader();
+
+    bool next_batch(batch_t& batch, size_t max_packets = BATCH_PACKETS); // false when there are no more packets
+    uint64_t run(const batch_handler_t& handler, size_t batch_packets = BATCH_PACKETS); // every remaining batch
+    void rewind();
+
+    int datalink() const { return linktype; }
+    uint32_t get_snaplen() const { return snaplen; }
+    bool nanosecond() const { return nsec; }
+    uint64_t packets_read() const { return packets; }
+    uint64_t bytes_read() const { return bytes; }            // captured bytes
+    bool truncated() const { return short_record; }
+
+    /* Where the IP header starts in a frame of link type dlt, or caplen if the frame doesn't carry IP */
+    static size_t ip_offset(int dlt, const uint8_t* data, size_t caplen);
+
+private:
+    pcap_reader(const pcap_reader&) = delete;
+    pcap_reader& operator=(const pcap_reader&) = delete;
+
+    std::unique_ptr<sbuf_t> map{};
+    const uint8_t* buf{nullptr};
+    size_t size{0};
+    size_t pos{FILE_HEADER_BYTES};
+    bool swapped{false};
+    bool nsec{false};
+    int linktype{0};
+    uint32_t snaplen{0};
+    uint64_t packets{0};
+    uint64_t bytes{0};
+    bool short_record{false};
+    uint32_t get32(size_t off) const;
+};
+
+#endif
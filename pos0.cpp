@@ -0,0 +1,58 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+#include "pos0.h"
+
+/*
+ * The intern table maps each path to its entry. The table holds weak pointers, so an entry is
+ * freed when the last pos0_t on that decoder level goes away; its deleter then takes it out of
+ * the table, unless the path has already been interned again.
+ */
+namespace {
+struct intern_table_t {
+    std::mutex M{};
+    std::unordered_map<std::string_view, std::weak_ptr<const pos0_t::interned_path_t>> table{};
+};
+
+/* Never destroyed, so pos0_t objects may be deleted during static destruction */
+intern_table_t& intern_table() {
+    static intern_table_t* t = new intern_table_t();
+    return *t;
+}
+
+void release_interned(const pos0_t::interned_path_t* entry) {
+    intern_table_t& t = intern_table();
+    {
+        const std::lock_guard<std::mutex> lock(t.M);
+        auto it = t.table.find(entry->path);
+        if (it != t.table.end() && it->second.expired()) t.table.erase(it);
+    }
+    delete entry;
+}
+} // namespace
+
+pos0_t::interned_path_ptr pos0_t::intern(const std::string& path) {
+    if (path.empty()) return nullptr;
+    intern_table_t& t = intern_table();
+    const std::lock_guard<std::mutex> lock(t.M);
+    auto it = t.table.find(path);
+    if (it != t.table.end()) {
+        if (auto entry = it->second.lock()) return entry;
+        t.table.erase(it); // expired; its key points into the old entry, so replace both
+    }
+    const unsigned int depth = std::count(path.begin(), path.end(), '-');
+    interned_path_ptr entry(new interned_path_t(path, depth), release_interned);
+    t.table.emplace(entry->path, entry);
+    return entry;
+}
+
+size_t pos0_t::interned_count() {
+    intern_table_t& t = intern_table();
+    const std::lock_guard<std::mutex> lock(t.M);
+    return t.table.size();
+}
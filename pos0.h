@@ -3,8 +3,11 @@
 
 #include <exception>
 #include <algorithm>
+#include <charconv>
 #include <cinttypes>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 
 /****************************************************************
@@ -25,8 +28,10 @@
  *       unzip, go 300 bytes into the decompressed stream, un-BASE64, and
  *       go 30 bytes into that.
  *
- * pos0_t uses a string to hold the base path and the offset into that path
- * in a 64-bit number.
+ * pos0_t holds the base path in an interned, immutable string that is shared by
+ * every pos0_t on the same decoder level, and the offset into that path in a
+ * 64-bit number. Slicing an sbuf only changes the offset, so it copies a pointer
+ * rather than the path; the path is formatted when a feature is written.
  */
 
 inline int64_t stoi64(std::string str) {
@@ -37,23 +42,54 @@ inline int64_t stoi64(std::string str) {
 }
 
 class pos0_t {
-    const size_t calc_depth(const std::string& s) const {
-        return std::count_if(s.begin(), s.end(), [](char c) { return c == '-'; });
+public:
+    /* The path of one decoder level, shared by every pos0_t at that level.
+     * Equal paths share an entry for as long as any pos0_t refers to it.
+     */
+    struct interned_path_t {
+        const std::string path;
+        const unsigned int depth;
+        interned_path_t(const std::string& path_, unsigned int depth_) : path(path_), depth(depth_) {}
+    };
+    typedef std::shared_ptr<const interned_path_t> interned_path_ptr;
+    static interned_path_ptr intern(const std::string& path);   // thread-safe; nullptr for ""
+    static size_t interned_count();                             // paths now in the table
+
+private:
+    /* The empty path (every top-level sbuf) has no entry, so copying it touches no shared counter */
+    interned_path_ptr interned;
+    static const std::string& empty_path() {
+        static const std::string empty{};
+        return empty;
     }
+    pos0_t(const interned_path_ptr& interned_, uint64_t o)
+        : interned(interned_), path(interned ? interned->path : empty_path()), offset(o),
+          depth(interned ? interned->depth : 0) {}
 
 public:
-    const std::string path{}; /* forensic path of decoders*/
+    const std::string& path;  /* forensic path of decoders */
     const uint64_t offset{0}; /* location of buf[0] */
     const unsigned int depth{0};
 
-    explicit pos0_t() {}                                                                // the beginning of a nothing
-    pos0_t(std::string s, uint64_t o = 0) : path(s), offset(o), depth(calc_depth(s)) {} // a specific offset in a place
-    pos0_t(const pos0_t& obj) : path(obj.path), offset(obj.offset) {}
+    explicit pos0_t() : pos0_t(interned_path_ptr(), 0) {}            // the beginning of a nothing
+    pos0_t(const std::string& s, uint64_t o = 0) : pos0_t(intern(s), o) {} // a specific offset in a place
+    pos0_t(const pos0_t& obj) : pos0_t(obj.interned, obj.offset) {}
+
+    /* The same path at another offset. This never allocates. */
+    pos0_t at(uint64_t o) const { return pos0_t(interned, o); }
+    bool same_path(const pos0_t& b) const { return interned == b.interned; }
+
     std::string str() const { // convert to a string, with offset included
-        std::stringstream ss;
-        if (path.size() > 0) { ss << path << "-"; }
-        ss << offset;
-        return ss.str();
+        if (path.empty()) return std::to_string(offset);
+        return path + "-" + std::to_string(offset);
+    }
+    void append_str(std::string& out) const { // append str() to out, without a temporary
+        if (!path.empty()) {
+            out.append(path);
+            out.push_back('-');
+        }
+        char buf[24];
+        out.append(buf, std::to_chars(buf, buf + sizeof(buf), offset).ptr);
     }
     bool isRecursive() const { // is there a path?
         return path.size() > 0;
@@ -103,10 +139,8 @@ public:
             return pos0_t("", offset + s);
         }
         /* Figure out the value of the shift */
-        int64_t baseOffset = stoi64(path.substr(0, p - 1));
-        std::stringstream ss;
-        ss << (baseOffset + s) << path.substr(p);
-        return pos0_t(ss.str(), offset);
+        int64_t baseOffset = stoi64(path.substr(0, p));
+        return pos0_t(std::to_string(baseOffset + s) + path.substr(p), offset);
     }
 };
 
@@ -119,42 +153,38 @@ inline std::ostream& operator<<(std::ostream& os, const class pos0_t& pos0) {
 /** Append a string (subdir).
  * The current offset is a prefix to the subdir.
  */
-inline class pos0_t operator+(pos0_t pos, const std::string& subdir) {
-    std::stringstream ss;
-    ss << pos.path << (pos.path.size() > 0 ? "-" : "") << pos.offset << "-" << subdir;
-    return pos0_t(ss.str(), 0);
+inline class pos0_t operator+(const pos0_t& pos, const std::string& subdir) {
+    return pos0_t(pos.str() + "-" + subdir, 0);
 };
 
 /** Adding an offset */
-inline class pos0_t operator+(pos0_t pos, size_t delta) {
-    return pos0_t(pos.path, pos.offset + delta);
+inline class pos0_t operator+(const pos0_t& pos, size_t delta) {
+    return pos.at(pos.offset + delta);
 };
 
 /** Subtracting an offset */
-inline class pos0_t operator-(pos0_t pos, size_t delta) {
+inline class pos0_t operator-(const pos0_t& pos, size_t delta) {
     if (delta > pos.offset) {
         throw std::runtime_error("attempt to subtract a delta from an pos0_t that is larger that pos.offset");
     }
-    return pos0_t(pos.path, pos.offset - delta);
+    return pos.at(pos.offset - delta);
 };
 
 /** \name Comparision operations
  * @{
  */
 inline bool operator<(const class pos0_t& pos0, const class pos0_t& pos1) {
-    if (pos0.path.size() == 0 && pos1.path.size() == 0) return pos0.offset < pos1.offset;
-    if (pos0.path == pos1.path) return pos0.offset < pos1.offset;
+    if (pos0.same_path(pos1)) return pos0.offset < pos1.offset;
     return pos0.path < pos1.path;
 };
 
 inline bool operator>(const class pos0_t& pos0, const class pos0_t& pos1) {
-    if (pos0.path.size() == 0 && pos1.path.size() == 0) return pos0.offset > pos1.offset;
-    if (pos0.path == pos1.path) return pos0.offset > pos1.offset;
+    if (pos0.same_path(pos1)) return pos0.offset > pos1.offset;
     return pos0.path > pos1.path;
 };
 
 inline bool operator==(const class pos0_t& pos0, const class pos0_t& pos1) {
-    return pos0.path == pos1.path && pos0.offset == pos1.offset;
+    return pos0.offset == pos1.offset && pos0.same_path(pos1);
 };
 
 inline bool operator!=(const class pos0_t& pos0, const class pos0_t& pos1) { return !(pos0 == pos1); };
@@ -0,0 +1,151 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(HAVE_RE2_RE2_H) && defined(HAVE_LIBRE2)
+#define REGEX_ENGINE_RE2
+#include <re2/re2.h>
+#include <re2/set.h>
+#endif
+
+#include "regex_engine.h"
+
+#ifdef REGEX_ENGINE_RE2
+static RE2::Options re2_options(bool icase) {
+    RE2::Options options;
+    options.set_encoding(RE2::Options::EncodingLatin1); // bytes, as std::regex
+    options.set_log_errors(false);
+    options.set_case_sensitive(!icase);
+    return options;
+}
+#endif
+
+struct regex_engine::pattern_t {
+    std::string text{};
+    bool icase{false};
+#ifdef REGEX_ENGINE_RE2
+    std::unique_ptr<RE2> re2{}; // if RE2 accepted it
+#endif
+    std::unique_ptr<std::regex> re{}; // otherwise
+};
+
+struct regex_engine::set_t {
+#ifdef REGEX_ENGINE_RE2
+    set_t() : set(re2_options(false), RE2::UNANCHORED) {}
+    RE2::Set set;
+    std::vector<size_t> pattern{}; // set index -> pattern number
+#endif
+};
+
+const char* regex_engine::name() {
+#ifdef REGEX_ENGINE_RE2
+    return "re2";
+#else
+    return "std-c++11";
+#endif
+}
+
+regex_engine::regex_engine() {}
+regex_engine::~regex_engine() {}
+
+size_t regex_engine::add(const std::string& text, bool icase) {
+    const std::lock_guard<std::mutex> lock(Mcompile);
+    compiled = false; // compiled again by the next search
+    set.reset();
+    auto p = std::make_unique<pattern_t>();
+    p->text = text;
+    p->icase = icase;
+#ifdef REGEX_ENGINE_RE2
+    p->re2 = std::make_unique<RE2>(text, re2_options(icase));
+    if (!p->re2->ok()) p->re2.reset();
+    if (!p->re2)
+#endif
+    {
+        auto flags = std::regex_constants::ECMAScript;
+        if (icase) flags |= std::regex_constants::icase;
+        p->re = std::make_unique<std::regex>(text, flags);
+        fallbacks.push_back(patterns.size());
+    }
+    patterns.push_back(std::move(p));
+    return patterns.size() - 1;
+}
+
+void regex_engine::compile() {
+    const std::lock_guard<std::mutex> lock(Mcompile);
+    compile_locked();
+}
+
+void regex_engine::compile_locked() const {
+    if (compiled) return;
+#ifdef REGEX_ENGINE_RE2
+    auto s = std::make_unique<set_t>();
+    bool ok = true;
+    for (size_t i = 0; i < patterns.size() && ok; i++) {
+        if (!patterns[i]->re2) continue;
+        /* The set has one set of options, so case-insensitivity goes in the pattern */
+        const std::string text = (patterns[i]->icase ? "(?i)" : "") + patterns[i]->text;
+        ok = s->set.Add(text, nullptr) >= 0;
+        s->pattern.push_back(i);
+    }
+    /* Without the set (it can fail if it would need too much memory), each pattern is searched on its own */
+    if (ok && !s->pattern.empty() && s->set.Compile()) set = std::move(s);
+#endif
+    compiled = true;
+}
+
+bool regex_engine::search_one(size_t i, std::string_view probe, size_t* offset, size_t* len) const {
+    const pattern_t& p = *patterns[i];
+#ifdef REGEX_ENGINE_RE2
+    if (p.re2) {
+        re2::StringPiece m;
+        if (!p.re2->Match(re2::StringPiece(probe.data(), probe.size()), 0, probe.size(), RE2::UNANCHORED, &m, 1)) {
+            return false;
+        }
+        if (offset) *offset = m.data() - probe.data();
+        if (len) *len = m.size();
+        return true;
+    }
+#endif
+    std::cmatch m;
+    if (!std::regex_search(probe.data(), probe.data() + probe.size(), m, *p.re)) return false;
+    if (offset) *offset = m.position();
+    if (len) *len = m.length();
+    return true;
+}
+
+bool regex_engine::search(std::string_view probe, size_t* which, size_t* offset, size_t* len) const {
+    if (!compiled) {
+        const std::lock_guard<std::mutex> lock(Mcompile);
+        compile_locked();
+    }
+    size_t best = patterns.size(); // the lowest-numbered pattern known to match
+#ifdef REGEX_ENGINE_RE2
+    if (set) {
+        std::vector<int> hits;
+        if (set->set.Match(re2::StringPiece(probe.data(), probe.size()), &hits)) {
+            for (int h : hits) best = std::min(best, set->pattern[h]);
+        }
+    } else {
+        for (size_t i = 0; i < patterns.size(); i++) {
+            if (patterns[i]->re2 && search_one(i, probe, nullptr, nullptr)) {
+                best = i;
+                break;
+            }
+        }
+    }
+#endif
+    /* A fallback pattern that comes before it wins */
+    for (size_t i : fallbacks) {
+        if (i >= best) break;
+        if (search_one(i, probe, offset, len)) {
+            if (which) *which = i;
+            return true;
+        }
+    }
+    if (best == patterns.size()) return false;
+    if (which) *which = best;
+    return search_one(best, probe, offset, len);
+}
@@ -0,0 +1,61 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * regex_engine - the regular expression matcher behind regex_vector and histogram_def.
+ *
+ * A regex_engine holds a list of patterns and finds the first of them (in the order they were added)
+ * that occurs in a string. When RE2 is available (HAVE_RE2_RE2_H and HAVE_LIBRE2, found by configure),
+ * the patterns are compiled into a single RE2::Set, so a string is scanned once by one DFA however
+ * many patterns there are, and only the pattern that won is run again to find where it matched.
+ * Strings are matched as bytes (RE2's Latin-1 mode), as std::regex matches them.
+ *
+ * std::regex is the fallback: it is used for everything without RE2, and with RE2 for any pattern that
+ * RE2 does not accept, such as one with a back-reference or a lookahead.
+ *
+ * Patterns are added with add(); the engine is compiled by the first search() after that, or by compile().
+ * search() may be called from any number of threads at once, but not while a pattern is being added.
+ */
+
+#ifndef REGEX_ENGINE_H
+#define REGEX_ENGINE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class regex_engine {
+public:
+    regex_engine();
+    ~regex_engine();
+    static const char* name(); // "re2" or "std-c++11"
+
+    /* Returns the pattern's number. Throws std::regex_error if no engine accepts it. */
+    size_t add(const std::string& pattern, bool icase);
+    void compile();
+    size_t size() const { return patterns.size(); }
+
+    /* The lowest-numbered pattern that occurs in probe, with where its leftmost match is */
+    bool search(std::string_view probe, size_t* which = nullptr, size_t* offset = nullptr, size_t* len = nullptr) const;
+
+private:
+    regex_engine(const regex_engine&) = delete;
+    regex_engine& operator=(const regex_engine&) = delete;
+
+    struct pattern_t;                // one pattern, compiled by RE2 or by std::regex
+    std::vector<std::unique_ptr<pattern_t>> patterns{};
+    struct set_t;                    // the RE2::Set of all the patterns RE2 accepted
+    mutable std::unique_ptr<set_t> set; // made by compile_locked()
+    std::vector<size_t> fallbacks{}; // the patterns that only std::regex accepted, in order
+
+    mutable std::mutex Mcompile{};
+    mutable std::atomic<bool> compiled{false};
+    void compile_locked() const;     // Mcompile must be held
+    bool search_one(size_t i, std::string_view probe, size_t* offset, size_t* len) const;
+};
+
+#endif
@@ -2,8 +2,7 @@
 
 #include "regex_vector.h"
 
-/* rewritten to use C++11's regex */
-const std::string regex_vector::regex_engine() { return std::string("std-c++11"); }
+const std::string regex_vector::regex_engine() { return std::string(engine.name()); }
 
 /* Only certain characters are assumed to be a regular expression. These characters are
  * coincidently never in email addresses.
@@ -25,18 +24,14 @@ bool regex_vector::has_metachars(const std::string& str) {
  * set *found to be what was found, *offset to be the starting offset, and *len to be
  * the length. Note that this only handles a single group.
  */
-bool regex_vector::search_all(const std::string& probe, std::string* found, size_t* offset, size_t* len) const {
-    for (auto it : regex_chars) {
-        std::smatch sm;
-        std::regex_search(probe, sm, it);
-        if (sm.size() > 0) {
-            if (found) *found = sm.str();
-            if (offset) *offset = sm.position();
-            if (len) *len = sm.length();
-            return true;
-        }
-    }
-    return false;
+bool regex_vector::search_all(std::string_view probe, std::string* found, size_t* offset, size_t* len) const {
+    size_t pos = 0;
+    size_t n = 0;
+    if (engine.size() == 0 || !engine.search(probe, nullptr, &pos, &n)) return false;
+    if (found) *found = std::string(probe.substr(pos, n));
+    if (offset) *offset = pos;
+    if (len) *len = n;
+    return true;
 }
 
 int regex_vector::readfile(const std::string& fname) {
@@ -50,7 +45,8 @@ int regex_vector::readfile(const std::string& fname) {
             if (line.size() > 0 && (((*line.end()) == '\r') || (*line.end()) == '\n')) { line.erase(line.end()); }
 
             /* Create a regular expression and add it */
-            regex_chars.push_back(std::regex(line));
+            regex_strings.push_back(line);
+            engine.add(line, false);
         }
         f.close();
         return 0;
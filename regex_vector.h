@@ -15,20 +15,24 @@
 #include <regex>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "regex_engine.h"
+
 /**
  * The regex_vector is a vector of character regexes with a few additional convenience functions.
  * We might want to change this to handle ASCII, UTF-16 and UTF-8 characters simultaneously.
+ * The regexes are matched by a regex_engine, which scans for all of them at once when it can.
  */
 class regex_vector {
     std::vector<std::string> regex_strings; // the original regex strings
-    std::vector<std::regex> regex_chars;
+    ::regex_engine engine;                  // regex_engine() is also a member function
     regex_vector(const regex_vector&) = delete;
     regex_vector& operator=(const regex_vector&) = delete;
 
 public:
-    regex_vector() : regex_strings(), regex_chars(){};
+    regex_vector() : regex_strings(), engine(){};
     // is this a regular expression with meta characters?
     static bool has_metachars(const std::string& str);
     const std::string regex_engine(); // which engine is in use
@@ -36,11 +40,12 @@ public:
     /* Add a string */
     void push_back(const std::string& val) {
         regex_strings.push_back(val);
-        regex_chars.push_back(std::regex(val, std::regex_constants::icase));
-        assert(regex_strings.size() == regex_chars.size());
+        engine.add(val, true);
+        assert(regex_strings.size() == engine.size());
     }
 
-    auto size() { return regex_chars.size(); }
+    auto size() { return engine.size(); }
+    const std::vector<std::string>& get_regex_strings() const { return regex_strings; }
 
     /**
      * Read regular expressions from a file: returns 0 if successful, -1 if failure.
@@ -54,7 +59,7 @@ public:
      * *found - set to the found string if something is found.
      */
 
-    bool search_all(const std::string& probe, std::string* found, size_t* offset = nullptr,
+    bool search_all(std::string_view probe, std::string* found, size_t* offset = nullptr,
                     size_t* len = nullptr) const;
     void dump(std::ostream& os) const;
 };
@@ -6,12 +6,15 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 
 #include <filesystem>
 #include <algorithm>
 
 #include "sbuf.h"
+#include "alloc_profile.h"
+#include "sbuf_pool.h"
 #include "dfxml_cpp/src/hash_t.h"
 #include "formatter.h"
 #include "unicode_escape.h"
@@ -29,6 +32,8 @@
 
 /* Keep track of how many sbufs we have */
 std::atomic<int> sbuf_t::sbuf_count = 0;
+memory_counter sbuf_t::mapped_memory;
+memory_counter sbuf_t::malloced_memory;
 
 /* Make an empty sbuf */
 sbuf_t::sbuf_t()
@@ -73,6 +78,7 @@ sbuf_t::sbuf_t(pos0_t pos0_, const sbuf_t *parent_,
     if (parent) {
         parent->add_child(*this);
     }
+    if (fd > 0) mapped_memory.add(bufsize);
     sbuf_count += 1;
 }
 
@@ -90,9 +96,11 @@ sbuf_t::~sbuf_t()
         std::runtime_error(Formatter() << "sbuf.cpp: fd>0 and HAVE_MMAP is not defined");
 #endif
         ::close(fd);
+        mapped_memory.sub(bufsize);
     }
     if (malloced != nullptr) {
-        free( malloced );
+        sbuf_pool::free_buffer( malloced, malloced_capacity );
+        malloced_memory.sub(malloced_size);
     }
     sbuf_count -= 1;
 }
@@ -120,20 +128,26 @@ void sbuf_t::del_child(const sbuf_t& child) const
 {
     children   -= 1;
     assert(children >= 0);
-    references -= 1;
-    // I'm not sure how to delete us when there are no children left. Perhaps we could be added to a list to be wiped?
-    //dereference();                      // child no longer has my reference
+    if (--references == 0) {            // we were released and this was the last child
+        delete this;
+    }
 }
 
-#if 0
-void sbuf_t::dereference()
+void sbuf_t::release() const
 {
-    references--;
-    if (references==0) {
+    if (--references == 0) {
         delete this;
     }
 }
-#endif
+
+bool sbuf_t::file_extent(int& fd_, uint64_t& offset_) const
+{
+    const sbuf_t* hp = highest_parent();
+    if (hp->fd <= 0 || buf < hp->buf || buf + bufsize > hp->buf + hp->bufsize) return false;
+    fd_ = hp->fd;
+    offset_ = buf - hp->buf;
+    return true;
+}
 
 /****************************************************************
  ** Allocators.
@@ -171,17 +185,28 @@ sbuf_t *sbuf_t::realloc(size_t newsize)
     if (malloced==nullptr) {
         throw std::runtime_error("sbuf_t::realloc called on buffer that was not malloced");
     }
+    if (children > 0) {
+        throw std::runtime_error("sbuf_t::realloc called on sbuf that has children.");
+    }
     if (newsize >bufsize) {
         throw std::runtime_error("sbuf_t::realloc attempt to make sbuf bigger");
     }
-    malloced = ::realloc(malloced, newsize);
-    if (malloced==nullptr) {
-        throw std::bad_alloc();
+    /* A pooled buffer shrinks to the size class of newsize, so it can still go back to the pool */
+    const size_t new_capacity = malloced_capacity ? sbuf_pool::size_class(newsize) : 0;
+    if (malloced_capacity == 0 || new_capacity != malloced_capacity) {
+        malloced = ::realloc(malloced, new_capacity ? new_capacity : newsize);
+        if (malloced==nullptr) {
+            throw std::bad_alloc();
+        }
     }
     sbuf_t *ret = new sbuf_t(pos0, nullptr,
                              static_cast<const uint8_t *>(malloced), newsize, newsize,
                              0, flags);
     ret->malloced = malloced;           // ret will delete it
+    ret->malloced_capacity = new_capacity;
+    ret->malloced_size = new_capacity ? new_capacity : newsize;
+    malloced_memory.add(ret->malloced_size);
+    malloced_memory.sub(malloced_size);
     malloced = nullptr;                 // prevent double deletion
     delete this;                        // this is a move
     return ret;
@@ -189,7 +214,7 @@ sbuf_t *sbuf_t::realloc(size_t newsize)
 
 /** Allocate a subset of an sbuf's memory to a child sbuf.
  * from within an existing sbuf.
- * The allocated buf MUST be freed before the parent, since no copy is made...
+ * No copy is made; the child holds a reference to the owner of the memory.
  */
 sbuf_t *sbuf_t::new_slice(size_t off, size_t len) const
 {
@@ -269,6 +294,9 @@ sbuf_t* sbuf_t::map_file(const std::filesystem::path fname) {
 
 #ifdef HAVE_MMAP
     uint8_t* mbuf = (uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_FILE | MAP_SHARED, mfd, 0);
+#ifdef HAVE_MADVISE
+    madvise(mbuf, st.st_size, MADV_SEQUENTIAL); // scanned front to back; see image_reader.h for large files
+#endif
 #else
     mmalloced = malloc(st.st_size);
     if (mmalloced == nullptr) { /* malloc failed */
@@ -297,10 +325,37 @@ sbuf_t* sbuf_t::map_file(const std::filesystem::path fname) {
  */
 sbuf_t* sbuf_t::sbuf_malloc(pos0_t pos0_, size_t len_)
 {
-    void *new_malloced = malloc(len_);
+    return sbuf_malloc(pos0_, len_, len_);
+}
+
+sbuf_t* sbuf_t::sbuf_malloc(pos0_t pos0_, size_t len_, size_t pagesize_, size_t alignment_)
+{
+    if (pagesize_ > len_) {
+        throw std::runtime_error("sbuf_t::sbuf_malloc: pagesize > len");
+    }
+    void *new_malloced = nullptr;
+    size_t capacity = 0;
+    size_t alloc_len = len_;
+    if (alignment_ > 0) {
+        alloc_len = std::max((len_ + alignment_ - 1) / alignment_ * alignment_, alignment_);
+        alloc_profile::record(alloc_len);
+#ifdef HAVE_POSIX_MEMALIGN
+        if (posix_memalign(&new_malloced, alignment_, alloc_len) != 0) new_malloced = nullptr;
+#else
+        new_malloced = aligned_alloc(alignment_, alloc_len);
+#endif
+    } else {
+        new_malloced = sbuf_pool::alloc_buffer(len_, capacity);
+    }
+    if (new_malloced == nullptr) {
+        throw std::bad_alloc();
+    }
     sbuf_t *ret = new sbuf_t(pos0_, nullptr,
-                             static_cast<const uint8_t *>(new_malloced), len_, len_, NO_FD, flags_t());
+                             static_cast<const uint8_t *>(new_malloced), len_, pagesize_, NO_FD, flags_t());
     ret->malloced = new_malloced;
+    ret->malloced_capacity = capacity;
+    ret->malloced_size = capacity ? capacity : alloc_len;
+    malloced_memory.add(ret->malloced_size);
     ret->buf_writable = static_cast<uint8_t *>(new_malloced);
     return ret;
 }
@@ -317,6 +372,12 @@ void sbuf_t::wbuf(size_t i, uint8_t val)
         throw std::runtime_error("Attempt to write sbuf i>bufsize");
     }
     buf_writable[i] = val;
+    /* Writable sbufs are filled before they are shared, so the caches can be reset without the lock */
+    digests.valid = 0;
+    page_class.valid = false;
+    profile.reset();
+    block_profile.reset();
+    shadow.reset();
 }
 
 /**
@@ -443,16 +504,180 @@ void sbuf_t::hex_dump(std::ostream& os) const { hex_dump(os, 0, bufsize); }
 #define NSRL_HEXBUF_SPACE4 0x04
 #endif
 
-/* Determine if the sbuf consists of a repeating ngram */
-size_t sbuf_t::find_ngram_size(const size_t max_ngram) const {
+/* Determine if the sbuf consists of a repeating ngram.
+ * A page is made of an ngram of size n exactly when it equals itself shifted by n bytes, which memcmp()
+ * checks with the C library's vectorized compare. Testing the first few bytes first means that only
+ * the real candidates are compared over the whole page, so a page is usually read about once.
+ */
+static bool all_bytes_equal(const uint8_t* buf, size_t len, uint8_t val) {
+    const uint64_t pattern = uint64_t(val) * 0x0101010101010101ULL;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w[4];
+        memcpy(w, buf + i, sizeof(w));
+        if (((w[0] ^ pattern) | (w[1] ^ pattern) | (w[2] ^ pattern) | (w[3] ^ pattern)) != 0) return false;
+    }
+    for (; i < len; i++) {
+        if (buf[i] != val) return false;
+    }
+    return true;
+}
+
+sbuf_t::page_class_t sbuf_t::classify_page(const size_t max_ngram) const {
+    const sbuf_t* owner = digest_owner(CACHE_PAGE);
+    {
+        const std::lock_guard<std::mutex> lock(owner->Mhash);
+        /* A cached ngram is the page's smallest one, so it answers any limit; "none" answers smaller limits */
+        const page_class_cache_t& c = owner->page_class;
+        if (c.valid && (c.result.ngram_size > 0 || max_ngram <= c.max_ngram)) {
+            page_class_t ret = c.result;
+            if (ret.ngram_size >= max_ngram) ret.ngram_size = 0;
+            return ret;
+        }
+    }
+
+    const size_t len = std::min(pagesize, bufsize);
+    page_class_t ret;
+    ret.constant = len > 0 && all_bytes_equal(buf, len, buf[0]);
+    ret.all_zero = ret.constant && buf[0] == 0;
+
+    static const size_t PROBE = 64;
     for (size_t ngram_size = 1; ngram_size < max_ngram; ngram_size++) {
-        bool ngram_match = true;
-        for (size_t i = ngram_size; i < pagesize && ngram_match; i++) {
-            if ((*this)[i % ngram_size] != (*this)[i]) ngram_match = false;
+        if (ngram_size == 1 || ngram_size >= len) {
+            /* a constant page is a 1-gram; a page no longer than the ngram trivially matches */
+            if (ret.constant || ngram_size >= len) {
+                ret.ngram_size = ngram_size;
+                break;
+            }
+            continue;
+        }
+        const size_t cmp_len = len - ngram_size;
+        if (::memcmp(buf, buf + ngram_size, std::min(cmp_len, PROBE)) != 0) continue;
+        if (cmp_len <= PROBE || ::memcmp(buf + PROBE, buf + ngram_size + PROBE, cmp_len - PROBE) == 0) {
+            ret.ngram_size = ngram_size;
+            break;
+        }
+    }
+
+    const std::lock_guard<std::mutex> lock(owner->Mhash);
+    owner->page_class.valid = true;
+    owner->page_class.max_ngram = max_ngram;
+    owner->page_class.result = ret;
+    return ret;
+}
+
+const byte_profile_t& sbuf_t::byte_profile() const {
+    const sbuf_t* owner = digest_owner(CACHE_PAGE);
+    {
+        const std::lock_guard<std::mutex> lock(owner->Mhash);
+        if (owner->profile) return *owner->profile;
+    }
+    auto p = std::make_unique<byte_profile_t>(buf, std::min(pagesize, bufsize));
+    const std::lock_guard<std::mutex> lock(owner->Mhash);
+    if (!owner->profile) owner->profile = std::move(p); // unless another thread got there first
+    return *owner->profile;
+}
+
+/* The page's profile is the sum of the blocks', so it is made at the same time if it isn't cached */
+const std::vector<sbuf_t::block_profile_t>& sbuf_t::block_profiles() const {
+    const sbuf_t* owner = digest_owner(CACHE_PAGE);
+    bool need_page = true;
+    {
+        const std::lock_guard<std::mutex> lock(owner->Mhash);
+        if (owner->block_profile) return *owner->block_profile;
+        need_page = owner->profile == nullptr;
+    }
+    const size_t len = std::min(pagesize, bufsize);
+    auto blocks = std::make_unique<std::vector<block_profile_t>>();
+    blocks->reserve((len + PROFILE_BLOCK - 1) / PROFILE_BLOCK);
+    auto page = need_page ? std::make_unique<byte_profile_t>() : nullptr;
+    for (size_t start = 0; start < len; start += PROFILE_BLOCK) {
+        const byte_profile_t bp(buf + start, std::min(PROFILE_BLOCK, len - start));
+        block_profile_t b;
+        b.entropy = bp.entropy;
+        b.len = bp.total;
+        b.text = bp.text;
+        b.zero = bp.zero;
+        b.high = bp.high;
+        blocks->push_back(b);
+        if (page) {
+            for (size_t i = 0; i < 256; i++) page->counts[i] += bp.counts[i];
         }
-        if (ngram_match) return ngram_size;
     }
-    return 0; // no ngram size
+    if (page) page->finish();
+    const std::lock_guard<std::mutex> lock(owner->Mhash);
+    if (page && !owner->profile) owner->profile = std::move(page);
+    if (!owner->block_profile) owner->block_profile = std::move(blocks);
+    return *owner->block_profile;
+}
+
+/* ASCII is copied a vector at a time; a run of it needs only one span, since each byte in it is one code unit */
+const sbuf_t::utf16_shadow_t& sbuf_t::utf16_shadow() const {
+    const sbuf_t* owner = digest_owner(CACHE_PAGE_POS0);
+    {
+        const std::lock_guard<std::mutex> lock(owner->Mhash);
+        if (owner->shadow) return *owner->shadow;
+    }
+    auto sh = std::make_unique<utf16_shadow_t>();
+    const size_t units = bufsize / 2;
+    const size_t page_units = (std::min(pagesize, bufsize) + 1) / 2;
+    std::string out(3 * units, '\0'); // a code unit is at most 3 bytes of UTF-8, and a surrogate pair 4
+    const view_t v = view();
+    size_t o = 0;
+    size_t shadow_pagesize = std::string::npos;
+    for (size_t i = 0; i < units;) {
+        if (shadow_pagesize == std::string::npos && i >= page_units) shadow_pagesize = o;
+        size_t run = utf16_ascii_run(buf + 2 * i, units - i, true, &out[o]);
+        while (i + run < units && v.u16(2 * (i + run)) == 0) { // the SIMD runs stop at NULs
+            out[o + run] = '\0';
+            run += 1 + utf16_ascii_run(buf + 2 * (i + run + 1), units - i - run - 1, true, &out[o + run + 1]);
+        }
+        if (run > 0) {
+            if (sh->spans.empty() || !sh->spans.back().ascii) sh->spans.push_back(utf16_shadow_t::span_t{o, 2 * i, true});
+            if (shadow_pagesize == std::string::npos && i + run > page_units) shadow_pagesize = o + page_units - i;
+            i += run;
+            o += run;
+            continue;
+        }
+        sh->spans.push_back(utf16_shadow_t::span_t{o, 2 * i, false});
+        uint32_t cp = v.u16(2 * i);
+        i++;
+        if (cp >= 0xD800 && cp <= 0xDBFF && i < units) {
+            const uint32_t lo = v.u16(2 * i);
+            if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                i++;
+            }
+        }
+        if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD; // unpaired surrogate
+        if (cp < 0x800) {
+            out[o++] = static_cast<char>(0xC0 | (cp >> 6));
+        } else if (cp < 0x10000) {
+            out[o++] = static_cast<char>(0xE0 | (cp >> 12));
+            out[o++] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        } else {
+            out[o++] = static_cast<char>(0xF0 | (cp >> 18));
+            out[o++] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out[o++] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        }
+        out[o++] = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    if (shadow_pagesize == std::string::npos) shadow_pagesize = o;
+    sbuf_t* sb = sbuf_malloc(pos0, o, shadow_pagesize);
+    if (o > 0) memcpy(sb->malloc_buf(), out.data(), o);
+    sh->sbuf.reset(sb);
+
+    const std::lock_guard<std::mutex> lock(owner->Mhash);
+    if (!owner->shadow) owner->shadow = std::move(sh); // unless another thread got there first
+    return *owner->shadow;
+}
+
+size_t sbuf_t::utf16_shadow_t::offset_of(size_t i) const {
+    auto it = std::upper_bound(spans.begin(), spans.end(), i,
+                               [](size_t utf8, const span_t& span) { return utf8 < span.utf8; });
+    if (it == spans.begin()) return 0;
+    --it;
+    return it->ascii ? it->offset + 2 * (i - it->utf8) : it->offset;
 }
 
 bool sbuf_t::getline(size_t& pos, size_t& line_start, size_t& line_len) const
@@ -497,6 +722,13 @@ ssize_t sbuf_t::find(const char* str, size_t start ) const
     return -1;
 }
 
+std::vector<multi_pattern::hit_t> sbuf_t::find_all(const multi_pattern& patterns) const
+{
+    std::vector<multi_pattern::hit_t> hits;
+    patterns.search(buf, bufsize, pagesize, hits);
+    return hits;
+}
+
 std::ostream& operator<<(std::ostream& os, const sbuf_t& t) {
     os << "sbuf[pos0=" << t.pos0 << " " << "buf[0..8]=0x";
 
@@ -561,47 +793,14 @@ void sbuf_t::getUTF8(size_t i, std::string& utf8_string) const {
  * Read the requested number of UTF-16 format code units into wstring including any \U0000.
  */
 void sbuf_t::getUTF16(size_t i, size_t num_code_units_requested, std::wstring& utf16_string) const {
-    // clear any residual value
-    utf16_string = std::wstring();
-
-    if (i >= bufsize) {
-        // past EOF
-        return;
-    }
-    if (i + num_code_units_requested * 2 + 1 > bufsize) {
-        // clip at EOF
-        num_code_units_requested = ((bufsize - 1) - i) / 2;
-    }
-    // NOTE: we can't use wstring constructor because we require 16 bits,
-    // not whatever sizeof(wchar_t) is.
-    // utf16_string = std::wstring((const char *)buf+i,num_code_units_requested);
-
-    // get code units individually
-    for (size_t j = 0; j < num_code_units_requested; j++) { utf16_string.push_back(get16u(i + j * 2)); }
+    getUTF16(i, num_code_units_requested, BO_LITTLE_ENDIAN, utf16_string);
 }
 
 /**
  * Read UTF-16 format code units into wstring up to but not including \U0000.
  */
 void sbuf_t::getUTF16(size_t i, std::wstring& utf16_string) const {
-    // clear any residual value
-    utf16_string = std::wstring();
-
-    // read the code units
-    size_t off;
-    for (off = i; off < bufsize - 1; off += 2) {
-        uint16_t code_unit = get16u(off);
-        // cout << "sbuf.cpp getUTF16 i: " << i << " code unit: " << code_unit << "\n";
-
-        // stop before \U0000
-        if (code_unit == 0) {
-            // at \U0000
-            break;
-        }
-
-        // accept the code unit
-        utf16_string.push_back(code_unit);
-    }
+    getUTF16(i, BO_LITTLE_ENDIAN, utf16_string);
 }
 
 /**
@@ -622,10 +821,9 @@ void sbuf_t::getUTF16(size_t i, size_t num_code_units_requested, byte_order_t bo
     }
     // NOTE: we can't use wstring constructor because we require 16 bits,
     // not whatever sizeof(wchar_t) is.
-    // utf16_string = std::wstring((const char *)buf+i,num_code_units_requested);
-
-    // get code units individually
-    for (size_t j = 0; j < num_code_units_requested; j++) { utf16_string.push_back(get16u(i + j, bo)); }
+    const view_t v = view(i, num_code_units_requested * 2);
+    utf16_string.resize(num_code_units_requested);
+    for (size_t j = 0; j < num_code_units_requested; j++) { utf16_string[j] = v.u16(j * 2, bo); }
 }
 
 /**
@@ -634,31 +832,145 @@ void sbuf_t::getUTF16(size_t i, size_t num_code_units_requested, byte_order_t bo
 void sbuf_t::getUTF16(size_t i, byte_order_t bo, std::wstring& utf16_string) const {
     // clear any residual value
     utf16_string = std::wstring();
+    if (i >= bufsize) return;
 
     // read the code units
-    size_t off;
-    for (off = i; off < bufsize - 1; off += 2) {
-        uint16_t code_unit = get16u(off, bo);
-        // cout << "sbuf.cpp getUTF16 i: " << i << " code unit: " << code_unit << "\n";
+    const view_t v = view(i, (bufsize - i) & ~size_t(1));
+    for (size_t off = 0; off < v.size(); off += 2) {
+        uint16_t code_unit = v.u16(off, bo);
 
         // stop before \U0000
         if (code_unit == 0) {
-            // at \U0000
             break;
         }
-
-        // accept the code unit
         utf16_string.push_back(code_unit);
     }
 }
 
-std::string sbuf_t::hash() const {
-    const std::lock_guard<std::mutex> lock(Mhash); // protect this function
-    if (hash_.size() == 0) {
-        /* hasn't been hashed yet, so hash it */
-        hash_ = dfxml::sha1_generator::hash_buf(buf, bufsize).hexdigest();
+/****************************************************************
+ *** view_t
+ ****************************************************************/
+
+void sbuf_t::view_t::copy16(size_t i, size_t n, uint16_t* out, byte_order_t bo) const {
+    assert(i + n * 2 <= len);
+    memcpy(out, p + i, n * 2);
+#ifdef BE13_API_BIGENDIAN
+    const bool swapped = (bo == BO_LITTLE_ENDIAN);
+#else
+    const bool swapped = (bo == BO_BIG_ENDIAN);
+#endif
+    if (swapped) {
+        for (size_t j = 0; j < n; j++) { out[j] = swap(out[j]); }
     }
-    return hash_;
+}
+
+std::string sbuf_t::view_t::utf16_to_utf8(size_t i, size_t n, byte_order_t bo, bool stop_at_nul) const {
+    assert(i + n * 2 <= len);
+    std::string ret;
+    ret.reserve(n); // exact for ASCII, which is the common case
+    for (size_t j = 0; j < n; j++) {
+        uint32_t cp = u16(i + j * 2, bo);
+        if (cp == 0 && stop_at_nul) break;
+        if (cp < 0x80) { // ASCII fast path
+            ret.push_back(static_cast<char>(cp));
+            continue;
+        }
+        if (cp >= 0xD800 && cp <= 0xDBFF && j + 1 < n) {
+            const uint32_t lo = u16(i + (j + 1) * 2, bo);
+            if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                j++;
+            }
+        }
+        if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD; // unpaired surrogate
+        if (cp < 0x800) {
+            ret.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        } else if (cp < 0x10000) {
+            ret.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            ret.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        } else {
+            ret.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            ret.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            ret.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        }
+        ret.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+    return ret;
+}
+
+/****************************************************************
+ *** Digests
+ ****************************************************************/
+
+sbuf_t::digest_algorithm_t sbuf_t::digest_algorithm_for_name(const std::string& name) {
+    if (name == "md5" || name == "MD5") return DIGEST_MD5;
+    if (name == "sha1" || name == "SHA1" || name == "sha-1" || name == "SHA-1") return DIGEST_SHA1;
+    if (name == "sha256" || name == "SHA256" || name == "sha-256" || name == "SHA-256") return DIGEST_SHA256;
+    if (name == "fast") return DIGEST_FAST;
+    return DIGEST_NONE;
+}
+
+/* A slice that is exactly its parent's buffer has the parent's digests */
+const sbuf_t* sbuf_t::digest_owner(cache_key_t key) const {
+    const sbuf_t* owner = this;
+    while (owner->parent && owner->parent->buf == owner->buf && owner->parent->bufsize == owner->bufsize &&
+           (key == CACHE_BYTES || owner->parent->pagesize == pagesize) &&
+           (key != CACHE_PAGE_POS0 || owner->parent->pos0 == pos0)) {
+        owner = owner->parent;
+    }
+    return owner;
+}
+
+void sbuf_t::compute_digests(unsigned int algorithms) const {
+    const sbuf_t* owner = digest_owner();
+    const std::lock_guard<std::mutex> lock(owner->Mhash); // protect this function
+    algorithms &= ~owner->digests.valid;
+    if (algorithms == 0) return;
+
+    dfxml::md5_generator md5;
+    dfxml::sha1_generator sha1;
+    dfxml::sha256_generator sha256;
+    fast_hasher fast;
+
+    /* Chunks are small enough to stay in cache while each digest reads them, and a multiple of
+     * fast_hasher::BLOCK.
+     */
+    static const size_t CHUNK = 64 * 1024;
+    for (size_t off = 0; off < bufsize; off += CHUNK) {
+        const size_t len = std::min(CHUNK, bufsize - off);
+        if (algorithms & DIGEST_MD5) md5.update(buf + off, len);
+        if (algorithms & DIGEST_SHA1) sha1.update(buf + off, len);
+        if (algorithms & DIGEST_SHA256) sha256.update(buf + off, len);
+        if (algorithms & DIGEST_FAST) fast.update(buf + off, len);
+    }
+    if (algorithms & DIGEST_MD5) owner->digests.md5 = md5.digest().hexdigest();
+    if (algorithms & DIGEST_SHA1) owner->digests.sha1 = sha1.digest().hexdigest();
+    if (algorithms & DIGEST_SHA256) owner->digests.sha256 = sha256.digest().hexdigest();
+    if (algorithms & DIGEST_FAST) owner->digests.fast = fast.digest();
+    owner->digests.valid |= algorithms;
+}
+
+std::string sbuf_t::hexdigest(digest_algorithm_t algorithm) const {
+    compute_digests(algorithm);
+    const sbuf_t* owner = digest_owner();
+    const std::lock_guard<std::mutex> lock(owner->Mhash);
+    switch (algorithm) {
+    case DIGEST_MD5: return owner->digests.md5;
+    case DIGEST_SHA1: return owner->digests.sha1;
+    case DIGEST_SHA256: return owner->digests.sha256;
+    case DIGEST_FAST: return owner->digests.fast.hexdigest();
+    default: throw std::runtime_error("sbuf_t::hexdigest: invalid digest algorithm");
+    }
+}
+
+bool sbuf_t::has_digest(digest_algorithm_t algorithm) const {
+    const sbuf_t* owner = digest_owner();
+    const std::lock_guard<std::mutex> lock(owner->Mhash);
+    return (owner->digests.valid & algorithm) != 0;
+}
+
+std::string sbuf_t::hash() const {
+    return hexdigest(DIGEST_SHA1);
 }
 
 /* Similar to above, but does not cache */
@@ -666,8 +978,14 @@ std::string sbuf_t::hash(hash_func_t func) const {
     return func(buf, bufsize);
 }
 
+hash128_t sbuf_t::fast_hash() const {
+    compute_digests(DIGEST_FAST);
+    const sbuf_t* owner = digest_owner();
+    const std::lock_guard<std::mutex> lock(owner->Mhash);
+    return owner->digests.fast;
+}
+
 /* Report if the hash exists */
 bool sbuf_t::has_hash() const {
-    const std::lock_guard<std::mutex> lock(Mhash); // protect this function}
-    return (hash_.size() > 0 );
+    return has_digest(DIGEST_SHA1);
 }
@@ -35,14 +35,21 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "char_class.h"
+#include "fast_hash.h"
+#include "memory_counter.h"
+#include "multi_pattern.h"
 #include "pos0.h"
+#include "sbuf_pool.h"
 
 /*
  * NOTE: The crash identified in November 2019 was because access to
@@ -78,10 +85,18 @@
  * The subf_t class remembers how the sbuf_t was allocated and
  * automatically frees whatever resources are needed when it is freed.
  *
- * \warning DANGER: You must delete sbuf_t structures First-In,
- * Last-out, otherwise bad things can happen. (For example, if you
- * make a subset sbuf_t from a mapped file and unmap the file, the
- * subset will now point to unallocated memory.)
+ * Every child sbuf_t holds a reference to the sbuf_t whose memory it
+ * uses. An sbuf_t that was allocated with new (or one of the static
+ * allocators) and may still have children should be given up with
+ * release() rather than delete; it and its memory are freed when the
+ * last child is deleted, which may be on another thread. This lets a
+ * slice be queued or handed to another thread without a copy.
+ *
+ * \warning Stack-allocated sbuf_t structures, and heap-allocated ones
+ * that are deleted rather than released, must still be deleted
+ * First-In, Last-out. (For example, if you make a subset sbuf_t from
+ * a mapped file and unmap the file, the subset will now point to
+ * unallocated memory.)
  */
 class sbuf_t {
 public:
@@ -117,9 +132,13 @@ public:
     /* Allocate writable memory, with buf[0] being at pos0_..
      * Throws std::bad_alloc() if memory is not available.
      * Use malloc_buf() to get the buffer.
-     * Data is automatically freed when deleted.
+     * Data is automatically freed when deleted. The memory comes from sbuf_pool (see sbuf_pool.h).
      */
     static sbuf_t* sbuf_malloc(const pos0_t pos0_, size_t len_ );
+    /* As above, with page data followed by a margin. If alignment_>0, the buffer is aligned to it and
+     * malloc_buf() has room for len_ rounded up to a multiple of it (for O_DIRECT reads).
+     */
+    static sbuf_t* sbuf_malloc(const pos0_t pos0_, size_t len_, size_t pagesize_, size_t alignment_ = 0);
     void *malloc_buf() const;        // the writable buf
     void wbuf(size_t i, uint8_t val);   // write to location i with val
     // the following must be used like this:
@@ -152,12 +171,21 @@ public:
      *** Child allocators --- allocate an sbuf from another sbuf
      ****************************************************************/
 
-    /** Move constructor is properly implemented. */
+    /** Move constructor is properly implemented. We take over that's reference to its parent and its memory. */
     sbuf_t(sbuf_t&& that) noexcept
-        : pos0(that.pos0), bufsize(that.bufsize), pagesize(that.pagesize),
-          parent(that.parent), buf(that.buf), malloced(that.malloced) {
-        parent->del_child(that);
-        parent->add_child(*this);
+        : pos0(that.pos0), bufsize(that.bufsize), pagesize(that.pagesize), flags(that.flags),
+          fd(that.fd), parent(that.parent), buf(that.buf), malloced(that.malloced),
+          malloced_capacity(that.malloced_capacity), malloced_size(that.malloced_size), buf_writable(that.buf_writable) {
+        digests = that.digests;
+        page_class = that.page_class;
+        profile = std::move(that.profile);
+        block_profile = std::move(that.block_profile);
+        shadow = std::move(that.shadow);
+        that.fd = 0;
+        that.parent = nullptr;
+        that.malloced = nullptr;
+        that.buf_writable = nullptr;
+        sbuf_count += 1;
     }
 
     /**
@@ -172,8 +200,9 @@ public:
 #endif
 
     /** Allocate a subset of an sbuf's memory to a child sbuf.  from
-     * within an existing sbuf.  The allocated buf MUST be freed
-     * before the parent, since no copy is made.
+     * within an existing sbuf.  No copy is made; the child holds a
+     * reference to the sbuf that owns the memory, so the owner must be
+     * deleted after the child or given up with release().
      *
      * slice() returns an object on the stack.
      *
@@ -191,6 +220,10 @@ public:
     sbuf_t slice(size_t off) const;
     sbuf_t *new_slice(size_t off) const; // allocates; must be deleted
     virtual ~sbuf_t();
+
+    /* sbuf_t objects are recycled by sbuf_pool */
+    static void* operator new(size_t size) { return sbuf_pool::alloc_object(size); }
+    static void operator delete(void* ptr, size_t size) { sbuf_pool::free_object(ptr, size); }
     sbuf_t operator+(size_t off) const { return slice(off); }
 
     inline static const std::string U10001C = "\xf4\x80\x80\x9c"; // default delimeter character in bulk_extractor
@@ -207,8 +240,14 @@ public:
     size_t left(size_t n) const { return n < bufsize ? bufsize - n : 0; }; // how much space is left at n
 
     /* Child management */
-    void add_child(const sbuf_t& child) const; //
-    void del_child(const sbuf_t& child) const; //
+    void add_child(const sbuf_t& child) const; // child takes a reference
+    void del_child(const sbuf_t& child) const; // child drops its reference; frees us if we were released
+
+    /* Give up the creator's reference to a heap-allocated sbuf. It is deleted now if it has no children,
+     * otherwise when the last child is deleted. The caller must not use the sbuf afterwards.
+     */
+    void release() const;
+    int reference_count() const { return references; } // the creator's, if not released, plus one per child
 
     /* Forensic API */
     /** Find the offset of a byte */
@@ -224,8 +263,54 @@ public:
 
     std::string asString() const { return std::string((reinterpret_cast<const char*>(buf)), bufsize); }
 
-    /* return true if the sbuf consists solely of ngrams */
-    size_t find_ngram_size(size_t max_ngram) const;
+    /* Classify the page (the first pagesize bytes): constant, all zero, or a repeating ngram.
+     * The result is cached, so the dispatcher and the scanners can all ask for it.
+     */
+    struct page_class_t {
+        size_t ngram_size{0};    // smallest repeating ngram shorter than max_ngram, or 0 if none
+        bool constant{false};    // every byte is the same (and non-empty)
+        bool all_zero{false};    // every byte is zero (and non-empty)
+    };
+    page_class_t classify_page(size_t max_ngram) const;
+
+    /* return the size of the repeating ngram that the page consists of, or 0 if none */
+    size_t find_ngram_size(size_t max_ngram) const { return classify_page(max_ngram).ngram_size; }
+
+    /* The byte profile (see char_class.h) of the page, and a summary of it for each PROFILE_BLOCK bytes
+     * of the page. Each is computed on first use and cached, like classify_page().
+     */
+    static inline const size_t PROFILE_BLOCK = 4096;
+    struct block_profile_t {
+        float entropy{0};  // bits per byte
+        uint16_t len{0};   // PROFILE_BLOCK, except for the last block
+        uint16_t text{0};  // bytes of each kind; see byte_profile_t
+        uint16_t zero{0};
+        uint16_t high{0};
+        bool looks_random() const { return len > 0 && entropy >= byte_profile_t::RANDOM_ENTROPY; }
+        bool looks_text() const { return len > 0 && text >= byte_profile_t::TEXT_FRACTION * len; }
+    };
+    const byte_profile_t& byte_profile() const;
+    const std::vector<block_profile_t>& block_profiles() const;
+
+    /* The buffer read as UTF-16LE and transcoded to UTF-8, for scanners that look for text in both encodings.
+     * It is made on first use and cached, like byte_profile(), so the scanners of a page share one transcoding.
+     * Every code unit at an even offset is converted, NULs included; unpaired surrogates become U+FFFD and an odd
+     * trailing byte is dropped. sbuf has this sbuf's pos0, and its pagesize ends at the character that the page
+     * ends at; a feature found at i in it is at pos0_of(i) in this sbuf.
+     */
+    struct utf16_shadow_t {
+        std::unique_ptr<const sbuf_t> sbuf{};
+        /* Where each run of ASCII (one byte per code unit) and each other character starts */
+        struct span_t {
+            size_t utf8{0};         // in sbuf
+            size_t offset{0};       // in the UTF-16 sbuf
+            bool ascii{false};
+        };
+        std::vector<span_t> spans{};
+        size_t offset_of(size_t i) const; // where the code unit of sbuf[i] starts in the UTF-16 sbuf
+        pos0_t pos0_of(size_t i) const { return sbuf->pos0 + offset_of(i); }
+    };
+    const utf16_shadow_t& utf16_shadow() const;
 
     /* get the next line line from the sbuf.
      * @param pos  - on entry, current position. On exit, new position.
@@ -413,6 +498,74 @@ public:
     int64_t get64i(size_t i, sbuf_t::byte_order_t bo) const { return bo == BO_LITTLE_ENDIAN ? get64u(i) : get64uBE(i); }
     /** @} */
 
+    /**
+     * \name typed views
+     * @{
+     * view(off, len) checks once that [off, off+len) is in the buffer (or throws sbuf_range_exception)
+     * and returns a view_t whose readers do no further checking. Use it to parse a structure whose
+     * size is known: check the structure once, then read its fields. The readers take offsets
+     * relative to the view; an out-of-range offset is caught by assert() in debug builds only.
+     */
+    class view_t {
+        const uint8_t* p{nullptr};
+        size_t len{0};
+        template <typename T> T load(size_t i) const {
+            assert(i + sizeof(T) <= len);
+            T v;
+            memcpy(&v, p + i, sizeof(T)); // unaligned-safe; compiles to a single load
+            return v;
+        }
+        static uint16_t swap(uint16_t v) { return __builtin_bswap16(v); }
+        static uint32_t swap(uint32_t v) { return __builtin_bswap32(v); }
+        static uint64_t swap(uint64_t v) { return __builtin_bswap64(v); }
+#ifdef BE13_API_BIGENDIAN
+        template <typename T> T le(T v) const { return swap(v); }
+        template <typename T> T be(T v) const { return v; }
+#else
+        template <typename T> T le(T v) const { return v; }
+        template <typename T> T be(T v) const { return swap(v); }
+#endif
+
+    public:
+        view_t(const uint8_t* p_, size_t len_) : p(p_), len(len_) {}
+        size_t size() const { return len; }
+        const uint8_t* data() const { return p; }
+        view_t subview(size_t off, size_t n) const { // checked
+            if (off > len || n > len - off) throw sbuf_t::range_exception_t(off, n);
+            return view_t(p + off, n);
+        }
+
+        uint8_t u8(size_t i) const { return load<uint8_t>(i); }
+        uint16_t u16(size_t i) const { return le(load<uint16_t>(i)); }
+        uint32_t u32(size_t i) const { return le(load<uint32_t>(i)); }
+        uint64_t u64(size_t i) const { return le(load<uint64_t>(i)); }
+        uint16_t u16BE(size_t i) const { return be(load<uint16_t>(i)); }
+        uint32_t u32BE(size_t i) const { return be(load<uint32_t>(i)); }
+        uint64_t u64BE(size_t i) const { return be(load<uint64_t>(i)); }
+        uint16_t u16(size_t i, byte_order_t bo) const { return bo == BO_LITTLE_ENDIAN ? u16(i) : u16BE(i); }
+        uint32_t u32(size_t i, byte_order_t bo) const { return bo == BO_LITTLE_ENDIAN ? u32(i) : u32BE(i); }
+        uint64_t u64(size_t i, byte_order_t bo) const { return bo == BO_LITTLE_ENDIAN ? u64(i) : u64BE(i); }
+        int8_t i8(size_t i) const { return u8(i); }
+        int16_t i16(size_t i, byte_order_t bo = BO_LITTLE_ENDIAN) const { return u16(i, bo); }
+        int32_t i32(size_t i, byte_order_t bo = BO_LITTLE_ENDIAN) const { return u32(i, bo); }
+        int64_t i64(size_t i, byte_order_t bo = BO_LITTLE_ENDIAN) const { return u64(i, bo); }
+
+        /* Copy n 16-bit code units starting at i into out, in host byte order */
+        void copy16(size_t i, size_t n, uint16_t* out, byte_order_t bo = BO_LITTLE_ENDIAN) const;
+
+        /* Convert n UTF-16 code units starting at i to UTF-8. Surrogate pairs are combined;
+         * unpaired surrogates become U+FFFD. Conversion stops at a U+0000 if stop_at_nul.
+         */
+        std::string utf16_to_utf8(size_t i, size_t n, byte_order_t bo = BO_LITTLE_ENDIAN,
+                                  bool stop_at_nul = false) const;
+    };
+    view_t view(size_t off, size_t len) const {
+        if (off > bufsize || len > bufsize - off) throw sbuf_t::range_exception_t(off, len);
+        return view_t(buf + off, len);
+    }
+    view_t view() const { return view_t(buf, bufsize); } // the whole buffer
+    /** @} */
+
     /**
      * \name string readers
      * @{
@@ -455,6 +608,13 @@ public:
      * This would benefit from a boyer-Moore implementation
      */
     ssize_t find(const char* str, size_t start = 0) const;
+
+    /**
+     * Find every occurrence of all of the patterns in a compiled multi_pattern, in one pass.
+     * Like features, a match is reported if it starts in the page; it may continue into the margin.
+     * Hits are in order of offset.
+     */
+    std::vector<multi_pattern::hit_t> find_all(const multi_pattern& patterns) const;
     const std::string substr(size_t loc, size_t len) const;     // make a substring
     bool is_constant(size_t loc, size_t len, uint8_t ch) const; // verify that it's constant
     bool is_constant(uint8_t ch) const { return is_constant(0, this->pagesize, ch); }
@@ -472,6 +632,18 @@ public:
     std::string hash() const;           //  default hasher (currently SHA1); caches results
     std::string hash(hash_func_t func) const; // hash with this hash func; does not cache
     bool has_hash() const;                    // report if hash has already been computed
+    hash128_t fast_hash() const;              // non-cryptographic hash for de-duplication; see fast_hash.h; caches
+
+    /* Digests are computed at most once per sbuf and cached. compute_digests() computes any number of them
+     * in a single pass over the buffer, a chunk at a time, so the data is only read from memory once.
+     * A slice that covers all of its parent's buffer shares the parent's cache.
+     */
+    enum digest_algorithm_t { DIGEST_NONE = 0, DIGEST_MD5 = 0x01, DIGEST_SHA1 = 0x02, DIGEST_SHA256 = 0x04,
+                              DIGEST_FAST = 0x08 };
+    static digest_algorithm_t digest_algorithm_for_name(const std::string& name); // DIGEST_NONE if unknown
+    void compute_digests(unsigned int algorithms) const; // bitmask of digest_algorithm_t; skips cached ones
+    std::string hexdigest(digest_algorithm_t algorithm) const;
+    bool has_digest(digest_algorithm_t algorithm) const;
 
     /**
      * These are largely for debugging, but they also support the BEViewer.
@@ -497,7 +669,18 @@ public:
         return hp;
     }
 
+    /* If the data is a mapped file (see map_file()), the file's descriptor and the offset of buf[0] in it.
+     * The descriptor is closed when the mapping sbuf is deleted; dup() it to keep it longer.
+     */
+    bool file_extent(int& fd_, uint64_t& offset_) const;
+
     static std::atomic<int> sbuf_count;   // how many are in use
+    /* The bytes of all the live sbufs' buffers: mapped files (see map_file()) and allocations (sbuf_malloc()).
+     * Slices and sbufs made over memory that the caller owns are not counted.
+     */
+    static memory_counter mapped_memory;
+    static memory_counter malloced_memory;
+    size_t memory_bytes() const { return malloced ? malloced_size : (fd > 0 ? bufsize : 0); } // what this sbuf counts
     mutable std::atomic<int> children{0}; // number of child sbufs; incremented when data in *buf is used by a child
 private:
     // explicit allocation is only allowed in internal implementation
@@ -507,18 +690,41 @@ private:
 
 
     /* The private structures keep track of memory management */
-    mutable std::atomic<int> references{0}; // when goes to zero, automatically free
+    mutable std::atomic<int> references{1}; // creator + children; when it goes to zero, automatically free
     int fd{0};                     // if fd>0, unmap(buf) and close(fd) when sbuf is deleted.
     const sbuf_t* parent{nullptr}; // parent sbuf references data in another.
     mutable std::mutex Mhash{};    // mutext for hashing
-    mutable std::string hash_{};   // the hash of the sbuf data, or "" if it
-                                   // hasn't been hashed yet
+    struct digest_cache_t {
+        unsigned int valid{0};     // digest_algorithm_t bits that have been computed
+        std::string md5{};
+        std::string sha1{};
+        std::string sha256{};
+        hash128_t fast{};
+    };
+    mutable digest_cache_t digests{}; // protected by Mhash
+    struct page_class_cache_t {
+        bool valid{false};
+        size_t max_ngram{0};       // the search limit used for result
+        page_class_t result{};
+    };
+    mutable page_class_cache_t page_class{}; // protected by Mhash
+    mutable std::unique_ptr<byte_profile_t> profile{};                 // protected by Mhash
+    mutable std::unique_ptr<std::vector<block_profile_t>> block_profile{}; // protected by Mhash
+    mutable std::unique_ptr<utf16_shadow_t> shadow{};                  // protected by Mhash
+    /* The sbuf whose caches hold ours: a slice that covers all of its parent's buffer shares the parent's.
+     * The digests depend only on the bytes; the page caches also on pagesize, and the UTF-16 shadow also on
+     * pos0, so those are only shared with parents that have the same.
+     */
+    enum cache_key_t { CACHE_BYTES, CACHE_PAGE, CACHE_PAGE_POS0 };
+    const sbuf_t* digest_owner(cache_key_t key = CACHE_BYTES) const;
     /**
      * \deprecated
      * This field will be private in a future release of \b bulk_extractor.
      */
     const uint8_t* buf{nullptr};   // start of the buffer
     void* malloced{nullptr};       // malloced==buf if this was malloced and needs to be freed when sbuf is deleted.
+    size_t malloced_capacity{0};   // sbuf_pool size class of malloced, or 0 if it is not pooled
+    size_t malloced_size{0};       // the bytes of malloced counted in malloced_memory
     uint8_t* buf_writable{nullptr}; // if this is a writable buffer, buf_writable=buf
 
     sbuf_t(const sbuf_t& that) = delete;            // default copy is not implemented
@@ -0,0 +1,223 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "alloc_profile.h"
+#include "numa.h"
+#include "sbuf_pool.h"
+
+namespace {
+const unsigned int MIN_SHIFT = 10; // log2(MIN_POOLED)
+const unsigned int MAX_SHIFT = 26; // log2(MAX_POOLED)
+const unsigned int NCLASSES = MAX_SHIFT - MIN_SHIFT + 1;
+
+unsigned int class_index(size_t capacity) {
+    unsigned int i = 0;
+    while ((size_t(1) << (MIN_SHIFT + i)) < capacity) i++;
+    return i;
+}
+
+bool enabled_from_environment() {
+    const char* val = getenv("BE13_API_SBUF_POOL");
+    return val == nullptr || strcmp(val, "0") != 0;
+}
+
+std::atomic<bool> pool_enabled{enabled_from_environment()};
+std::atomic<uint64_t> buffer_hits{0};
+std::atomic<uint64_t> buffer_misses{0};
+std::atomic<uint64_t> object_hits{0};
+std::atomic<uint64_t> object_misses{0};
+std::atomic<uint64_t> bytes_cached{0};
+
+/* Shared by all threads. It is never destroyed, so thread caches can be flushed into it at exit. */
+struct depot_t {
+    std::mutex M[NCLASSES]{};
+    std::vector<void*> lists[NCLASSES]{};
+    std::atomic<size_t> bytes{0};
+};
+
+/* One depot per NUMA node, so that a buffer freed on a node is reused on that node; see numa.h */
+std::vector<depot_t*>& depots() {
+    static std::vector<depot_t*>* d = [] {
+        auto* v = new std::vector<depot_t*>();
+        for (size_t i = 0; i < numa_topology::system().node_count(); i++) v->push_back(new depot_t());
+        return v;
+    }();
+    return *d;
+}
+depot_t& depot() {
+    const auto& d = depots();
+    return d.size() == 1 ? *d[0] : *d[numa_topology::system().current_node() % d.size()];
+}
+
+/* Give a buffer to the calling thread's depot, or free it if the depot is full */
+void depot_put(void* buf, size_t capacity) {
+    depot_t& d = depot();
+    if (d.bytes + capacity <= sbuf_pool::DEPOT_BYTES / depots().size()) {
+        const unsigned int i = class_index(capacity);
+        const std::lock_guard<std::mutex> lock(d.M[i]);
+        d.lists[i].push_back(buf);
+        d.bytes += capacity;
+        return;
+    }
+    bytes_cached -= capacity;
+    free(buf);
+}
+
+void* depot_get(size_t capacity) {
+    depot_t& d = depot();
+    if (d.bytes == 0) return nullptr;
+    const unsigned int i = class_index(capacity);
+    const std::lock_guard<std::mutex> lock(d.M[i]);
+    if (d.lists[i].empty()) return nullptr;
+    void* buf = d.lists[i].back();
+    d.lists[i].pop_back();
+    d.bytes -= capacity;
+    return buf;
+}
+
+struct thread_cache_t {
+    std::vector<void*> lists[NCLASSES]{};
+    size_t bytes{0};
+    std::vector<void*> objects{};
+    size_t object_size{0};
+
+    void flush() {
+        for (unsigned int i = 0; i < NCLASSES; i++) {
+            for (auto* buf : lists[i]) { depot_put(buf, size_t(1) << (MIN_SHIFT + i)); }
+            lists[i].clear();
+        }
+        bytes = 0;
+        for (auto* obj : objects) { free(obj); }
+        objects.clear();
+    }
+    ~thread_cache_t();
+};
+
+/* sbufs may be deleted during static destruction, after this thread's cache is gone */
+thread_local bool tl_cache_destroyed{false};
+thread_local thread_cache_t tl_cache{};
+
+thread_cache_t::~thread_cache_t() {
+    flush();
+    tl_cache_destroyed = true;
+}
+
+thread_cache_t* get_cache() { return tl_cache_destroyed ? nullptr : &tl_cache; }
+} // namespace
+
+void sbuf_pool::set_enabled(bool enabled) { pool_enabled = enabled; }
+bool sbuf_pool::is_enabled() { return pool_enabled; }
+
+size_t sbuf_pool::size_class(size_t len) {
+    if (len < MIN_POOLED || len > MAX_POOLED) return 0;
+    return size_t(1) << (MIN_SHIFT + class_index(len));
+}
+
+void* sbuf_pool::alloc_buffer(size_t len, size_t& capacity) {
+    alloc_profile::record(len);
+    capacity = pool_enabled ? size_class(len) : 0;
+    if (capacity == 0) {
+        void* buf = malloc(len > 0 ? len : 1);
+        if (buf == nullptr) throw std::bad_alloc();
+        return buf;
+    }
+    thread_cache_t* cache = get_cache();
+    if (cache) {
+        auto& list = cache->lists[class_index(capacity)];
+        if (!list.empty()) {
+            void* buf = list.back();
+            list.pop_back();
+            cache->bytes -= capacity;
+            bytes_cached -= capacity;
+            buffer_hits++;
+            return buf;
+        }
+    }
+    void* buf = depot_get(capacity);
+    if (buf) {
+        bytes_cached -= capacity;
+        buffer_hits++;
+        return buf;
+    }
+    buffer_misses++;
+    buf = malloc(capacity);
+    if (buf == nullptr) throw std::bad_alloc();
+    return buf;
+}
+
+void sbuf_pool::free_buffer(void* buf, size_t capacity) {
+    if (buf == nullptr) return;
+    if (capacity == 0 || !pool_enabled) {
+        free(buf);
+        return;
+    }
+    bytes_cached += capacity;
+    thread_cache_t* cache = get_cache();
+    if (cache && cache->bytes + capacity <= THREAD_CACHE_BYTES) {
+        cache->lists[class_index(capacity)].push_back(buf);
+        cache->bytes += capacity;
+        return;
+    }
+    depot_put(buf, capacity);
+}
+
+void* sbuf_pool::alloc_object(size_t size) {
+    alloc_profile::record(size);
+    thread_cache_t* cache = get_cache();
+    if (pool_enabled && cache && size == cache->object_size && !cache->objects.empty()) {
+        void* obj = cache->objects.back();
+        cache->objects.pop_back();
+        object_hits++;
+        return obj;
+    }
+    object_misses++;
+    void* obj = malloc(size);
+    if (obj == nullptr) throw std::bad_alloc();
+    return obj;
+}
+
+/* Only objects of a single size (sbuf_t itself, not subclasses) are cached */
+void sbuf_pool::free_object(void* obj, size_t size) {
+    thread_cache_t* cache = get_cache();
+    if (pool_enabled && cache && cache->objects.size() < OBJECT_CACHE &&
+        (cache->object_size == 0 || cache->object_size == size)) {
+        cache->object_size = size;
+        cache->objects.push_back(obj);
+        return;
+    }
+    free(obj);
+}
+
+sbuf_pool::stats_t sbuf_pool::get_stats() {
+    stats_t st;
+    st.buffer_hits = buffer_hits;
+    st.buffer_misses = buffer_misses;
+    st.object_hits = object_hits;
+    st.object_misses = object_misses;
+    st.bytes_cached = bytes_cached;
+    return st;
+}
+
+void sbuf_pool::trim() {
+    thread_cache_t* cache = get_cache();
+    if (cache) cache->flush();
+    for (depot_t* d : depots()) {
+        for (unsigned int i = 0; i < NCLASSES; i++) {
+            const std::lock_guard<std::mutex> lock(d->M[i]);
+            for (auto* buf : d->lists[i]) {
+                const size_t capacity = size_t(1) << (MIN_SHIFT + i);
+                d->bytes -= capacity;
+                bytes_cached -= capacity;
+                free(buf);
+            }
+            d->lists[i].clear();
+        }
+    }
+}
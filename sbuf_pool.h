@@ -0,0 +1,64 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * sbuf_pool - recycles the buffers made by sbuf_t::sbuf_malloc() and the sbuf_t objects themselves.
+ *
+ * Decoding scanners allocate an output buffer for every object they decode, often megabytes at a
+ * time, and free it a moment later. With many threads this churns the heap and fragments it. The
+ * pool rounds buffer requests of MIN_POOLED bytes or more up to a power of two (up to MAX_POOLED)
+ * and keeps freed buffers for reuse:
+ *
+ * - each thread has a cache of up to THREAD_CACHE_BYTES, so the common case takes no lock;
+ * - buffers that overflow a thread cache go to a shared depot of up to DEPOT_BYTES (one mutex per
+ *   size class), which is also where a thread's cache goes when the thread exits. On a NUMA host
+ *   each node has a depot, sharing DEPOT_BYTES, and a thread uses the one of the node it runs on;
+ * - anything beyond that is freed.
+ *
+ * Every buffer and object is allocated with malloc(), and the pool only decides whether to keep it
+ * or free() it, so the pool can be turned on and off at any time, even with sbufs outstanding.
+ * It is on by default; set_enabled(false), or BE13_API_SBUF_POOL=0 in the environment, makes
+ * sbuf_malloc() use plain malloc/free so the two can be compared.
+ */
+
+#ifndef SBUF_POOL_H
+#define SBUF_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class sbuf_pool {
+public:
+    static inline const size_t MIN_POOLED = 1024;             // smaller buffers use malloc
+    static inline const size_t MAX_POOLED = 64 * 1024 * 1024; // larger buffers use malloc
+    static inline const size_t THREAD_CACHE_BYTES = 64 * 1024 * 1024;
+    static inline const size_t DEPOT_BYTES = 256 * 1024 * 1024;
+    static inline const size_t OBJECT_CACHE = 256;            // sbuf_t objects cached per thread
+
+    static void set_enabled(bool enabled);
+    static bool is_enabled();
+
+    /* Buffers. capacity is set to the size actually allocated: a size class if the buffer can go
+     * back into the pool, or 0 if it can't. free_buffer() needs it back.
+     */
+    static void* alloc_buffer(size_t len, size_t& capacity);  // throws std::bad_alloc
+    static void free_buffer(void* buf, size_t capacity);
+    static size_t size_class(size_t len);                     // the capacity len rounds up to, or 0 if not pooled
+
+    /* sbuf_t objects; see sbuf_t::operator new */
+    static void* alloc_object(size_t size);
+    static void free_object(void* obj, size_t size);
+
+    struct stats_t {
+        uint64_t buffer_hits{0};      // buffers reused
+        uint64_t buffer_misses{0};    // buffers that had to be malloced
+        uint64_t object_hits{0};
+        uint64_t object_misses{0};
+        uint64_t bytes_cached{0};     // in the thread caches and the depot
+    };
+    static stats_t get_stats();
+    static void trim();               // free this thread's cache and the depot
+};
+
+#endif
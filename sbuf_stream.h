@@ -2,6 +2,12 @@
 #ifndef SBUF_STREAM_H
 #define SBUF_STREAM_H
 
+#include <array>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 #include "sbuf.h"
 
 /** \addtogroup bulk_extractor_APIs
@@ -11,9 +17,107 @@
 /** \file */
 /**
  * sbuf_stream provides the get services of sbuf_t but wrapped in a Stream interface.
- * Note that sbuf_stream is not particularly optimized; it is simply a wrapper.
+ * Note that the get*() methods are not particularly optimized; each is a bounds-checked wrapper.
  * Right now this is only used by scan_winprefetch. It could become a general iterator.
+ * To read a fixed-layout structure, describe it with sbuf_record (below) and use get_record().
+ */
+
+/**
+ * sbuf_record describes the on-disk layout of a C++ struct, so that a whole record is decoded with a
+ * single bounds check and the field loads are generated (and unrolled) by the compiler:
+ *
+ *     struct prefetch_header { uint32_t version; char magic[4]; uint32_t file_size; };
+ *     using prefetch_layout = sbuf_record<prefetch_header,
+ *                                         sbuf_field<&prefetch_header::version>,
+ *                                         sbuf_field<&prefetch_header::magic>,
+ *                                         sbuf_skip<4>,
+ *                                         sbuf_field<&prefetch_header::file_size>>;
+ *     prefetch_header h = prefetch_layout::decode(sbuf, 0); // throws sbuf_range_exception if short
+ *
+ * Fields are laid out in the order given, with no padding except for sbuf_skip. Integer (and enum)
+ * fields are little-endian unless a byte order is given: sbuf_field<&S::x, sbuf_t::BO_BIG_ENDIAN>.
+ * Array fields of 1-byte elements (e.g. char magic[4]) are copied as is.
  */
+namespace sbuf_record_detail {
+template <typename> struct member_traits;
+template <typename S, typename T> struct member_traits<T S::*> {
+    using struct_type = S;
+    using value_type = T;
+};
+
+template <typename T, sbuf_t::byte_order_t BO> T load(const sbuf_t::view_t& v, size_t off) {
+    if constexpr (std::is_enum_v<T>) {
+        return static_cast<T>(load<std::underlying_type_t<T>, BO>(v, off));
+    } else {
+        static_assert(std::is_integral_v<T>, "sbuf_field: field must be an integer, enum or byte array");
+        if constexpr (sizeof(T) == 1) return static_cast<T>(v.u8(off));
+        if constexpr (sizeof(T) == 2) return static_cast<T>(v.u16(off, BO));
+        if constexpr (sizeof(T) == 4) return static_cast<T>(v.u32(off, BO));
+        if constexpr (sizeof(T) == 8) return static_cast<T>(v.u64(off, BO));
+    }
+}
+} // namespace sbuf_record_detail
+
+template <auto Member, sbuf_t::byte_order_t BO = sbuf_t::BO_LITTLE_ENDIAN> struct sbuf_field {
+    using value_type = typename sbuf_record_detail::member_traits<decltype(Member)>::value_type;
+    static constexpr size_t size = sizeof(value_type);
+    template <typename S> static void decode(const sbuf_t::view_t& v, size_t off, S& s) {
+        if constexpr (std::is_array_v<value_type>) {
+            static_assert(sizeof(std::remove_extent_t<value_type>) == 1, "sbuf_field: arrays must be of bytes");
+            memcpy(s.*Member, v.data() + off, size);
+        } else {
+            s.*Member = sbuf_record_detail::load<value_type, BO>(v, off);
+        }
+    }
+};
+
+template <size_t N> struct sbuf_skip {
+    static constexpr size_t size = N;
+    template <typename S> static void decode(const sbuf_t::view_t&, size_t, S&) {}
+};
+
+template <typename S, typename... Fields> struct sbuf_record {
+    using struct_type = S;
+    static constexpr size_t size = (Fields::size + ... + 0); // bytes in a record
+
+    /* Decode from a view; the caller has checked that size bytes at off are in the view. */
+    static S decode(const sbuf_t::view_t& v, size_t off) {
+        S s{};
+        decode_fields(v, off, s, std::index_sequence_for<Fields...>{});
+        return s;
+    }
+    /* Decode from an sbuf, with one bounds check */
+    static S decode(const sbuf_t& sbuf, size_t off) { return decode(sbuf.view(off, size), 0); }
+
+    /* Decode count records, stride bytes apart, with one bounds check */
+    static std::vector<S> decode_array(const sbuf_t& sbuf, size_t off, size_t count, size_t stride = size) {
+        std::vector<S> ret;
+        if (count == 0) return ret;
+        if (stride < size) throw std::invalid_argument("sbuf_record::decode_array: stride < size");
+        const sbuf_t::view_t v = sbuf.view(off, (count - 1) * stride + size);
+        ret.reserve(count);
+        for (size_t i = 0; i < count; i++) { ret.push_back(decode(v, i * stride)); }
+        return ret;
+    }
+
+private:
+    static constexpr std::array<size_t, sizeof...(Fields)> offsets() {
+        std::array<size_t, sizeof...(Fields)> ret{};
+        const size_t sizes[] = {Fields::size..., 0};
+        size_t off = 0;
+        for (size_t i = 0; i < sizeof...(Fields); i++) {
+            ret[i] = off;
+            off += sizes[i];
+        }
+        return ret;
+    }
+    template <size_t... I>
+    static void decode_fields(const sbuf_t::view_t& v, size_t off, S& s, std::index_sequence<I...>) {
+        constexpr auto field_offsets = offsets();
+        (Fields::decode(v, off + field_offsets[I], s), ...);
+    }
+};
+
 class sbuf_stream {
 private:
     const sbuf_t& sbuf;
@@ -67,6 +171,21 @@ public:
     void getUTF16(std::wstring& utf16_string);
     void getUTF16(size_t num_code_units_requested, std::wstring& utf16_string);
     /** @} */
+
+    /**
+     * \name record readers: decode an sbuf_record at the current offset and advance past it
+     * @{ */
+    template <typename R> typename R::struct_type get_record() {
+        auto ret = R::decode(sbuf, offset);
+        offset += R::size;
+        return ret;
+    }
+    template <typename R> std::vector<typename R::struct_type> get_records(size_t count) {
+        auto ret = R::decode_array(sbuf, offset, count);
+        offset += count * R::size;
+        return ret;
+    }
+    /** @} */
 };
 
 #endif
@@ -0,0 +1,109 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "scan_journal.h"
+
+scan_journal::scan_journal(const std::filesystem::path& fname_) : fname(fname_) {
+    /* Read the committed checkpoints, and find where the last one ends */
+    uint64_t good_length = 0;
+    std::ifstream in(fname, std::ios_base::binary);
+    if (in.is_open()) {
+        std::vector<uint64_t> pages;
+        std::map<std::string, uint64_t> lens;
+        std::string line;
+        uint64_t pos = 0;
+        bool first = true;
+        while (std::getline(in, line)) {
+            if (in.eof()) break; // a line without its newline was not finished
+            pos += line.size() + 1;
+            if (first) {
+                if (line != HEADER) throw std::runtime_error("scan_journal: " + fname.string() + " is not a scan journal");
+                first = false;
+                good_length = pos;
+                continue;
+            }
+            std::istringstream ss(line);
+            std::string tag;
+            ss >> tag;
+            if (tag == "page") {
+                uint64_t offset = 0;
+                if (ss >> offset) pages.push_back(offset);
+            } else if (tag == "length") {
+                std::string name;
+                uint64_t len = 0;
+                if (ss >> name >> len) lens[name] = len;
+            } else if (tag == "commit") {
+                completed.insert(pages.begin(), pages.end());
+                for (const auto& it : lens) lengths[it.first] = it.second;
+                pages.clear();
+                lens.clear();
+                loaded_commits++;
+                good_length = pos;
+            }
+        }
+    }
+    in.close();
+    commits = loaded_commits;
+
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) throw std::runtime_error("scan_journal: cannot open " + fname.string() + ": " + strerror(errno));
+    /* Cut off a checkpoint that was not finished, so that its pages are not committed by the next one */
+    if (ftruncate(fd, good_length) != 0 || lseek(fd, good_length, SEEK_SET) < 0) {
+        ::close(fd);
+        throw std::runtime_error("scan_journal: cannot truncate " + fname.string() + ": " + strerror(errno));
+    }
+    if (good_length == 0) append(HEADER + "\n");
+}
+
+scan_journal::~scan_journal() {
+    if (fd >= 0) ::close(fd);
+}
+
+bool scan_journal::committed_length(const std::string& recorder, uint64_t& len) const {
+    auto it = lengths.find(recorder);
+    if (it == lengths.end()) return false;
+    len = it->second;
+    return true;
+}
+
+void scan_journal::page_done(uint64_t offset) {
+    const std::lock_guard<std::mutex> lock(M);
+    pending.push_back(offset);
+}
+
+uint64_t scan_journal::checkpoints() const {
+    const std::lock_guard<std::mutex> lock(M);
+    return commits;
+}
+
+void scan_journal::append(const std::string& text) {
+    size_t done = 0;
+    while (done < text.size()) {
+        const ssize_t r = ::write(fd, text.data() + done, text.size() - done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) throw std::runtime_error("scan_journal: cannot write " + fname.string() + ": " + strerror(errno));
+        done += r;
+    }
+}
+
+/* The whole checkpoint goes out in one write() */
+void scan_journal::checkpoint(const std::map<std::string, uint64_t>& lens) {
+    const std::lock_guard<std::mutex> lock(M);
+    std::string text;
+    for (const auto offset : pending) text += "page " + std::to_string(offset) + "\n";
+    for (const auto& it : lens) text += "length " + it.first + " " + std::to_string(it.second) + "\n";
+    text += "commit " + std::to_string(commits + 1) + "\n";
+    append(text);
+    pending.clear();
+    commits++;
+}
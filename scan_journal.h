@@ -0,0 +1,71 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * scan_journal - records the progress of a scan, so that a scan that was interrupted can be resumed.
+ *
+ * The journal is a text file that is only appended to. As each top-level page finishes, its offset is
+ * remembered; a checkpoint appends a "page" line for each page finished since the last checkpoint, a
+ * "length" line with the committed length of each feature file, and then a "commit" line:
+ *
+ *     # be13_api scan journal 1
+ *     page 0
+ *     page 16777216
+ *     length email 123456
+ *     commit 1
+ *
+ * Only what is followed by a commit line counts, so a checkpoint that was cut short by a crash is
+ * ignored (and cut off the file when it is opened again). On restart, the scanner_set skips the pages
+ * that were committed, and each feature_recorder_file truncates its file to its committed length, which
+ * removes the features of pages that will be scanned again. See scanner_set::checkpoint() for when
+ * checkpoints are taken.
+ *
+ * The journal survives the process dying but, like the feature files it describes, is not synced to
+ * the disk, so it does not survive the system crashing.
+ */
+
+#ifndef SCAN_JOURNAL_H
+#define SCAN_JOURNAL_H
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+class scan_journal {
+public:
+    static inline const std::string FILENAME = "scan_journal.txt";
+    static inline const std::string HEADER = "# be13_api scan journal 1";
+
+    explicit scan_journal(const std::filesystem::path& fname); // loads an existing journal; throws std::runtime_error
+    ~scan_journal();
+
+    /* What the previous runs committed; these don't change during the scan */
+    bool resumed() const { return loaded_commits > 0; }
+    bool page_completed(uint64_t offset) const { return completed.find(offset) != completed.end(); }
+    bool committed_length(const std::string& recorder, uint64_t& len) const; // false if there is none
+    size_t completed_pages() const { return completed.size(); }
+
+    void page_done(uint64_t offset); // threadsafe
+    void checkpoint(const std::map<std::string, uint64_t>& lengths); // commits the pages done so far
+    uint64_t checkpoints() const; // including the previous runs'
+
+private:
+    scan_journal(const scan_journal&) = delete;
+    scan_journal& operator=(const scan_journal&) = delete;
+
+    const std::filesystem::path fname;
+    int fd{-1};
+    std::unordered_set<uint64_t> completed{};
+    std::map<std::string, uint64_t> lengths{};
+    uint64_t loaded_commits{0};
+    mutable std::mutex M{}; // protects everything below
+    std::vector<uint64_t> pending{};
+    uint64_t commits{0};
+    void append(const std::string& text); // throws std::runtime_error
+};
+
+#endif
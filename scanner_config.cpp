@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <stdexcept>
+
 #include "scanner_config.h"
 
 /************************************
@@ -54,3 +57,19 @@ template <> void scanner_config::get_config(const std::string& n, bool* val, con
 void scanner_config::push_scanner_command(const std::string& scannerName, scanner_command::command_t c) {
     scanner_commands.push_back(scanner_command(scannerName, c));
 }
+
+/* Each shard gets a whole number of pages, and the last one runs to the end of the input */
+scanner_config::shard_t scanner_config::shard_t::assign(uint64_t size, unsigned int count, unsigned int id,
+                                                        uint64_t pagesize) {
+    if (count == 0 || id >= count || pagesize == 0) {
+        throw std::invalid_argument("shard_t::assign: need id < count and pagesize > 0");
+    }
+    const uint64_t pages = (size + pagesize - 1) / pagesize;
+    shard_t s;
+    s.id = id;
+    s.count = count;
+    s.size = size;
+    s.start = std::min(size, pages * id / count * pagesize);
+    s.end = id + 1 == count ? size : std::min(size, pages * (id + 1) / count * pagesize);
+    return s;
+}
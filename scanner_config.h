@@ -40,6 +40,47 @@ struct scanner_config {
     std::filesystem::path input_fname{NO_INPUT}; // where input comes from
     std::filesystem::path outdir{NO_OUTDIR};     // where output goes
     std::string hash_algorithm{"sha1"};          // which hash algorithm are using; default to SHA1
+    std::string dedup_hash_algorithm{"sha1"};    // hash for detecting previously seen sbufs: sha1 or fast; see fast_hash.h
+    std::filesystem::path trace_file{};          // if set, trace the scan and write it here (in outdir if relative)
+    std::filesystem::path journal_file{};        // if set, checkpoint the scan here and resume from it; see scan_journal.h
+    unsigned int checkpoint_seconds{60};         // how often the scan is checkpointed to the journal
+    std::filesystem::path page_cache_file{};     // if set, replay pages scanned by earlier runs; see page_cache.h
+    std::filesystem::path metrics_file{};        // if set, write the scan's metrics here (in outdir if relative)
+    unsigned int metrics_seconds{10};            // how often; see metrics_exporter.h
+    bool numa_placement{false};                  // pin the workers and keep each page on one node; see numa.h
+    std::filesystem::path plugin_manifest_dir{}; // if set, cache what plugins' scanners register; see scanner_manifest.h
+    bool alloc_profile{false};                   // charge allocations to scanners and recorders; see alloc_profile.h
+
+    /* The child sbufs of up to batch_max_bytes that a scanner recurses with are scanned together when it
+     * returns, up to batch_max_sbufs at a time, and the scanners with scan_batch are called once for them all;
+     * see scanner_set::process_batch(). Children over memory that the scanner owns are never batched; see
+     * scanner_set::outlives_call(). 0 is no batching.
+     */
+    size_t batch_max_bytes{0};
+    size_t batch_max_sbufs{256};
+
+    /* Time budgets, in milliseconds; 0 is no limit. A scanner call or top-level page that runs past its budget
+     * is reported to the alert recorder and cancelled; see watchdog.h
+     */
+    unsigned int scanner_budget_ms{0};                    // every scanner call
+    std::map<std::string, unsigned int> scanner_budgets_ms{}; // by scanner name, instead of scanner_budget_ms
+    unsigned int sbuf_budget_ms{0};              // a top-level page and the children scanned on its thread
+
+    /* A sharded scan scans only the top-level pages that start in [start,end) of the input, and records a
+     * shard manifest so that shard_merge can combine the shards' outputs; see shard_merge.h
+     */
+    struct shard_t {
+        unsigned int id{0};
+        unsigned int count{0};          // 0 if the scan is not sharded
+        uint64_t start{0};
+        uint64_t end{0};
+        uint64_t size{0};               // of the whole input, which the shards cover
+        bool enabled() const { return count > 0; }
+        bool contains(uint64_t offset) const { return !enabled() || (offset >= start && offset < end); }
+        /* Shard id of count over an input of size bytes, on pagesize boundaries; throws std::invalid_argument */
+        static shard_t assign(uint64_t size, unsigned int count, unsigned int id, uint64_t pagesize);
+    };
+    shard_t shard{};
     std::string help() { return help_str; };
     inline static const std::string NO_INPUT = "<NO-INPUT>"; // 'filename' indicator that the FRS has no input file
     inline static const std::string NO_OUTDIR =
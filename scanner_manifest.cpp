@@ -0,0 +1,187 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "scanner_manifest.h"
+#include "unicode_escape.h"
+#include "utils.h"
+
+std::string scanner_manifest::plugin_key(const std::filesystem::path& plugin) {
+    std::unique_ptr<sbuf_t> sbuf(sbuf_t::map_file(plugin));
+    return sbuf->hexdigest(sbuf_t::DIGEST_SHA1);
+}
+
+/* An empty value is written as "-", so that every field is at least one character */
+std::string scanner_manifest::escape(const std::string& s) {
+    if (s.empty()) return "-";
+    if (s == "-") return hexesc('-');
+    std::string ret;
+    for (const char ch : s) {
+        const unsigned char uch = static_cast<unsigned char>(ch);
+        if (uch <= ' ' || uch > '~' || uch == '\\') {
+            ret += hexesc(uch);
+        } else {
+            ret.push_back(ch);
+        }
+    }
+    return ret;
+}
+
+std::string scanner_manifest::unescape(const std::string& s) {
+    if (s == "-") return "";
+    std::string ret;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '\\' && i + 3 < s.size() && s[i + 1] == 'x' && isxdigit(s[i + 2]) && isxdigit(s[i + 3])) {
+            ret.push_back(static_cast<char>(std::stoi(s.substr(i + 2, 2), nullptr, 16)));
+            i += 3;
+            continue;
+        }
+        ret.push_back(s[i]);
+    }
+    return ret;
+}
+
+namespace {
+typedef scanner_params::scanner_info::scanner_flags_t scanner_flags_t;
+
+/* The scanner flags by name, for writing and reading them */
+std::vector<std::pair<std::string, bool scanner_flags_t::*>> flag_fields() {
+    return {{"default_enabled", &scanner_flags_t::default_enabled},
+            {"no_usage", &scanner_flags_t::no_usage},
+            {"no_all", &scanner_flags_t::no_all},
+            {"find_scanner", &scanner_flags_t::find_scanner},
+            {"recurse", &scanner_flags_t::recurse},
+            {"recurse_expand", &scanner_flags_t::recurse_expand},
+            {"recurse_always", &scanner_flags_t::recurse_always},
+            {"scan_ngram_buffer", &scanner_flags_t::scan_ngram_buffer},
+            {"scan_seen_before", &scanner_flags_t::scan_seen_before},
+            {"fast_find", &scanner_flags_t::fast_find},
+            {"depth0_only", &scanner_flags_t::depth0_only},
+            {"skip_random", &scanner_flags_t::skip_random},
+            {"skip_text", &scanner_flags_t::skip_text},
+            {"init_when_enabled", &scanner_flags_t::init_when_enabled},
+            {"init_parallel", &scanner_flags_t::init_parallel},
+            {"scan_batch", &scanner_flags_t::scan_batch}};
+}
+
+typedef feature_recorder_def::flags_t recorder_flags_t;
+std::vector<std::pair<std::string, bool recorder_flags_t::*>> recorder_flag_fields() {
+    return {{"disabled", &recorder_flags_t::disabled},       {"no_context", &recorder_flags_t::no_context},
+            {"no_stoplist", &recorder_flags_t::no_stoplist}, {"no_alertlist", &recorder_flags_t::no_alertlist},
+            {"no_features", &recorder_flags_t::no_features}, {"no_quote", &recorder_flags_t::no_quote},
+            {"xml", &recorder_flags_t::xml}};
+}
+} // namespace
+
+void scanner_manifest::write(const std::filesystem::path& fname, const scanner_params::scanner_info& info,
+                             const std::string& help) {
+    /* Written to a temporary file and renamed, so that two runs writing the same manifest don't mix */
+    const std::filesystem::path tmp = fname.string() + ".tmp";
+    std::ofstream of(tmp, std::ios::trunc);
+    if (!of.is_open()) throw std::runtime_error("scanner_manifest: cannot create " + tmp.string());
+    of << HEADER << "\n";
+    of << "name " << escape(info.name) << "\n";
+    of << "prefix " << escape(info.pathPrefix) << "\n";
+    of << "helpstr " << escape(info.helpstr) << "\n";
+    of << "author " << escape(info.author) << "\n";
+    of << "description " << escape(info.description) << "\n";
+    of << "url " << escape(info.url) << "\n";
+    of << "scanner_version " << escape(info.scanner_version) << "\n";
+    of << "flags " << info.flags << "\n";
+    for (const auto& it : flag_fields()) {
+        of << "flag " << it.first << " " << (info.scanner_flags.*it.second) << "\n";
+    }
+    for (const auto& def : info.feature_defs) {
+        of << "feature " << escape(def.name) << " " << def.max_context_size << " " << def.max_feature_size << " "
+           << def.default_carve_mode << " " << def.min_carve_size << " " << def.max_carve_size;
+        for (const auto& it : recorder_flag_fields()) {
+            if (def.flags.*it.second) of << " " << it.first;
+        }
+        of << "\n";
+    }
+    for (const auto& def : info.histogram_defs) {
+        of << "histogram " << escape(def.name) << " " << escape(def.feature) << " " << escape(def.pattern) << " "
+           << escape(def.require) << " " << escape(def.suffix) << " " << def.flags.lowercase << " "
+           << def.flags.numeric << " " << def.flags.approximate << "\n";
+    }
+    for (const auto& it : info.find_patterns) of << "find " << escape(it) << "\n";
+    for (const auto& it : info.prefilters) of << "prefilter " << escape(it) << "\n";
+    if (!help.empty()) of << "help " << escape(help) << "\n";
+    of.close();
+    if (of.fail()) throw std::runtime_error("scanner_manifest: cannot write " + tmp.string());
+    std::filesystem::rename(tmp, fname);
+}
+
+scanner_params::scanner_info* scanner_manifest::read(const std::filesystem::path& fname, scanner_t* scanner,
+                                                     std::string& help) {
+    std::ifstream in(fname);
+    std::string line;
+    if (!std::getline(in, line) || line != HEADER) return nullptr;
+    std::unique_ptr<scanner_params::scanner_info> info;
+    help.clear();
+    try {
+        while (std::getline(in, line)) {
+            const std::vector<std::string> f = split(line, ' ');
+            if (f.size() < 2) return nullptr;
+            const std::string& kw = f[0];
+            if (kw == "name") {
+                info = std::make_unique<scanner_params::scanner_info>(scanner, unescape(f[1]));
+                continue;
+            }
+            if (!info) return nullptr; // the name comes first
+            if (kw == "prefix") {
+                info->pathPrefix = unescape(f[1]);
+            } else if (kw == "helpstr") {
+                info->helpstr = unescape(f[1]);
+            } else if (kw == "author") {
+                info->author = unescape(f[1]);
+            } else if (kw == "description") {
+                info->description = unescape(f[1]);
+            } else if (kw == "url") {
+                info->url = unescape(f[1]);
+            } else if (kw == "scanner_version") {
+                info->scanner_version = unescape(f[1]);
+            } else if (kw == "flags") {
+                info->flags = std::stoull(f[1]);
+            } else if (kw == "flag" && f.size() == 3) {
+                for (const auto& it : flag_fields()) {
+                    if (it.first == f[1]) info->scanner_flags.*it.second = f[2] == "1";
+                }
+            } else if (kw == "feature" && f.size() >= 7) {
+                feature_recorder_def def(unescape(f[1]));
+                def.max_context_size = std::stoul(f[2]);
+                def.max_feature_size = std::stoul(f[3]);
+                def.default_carve_mode = static_cast<feature_recorder_def::carve_mode_t>(std::stoi(f[4]));
+                def.min_carve_size = std::stoull(f[5]);
+                def.max_carve_size = std::stoull(f[6]);
+                for (size_t i = 7; i < f.size(); i++) {
+                    for (const auto& it : recorder_flag_fields()) {
+                        if (it.first == f[i]) def.flags.*it.second = true;
+                    }
+                }
+                info->feature_defs.push_back(def);
+            } else if (kw == "histogram" && f.size() == 9) {
+                histogram_def::flags_t flags(f[6] == "1", f[7] == "1");
+                flags.approximate = std::stoull(f[8]);
+                info->histogram_defs.push_back(
+                    histogram_def(unescape(f[1]), unescape(f[2]), unescape(f[3]), unescape(f[4]), unescape(f[5]), flags));
+            } else if (kw == "find") {
+                info->find_patterns.push_back(unescape(f[1]));
+            } else if (kw == "prefilter") {
+                info->prefilters.push_back(unescape(f[1]));
+            } else if (kw == "help") {
+                help = unescape(f[1]);
+            } else {
+                return nullptr; // written by something newer
+            }
+        }
+    } catch (const std::exception&) { // a number that won't parse, or a histogram pattern that won't compile
+        return nullptr;
+    }
+    return info.release();
+}
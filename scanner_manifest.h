@@ -0,0 +1,63 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * scanner_manifest - remembers what a plugin's scanner said about itself in PHASE_INIT, so that the next
+ * run can register the scanner without loading and initializing it first.
+ *
+ * With scanner_config::plugin_manifest_dir set, scanner_set::add_scanner_file() looks for the manifest of
+ * the plugin under the SHA1 of the plugin file. If there is one, the scanner is registered from it: its
+ * name, flags, feature and histogram definitions, find patterns, prefilters and the help that its
+ * configuration options added are all known without calling it. The scanner only gets its PHASE_INIT in
+ * apply_scanner_commands(), and only if it is enabled, so the tables that a scanner builds in PHASE_INIT
+ * are only built for the scanners that will run. If there is no manifest, the scanner is initialized as
+ * usual and its manifest is written for the next run. A changed plugin has a different SHA1, so its old
+ * manifest is never used.
+ *
+ * A manifest is a text file of one field per line, a keyword and its values separated by spaces; values
+ * escape backslash, space, control characters and bytes over 0x7E as \xHH:
+ *
+ *     # be13_api scanner manifest 1
+ *     name email
+ *     prefix EMAIL
+ *     flag default_enabled 1
+ *     flag recurse 0
+ *     feature email 1048576 1048576 2 200 16777216 no_context
+ *     histogram email_domain email @(.*) - _domain 1 0 0
+ *     find @
+ *     help \x20\x20\x20-S\x20email_max=...
+ *
+ * An empty value is written as "-". A manifest that can't be read is ignored. Scanners with a packet
+ * callback have no manifest, since the callback can only be had by initializing the scanner.
+ */
+
+#ifndef SCANNER_MANIFEST_H
+#define SCANNER_MANIFEST_H
+
+#include <filesystem>
+#include <string>
+
+#include "scanner_params.h"
+
+class scanner_manifest {
+public:
+    static inline const std::string HEADER = "# be13_api scanner manifest 1";
+    static inline const std::string EXTENSION = ".manifest";
+
+    /* The key of a plugin: the SHA1 of its contents. Throws if the file can't be read. */
+    static std::string plugin_key(const std::filesystem::path& plugin);
+    static std::filesystem::path path_for(const std::filesystem::path& dir, const std::string& key) {
+        return dir / (key + EXTENSION);
+    }
+
+    /* help is what scanner's PHASE_INIT added to scanner_config::help_str. Throws std::runtime_error. */
+    static void write(const std::filesystem::path& fname, const scanner_params::scanner_info& info,
+                      const std::string& help);
+    /* A new scanner_info for scanner, or nullptr if there is no usable manifest */
+    static scanner_params::scanner_info* read(const std::filesystem::path& fname, scanner_t* scanner, std::string& help);
+
+    static std::string escape(const std::string& s);
+    static std::string unescape(const std::string& s);
+};
+
+#endif
@@ -11,6 +11,15 @@ feature_recorder& scanner_params::named_feature_recorder(const std::string featu
 const std::filesystem::path scanner_params::get_input_fname() const { return ss.get_input_fname(); }
 
 void scanner_params::recurse(sbuf_t* new_sbuf) const {
+    if (cancelled()) {          // over its time budget; don't make it any later
+        delete new_sbuf;
+        return;
+    }
+    if (!ss.outlives_call(new_sbuf, sbuf)) { // its memory is the scanner's, so it is scanned before we return
+        ss.process_sbuf(new_sbuf);
+        return;
+    }
+    if (collect && ss.add_to_batch(*collect, new_sbuf, sbuf)) return; // scanned when the scanner returns
     ss.schedule_sbuf(new_sbuf);
     /* sbuf will be deleted after it is processed */
 }
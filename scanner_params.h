@@ -13,6 +13,7 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <cctype>
 #include <iostream>
@@ -21,15 +22,26 @@
 // Note: Do not include scanner_set.h, because it needs scanner_params.h!
 
 #include "histogram_def.h"
-//#include "packet_info.h"
 #include "feature_recorder.h"
 #include "feature_recorder_set.h"
 #include "sbuf.h"
+#include "watchdog.h"
 #include "scanner_config.h"
 
+/* packet_info.h brings in pcap, so only what the scanner_info needs is declared here */
+namespace be13 {
+class packet_info;
+typedef void packet_callback_t(void* user, const be13::packet_info& pi);
+}
+
 /** A scanner is a function that takes a reference to scanner params and a recrusion control block */
 typedef void scanner_t(struct scanner_params& sp);
 
+/* The small sbufs that a scanner recursed with, which are scanned together when it returns */
+struct sbuf_batch {
+    std::vector<sbuf_t*> sbufs{};
+};
+
 /**
  * \class scanner_params
  * The scanner params class is the primary way that the bulk_extractor framework
@@ -74,6 +86,12 @@ struct scanner_params {
             bool scan_seen_before{false}; //  Scanner can run even if buffer has seen before
             bool fast_find{false};        //  This scanner is a very fast FIND scanner
             bool depth0_only{false};      //  scanner only runs at depth 0 by default
+            bool skip_random{false};      //  not run on pages that look encrypted or compressed; see byte_profile_t
+            bool skip_text{false};        //  not run on pages that look like text
+            bool init_when_enabled{false}; // sent PHASE_ENABLED if it is enabled, to build its tables; see
+                                           //   scanner_set::apply_scanner_commands()
+            bool init_parallel{false};     // its PHASE_ENABLED is thread-safe, and may run alongside others'
+            bool scan_batch{false};        // called once for a batch of small sbufs; see scanner_params::batch
 
             const std::string asString() const {
                 std::string ret;
@@ -87,6 +105,11 @@ struct scanner_params {
                 if (scan_seen_before) ret += " SCAN_SEEN_BEFORE";
                 if (fast_find) ret += " FAST_FIND";
                 if (depth0_only) ret += " DEPTH0_ONLY";
+                if (skip_random) ret += " SKIP_RANDOM";
+                if (skip_text) ret += " SKIP_TEXT";
+                if (init_when_enabled) ret += " INIT_WHEN_ENABLED";
+                if (init_parallel) ret += " INIT_PARALLEL";
+                if (scan_batch) ret += " SCAN_BATCH";
                 return ret;
             }
         } scanner_flags{};
@@ -115,19 +138,26 @@ struct scanner_params {
         uint64_t flags{};              //   flags
         std::vector<feature_recorder_def> feature_defs{}; //   feature files that this scanner needs.
         std::vector<histogram_def> histogram_defs{};      //   histogram definitions that the scanner needs
+        std::vector<std::string> find_patterns{};         //   literals for the shared find list (see scanner_set::get_find_list)
+        /* Literals (of any bytes) that the sbuf must contain for the scanner to be called, e.g. "%PDF" or
+         * "PK\x03\x04". The prefilters of all the scanners are searched for in one pass over each sbuf,
+         * and the scanner is given where they are in scanner_params::prefilter_hits.
+         */
+        std::vector<std::string> prefilters{};
 
         // Derrived:
 
 
-        // void              *packet_user {};        //   data for network callback
-        // be13::packet_callback_t *packet_cb {};    //   callback for processing network packets, or NULL
+        void              *packet_user {};        //   data for network callback
+        be13::packet_callback_t *packet_cb {};    //   callback for processing network packets, or NULL
 
         // Move constructor
         scanner_info(scanner_info&& source)
             : scanner(source.scanner), name(source.name), pathPrefix(source.pathPrefix),
               helpstr(source.helpstr), description(source.description),
               url(source.url), scanner_version(source.scanner_version),
-              flags(source.flags), feature_defs(source.feature_defs), histogram_defs(source.histogram_defs) {}
+              flags(source.flags), feature_defs(source.feature_defs), histogram_defs(source.histogram_defs),
+              find_patterns(source.find_patterns), prefilters(source.prefilters), packet_user(source.packet_user), packet_cb(source.packet_cb) {}
     };
 
     /* Scanners can also be asked to assist in printing. */
@@ -161,7 +191,8 @@ struct scanner_params {
     // the scans are implemented in the scanner set
     enum phase_t {
         PHASE_INIT,    // called in main thread when scanner loads
-        PHASE_ENABLED, // enable/disable commands called
+        PHASE_ENABLED, // enable/disable commands called; sent to the enabled scanners with init_when_enabled,
+                       // in the main thread unless the scanner sets init_parallel
         PHASE_SCAN,    // called in worker thread for every ENABLED scanner to scan an sbuf
         PHASE_SHUTDOWN // called in main thread for every ENABLED scanner when scanner is shutting down. Allows XML
                        // closing.
@@ -190,7 +221,7 @@ struct scanner_params {
      */
     scanner_params(const scanner_params& sp_existing, const sbuf_t* sbuf_)
         : ss(sp_existing.ss), phase(sp_existing.phase), sbuf(sbuf_), print_options(sp_existing.print_options),
-          depth(sp_existing.depth + 1), sxml(sp_existing.sxml){};
+          depth(sp_existing.depth + 1), sxml(sp_existing.sxml), cancel(sp_existing.cancel){};
 #if 0
     /* A scanner params with no print options */
     scanner_params(phase_t phase_, const sbuf_t &sbuf_, class feature_recorder_set &fs_):
@@ -210,6 +241,18 @@ struct scanner_params {
     PrintOptions print_options{}; // how to print. Default is that there are no options
     const uint32_t depth{0};      //  how far down are we? / only valid in SCAN_PHASE
     std::stringstream* sxml{};    //  on scanning and shutdown: CDATA added to XML stream if provided
+    const cancel_token* cancel{nullptr}; // on scanning: set when there is a time budget; see watchdog.h
+    /* On scanning, for a scanner with prefilters: where they start in the page, in order of offset. A hit's
+     * pattern is the index of the prefilter in scanner_info::prefilters. Never empty.
+     */
+    const std::vector<multi_pattern::hit_t>* prefilter_hits{nullptr};
+    /* On scanning a batch, for a scanner with scan_batch: the sbufs to scan, all at the same depth; sbuf is
+     * the first of them, and prefilter_hits is not set. A scanner without scan_batch is called for each one.
+     */
+    const std::vector<const sbuf_t*>* batch{nullptr};
+    sbuf_batch* collect{nullptr}; // on scanning, if batching: where recurse() puts the small sbufs
+    /* A scanner that loops over its sbuf should return early when this is true */
+    bool cancelled() const { return cancel != nullptr && cancel->cancelled(); }
     std::filesystem::path const get_input_fname() const; // not sure why this is needed?
 
     virtual void recurse(sbuf_t* sbuf) const; // recursive call by scanner
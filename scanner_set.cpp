@@ -4,8 +4,13 @@
  * bulk_extractor backend stuff, used for both standalone executable and bulk_extractor.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 /* needed solely for loading shared libraries */
@@ -16,11 +21,23 @@
 #endif
 
 #include "aftimer.h"
+#include "dfxml_log.h"
 #include "dfxml_cpp/src/dfxml_writer.h"
 #include "dfxml_cpp/src/hash_t.h"
+#include "flow_sharder.h"
 #include "formatter.h"
+#include "metrics_exporter.h"
+#include "numa.h"
+#include "page_cache.h"
+#include "pcap_reader.h"
+#include "scan_journal.h"
 #include "scanner_config.h"
+#include "scanner_manifest.h"
 #include "scanner_set.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "utils.h"
+#include "word_and_context_list.h"
 
 /****************************************************************
  *** SCANNER SET IMPLEMENTATION (previously the PLUG-IN SYSTEM)
@@ -34,25 +51,12 @@
  *        All of the global variables go away.
  */
 
-#if 0
-/* object for keeping track of packet callbacks */
-class packet_plugin_info {
-public:
-    packet_plugin_info(void *user_,be13::packet_callback_t *callback_):user(user_),callback(callback_){};
-    void *user;
-    be13::packet_callback_t *callback;
-};
-
-/* Vector of callbacks */
-typedef std::vector<packet_plugin_info> packet_plugin_info_vector_t;
-//packet_plugin_info_vector_t  packet_handlers;   // pcap callback handlers
-#endif
-
 /****************************************************************
  * create the scanner set
  */
 scanner_set::scanner_set(const scanner_config& sc_, const feature_recorder_set::flags_t& f, class dfxml_writer* writer_)
     : sc(sc_), fs(f, sc_), writer(writer_) {
+    if (writer) dlog = std::make_unique<dfxml_log>(*writer);
     if (getenv("DEBUG_SCANNER_SET_PRINT_STEPS")) debug_flags.debug_print_steps = true;
     if (getenv("DEBUG_SCANNER_SET_NO_SCANNERS")) debug_flags.debug_no_scanners = true;
     if (getenv("DEBUG_SCANNER_SET_SCANNER")) debug_flags.debug_scanner = true;
@@ -61,8 +65,34 @@ scanner_set::scanner_set(const scanner_config& sc_, const feature_recorder_set::
     if (getenv("DEBUG_SCANNER_SET_INFO")) debug_flags.debug_info = true;
     if (getenv("DEBUG_SCANNER_SET_EXIT_EARLY")) debug_flags.debug_exit_early = true;
     if (getenv("DEBUG_SCANNER_SET_REGISTER")) debug_flags.debug_register = true;
+    if (getenv("DEBUG_SCANNER_SET_NO_THREADS")) debug_flags.debug_no_threads = true;
     const char *dsi = getenv("DEBUG_SCANNERS_IGNORE");
     if (dsi!=nullptr) debug_flags.debug_scanners_ignore=dsi;
+
+    if (sc.dedup_hash_algorithm == "fast") {
+        dedup_fast = true;
+    } else if (sc.dedup_hash_algorithm == "sha1" || sc.dedup_hash_algorithm == "SHA1") {
+        dedup_fast = false;
+    } else {
+        throw std::runtime_error("scanner_set: invalid dedup_hash_algorithm: " + sc.dedup_hash_algorithm);
+    }
+    if (!sc.trace_file.empty()) {
+        trace_sbuf_name = tracer::intern("process_sbuf");
+        tracer::enable();
+    }
+}
+
+scanner_set::~scanner_set()
+{
+    /* If shutdown() was not called, the threads that call back into this object are stopped first */
+    exporter.reset();
+    watchdog.reset();
+    delete pool;                // joins the workers
+    if (alloc_profiling) alloc_profile::disable();
+    dlog.reset();               // writes what is still buffered
+    for (auto it : stats_shards) {
+        delete it.second;
+    }
 }
 
 /****************************************************************
@@ -115,93 +145,134 @@ void scanner_set::add_scanners(scanner_t* const* scanners) {
     for (int i = 0; scanners[i]; i++) { add_scanner(scanners[i]); }
 }
 
-/* Add a scanner from a file (it's in the file as a shared library) */
-#if 0
-void scanner_set::add_scanner_file(std::string fn, const scanner_config &c)
-{    /* Figure out the function name */
-    size_t extloc = fn.rfind('.');
-    if(extloc==std::string::npos){
-        fprintf(stderr,"Cannot find '.' in %s",fn.c_str());
-        exit(1);
-    }
-    std::string func_name = fn.substr(0,extloc);
-    size_t slashloc = func_name.rfind('/');
-    if(slashloc!=std::string::npos) func_name = func_name.substr(slashloc+1);
-    slashloc = func_name.rfind('\\');
-    if(slashloc!=std::string::npos) func_name = func_name.substr(slashloc+1);
-
-    if(debug) std::cout << "Loading: " << fn << " (" << func_name << ")\n";
-    scanner_t *scanner = 0;
-#if defined(HAVE_DLOPEN)
-    void *lib=dlopen(fn.c_str(), RTLD_LAZY);
-
-    if(lib==0){
-        fprintf(stderr,"dlopen: %s\n",dlerror());
-        exit(1);
-    }
-
-    /* Resolve the symbol */
-    scanner = (scanner_t *)dlsym(lib, func_name.c_str());
-
-    if(scanner==0){
-        fprintf(stderr,"dlsym: %s\n",dlerror());
-        exit(1);
-    }
-#elif defined(HAVE_LOADLIBRARY)
-    /* Use Win32 LoadLibrary function */
-    /* See http://msdn.microsoft.com/en-us/library/ms686944(v=vs.85).aspx */
-    HINSTANCE hinstLib = LoadLibrary(TEXT(fn.c_str()));
-    if(hinstLib==0){
-        fprintf(stderr,"LoadLibrary(%s) failed",fn.c_str());
-        exit(1);
-    }
-    scanner = (scanner_t *)GetProcAddress(hinstLib,func_name.c_str());
-    if(scanner==0){
-        fprintf(stderr,"GetProcAddress(%s) failed",func_name.c_str());
-        exit(1);
+/* Register a plugin's scanner from its manifest, or initialize it and write the manifest for next time */
+void scanner_set::add_plugin_scanner(scanner_t* scanner, const std::string& plugin_key)
+{
+    if (scanner_info_db.find(scanner) != scanner_info_db.end()) { throw std::runtime_error("scanner already added"); }
+    const std::filesystem::path manifest =
+        plugin_key.empty() ? std::filesystem::path() : scanner_manifest::path_for(sc.plugin_manifest_dir, plugin_key);
+    if (!manifest.empty()) {
+        std::string help;
+        std::unique_ptr<const scanner_params::scanner_info> info(scanner_manifest::read(manifest, scanner, help));
+        if (info) {
+            if (debug_flags.debug_scanners_ignore.find(info->name) != std::string::npos) {
+                std::cerr << "DEBUG: ignore add_scanner " << info->name << "\n";
+                return;
+            }
+            if (debug_flags.debug_register) {
+                std::cerr << "add_scanner( " << info->name << " ) from " << manifest << "\n";
+            }
+            sc.help_str += help;
+            scanner_info_db[scanner] = info.get();
+            if (info->scanner_flags.default_enabled) { enabled_scanners.insert(scanner); }
+            uninitialized_scanners[scanner] = std::move(info);
+            return;
+        }
+    }
+    const size_t help_start = sc.help_str.size();
+    add_scanner(scanner);
+    auto it = scanner_info_db.find(scanner);
+    if (manifest.empty() || it == scanner_info_db.end() || it->second->packet_cb != nullptr) return;
+    try {
+        std::filesystem::create_directories(sc.plugin_manifest_dir);
+        scanner_manifest::write(manifest, *it->second, sc.help_str.substr(help_start));
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";  // the next run initializes it again
     }
+}
+
+void scanner_set::add_scanner_from(scanner_t scanner, const std::filesystem::path& plugin)
+{
+    add_plugin_scanner(scanner, sc.plugin_manifest_dir.empty() ? "" : scanner_manifest::plugin_key(plugin));
+}
+
+/* Load a shared library; its scanner is the function with the name of the file, e.g. scan_email in scan_email.so */
+static scanner_t* load_plugin(const std::filesystem::path& fn)
+{
+    const std::string func_name = fn.stem().string();
+#if defined(HAVE_DLFCN_H)
+    void* lib = dlopen(fn.c_str(), RTLD_LAZY);
+    if (lib == nullptr) { throw std::runtime_error(std::string("scanner_set: dlopen: ") + dlerror()); }
+    scanner_t* scanner = reinterpret_cast<scanner_t*>(dlsym(lib, func_name.c_str()));
+    if (scanner == nullptr) { throw std::runtime_error(std::string("scanner_set: dlsym: ") + dlerror()); }
+    return scanner;
 #else
-    std::cout << "  ERROR: Support for loadable libraries not enabled\n";
-    return;
+    throw std::runtime_error("scanner_set: cannot load " + fn.string() + ": loadable scanners are not supported");
 #endif
-    load_scanner(*scanner,sc);
 }
-#endif
 
-#if 0
-/* Add all of the scanners in a directory */
-void scanner_set::add_scanner_directory(const std::string &dirname,const scanner_info::scanner_config &sc )
+void scanner_set::add_scanner_file(std::string fn)
 {
-TODO: Re-implement using C++17 directory reading.
-
+    if (debug_flags.debug_register) std::cerr << "Loading: " << fn << "\n";
+    /* The key is taken first, so that a plugin that can't be read fails the same way with or without manifests */
+    const std::string key = sc.plugin_manifest_dir.empty() ? "" : scanner_manifest::plugin_key(fn);
+    add_plugin_scanner(load_plugin(fn), key);
+}
 
-        if(fname.substr(0,5)=="scan_" || fname.substr(0,5)=="SCAN_"){
-            size_t extloc = fname.rfind('.');
-            if(extloc==std::string::npos) continue; // no '.'
-            std::string ext = fname.substr(extloc+1);
-#ifdef WIN32
-            if(ext!="DLL") continue;    // not a DLL
+/* Add all of the scanners in a directory: the files named scan_*.so (scan_*.dll on Windows), in name order.
+ * The plugins' keys are found in parallel, since hashing them is most of the work when their manifests are
+ * used. Loading them stays on this thread: dlopen() takes the loader's lock anyway, and PHASE_INIT
+ * writes to sc.
+ */
+void scanner_set::add_scanner_directory(const std::string& dirname)
+{
+#ifdef _WIN32
+    const std::string ext = ".dll";
 #else
-            if(ext!="so") continue;     // not a shared library
+    const std::string ext = ".so";
 #endif
-            load_scanner_file(dirname+"/"+fname,sc );
+    std::vector<std::filesystem::path> plugins;
+    for (const auto& entry : std::filesystem::directory_iterator(dirname)) {
+        const std::string fname = entry.path().filename().string();
+        if (fname.size() > 5 && (fname.compare(0, 5, "scan_") == 0 || fname.compare(0, 5, "SCAN_") == 0) &&
+            ends_with(fname, ext)) {
+            plugins.push_back(entry.path());
+        }
+    }
+    std::sort(plugins.begin(), plugins.end());
+
+    std::vector<std::string> keys(plugins.size());
+    if (!sc.plugin_manifest_dir.empty()) {
+        std::vector<std::exception_ptr> errors(plugins.size());
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> threads;
+        const size_t nthreads = std::min<size_t>(plugins.size(), std::max(1u, std::thread::hardware_concurrency()));
+        for (size_t t = 0; t < nthreads; t++) {
+            threads.emplace_back([&plugins, &keys, &errors, &next] {
+                for (size_t i = next++; i < plugins.size(); i = next++) {
+                    try {
+                        keys[i] = scanner_manifest::plugin_key(plugins[i]);
+                    } catch (...) {
+                        errors[i] = std::current_exception();
+                    }
+                }
+            });
+        }
+        for (auto& it : threads) it.join();
+        for (const auto& it : errors) {
+            if (it) std::rethrow_exception(it);
         }
     }
+    for (size_t i = 0; i < plugins.size(); i++) {
+        if (debug_flags.debug_register) std::cerr << "Loading: " << plugins[i] << "\n";
+        add_plugin_scanner(load_plugin(plugins[i]), keys[i]);
+    }
 }
-#endif
 
-#if 0
 void scanner_set::load_scanner_packet_handlers()
 {
-    for (auto it: enabled_scanners){
-        const scanner_def *sd = (*it);
-            if(sd->info.packet_cb){
-                packet_handlers.push_back(packet_plugin_info(sd->info.packet_user,sd->info.packet_cb));
-            }
+    for (auto it : scanner_info_db) {
+        if (enabled_scanners.find(it.first) == enabled_scanners.end()) continue;
+        if (it.second->packet_cb) {
+            packet_handlers.push_back(packet_plugin_info(it.second->packet_user, it.second->packet_cb));
         }
     }
 }
-#endif
+
+void scanner_set::add_packet_handler(void* user, be13::packet_callback_t* callback)
+{
+    packet_handlers.push_back(packet_plugin_info(user, callback));
+}
 
 /****************************************************************
  *** scanner plugin loading
@@ -311,17 +382,27 @@ void scanner_set::log(const std::string message)
     }
 }
 
+/* Per-sbuf entries go to the DFXML file through dlog, without taking the writer's lock */
 void scanner_set::log(const sbuf_t &sbuf, const std::string message) // writes sbuf if not too deep.
 {
-    if (sbuf.depth() <= log_depth) {
-        std::stringstream m2;
-        m2 << sbuf.pos0 << " buflen=" << sbuf.bufsize;
-        if (sbuf.has_hash()) {
-            m2 << " " << sbuf.hash();
-        }
-        m2 << ": " << message;
-        log(m2.str());
+    if (!log_enabled(sbuf)) return;
+    std::string m2;
+    sbuf.pos0.append_str(m2);
+    m2 += " buflen=" + std::to_string(sbuf.bufsize);
+    if (sbuf.has_hash()) {
+        m2 += " " + sbuf.hash();
+    }
+    m2 += ": " + message;
+    dlog->write("log", m2);
+}
+
+void scanner_set::set_dfxml_writer(class dfxml_writer *writer_)
+{
+    if (writer) {
+        throw std::runtime_error("dfxml_writer already set");
     }
+    writer = writer_;
+    if (writer) dlog = std::make_unique<dfxml_log>(*writer);
 }
 
 
@@ -363,6 +444,7 @@ void scanner_set::apply_scanner_commands() {
             }
         }
     }
+    init_uninitialized_scanners();
 
     /* Create all of the requested feature recorders.
      * Multiple scanners may request the same feature recorder without generating an error.
@@ -384,9 +466,118 @@ void scanner_set::apply_scanner_commands() {
 
     /* set the carve defaults */
     fs.set_carve_defaults();
+    send_phase_enabled();
+    build_dispatch_plan();
+
+    for (auto it : enabled_scanners) {
+        for (const auto& pattern : scanner_info_db[it]->find_patterns) {
+            find_list.add(pattern);
+        }
+    }
+    find_list.compile();
     current_phase = scanner_params::PHASE_ENABLED;
 }
 
+/* A scanner registered from its manifest is initialized once it is known to be enabled. Its help was added
+ * from the manifest, so what its PHASE_INIT adds is dropped.
+ */
+void scanner_set::init_uninitialized_scanners()
+{
+    for (auto it = uninitialized_scanners.begin(); it != uninitialized_scanners.end();) {
+        scanner_t* scanner = it->first;
+        if (enabled_scanners.find(scanner) == enabled_scanners.end()) {
+            ++it;
+            continue;
+        }
+        const size_t help_start = sc.help_str.size();
+        scanner_params::PrintOptions po;
+        scanner_params sp(*this, scanner_params::PHASE_INIT, nullptr, po, nullptr);
+        (*scanner)(sp);
+        if (sp.info == nullptr) {
+            throw std::runtime_error("scanner_set::apply_scanner_commands: scanner " + it->second->name +
+                                     " did not set the sp.info field");
+        }
+        sc.help_str.resize(help_start);
+        scanner_info_db[scanner] = sp.info;
+        it = uninitialized_scanners.erase(it);
+    }
+}
+
+/* Scanners are not required to make PHASE_ENABLED thread-safe (many set globals there), so it is sent one
+ * scanner at a time, except to those that set init_parallel: they are called together, so that one that
+ * builds large tables there costs no more than the slowest of them. The first exception is rethrown.
+ */
+void scanner_set::send_phase_enabled()
+{
+    std::vector<scanner_t*> todo;
+    std::vector<scanner_t*> serial;
+    for (auto it : enabled_scanners) {
+        const auto& flags = scanner_info_db[it]->scanner_flags;
+        if (flags.init_when_enabled) (flags.init_parallel ? todo : serial).push_back(it);
+    }
+    std::vector<std::exception_ptr> errors(todo.size());
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    const size_t nthreads = std::min<size_t>(todo.size(), std::max(1u, std::thread::hardware_concurrency()));
+    for (size_t t = 0; t < nthreads; t++) {
+        threads.emplace_back([this, &todo, &errors, &next] {
+            for (size_t i = next++; i < todo.size(); i = next++) {
+                try {
+                    scanner_params::PrintOptions po;
+                    scanner_params sp(*this, scanner_params::PHASE_ENABLED, nullptr, po, nullptr);
+                    (*todo[i])(sp);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            }
+        });
+    }
+    for (auto& it : threads) it.join();
+    for (const auto& it : errors) {
+        if (it) std::rethrow_exception(it);
+    }
+    for (auto it : serial) {
+        scanner_params::PrintOptions po;
+        scanner_params sp(*this, scanner_params::PHASE_ENABLED, nullptr, po, nullptr);
+        (*it)(sp);
+    }
+}
+
+/* Flatten the enabled scanners and their flags into the dispatch plan, in scanner_info_db order. */
+void scanner_set::build_dispatch_plan() {
+    dispatch_plan.clear();
+    dispatch_flags = 0;
+    for (auto it : scanner_info_db) {
+        if (enabled_scanners.find(it.first) == enabled_scanners.end()) {
+            continue;
+        }
+        const auto& flags = it.second->scanner_flags;
+        dispatch_entry e;
+        e.scanner = it.first;
+        e.info = it.second;
+        if (flags.scan_ngram_buffer == false) e.flags |= SKIP_IF_NGRAM;
+        if (flags.depth0_only) e.flags |= SKIP_IF_DEEP;
+        if (flags.scan_seen_before == false) e.flags |= SKIP_IF_SEEN;
+        if (flags.recurse_always) e.flags |= CHECK_PATH;
+        if (flags.skip_random) e.flags |= SKIP_IF_RANDOM;
+        if (flags.skip_text) e.flags |= SKIP_IF_TEXT;
+        e.trace_name = tracer::intern(it.second->name);
+        if (!it.second->prefilters.empty()) {
+            e.prefilter_slot = prefilter_slots++;
+            for (uint32_t i = 0; i < it.second->prefilters.size(); i++) {
+                const uint32_t id = prefilter.add(it.second->prefilters[i]);
+                if (id >= prefilter_targets.size()) prefilter_targets.resize(id + 1);
+                prefilter_targets[id].push_back(prefilter_target_t{uint32_t(e.prefilter_slot), i});
+            }
+        }
+        const auto budget = sc.scanner_budgets_ms.find(it.second->name);
+        e.budget_ns = uint64_t(budget != sc.scanner_budgets_ms.end() ? budget->second : sc.scanner_budget_ms) * 1000 * 1000;
+        dispatch_flags |= e.flags;
+        dispatch_plan.push_back(e);
+    }
+    if (prefilter_slots > 0) prefilter.compile();
+}
+
 bool scanner_set::is_scanner_enabled(const std::string& name) {
     scanner_t* scanner = get_scanner_by_name(name);
     return enabled_scanners.find(scanner) != enabled_scanners.end();
@@ -410,6 +601,13 @@ bool scanner_set::is_find_scanner_enabled() {
     return false;
 }
 
+void scanner_set::add_find_pattern(const std::string& literal) {
+    if (current_phase != scanner_params::PHASE_INIT) {
+        throw std::runtime_error("add_find_pattern can only be run in scanner_params::PHASE_INIT");
+    }
+    find_list.add(literal);
+}
+
 const std::filesystem::path scanner_set::get_input_fname() const { return sc.input_fname; }
 
 
@@ -424,6 +622,94 @@ void scanner_set::phase_scan() {
         throw std::runtime_error("start_scan can only be run in scanner_params::PHASE_ENABLED");
     }
     current_phase = scanner_params::PHASE_SCAN;
+    scan_start = std::chrono::steady_clock::now();
+    if (sc.alloc_profile) {
+        alloc_tagged0 = alloc_profile::get_tagged(); // the tags are process-wide
+        alloc_profile::enable();
+        alloc_profiling = true;
+    }
+    load_scanner_packet_handlers();
+    if (!sc.page_cache_file.empty()) {
+        cache = std::make_unique<page_cache>(sc.page_cache_file);
+        cache_fingerprint = scan_fingerprint();
+    }
+
+    /* The watchdog ticks often enough to notice the smallest budget running over */
+    sbuf_budget_ns = uint64_t(sc.sbuf_budget_ms) * 1000 * 1000;
+    uint64_t smallest = sbuf_budget_ns;
+    for (const auto& it : dispatch_plan) {
+        if (it.budget_ns > 0 && (smallest == 0 || it.budget_ns < smallest)) smallest = it.budget_ns;
+    }
+    if (smallest > 0) {
+        watchdog = std::make_unique<scan_watchdog>(scan_watchdog::tick_for(smallest),
+                                                   [this](const scan_watchdog::overrun_t& o) { report_overrun(o); });
+    }
+
+    if (!sc.metrics_file.empty()) {
+        const std::filesystem::path mf = sc.metrics_file.is_relative() && sc.outdir != scanner_config::NO_OUTDIR
+                                             ? sc.outdir / sc.metrics_file
+                                             : sc.metrics_file;
+        exporter = std::make_unique<metrics_exporter>(mf, std::chrono::seconds(sc.metrics_seconds),
+                                                      [this] { return get_metrics(); });
+    }
+}
+
+void scanner_set::report_overrun(const scan_watchdog::overrun_t& o)
+{
+    std::stringstream ss;
+    ss << "<timeout>budget_ms=" << o.budget_ns / (1000 * 1000) << " elapsed_ms=" << o.elapsed_ns / (1000 * 1000)
+       << "</timeout>";
+    std::cerr << "Time budget exceeded: " << (o.scanner.empty() ? "page" : "scanner " + o.scanner)
+              << " sbuf.pos0: " << o.pos0 << " " << ss.str() << "\n";
+    try {
+        fs.get_alert_recorder().write(o.pos0, o.scanner.empty() ? "sbuf_budget" : "scanner=" + o.scanner, ss.str());
+    } catch (feature_recorder_set::NoSuchFeatureRecorder& e) {}
+}
+
+
+/* What the features of a page depend on, other than its contents. The scanners are taken by name, since
+ * scanner_info_db is ordered by the scanners' addresses, which change from one run to the next.
+ */
+digest_set::digest_t scanner_set::scan_fingerprint() const {
+    std::set<std::string> scanners;
+    for (const auto& it : dispatch_plan) scanners.insert(it.info->name + " " + it.info->scanner_version);
+    std::string fp = std::string(PACKAGE_VERSION) + "\n";
+    for (const auto& it : scanners) fp += "scanner " + it + "\n";
+    for (const auto& it : sc.namevals) fp += "config " + it.first + "=" + it.second + "\n";
+    fp += "context_window " + std::to_string(sc.context_window_default) + "\n";
+    fp += "hash " + sc.hash_algorithm + "\n";
+    fp += "max_depth " + std::to_string(max_depth) + " max_ngram " + std::to_string(max_ngram) + "\n";
+    return digest_set::from_hex(dfxml::sha1_generator::hash_buf(reinterpret_cast<const uint8_t*>(fp.data()), fp.size()).hexdigest());
+}
+
+/****************************************************************
+ *** Threading
+ ****************************************************************/
+
+void scanner_set::launch_workers(unsigned int count)
+{
+    if (pool) {
+        throw std::runtime_error("scanner_set::launch_workers: workers already launched");
+    }
+    if (current_phase == scanner_params::PHASE_SHUTDOWN) {
+        throw std::runtime_error("scanner_set::launch_workers cannot be called in scanner_params::PHASE_SHUTDOWN");
+    }
+    if (count == 0 || debug_flags.debug_no_threads) {
+        return;                 // single-threaded mode
+    }
+    thread_pool* p = new thread_pool(count, sc.numa_placement ? &numa_topology::system() : nullptr);
+    const std::lock_guard<std::mutex> lock(Mpool);
+    pool = p;
+}
+
+unsigned int scanner_set::get_worker_count() const
+{
+    return pool ? pool->worker_count() : 0;
+}
+
+void scanner_set::join()
+{
+    if (pool) pool->wait_idle();
 }
 
 /****************************************************************
@@ -432,10 +718,15 @@ void scanner_set::phase_scan() {
 
 /*
  * uses hash to determine if a block was prevously seen.
- * Hopefully sbuf.buf() is zero-copy.
+ * By default this is the SHA1, since a collision would skip the scanners on a page; the fast
+ * non-cryptographic hash can be chosen with scanner_config::dedup_hash_algorithm.
  */
 bool scanner_set::check_previously_processed(const sbuf_t& sbuf) {
-    return seen_set.check_for_presence_and_insert(sbuf.hash());
+    if (dedup_fast) {
+        const hash128_t h = sbuf.fast_hash();
+        return seen_set.check_for_presence_and_insert(digest_set::digest_t{h.hi, h.lo});
+    }
+    return seen_set.check_for_presence_and_insert(digest_set::from_hex(sbuf.hash()));
 }
 
 /****************************************************************
@@ -453,6 +744,14 @@ void scanner_set::shutdown() {
     if (current_phase != scanner_params::PHASE_SCAN) {
         throw std::runtime_error("shutdown can only be called in scanner_params::PHASE_SCAN");
     }
+
+    /* Drain the queue and stop the workers before the scanners are told to shut down */
+    if (pool) pool->join();
+    watchdog.reset();           // no budgeted call is open
+    exporter.reset();           // writes the last snapshot
+    checkpoint();               // every page is done; what the scanners write from now on is not committed
+    if (cache) cache->save();
+
     current_phase = scanner_params::PHASE_SHUTDOWN;
 
     /* Tell the scanners we are shutting down */
@@ -461,23 +760,268 @@ void scanner_set::shutdown() {
     for (auto it : enabled_scanners) { (*it)(sp); }
 
     fs.feature_recorders_shutdown();
+    if (dlog) dlog->flush();    // the per-sbuf entries precede the stats
 
     /* Tell every feature recorder to flush all of its histograms */
     fs.histograms_generate();
+    if (sc.shard.enabled() && sc.outdir != scanner_config::NO_OUTDIR) fs.write_shard_manifest();
 
     /* Output the scanner stats */
     if (writer) {
         writer->push("scanner_stats");
-        for (auto it : scanner_stats) {
+        for (const auto& it : get_scanner_stats()) {
             writer->set_oneline("true");
             writer->push("scanner");
-            writer->xmlout("name", get_scanner_name(it.first));
-            writer->xmlout("ns", it.second->ns);
-            writer->xmlout("calls", it.second->calls);
+            writer->xmlout("name", it.first);
+            writer->xmlout("ns", it.second.ns);
+            writer->xmlout("calls", it.second.calls);
+            writer->xmlout("bytes", it.second.bytes);
+            writer->xmlout("features", it.second.features);
+            if (it.second.timeouts) writer->xmlout("timeouts", it.second.timeouts);
+            if (alloc_profiling) {
+                writer->xmlout("allocs", it.second.allocs);
+                writer->xmlout("alloc_bytes", it.second.alloc_bytes);
+            }
+            writer->pop();
+        }
+        for (const auto& it : get_scanner_stats_detail()) {
+            writer->set_oneline("true");
+            writer->push("scanner_path");
+            writer->xmlout("name", get_scanner_name(it.first.scanner));
+            writer->xmlout("depth", it.first.depth);
+            writer->xmlout("path", it.first.path);
+            writer->xmlout("ns", it.second.ns);
+            writer->xmlout("calls", it.second.calls);
+            writer->xmlout("bytes", it.second.bytes);
+            writer->xmlout("features", it.second.features);
+            if (it.second.timeouts) writer->xmlout("timeouts", it.second.timeouts);
+            if (alloc_profiling) {
+                writer->xmlout("allocs", it.second.allocs);
+                writer->xmlout("alloc_bytes", it.second.alloc_bytes);
+            }
             writer->pop();
         }
         writer->pop();
+        dump_memory_stats(*writer);
+        if (alloc_profiling) dump_alloc_profile(*writer);
+    }
+    if (alloc_profiling) {
+        alloc_profile::disable();
+        alloc_profiling = false;
+    }
+
+    if (!sc.trace_file.empty()) {
+        tracer::disable();
+        const std::filesystem::path tf =
+            sc.trace_file.is_relative() && sc.outdir != scanner_config::NO_OUTDIR ? sc.outdir / sc.trace_file : sc.trace_file;
+        tracer::write_chrome_json(tf);
+    }
+}
+
+/****************************************************************
+ *** Memory accounting
+ ****************************************************************/
+
+scanner_set::memory_stats_t scanner_set::get_memory_stats() const
+{
+    memory_stats_t ms;
+    ms.sbuf_mapped = sbuf_t::mapped_memory.bytes();
+    ms.sbuf_mapped_high_water = sbuf_t::mapped_memory.high_water();
+    ms.sbuf_malloced = sbuf_t::malloced_memory.bytes();
+    ms.sbuf_malloced_high_water = sbuf_t::malloced_memory.high_water();
+    ms.sbuf_in_flight = bytes_in_flight.bytes();
+    ms.sbuf_in_flight_high_water = bytes_in_flight.high_water();
+    ms.histograms = fs.histogram_memory.bytes();
+    ms.histograms_high_water = fs.histogram_memory.high_water();
+    ms.seen_set = seen_set.bytes();
+    ms.carve_index = fs.carve_index.bytes();
+    ms.carve_queue = fs.carve_queue_bytes();
+    ms.stop_list = fs.stop_list ? fs.stop_list->bytes() : 0;
+    ms.alert_list = fs.alert_list ? fs.alert_list->bytes() : 0;
+    return ms;
+}
+
+void scanner_set::dump_memory_stats(dfxml_writer& w) const
+{
+    const memory_stats_t ms = get_memory_stats();
+    w.push("memory_stats");
+    w.xmlout("sbuf_mapped", ms.sbuf_mapped);
+    w.xmlout("sbuf_mapped_high_water", ms.sbuf_mapped_high_water);
+    w.xmlout("sbuf_malloced", ms.sbuf_malloced);
+    w.xmlout("sbuf_malloced_high_water", ms.sbuf_malloced_high_water);
+    w.xmlout("sbuf_in_flight", ms.sbuf_in_flight);
+    w.xmlout("sbuf_in_flight_high_water", ms.sbuf_in_flight_high_water);
+    w.xmlout("histograms", ms.histograms);
+    w.xmlout("histograms_high_water", ms.histograms_high_water);
+    w.xmlout("seen_set", ms.seen_set);
+    w.xmlout("carve_index", ms.carve_index);
+    w.xmlout("carve_queue", ms.carve_queue);
+    w.xmlout("stop_list", ms.stop_list);
+    w.xmlout("alert_list", ms.alert_list);
+    w.pop("memory_stats");
+}
+
+/* What the feature recorders allocated during this scan; the scanners' allocations are in their stats */
+void scanner_set::dump_alloc_profile(dfxml_writer& w) const
+{
+    w.push("alloc_profile");
+    for (const auto& it : alloc_profile::get_tagged()) {
+        const auto before = alloc_tagged0.find(it.first);
+        const alloc_profile::counts_t c = before == alloc_tagged0.end() ? it.second : it.second - before->second;
+        if (c.allocs == 0) continue;
+        w.set_oneline("true");
+        w.push("recorder");
+        w.xmlout("name", it.first);
+        w.xmlout("allocs", c.allocs);
+        w.xmlout("alloc_bytes", c.bytes);
+        w.pop();
+    }
+    w.pop("alloc_profile");
+}
+
+scanner_set::metrics_t scanner_set::get_metrics() const
+{
+    metrics_t m;
+    if (current_phase != scanner_params::PHASE_INIT && current_phase != scanner_params::PHASE_ENABLED) {
+        m.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - scan_start).count();
+    }
+    m.bytes_depth0 = bytes_depth0;
+    for (const auto& it : sbufs_by_depth) m.sbufs_by_depth.push_back(it.load(std::memory_order_relaxed));
+    m.dup_bytes = dup_bytes_encountered;
+    m.max_depth_seen = max_depth_seen;
+    m.pages_skipped = pages_skipped;
+    m.pages_replayed = pages_replayed;
+    m.timeouts = timeouts;
+    {
+        const std::lock_guard<std::mutex> lock(Mpool);
+        if (pool) {
+            m.workers = pool->worker_count();
+            m.queue_depth = pool->get_pending();
+            m.tasks_executed = pool->get_tasks_executed();
+            m.tasks_stolen = pool->get_tasks_stolen();
+        }
+    }
+    m.admission_waits = admission_waits;
+    m.features = fs.get_features_written();
+    m.carved_files = fs.get_carved_file_count();
+    m.carve_queue_bytes = fs.carve_queue_bytes();
+    m.memory = get_memory_stats();
+    return m;
+}
+
+/****************************************************************
+ *** Scanner statistics
+ ****************************************************************/
+
+/* The calling thread's shard, cached so that the mutex is only taken on a thread's first call */
+static thread_local uint64_t tl_stats_owner {0};
+static thread_local scanner_set::stats_shard_t* tl_stats_shard {nullptr};
+
+/* Time and features charged to scanners called for child sbufs while the current scanner was running.
+ * These are subtracted so that the stats for a scanner don't include the scanners it recursed into.
+ */
+static thread_local uint64_t tl_nested_ns {0};
+static thread_local uint64_t tl_nested_features {0};
+static thread_local alloc_profile::counts_t tl_nested_allocs {};
+
+/* Measures calls to a scanner, from its construction to charge(). Whoever called us gets its nested counters
+ * back, plus what was used here.
+ */
+class scanner_meter {
+public:
+    scanner_meter()
+        : saved_ns(tl_nested_ns), saved_features(tl_nested_features), saved_allocs(tl_nested_allocs) {
+        tl_nested_ns = 0;
+        tl_nested_features = 0;
+        tl_nested_allocs = alloc_profile::counts_t{};
+    }
+    /* Charges the calls (less what the scanners for child sbufs were charged) to the slot, which is found
+     * from the key the first time; returns the total ns
+     */
+    uint64_t charge(scanner_set::stats_shard_t& shard, scanner_set::stats_t*& slot, scanner_t* scanner,
+                    unsigned int depth, const std::string& path, uint64_t calls, uint64_t bytes, bool overran) {
+        const uint64_t total_ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+        const uint64_t total_features = feature_recorder::thread_features_written - features0;
+        const alloc_profile::counts_t total_allocs = alloc_profile::thread_untagged() - allocs0;
+        {
+            const std::lock_guard<std::mutex> lock(shard.M);
+            if (slot == nullptr) slot = &shard.stats[scanner_set::stats_key_t{scanner, depth, path}];
+            scanner_set::stats_t& st = *slot;
+            st.calls += calls;
+            st.ns += total_ns - tl_nested_ns;
+            st.bytes += bytes;
+            st.features += total_features - tl_nested_features;
+            if (overran) st.timeouts += 1;
+            st.allocs += total_allocs.allocs - tl_nested_allocs.allocs;
+            st.alloc_bytes += total_allocs.bytes - tl_nested_allocs.bytes;
+        }
+        tl_nested_ns = saved_ns + total_ns;
+        tl_nested_features = saved_features + total_features;
+        tl_nested_allocs = alloc_profile::counts_t{saved_allocs.allocs + total_allocs.allocs,
+                                                   saved_allocs.bytes + total_allocs.bytes};
+        return total_ns;
     }
+
+private:
+    const uint64_t saved_ns;
+    const uint64_t saved_features;
+    const alloc_profile::counts_t saved_allocs;
+    const uint64_t features0{feature_recorder::thread_features_written};
+    const alloc_profile::counts_t allocs0{alloc_profile::thread_untagged()}; // not the recorders'
+    const std::chrono::steady_clock::time_point t0{std::chrono::steady_clock::now()};
+};
+
+scanner_set::stats_shard_t& scanner_set::get_stats_shard()
+{
+    if (tl_stats_owner != instance_id) {
+        const std::lock_guard<std::mutex> lock(Mstats);
+        auto& shard = stats_shards[std::this_thread::get_id()];
+        if (shard == nullptr) {
+            shard = new stats_shard_t();
+        }
+        tl_stats_shard = shard;
+        tl_stats_owner = instance_id;
+    }
+    return *tl_stats_shard;
+}
+
+/* The dispatch plan doesn't change once scanning starts, so a slot is found by the index of its entry */
+std::vector<scanner_set::stats_t*>& scanner_set::get_stats_slots(stats_shard_t& shard, unsigned int depth,
+                                                                 const std::string& path)
+{
+    std::vector<stats_t*>& slots = depth == 0 ? shard.top_slots : shard.nested_slots[std::make_pair(depth, path)];
+    if (slots.size() != dispatch_plan.size()) slots.assign(dispatch_plan.size(), nullptr);
+    return slots;
+}
+
+scanner_set::stats_map_t scanner_set::get_scanner_stats_detail() const
+{
+    stats_map_t ret;
+    const std::lock_guard<std::mutex> lock(Mstats);
+    for (const auto& it : stats_shards) {
+        const std::lock_guard<std::mutex> shard_lock(it.second->M);
+        for (const auto& st : it.second->stats) {
+            ret[st.first] += st.second;
+        }
+    }
+    return ret;
+}
+
+std::map<std::string, scanner_set::stats_t> scanner_set::get_scanner_stats() const
+{
+    std::map<std::string, stats_t> ret;
+    for (const auto& it : get_scanner_stats_detail()) {
+        ret[get_scanner_name(it.first.scanner)] += it.second;
+    }
+    return ret;
+}
+
+std::string scanner_set::stats_path(const pos0_t& pos0)
+{
+    std::string ret = pos0.alphaPart();
+    std::replace(ret.begin(), ret.end(), '/', '-');
+    return ret;
 }
 
 // https://stackoverflow.com/questions/16190078/how-to-atomically-update-a-maximum-value
@@ -504,14 +1048,39 @@ void scanner_set::process_sbuf(class sbuf_t* sbufp) {
         return;        // nothing to scan
     }
 
+    if (sbufp->depth() == 0 && !sc.shard.contains(sbufp->pos0.offset)) {
+        pages_skipped++; // another shard's
+        delete sbufp;
+        return;
+    }
+
+    scan_journal* journal = fs.get_journal();
+    const bool top_page = journal && sbufp->depth() == 0;
+    if (top_page) {
+        if (journal->page_completed(sbufp->pos0.offset)) {
+            pages_skipped++;
+            delete sbufp;
+            return;
+        }
+        if (pool == nullptr) maybe_checkpoint(); // everything before this page is done
+    }
+
     const class sbuf_t& sbuf = *sbufp; // don't allow modification
 
-    log(sbuf, "scanner_set::process_sbuf() START");
+    const trace_span span(tracer::SBUF, trace_sbuf_name, sbuf.bufsize, sbuf.depth());
+    const bool logging = log_enabled(sbuf); // checked once, before anything is formatted
+    if (logging) log(sbuf, "scanner_set::process_sbuf() START");
+    const alloc_profile::counts_t sbuf_allocs0 = alloc_profile::thread_total();
     aftimer timer;
     timer.start();
 
     const pos0_t& pos0 = sbuf.pos0;
 
+    /* A top-level page's budget covers its scanners and the children scanned on this thread */
+    std::optional<scan_watchdog::scope> page_budget;
+    if (watchdog && sbuf_budget_ns > 0 && sbuf.depth() == 0) page_budget.emplace(*watchdog, sbuf, nullptr, sbuf_budget_ns);
+    bool overran_page = false;
+
     /* If we are too deep, error out */
     if (sbuf.depth() >= max_depth) {
         fs.get_alert_recorder().write(pos0, feature_recorder::MAX_DEPTH_REACHED_ERROR_FEATURE,
@@ -521,6 +1090,11 @@ void scanner_set::process_sbuf(class sbuf_t* sbufp) {
     }
 
     update_maximum<unsigned int>(max_depth_seen, sbuf.depth());
+    constexpr size_t depths = sizeof(sbufs_by_depth) / sizeof(sbufs_by_depth[0]);
+    sbufs_by_depth[std::min<size_t>(sbuf.depth(), depths - 1)].fetch_add(1, std::memory_order_relaxed);
+    if (sbuf.depth() == 0 && sbuf.highest_parent() == &sbuf) { // not a slice of a page
+        bytes_depth0.fetch_add(sbuf.bufsize, std::memory_order_relaxed);
+    }
 
     /* Determine if we have seen this buffer before */
     bool seen_before = check_previously_processed(sbuf);
@@ -528,12 +1102,31 @@ void scanner_set::process_sbuf(class sbuf_t* sbufp) {
         dup_bytes_encountered += sbuf.bufsize;
     }
 
+    /* A top-level page that an earlier run scanned is replayed from the page cache; otherwise what it
+     * writes is captured for the next run.
+     */
+    std::optional<page_cache::capture_t> capture;
+    digest_set::digest_t cache_key{};
+    if (cache && sbuf.depth() == 0 && !seen_before && pos0.path.empty()) {
+        cache_key = page_cache::key(digest_set::from_hex(sbuf.hash()), cache_fingerprint);
+        page_cache::features_t features;
+        if (cache->lookup(cache_key, features)) {
+            for (const auto& f : features) fs.named_feature_recorder(f.recorder).write(f.pos0(pos0), f.feature, f.context);
+            pages_replayed++;
+            features_replayed += features.size();
+            if (top_page) journal->page_done(pos0.offset);
+            sbufp->release();
+            return;
+        }
+        capture.emplace(pos0);
+    }
+
     /* Determine if the sbuf consists of a repeating ngram. If so,
      * it's only passed to the parsers that want ngrams. (By default,
      * such sbufs are booring.)
      */
 
-    size_t ngram_size = sbuf.find_ngram_size(max_ngram);
+    const sbuf_t::page_class_t page_class = sbuf.classify_page(max_ngram);
 
     /****************************************************************
      *** CALL EACH OF THE SCANNERS ON THE SBUF
@@ -543,122 +1136,447 @@ void scanner_set::process_sbuf(class sbuf_t* sbufp) {
         sbuf.hex_dump(std::cerr);
     }
 
-    for (auto it : scanner_info_db) {
-        // Look for reasons not to run a scanner
-        // this is a lot of find operations - could we make a vector of the enabled scanner_info_dbs?
-        const auto &name = it.second->name; // scanner name
-        const auto &flags = it.second->scanner_flags; // scanner flags
-        if (enabled_scanners.find(it.first) == enabled_scanners.end()) {
-            continue; //  not enabled
-        }
+    stats_shard_t& shard = get_stats_shard();
+    const std::string path = stats_path(pos0);
+    std::vector<stats_t*>& slots = get_stats_slots(shard, sbuf.depth(), path);
+
+    /* Reasons why a scanner might not be called for this sbuf */
+    uint32_t skip = 0;
+    if (page_class.ngram_size > 0) skip |= SKIP_IF_NGRAM;
+    if (sbuf.depth() > 0) skip |= SKIP_IF_DEEP;
+    if (seen_before) skip |= SKIP_IF_SEEN;
+    if (dispatch_flags & (SKIP_IF_RANDOM | SKIP_IF_TEXT)) {
+        const byte_profile_t& profile = sbuf.byte_profile();
+        if (profile.looks_random()) skip |= SKIP_IF_RANDOM;
+        if (profile.looks_text()) skip |= SKIP_IF_TEXT;
+    }
 
-        if (ngram_size > 0 && flags.scan_ngram_buffer == false) {
-            continue;
+    /* One pass over the sbuf for the prefilters of every scanner that declared them. The hits are kept
+     * on the stack, since the scanners may recurse into process_sbuf() on this thread.
+     */
+    std::vector<std::vector<multi_pattern::hit_t>> prefilter_hits(prefilter_slots);
+    if (prefilter_slots > 0) {
+        for (const auto& hit : sbuf.find_all(prefilter)) {
+            for (const auto& t : prefilter_targets[hit.pattern]) {
+                prefilter_hits[t.slot].push_back(multi_pattern::hit_t{hit.offset, hit.len, t.index});
+            }
         }
+    }
 
-        if (sbuf.depth() > 0 && flags.depth0_only) {
-            // depth >0 and this scanner only run at depth 0
+    for (size_t i = 0; i < dispatch_plan.size(); i++) {
+        const auto& it = dispatch_plan[i];
+        const auto &name = it.info->name; // scanner name
+        if (it.flags & skip) {
             continue;
         }
-
-        // Don't rescan data that has been seen twice (if scanner doesn't want it.)
-        if (seen_before && flags.scan_seen_before == false) {
-            continue;
+        if (it.prefilter_slot >= 0 && prefilter_hits[it.prefilter_slot].empty()) {
+            continue;               // none of what it looks for is here
+        }
+        if (page_budget && page_budget->token().cancelled()) {
+            break;                  // the page ran over; the rest of its scanners are not run
         }
 
         // If the scanner is a recurse_all, it always calls recurse. We can't it twice in the stack, or else
         // we get infinite regression.
-        if (flags.recurse_always && sbuf.pos0.contains( it.second->pathPrefix)) {
+        if ((it.flags & CHECK_PATH) && sbuf.pos0.contains(it.info->pathPrefix)) {
             continue;
         }
 
-        bool record_call_stats = false;
+        scanner_meter meter;
+        sbuf_batch collected;
+        bool overran = false;
+        {
+            scanner_params sp(*this, scanner_params::PHASE_SCAN, sbufp, scanner_params::PrintOptions(), nullptr);
+            if (it.prefilter_slot >= 0) sp.prefilter_hits = &prefilter_hits[it.prefilter_slot];
+            if (sc.batch_max_bytes > 0) sp.collect = &collected;
+            overran = call_scanner(it, sp);
+        }
+        schedule_batch(collected);  // without workers, scanned here and charged to their own scanners
+        const uint64_t total_ns =
+            meter.charge(shard, slots[i], it.scanner, sbuf.depth(), path, 1, sbuf.bufsize, overran);
+        if (overran) overran_page = true;
+
+        if (debug_flags.debug_print_steps) {
+            std::cerr << "sbuf.pos0=" << sbuf.pos0 << " scanner " << name << " t=" << total_ns / 1.0e9 << "\n";
+        }
+    }
+    timer.stop();
+    if (logging) {
+        std::string m = "scanner_set::process_sbuf() END t=" + std::to_string(timer.elapsed_seconds());
+        if (alloc_profiling) {
+            const alloc_profile::counts_t a = alloc_profile::thread_total() - sbuf_allocs0;
+            m += " allocs=" + std::to_string(a.allocs) + " alloc_bytes=" + std::to_string(a.bytes);
+        }
+        log(sbuf, m);
+    }
+    if (max_bytes_in_flight > 0) {
+        wait_for_children(sbuf);    // the memory budget counts our bytes until they are freed
+    }
+    if (page_budget && page_budget->overran()) {
+        overran_page = true;
+        timeouts++;
+    }
+    if (overran_page && page_cache::capturing) page_cache::capturing->complete = false; // what it found depends on time
+    if (capture && capture->complete) cache->store(cache_key, capture->features); // the children were scanned here
+    if (top_page) journal->page_done(pos0.offset); // with workers, checkpoint() waits for the children
+    sbufp->release();               // freed now, or by the last child to finish
+    return;
+}
+
+bool scanner_set::call_scanner(const dispatch_entry& it, scanner_params& sp)
+{
+    const auto& name = it.info->name;
+    const sbuf_t& sbuf = *sp.sbuf;
+    bool overran = false;
+    try {
+        if (debug_flags.debug_print_steps) {
+            std::cerr << "sbuf.pos0=" << sbuf.pos0 << " calling scanner " << name << "\n";
+        }
 
+        /* Call the scanner.*/
+        const trace_span scanner_span(tracer::SCANNER, it.trace_name, sbuf.bufsize, sbuf.depth());
+        if (watchdog && it.budget_ns > 0) {
+            const scan_watchdog::scope budget(*watchdog, sbuf, &name, it.budget_ns);
+            sp.cancel = &budget.token();
+            (*it.scanner)(sp);
+            overran = budget.overran();
+            if (overran) timeouts++; // here rather than in report_overrun(), which may not have run yet
+        } else {
+            sp.cancel = scan_watchdog::current(); // the page's, or that of the scanner that recursed
+            (*it.scanner)(sp);
+        }
+    } catch (const std::exception& e) {
+        std::stringstream ss;
+        ss << "std::exception Scanner: " << name << " Exception: " << e.what() << " sbuf.pos0: " << sbuf.pos0
+           << " bufsize=" << sbuf.bufsize << "\n";
+        std::cerr << ss.str();
         try {
+            fs.get_alert_recorder().write(sbuf.pos0, "scanner=" + name,
+                                          std::string("<exception>") + e.what() + "</exception>");
+        } catch (feature_recorder_set::NoSuchFeatureRecorder& e2) {}
+    } catch (...) {
+        std::stringstream ss;
+        ss << "std::exception Scanner: " << name << " Unknown Exception "
+           << " sbuf.pos0: " << sbuf.pos0 << " bufsize=" << sbuf.bufsize << "\n";
+        std::cerr << ss.str();
+        try {
+            fs.get_alert_recorder().write(sbuf.pos0, "scanner=" + name,
+                                          std::string("<unknown_exception></unknown_exception>"));
+        } catch (feature_recorder_set::NoSuchFeatureRecorder& e) {}
+    }
+    return overran;
+}
+
+/* What process_sbuf() does for each sbuf, except that for a batch the per-call work (the stats path and shard,
+ * the clock, the stats lock, the trace span and the log entries) is done once, and the scanners with
+ * scan_batch are called once. The sbufs are children, so there is no shard, journal, page cache or page budget.
+ */
+void scanner_set::process_batch(const std::vector<sbuf_t*>& sbufs)
+{
+    if (current_phase != scanner_params::PHASE_SCAN) {
+        throw std::runtime_error("process_batch can only be run in scanner_params::PHASE_SCAN");
+    }
 
-            /* Compute the effective path for stats */
-            std::string epath;
-            if (record_call_stats) {
-                bool inname = false;
-                for (auto cc : sbuf.pos0.path) {
-                    if (isupper(cc)) inname = true;
-                    if (inname) epath.push_back(toupper(cc));
-                    if (cc == '-') inname = false;
+    struct member_t {
+        sbuf_t* sbufp{nullptr};
+        uint32_t skip{0};
+        std::vector<std::vector<multi_pattern::hit_t>> prefilter_hits{};
+    };
+    std::vector<member_t> members;
+    members.reserve(sbufs.size());
+    uint64_t bytes = 0;
+    constexpr size_t depths = sizeof(sbufs_by_depth) / sizeof(sbufs_by_depth[0]);
+    for (sbuf_t* sbufp : sbufs) {
+        const sbuf_t& sbuf = *sbufp;
+        if (sbuf.bufsize == 0) {
+            delete sbufp;
+            continue;
+        }
+        if (sbuf.depth() >= max_depth) {
+            fs.get_alert_recorder().write(sbuf.pos0, feature_recorder::MAX_DEPTH_REACHED_ERROR_FEATURE,
+                                          feature_recorder::MAX_DEPTH_REACHED_ERROR_CONTEXT);
+            delete sbufp;
+            continue;
+        }
+        update_maximum<unsigned int>(max_depth_seen, sbuf.depth());
+        sbufs_by_depth[std::min<size_t>(sbuf.depth(), depths - 1)].fetch_add(1, std::memory_order_relaxed);
+
+        member_t m;
+        m.sbufp = sbufp;
+        if (check_previously_processed(sbuf)) {
+            dup_bytes_encountered += sbuf.bufsize;
+            m.skip |= SKIP_IF_SEEN;
+        }
+        if (sbuf.classify_page(max_ngram).ngram_size > 0) m.skip |= SKIP_IF_NGRAM;
+        if (sbuf.depth() > 0) m.skip |= SKIP_IF_DEEP;
+        if (dispatch_flags & (SKIP_IF_RANDOM | SKIP_IF_TEXT)) {
+            const byte_profile_t& profile = sbuf.byte_profile();
+            if (profile.looks_random()) m.skip |= SKIP_IF_RANDOM;
+            if (profile.looks_text()) m.skip |= SKIP_IF_TEXT;
+        }
+        if (prefilter_slots > 0) {
+            m.prefilter_hits.resize(prefilter_slots);
+            for (const auto& hit : sbuf.find_all(prefilter)) {
+                for (const auto& t : prefilter_targets[hit.pattern]) {
+                    m.prefilter_hits[t.slot].push_back(multi_pattern::hit_t{hit.offset, hit.len, t.index});
                 }
-                if (epath.size() > 0) epath.push_back('-');
-                for (auto cc : name) { epath.push_back(toupper(cc)); }
             }
+        }
+        bytes += sbuf.bufsize;
+        members.push_back(std::move(m));
+    }
+    if (members.empty()) return;
 
-            /* Call the scanner.*/
-            aftimer t;
+    const sbuf_t& first = *members.front().sbufp;
+    const trace_span span(tracer::SBUF, trace_sbuf_name, bytes, first.depth());
+    const bool logging = log_enabled(first);
+    if (logging) log(first, "scanner_set::process_batch() START sbufs=" + std::to_string(members.size()));
+    aftimer timer;
+    timer.start();
 
-            if (debug_flags.debug_print_steps) {
-                std::cerr << "sbuf.pos0=" << sbuf.pos0 << " calling scanner " << name << "\n";
-            }
-            if (record_call_stats || debug_flags.debug_print_steps) {
-                t.start();
-            }
-            scanner_params sp(*this, scanner_params::PHASE_SCAN, sbufp, scanner_params::PrintOptions(), nullptr);
-            aftimer t2;
-            //t2.start();
-            //log(sbuf, name + " calling");
-            (*it.first)(sp);
-            //t2.stop();
-            //log(sbuf, name + " returned " + std::to_string(t2.elapsed_seconds()));
-
-            if (record_call_stats || debug_flags.debug_print_steps) {
-                t.stop();
-                // fs.add_stats(epath,t.elapsed_seconds());
-                if (debug_flags.debug_print_steps) {
-                    std::cerr << "sbuf.pos0=" << sbuf.pos0 << " scanner " << name << " t=" << t.elapsed_seconds() << "\n";
-                }
+    stats_shard_t& shard = get_stats_shard();
+    const std::string path = stats_path(first.pos0); // they came from one scanner call, so share a path
+    std::vector<stats_t*>& slots = get_stats_slots(shard, first.depth(), path);
+    std::vector<size_t> wanted;
+    std::vector<const sbuf_t*> batch;
+    for (size_t d = 0; d < dispatch_plan.size(); d++) {
+        const auto& it = dispatch_plan[d];
+        wanted.clear();
+        uint64_t wanted_bytes = 0;
+        for (size_t i = 0; i < members.size(); i++) {
+            const member_t& m = members[i];
+            if (it.flags & m.skip) continue;
+            if (it.prefilter_slot >= 0 && m.prefilter_hits[it.prefilter_slot].empty()) continue;
+            if ((it.flags & CHECK_PATH) && m.sbufp->pos0.contains(it.info->pathPrefix)) continue;
+            wanted.push_back(i);
+            wanted_bytes += m.sbufp->bufsize;
+        }
+        if (wanted.empty()) continue;
+
+        scanner_meter meter;
+        sbuf_batch collected;
+        bool overran = false;
+        if (it.info->scanner_flags.scan_batch) {
+            batch.clear();
+            for (const size_t i : wanted) batch.push_back(members[i].sbufp);
+            scanner_params sp(*this, scanner_params::PHASE_SCAN, batch.front(), scanner_params::PrintOptions(), nullptr);
+            sp.batch = &batch;
+            if (sc.batch_max_bytes > 0) sp.collect = &collected;
+            overran = call_scanner(it, sp);
+        } else {
+            for (const size_t i : wanted) {
+                scanner_params sp(*this, scanner_params::PHASE_SCAN, members[i].sbufp, scanner_params::PrintOptions(),
+                                  nullptr);
+                if (it.prefilter_slot >= 0) sp.prefilter_hits = &members[i].prefilter_hits[it.prefilter_slot];
+                if (sc.batch_max_bytes > 0) sp.collect = &collected;
+                if (call_scanner(it, sp)) overran = true;
             }
-        } catch (const std::exception& e) {
-            std::stringstream ss;
-            ss << "std::exception Scanner: " << name << " Exception: " << e.what() << " sbuf.pos0: " << sbuf.pos0
-               << " bufsize=" << sbuf.bufsize << "\n";
-            std::cerr << ss.str();
-            try {
-                fs.get_alert_recorder().write(sbuf.pos0, "scanner=" + name,
-                                              std::string("<exception>") + e.what() + "</exception>");
-            } catch (feature_recorder_set::NoSuchFeatureRecorder& e2) {}
-        } catch (...) {
-            std::stringstream ss;
-            ss << "std::exception Scanner: " << name << " Unknown Exception "
-               << " sbuf.pos0: " << sbuf.pos0 << " bufsize=" << sbuf.bufsize << "\n";
-            std::cerr << ss.str();
-            try {
-                fs.get_alert_recorder().write(sbuf.pos0, "scanner=" + name,
-                                              std::string("<unknown_exception></unknown_exception>"));
-            } catch (feature_recorder_set::NoSuchFeatureRecorder& e) {}
         }
+        schedule_batch(collected);
+        meter.charge(shard, slots[d], it.scanner, first.depth(), path, wanted.size(), wanted_bytes, overran);
     }
     timer.stop();
-    std::stringstream ss;
-    ss << "scanner_set::process_sbuf() END t=" << timer.elapsed_seconds();
-    log(sbuf, ss.str());
-    delete sbufp;
-    return;
+    if (logging) log(first, "scanner_set::process_batch() END t=" + std::to_string(timer.elapsed_seconds()));
+    for (const member_t& m : members) {
+        if (max_bytes_in_flight > 0) wait_for_children(*m.sbufp);
+        m.sbufp->release();
+    }
+}
+
+/*
+ * In single-threaded mode every child has been processed (and deleted) by the time the scanners return.
+ * With a thread pool, children that reference our memory may still be queued or running on another
+ * worker. They hold references, so the memory stays valid without waiting; but when there is a memory
+ * budget we wait so that our bytes are counted until they are freed. Rather than block, run our own
+ * queued tasks, which are most likely to be those children.
+ */
+void scanner_set::wait_for_children(const sbuf_t& sbuf)
+{
+    if (pool == nullptr) return;
+    while (sbuf.children > 0) {
+        if (!pool->help()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void scanner_set::release_bytes_in_flight(uint64_t bytes)
+{
+    if (bytes == 0) return;
+    bytes_in_flight.sub(bytes);
+    const std::lock_guard<std::mutex> lock(Madmission);
+    admission_cv.notify_all();
+}
+
+void scanner_set::checkpoint()
+{
+    if (fs.get_journal() == nullptr) return;
+    join();                     // the pages that are done have no children left
+    fs.journal_checkpoint();
+    last_checkpoint = std::chrono::steady_clock::now();
+}
+
+void scanner_set::maybe_checkpoint()
+{
+    if (std::chrono::steady_clock::now() - last_checkpoint >= std::chrono::seconds(sc.checkpoint_seconds)) {
+        checkpoint();
+    }
 }
 
 void scanner_set::schedule_sbuf(sbuf_t *sbuf)
 {
-    process_sbuf(sbuf);
+    if (pool == nullptr || page_cache::capturing) { // a page being captured is scanned on one thread
+        process_sbuf(sbuf);
+        return;
+    }
+
+    if (!pool->is_worker_thread() && sbuf->depth() == 0) maybe_checkpoint();
+
+    /* Only sbufs that own their memory count against the budget */
+    const uint64_t bytes = (sbuf->highest_parent() == sbuf) ? sbuf->bufsize : 0;
+    if (!admit(bytes)) {
+        process_sbuf(sbuf);
+        return;
+    }
+    /* A top-level page goes to the node that image_reader put it on; anything else to the next node in turn.
+     * (Only the pagesize of the last page is short, so at worst one page is on the wrong node.)
+     */
+    int node = -1;
+    if (sc.numa_placement && sbuf->depth() == 0 && pool->node_count() > 1) {
+        node = numa_topology::page_node(sbuf->pos0.offset, sbuf->pagesize, pool->node_count());
+    }
+    pool->submit([this, sbuf, bytes] {
+        try {
+            process_sbuf(sbuf);
+        } catch (...) {
+            release_bytes_in_flight(bytes);
+            throw;
+        }
+        release_bytes_in_flight(bytes);
+    }, node);
 }
 
-std::string scanner_set::hash(const sbuf_t& sbuf) const { return sbuf.hash(fs.hasher.func); }
+bool scanner_set::admit(uint64_t bytes)
+{
+    const uint64_t limit = max_bytes_in_flight;
+    if (limit > 0 && bytes > 0 && bytes_in_flight + bytes > limit) {
+        if (pool->is_worker_thread()) {
+            /* Blocking a worker could deadlock the pool. Go depth-first instead. */
+            admission_inline++;
+            return false;
+        }
+        /* Wait for the workers to free some memory. A single sbuf larger than the budget is admitted
+         * once nothing else is in flight.
+         */
+        admission_waits++;
+        std::unique_lock<std::mutex> lock(Madmission);
+        admission_cv.wait(lock, [this, bytes, limit] {
+            return bytes_in_flight + bytes <= limit || bytes_in_flight == 0;
+        });
+    }
+    bytes_in_flight.add(bytes);
+    return true;
+}
+
+bool scanner_set::outlives_call(const sbuf_t* sbuf, const sbuf_t* scanned)
+{
+    const sbuf_t* owner = sbuf->highest_parent();
+    return (owner == sbuf && sbuf->memory_bytes() > 0) || (scanned != nullptr && owner == scanned->highest_parent());
+}
+
+/* Top-level pages are never batched, so each stays one task */
+bool scanner_set::add_to_batch(sbuf_batch& batch, sbuf_t* sbuf, const sbuf_t* scanned)
+{
+    if (sc.batch_max_bytes == 0 || sbuf->bufsize > sc.batch_max_bytes || sbuf->depth() == 0) return false;
+    if (!outlives_call(sbuf, scanned)) return false;
+    if (!batch.sbufs.empty() && batch.sbufs.front()->depth() != sbuf->depth()) schedule_batch(batch);
+    batch.sbufs.push_back(sbuf);
+    if (batch.sbufs.size() >= std::max<size_t>(sc.batch_max_sbufs, 1)) schedule_batch(batch);
+    return true;
+}
+
+void scanner_set::schedule_batch(sbuf_batch& batch)
+{
+    if (batch.sbufs.empty()) return;
+    std::vector<sbuf_t*> sbufs;
+    sbufs.swap(batch.sbufs);
+    if (pool == nullptr || page_cache::capturing) {
+        process_batch(sbufs);
+        return;
+    }
+    uint64_t bytes = 0;
+    for (const sbuf_t* sbuf : sbufs) {
+        if (sbuf->highest_parent() == sbuf) bytes += sbuf->bufsize;
+    }
+    if (!admit(bytes)) {
+        process_batch(sbufs);
+        return;
+    }
+    pool->submit([this, sbufs, bytes] {
+        try {
+            process_batch(sbufs);
+        } catch (...) {
+            release_bytes_in_flight(bytes);
+            throw;
+        }
+        release_bytes_in_flight(bytes);
+    });
+}
+
+std::string scanner_set::hash(const sbuf_t& sbuf) const {
+    if (fs.hasher.algorithm != sbuf_t::DIGEST_NONE) return sbuf.hexdigest(fs.hasher.algorithm);
+    return sbuf.hash(fs.hasher.func);
+}
 
 /**
  * Process a pcap packet.
  * Designed to be very efficient because we have so many packets.
  */
-#if 0
 void scanner_set::process_packet(const be13::packet_info &pi)
 {
-    for (packet_plugin_info_vector_t::iterator it = packet_handlers.begin(); it != packet_handlers.end(); it++){
-        (*(*it).callback)((*it).user,pi);
+    for (const auto& it : packet_handlers) {
+        (*it.callback)(it.user, pi);
     }
 }
+
+/* A hint only, so it does nothing where the compiler has no prefetch builtin */
+static inline void prefetch(const void* p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
 #endif
+}
+
+/**
+ * Process a batch of packets from a pcap_reader.
+ * Each packet is given to every handler while it is in cache, and the packets a few ahead are prefetched,
+ * since the packet data is in the mapped capture and is usually being read for the first time.
+ */
+void scanner_set::process_packets(const pcap_batch_t &batch)
+{
+    const size_t n = batch.size();
+    for (size_t i = 0; i < n; i++) {
+        if (i + PACKET_PREFETCH < n) {
+            prefetch(batch[i + PACKET_PREFETCH].pcap_data);
+        }
+        process_packet(batch[i]);
+    }
+    packets_processed += n;
+}
+
+uint64_t scanner_set::process_pcap(pcap_reader &reader, unsigned int shards)
+{
+    if (shards <= 1) {
+        return reader.run([this](const pcap_batch_t &batch) { process_packets(batch); });
+    }
+    flow_sharder sharder(shards, [this](size_t, const be13::packet_info &pi) { process_packet(pi); });
+    const uint64_t count = reader.run([&sharder](const pcap_batch_t &batch) { sharder.add(batch); });
+    sharder.finish();
+    packets_processed += count;
+    if (writer) sharder.dump_stats(*writer);
+    return count;
+}
 
 std::vector<std::string> scanner_set::feature_file_list() const { return fs.feature_file_list(); }
@@ -3,17 +3,23 @@
 #ifndef SCANNER_SET_H
 #define SCANNER_SET_H
 
+#include <condition_variable>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "alloc_profile.h"
 #include "atomic_map.h"
+#include "digest_set.h"
 #include "sbuf.h"
 #include "scanner_config.h"
 #include "scanner_params.h"
+#include "watchdog.h"
 
 /**
  * \file
@@ -49,14 +55,16 @@
  * The scanner_set references the feature_recorder_set, which is a set of feature_recorder objects.
  *
  * The scanner_set controls running of the scanners. It can run in a single-threaded mode, having a single
- * sbuf processed recursively within a single thread.
- * TODO: or it can be called with a threadpool.
+ * sbuf processed recursively within a single thread, or launch_workers() can be called to process
+ * scheduled sbufs with a work-stealing thread pool (see thread_pool.h). In threaded mode the child sbufs
+ * created by recursive scanners become tasks that idle workers can steal.
  */
 
-//#include "packet_info.h"
 #include "feature_recorder_set.h"
 #include "scanner_params.h" // needed for scanner_t
 
+struct pcap_batch_t; // see pcap_reader.h
+
 /**
  *  \class scanner_set
  *
@@ -77,13 +85,107 @@ class scanner_set {
     // Map the scanner name to the scanner pointer
     std::map<scanner_t*, const struct scanner_params::scanner_info*> scanner_info_db{};
     std::set<scanner_t*> enabled_scanners{}; // the scanners that are enabled
+    /* Scanners registered from a manifest, which get their PHASE_INIT in apply_scanner_commands() if they are
+     * enabled; see scanner_manifest.h. Their scanner_info is owned here until then.
+     */
+    std::map<scanner_t*, std::unique_ptr<const struct scanner_params::scanner_info>> uninitialized_scanners{};
+    void add_plugin_scanner(scanner_t* scanner, const std::string& plugin_key); // "" for no manifest
+    void init_uninitialized_scanners(); // the PHASE_INIT of the enabled uninitialized_scanners
+    void send_phase_enabled();          // PHASE_ENABLED to the enabled scanners with init_when_enabled
+
+    /* The dispatch plan is a flat array of the enabled scanners, built at the end of apply_scanner_commands().
+     * Each entry's flags are the reasons it might be skipped, so process_sbuf() can decide which scanners
+     * to call with a linear scan and a mask instead of map and set lookups.
+     */
+    struct dispatch_entry {
+        scanner_t* scanner{nullptr};
+        const struct scanner_params::scanner_info* info{nullptr};
+        uint32_t flags{0};
+        uint32_t trace_name{0};         // see tracer::intern()
+        uint64_t budget_ns{0};          // 0 for no time budget
+        int prefilter_slot{-1};         // where its prefilter hits go, if it has prefilters
+    };
+    static inline const uint32_t SKIP_IF_NGRAM = 0x01;   // scanner does not want ngram buffers
+    static inline const uint32_t SKIP_IF_DEEP = 0x02;    // scanner only runs at depth 0
+    static inline const uint32_t SKIP_IF_SEEN = 0x04;    // scanner does not want data seen before
+    static inline const uint32_t CHECK_PATH = 0x08;      // recurse_always: skip if our prefix is already in pos0
+    static inline const uint32_t SKIP_IF_RANDOM = 0x10;  // scanner does not want encrypted or compressed pages
+    static inline const uint32_t SKIP_IF_TEXT = 0x20;    // scanner does not want text pages
+    std::vector<dispatch_entry> dispatch_plan{};
+    uint32_t dispatch_flags{0};                 // every entry's flags, or'd; the page profile is only made if needed
+    multi_pattern find_list{};                  // compiled by apply_scanner_commands()
+
+    /* The prefilters of every scanner in the plan, in one automaton. A literal that several scanners
+     * declared is one pattern, which has a target for each of them.
+     */
+    struct prefilter_target_t {
+        uint32_t slot{0};               // the scanner's dispatch_entry::prefilter_slot
+        uint32_t index{0};              // in its scanner_info::prefilters
+    };
+    multi_pattern prefilter{};
+    std::vector<std::vector<prefilter_target_t>> prefilter_targets{}; // by pattern id
+    uint32_t prefilter_slots{0};
+    void build_dispatch_plan();
+    /* Calls the scanner with sp, sending what it throws to the alert recorder; true if it ran over its budget */
+    bool call_scanner(const dispatch_entry& it, scanner_params& sp);
 
-    // scanner_stats
-    struct stats {
-        std::atomic<uint64_t> ns{0};    // nanoseconds
-        std::atomic<uint64_t> calls{0}; // calls
+public:
+    /* Per-scanner statistics.
+     * Every scanner call is charged to the scanner, the depth of the sbuf and the sbuf's forensic path
+     * prefix (the decoder names in pos0, e.g. GZIP-BASE64). Each thread accumulates into its own shard,
+     * which is only contended when it is merged for reporting.
+     * ns and features are self values: recursive calls made on the same thread are charged to the scanner
+     * that processes the child sbuf, not to the parent.
+     */
+    struct stats_t {
+        uint64_t calls{0};    // calls; a scan_batch scanner's batch counts one for each of its sbufs
+        uint64_t ns{0};       // nanoseconds
+        uint64_t bytes{0};    // bytes in the sbufs scanned
+        uint64_t features{0}; // features written
+        uint64_t timeouts{0}; // calls that ran past their time budget
+        uint64_t allocs{0};   // heap allocations, with sc.alloc_profile; see alloc_profile.h
+        uint64_t alloc_bytes{0};
+        stats_t& operator+=(const stats_t& b) {
+            calls += b.calls;
+            ns += b.ns;
+            bytes += b.bytes;
+            features += b.features;
+            timeouts += b.timeouts;
+            allocs += b.allocs;
+            alloc_bytes += b.alloc_bytes;
+            return *this;
+        }
     };
-    atomic_map<scanner_t*, struct stats*> scanner_stats{}; // maps scanner name to performance stats
+    struct stats_key_t {
+        scanner_t* scanner{nullptr};
+        unsigned int depth{0};
+        std::string path{};   // forensic path prefix; empty at depth 0
+        bool operator<(const stats_key_t& b) const {
+            if (scanner != b.scanner) return scanner < b.scanner;
+            if (depth != b.depth) return depth < b.depth;
+            return path < b.path;
+        }
+    };
+    typedef std::map<stats_key_t, stats_t> stats_map_t;
+    /* The slots are where each dispatch_plan entry's calls are charged, found once for each depth and path
+     * so that a scanner call neither builds a stats_key_t nor searches stats. Only the owner thread uses
+     * them; a slot is null until the scanner is first charged there, and then points into stats, whose
+     * entries never move.
+     */
+    struct stats_shard_t {
+        std::mutex M{};       // owner thread and merges
+        stats_map_t stats{};  // protected by M
+        std::vector<stats_t*> top_slots{};  // at depth 0
+        std::map<std::pair<unsigned int, std::string>, std::vector<stats_t*>> nested_slots{};
+    };
+
+private:
+    inline static std::atomic<uint64_t> instance_counter{0};
+    const uint64_t instance_id{++instance_counter};     // identifies this scanner_set in thread-local caches
+    mutable std::mutex Mstats{};                        // protects stats_shards
+    std::map<std::thread::id, stats_shard_t*> stats_shards{};
+    stats_shard_t& get_stats_shard();                   // the calling thread's shard
+    std::vector<stats_t*>& get_stats_slots(stats_shard_t& shard, unsigned int depth, const std::string& path);
 
     // a pointer to every scanner info in all of the scanners.
     // This provides all_scanners
@@ -109,7 +211,65 @@ private:
     uint32_t max_ngram{10};                         // maximum ngram size to scan for
     std::atomic<uint64_t> dup_bytes_encountered{0}; // amount of dup data encountered
     class dfxml_writer* writer {nullptr};           // if provided, a dfxml writer. Mutext locking done by dfxml_writer.h
+    std::unique_ptr<class dfxml_log> dlog{};        // buffers the per-sbuf log entries for writer
+    uint32_t trace_sbuf_name{0};                    // the process_sbuf() span, if sc.trace_file is set
+
+    struct packet_plugin_info {
+        packet_plugin_info(void* user_, be13::packet_callback_t* callback_) : user(user_), callback(callback_) {}
+        void* user;
+        be13::packet_callback_t* callback;
+    };
+    std::vector<packet_plugin_info> packet_handlers{}; // pcap callback handlers; set before the scan starts
+    std::atomic<uint64_t> packets_processed{0};
     scanner_params::phase_t current_phase{scanner_params::PHASE_INIT};
+    bool dedup_fast{false};                         // use sbuf_t::fast_hash() rather than the SHA1 for seen_set
+    class thread_pool* pool {nullptr};              // if provided, scheduled sbufs are processed by worker threads
+    mutable std::mutex Mpool{};                     // protects setting pool from get_metrics() on the exporter's thread
+    void wait_for_children(const sbuf_t& sbuf);     // in threaded mode, children may still be using our memory
+
+    /* Admission control. In threaded mode, the bytes of the sbufs that have been queued but not yet
+     * deleted are tracked. When they would exceed max_bytes_in_flight, threads that aren't workers
+     * (the image reader) block in schedule_sbuf(), and workers process their new children immediately
+     * rather than queueing them, so the deepest (newest) work finishes and frees its memory first.
+     * Child sbufs that share their parent's memory are not counted, since the parent is already counted.
+     */
+    std::atomic<uint64_t> max_bytes_in_flight{0};   // 0 means no limit
+    memory_counter bytes_in_flight{};
+    std::atomic<uint64_t> admission_waits{0};       // times a producer blocked
+    std::atomic<uint64_t> admission_inline{0};      // times a worker processed a child immediately
+    std::mutex Madmission{};                        // for admission_cv
+    std::condition_variable admission_cv{};         // signaled when bytes_in_flight goes down
+    void release_bytes_in_flight(uint64_t bytes);
+    bool admit(uint64_t bytes);                     // false if a worker should process the bytes itself
+
+    /* Checkpoints; see scan_journal.h */
+    std::chrono::steady_clock::time_point last_checkpoint{std::chrono::steady_clock::now()};
+    std::atomic<uint64_t> pages_skipped{0};     // committed by an earlier run, or in another shard
+    void maybe_checkpoint();                    // if checkpoint_seconds have passed; called between pages
+
+    /* Pages replayed from earlier runs; see page_cache.h */
+    std::unique_ptr<class page_cache> cache{};  // if sc.page_cache_file is set; opened by phase_scan()
+    digest_set::digest_t cache_fingerprint{};   // of the enabled scanners and the configuration
+    std::atomic<uint64_t> pages_replayed{0};
+    std::atomic<uint64_t> features_replayed{0};
+    digest_set::digest_t scan_fingerprint() const;
+
+    /* Time budgets; see watchdog.h */
+    std::unique_ptr<scan_watchdog> watchdog{};  // if any budget is set; started by phase_scan()
+    uint64_t sbuf_budget_ns{0};
+    std::atomic<uint64_t> timeouts{0};
+    void report_overrun(const scan_watchdog::overrun_t& o); // on the watchdog thread
+
+    /* Metrics; see get_metrics() */
+    std::chrono::steady_clock::time_point scan_start{};
+    std::atomic<uint64_t> bytes_depth0{0};
+    std::atomic<uint64_t> sbufs_by_depth[16]{};   // deeper sbufs are counted in the last
+    std::unique_ptr<class metrics_exporter> exporter{}; // if sc.metrics_file is set; started by phase_scan()
+
+    /* Allocation profiling; see alloc_profile.h */
+    bool alloc_profiling{false};                // between phase_scan() and shutdown(), if sc.alloc_profile
+    std::map<std::string, alloc_profile::counts_t> alloc_tagged0{}; // the recorders' counts when the scan started
+    void dump_alloc_profile(class dfxml_writer& w) const;
 
 public:
     /* constructor and destructor */
@@ -118,14 +278,9 @@ public:
        @param writer - the DFXML writer to use, or nullptr.
     */
     scanner_set(const scanner_config& sc, const feature_recorder_set::flags_t& f, class dfxml_writer* writer);
-    virtual ~scanner_set(){};
+    virtual ~scanner_set();
 
-    void set_dfxml_writer(class dfxml_writer *writer_) {
-        if (writer) {
-            throw std::runtime_error("dfxml_writer already set");
-        }
-        writer = writer_;
-    }
+    void set_dfxml_writer(class dfxml_writer *writer_);
     class dfxml_writer *get_dfxml_writer() { return writer; }
 
     /* PHASE_INIT */
@@ -146,6 +301,7 @@ public:
         bool debug_exit_early{false};      // just print the size of the volume and exit
         bool debug_allocate_512MiB{false}; // allocate 512MiB but don't set any flags
         bool debug_register{false};        // print when scanners register
+        bool debug_no_threads{false};      // ignore launch_workers() and process every sbuf on the calling thread
         std::string debug_scanners_ignore{}; // ignore these scanners, separated by :
     } debug_flags{};
 
@@ -161,6 +317,10 @@ public:
     void add_scanners(scanner_t* const* scanners_builtin);  // load a nullptr array of scanners.
     void add_scanner_file(std::string fn);                  // load a scanner from a shared library file
     void add_scanner_directory(const std::string& dirname); // load all scanners in the directory
+    /* The scanner of a plugin file: with sc.plugin_manifest_dir, it is registered from the plugin's manifest if
+     * there is one, and only initialized once it is enabled. add_scanner_file() calls this.
+     */
+    void add_scanner_from(scanner_t scanner, const std::filesystem::path& plugin);
 
     /* These functions must be virtual so they can be called by dynamically loaded plugins */
     /* They throw a ScannerNotFound exception if no scanner exists */
@@ -187,6 +347,8 @@ public:
     // dfxml support
     virtual void log(const std::string message); // writes message to dfxml and log
     virtual void log(const sbuf_t &sbuf, const std::string message); // writes sbuf if not too deep.
+    /* Check this before formatting a message for log(sbuf, ...): the sbuf is not too deep and there is a writer */
+    bool log_enabled(const sbuf_t &sbuf) const { return writer != nullptr && sbuf.depth() <= log_depth; }
 
     scanner_params::phase_t get_current_phase() const { return current_phase; };
 
@@ -200,7 +362,18 @@ public:
     std::vector<std::string> get_enabled_scanners() const; // put names of the enabled scanners into the vector
     bool is_find_scanner_enabled();                        // return true if a find scanner is enabled
 
-    // void    load_scanner_packet_handlers(); // after all scanners are loaded, this sets up the packet handlers.
+    /* The find list: literals from add_find_pattern() (during PHASE_INIT) and from the find_patterns of
+     * the enabled scanners, compiled once by apply_scanner_commands() and shared by all threads.
+     */
+    void add_find_pattern(const std::string& literal);
+    const multi_pattern& get_find_list() const { return find_list; }
+
+    /* Packet handlers: the packet_cb of every enabled scanner (collected by phase_scan()), and any added
+     * with add_packet_handler(). Each packet is given to every handler, in that order.
+     */
+    void load_scanner_packet_handlers(); // after all scanners are loaded, this sets up the packet handlers.
+    void add_packet_handler(void* user, be13::packet_callback_t* callback);
+    size_t packet_handler_count() const { return packet_handlers.size(); }
 
     const std::filesystem::path get_input_fname() const;
     size_t histogram_count() const { return fs.histogram_count(); }; // passthrough, mostly for debugging
@@ -216,11 +389,113 @@ public:
     void process_sbuf(sbuf_t* sbuf); // process the sbuf, then delete it.
     virtual void schedule_sbuf(sbuf_t* sbuf);  // schedule the sbuf to be processed
 
-    // void     process_packet(const be13::packet_info &pi);
+    /* Batches; see scanner_config::batch_max_bytes. A batch is scheduled as one task, and process_batch()
+     * hashes, classifies and logs its sbufs, then calls each scan_batch scanner once with all of those that
+     * it wants and any other scanner once for each of them.
+     *
+     * A batched child is scanned after the scanner that made it returns, so only children for which
+     * outlives_call() holds are batched.
+     */
+    bool add_to_batch(sbuf_batch& batch, sbuf_t* sbuf, const sbuf_t* scanned); // false if not batched; schedules full batches
+    void schedule_batch(sbuf_batch& batch);            // schedule the batch's sbufs and empty it
+    void process_batch(const std::vector<sbuf_t*>& sbufs); // process sbufs of one depth, then delete them
+
+    /* Whether a child that a scanner gave to recurse() can still be scanned after the scanner returns, so that
+     * it may be batched or queued for the workers: it owns its buffer (from sbuf_malloc() or map_file()), or
+     * it is a slice of the sbuf being scanned, which its reference keeps alive. A child over memory that the
+     * scanner owns or reuses (a stack buffer, a decode buffer, sbuf_new()) must be scanned before recurse()
+     * returns.
+     */
+    static bool outlives_call(const sbuf_t* sbuf, const sbuf_t* scanned);
+
+    /* Threading. If launch_workers() is never called, schedule_sbuf() processes the sbuf immediately
+     * on the calling thread. Otherwise it queues the sbuf for the worker threads and returns, so the
+     * sbuf's memory must outlive the caller; see outlives_call().
+     */
+    void launch_workers(unsigned int count);   // start count worker threads; call before scheduling sbufs
+    unsigned int get_worker_count() const;     // 0 means single-threaded
+    void join();                               // wait until every scheduled sbuf has been processed
+
+    /* Memory budget for queued sbufs; see admission control above */
+    void set_max_bytes_in_flight(uint64_t bytes) { max_bytes_in_flight = bytes; }
+    uint64_t get_max_bytes_in_flight() const { return max_bytes_in_flight; }
+    uint64_t get_bytes_in_flight() const { return bytes_in_flight.bytes(); }
+    uint64_t get_bytes_in_flight_high_water() const { return bytes_in_flight.high_water(); }
+    uint64_t get_admission_waits() const { return admission_waits; }
+    /* With sc.journal_file, the scan is checkpointed every sc.checkpoint_seconds, between top-level pages,
+     * and when it is shut down; a checkpoint first waits for the workers to finish everything that has been
+     * scheduled. Top-level pages that an earlier run committed are skipped, as are those outside sc.shard.
+     */
+    void checkpoint();                         // call from the thread that schedules the pages
+    uint64_t get_pages_skipped() const { return pages_skipped; }
+    uint64_t get_pages_replayed() const { return pages_replayed; }     // from the page cache
+    uint64_t get_features_replayed() const { return features_replayed; }
+    uint64_t get_admission_inline() const { return admission_inline; }
+    uint64_t get_timeouts() const { return timeouts; } // calls and pages that ran past their time budget
+
+    static inline const size_t PACKET_PREFETCH = 4; // how far ahead process_packets() prefetches
+    void process_packet(const be13::packet_info &pi);
+    void process_packets(const pcap_batch_t &batch); // a batch from pcap_reader::next_batch()
+    uint64_t get_packets_processed() const { return packets_processed; }
+    /* Every remaining packet in reader. With shards > 1 the packets are split by flow over that many threads
+     * (see flow_sharder.h), so the handlers must be threadsafe, although each flow stays on one thread; the
+     * per-shard stats are written to the DFXML file. Returns the number of packets.
+     */
+    uint64_t process_pcap(class pcap_reader& reader, unsigned int shards = 0);
+
+    /* Scanner statistics, merged over all threads. Threads may still be adding to them during the scan. */
+    stats_map_t get_scanner_stats_detail() const;              // by scanner, depth and path prefix
+    std::map<std::string, stats_t> get_scanner_stats() const;  // totals by scanner name
+    static std::string stats_path(const pos0_t& pos0);         // e.g. 1000-GZIP-300-BASE64 -> GZIP-BASE64
     uint32_t get_max_depth_seen() const; // max seen during scan
 
+    /* Live memory, read from the counters that are kept as memory is allocated and freed (see
+     * memory_counter.h), so it is cheap enough to poll during the scan. The DFXML file gets it at shutdown.
+     */
+    struct memory_stats_t {
+        uint64_t sbuf_mapped{0};        // all the sbufs in the process, not just this scanner_set's
+        uint64_t sbuf_mapped_high_water{0};
+        uint64_t sbuf_malloced{0};
+        uint64_t sbuf_malloced_high_water{0};
+        uint64_t sbuf_in_flight{0};     // what admission control counts
+        uint64_t sbuf_in_flight_high_water{0};
+        uint64_t histograms{0};         // what the histogram spill governor counts
+        uint64_t histograms_high_water{0};
+        uint64_t seen_set{0};
+        uint64_t carve_index{0};
+        uint64_t carve_queue{0};
+        uint64_t stop_list{0};
+        uint64_t alert_list{0};
+    };
+    memory_stats_t get_memory_stats() const;
+    void dump_memory_stats(class dfxml_writer& writer) const; // <memory_stats>...</memory_stats>
+
+    /* A snapshot of the scan's counters, cheap enough to take every few seconds during the scan.
+     * The counters only go up; metrics_exporter turns two snapshots into rates. See metrics_exporter.h
+     */
+    struct metrics_t {
+        double seconds{0};                  // since phase_scan()
+        uint64_t bytes_depth0{0};           // bytes of the top-level pages scanned (not their slices)
+        std::vector<uint64_t> sbufs_by_depth{}; // sbufs scanned, by depth; the last counts the deeper ones too
+        uint64_t dup_bytes{0};
+        uint32_t max_depth_seen{0};
+        uint64_t pages_skipped{0};
+        uint64_t pages_replayed{0};
+        uint64_t timeouts{0};
+        unsigned int workers{0};
+        uint64_t queue_depth{0};            // tasks scheduled but not yet finished
+        uint64_t tasks_executed{0};
+        uint64_t tasks_stolen{0};
+        uint64_t admission_waits{0};
+        std::map<std::string, uint64_t> features{}; // features written, by recorder
+        uint64_t carved_files{0};
+        uint64_t carve_queue_bytes{0};      // carved data waiting to be written
+        memory_stats_t memory{};
+    };
+    metrics_t get_metrics() const;           // threadsafe
+
     // Management of previously seen data
-    atomic_set<std::string> seen_set {}; // hex hash values of sbuf pages that have been seen
+    digest_set seen_set {}; // digests of sbuf pages that have been seen; call seen_set.set_bounded() to cap memory
     virtual bool check_previously_processed(const sbuf_t& sbuf);
 
     /* PHASE_SHUTDOWN */
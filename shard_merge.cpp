@@ -0,0 +1,202 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include "atomic_unicode_histogram.h"
+#include "frame_codec.h"
+#include "shard_merge.h"
+
+void shard_merge::manifest_t::write(const std::filesystem::path& dir) const {
+    const std::filesystem::path fname = dir / MANIFEST;
+    std::ofstream of(fname);
+    if (!of.is_open()) throw std::runtime_error("shard_merge: cannot create " + fname.string());
+    of << HEADER << "\n";
+    of << "shard " << shard.id << " " << shard.count << " " << shard.start << " " << shard.end << " " << shard.size
+       << "\n";
+    of << "input " << input_fname << "\n";
+    for (const auto& it : feature_files) of << "feature " << it << "\n";
+    for (const auto& it : histogram_files) of << "histogram " << it << "\n";
+    of.close();
+    if (of.fail()) throw std::runtime_error("shard_merge: cannot write " + fname.string());
+}
+
+shard_merge::manifest_t shard_merge::manifest_t::read(const std::filesystem::path& dir) {
+    const std::filesystem::path fname = dir / MANIFEST;
+    std::ifstream in(fname);
+    if (!in.is_open()) throw std::runtime_error("shard_merge: cannot read " + fname.string());
+    manifest_t m;
+    std::string line;
+    if (!std::getline(in, line) || line != HEADER) {
+        throw std::runtime_error("shard_merge: " + fname.string() + " is not a shard manifest");
+    }
+    bool have_shard = false;
+    while (std::getline(in, line)) {
+        const size_t sp = line.find(' ');
+        const std::string tag = line.substr(0, sp);
+        const std::string rest = sp == std::string::npos ? "" : line.substr(sp + 1);
+        if (tag == "shard") {
+            std::istringstream ss(rest);
+            have_shard =
+                static_cast<bool>(ss >> m.shard.id >> m.shard.count >> m.shard.start >> m.shard.end >> m.shard.size);
+        } else if (tag == "input") {
+            m.input_fname = rest;
+        } else if (tag == "feature") {
+            m.feature_files.push_back(rest);
+        } else if (tag == "histogram") {
+            m.histogram_files.push_back(rest);
+        }
+    }
+    if (!have_shard || !m.shard.enabled() || m.shard.id >= m.shard.count || m.shard.start > m.shard.end ||
+        m.shard.end > m.shard.size) {
+        throw std::runtime_error("shard_merge: " + fname.string() + " has no valid shard line");
+    }
+    return m;
+}
+
+shard_merge::shard_merge(const std::vector<std::filesystem::path>& shard_dirs) {
+    for (const auto& dir : shard_dirs) shards.push_back(shard_dir_t{dir, manifest_t::read(dir)});
+    if (shards.empty()) throw std::runtime_error("shard_merge: no shards");
+    std::sort(shards.begin(), shards.end(),
+              [](const shard_dir_t& a, const shard_dir_t& b) { return a.manifest.shard.id < b.manifest.shard.id; });
+
+    /* The shards must be all of the shards of one scan, and cover the input without gaps or overlaps */
+    const auto& first = shards.front().manifest;
+    if (first.shard.count != shards.size()) {
+        throw std::runtime_error("shard_merge: the scan had " + std::to_string(first.shard.count) + " shards, but " +
+                                 std::to_string(shards.size()) + " were given");
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        const auto& m = shards[i].manifest;
+        const std::string where = "shard_merge: " + shards[i].dir.string() + ": ";
+        if (m.shard.id != i) throw std::runtime_error(where + "shard " + std::to_string(i) + " is missing or repeated");
+        if (m.shard.count != first.shard.count || m.shard.size != first.shard.size ||
+            m.input_fname != first.input_fname) {
+            throw std::runtime_error(where + "is a shard of a different scan");
+        }
+        const uint64_t expected_start = i == 0 ? 0 : shards[i - 1].manifest.shard.end;
+        if (m.shard.start != expected_start) throw std::runtime_error(where + "does not start where the last shard ended");
+    }
+    const auto& last = shards.back();
+    if (last.manifest.shard.end != first.shard.size) {
+        throw std::runtime_error("shard_merge: " + last.dir.string() + ": the last shard ends at " +
+                                 std::to_string(last.manifest.shard.end) + ", before the end of the input at " +
+                                 std::to_string(first.shard.size));
+    }
+}
+
+uint64_t shard_merge::line_offset(std::string_view line) {
+    uint64_t offset = 0;
+    for (const char ch : line) {
+        if (ch < '0' || ch > '9') break;
+        offset = offset * 10 + (ch - '0');
+    }
+    return offset;
+}
+
+void shard_merge::merge(const std::filesystem::path& outdir) {
+    for (const auto& s : shards) {
+        if (std::filesystem::exists(outdir) && std::filesystem::equivalent(s.dir, outdir)) {
+            throw std::runtime_error("shard_merge: cannot merge into a shard's outdir " + outdir.string());
+        }
+    }
+    std::filesystem::create_directories(outdir);
+
+    /* Every file that any shard has, once */
+    std::set<std::string> feature_files, histogram_files;
+    for (const auto& s : shards) {
+        feature_files.insert(s.manifest.feature_files.begin(), s.manifest.feature_files.end());
+        histogram_files.insert(s.manifest.histogram_files.begin(), s.manifest.histogram_files.end());
+    }
+    for (const auto& name : feature_files) merge_feature_file(name, outdir);
+    for (const auto& name : histogram_files) merge_histogram(name, outdir);
+}
+
+void shard_merge::merge_feature_file(const std::string& name, const std::filesystem::path& outdir) {
+    const std::string ext = std::filesystem::path(name).extension().string();
+    for (const auto codec : {frame_codec::GZIP, frame_codec::ZSTD, frame_codec::LZ4}) {
+        if (ext == frame_codec::extension(codec)) {
+            throw std::runtime_error("shard_merge: compressed feature file " + name + " cannot be merged");
+        }
+    }
+    const std::filesystem::path fname = outdir / name;
+    std::ofstream of(fname, std::ios_base::binary | std::ios_base::trunc);
+    if (!of.is_open()) throw std::runtime_error("shard_merge: cannot create " + fname.string());
+    bool banner_written = false;
+    for (const auto& s : shards) {
+        std::ifstream in(s.dir / name, std::ios_base::binary);
+        if (!in.is_open()) continue; // this shard found nothing for the recorder
+        std::vector<std::string> lines;
+        std::string line;
+        bool in_banner = true;
+        while (std::getline(in, line)) {
+            if (line.empty()) continue;
+            if (line[0] == '#') {
+                /* Only the first banner is kept, and it is no longer the banner of one shard */
+                if (in_banner && !banner_written && line.rfind("# Shard: ", 0) != 0) of << line << "\n";
+                continue;
+            }
+            in_banner = false;
+            lines.push_back(std::move(line));
+        }
+        banner_written = true;
+        std::stable_sort(lines.begin(), lines.end(), [](const std::string& a, const std::string& b) {
+            return line_offset(a) < line_offset(b);
+        });
+        for (const auto& it : lines) of << it << "\n";
+        features_merged += lines.size();
+    }
+    of.close();
+    if (of.fail()) throw std::runtime_error("shard_merge: cannot write " + fname.string());
+}
+
+/* A histogram line is n={count}\t{key}, then \t(utf16={count16}) and \t(error<={error}) if they are not 0 */
+void shard_merge::merge_histogram(const std::string& name, const std::filesystem::path& outdir) {
+    std::map<std::string, AtomicUnicodeHistogram::HistogramTally> totals;
+    for (const auto& s : shards) {
+        std::ifstream in(s.dir / name, std::ios_base::binary);
+        if (!in.is_open()) continue;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.compare(0, 2, "n=") != 0) continue;
+            const size_t tab = line.find('\t');
+            if (tab == std::string::npos) continue;
+            AtomicUnicodeHistogram::HistogramTally tally;
+            tally.count = std::stoul(line.substr(2, tab - 2));
+            std::string key = line.substr(tab + 1);
+            auto take_suffix = [&key](const std::string& tag, uint32_t& n) { // \t({tag}{n}) at the end of key
+                const size_t pos = key.rfind("\t(" + tag);
+                if (pos == std::string::npos || key.back() != ')') return;
+                const std::string digits = key.substr(pos + tag.size() + 2, key.size() - pos - tag.size() - 3);
+                if (digits.empty() || digits.find_first_not_of("0123456789") != std::string::npos) return;
+                n = std::stoul(digits);
+                key.erase(pos);
+            };
+            take_suffix("error<=", tally.error);
+            take_suffix("utf16=", tally.count16);
+            auto& total = totals[key];
+            total.count += tally.count;
+            total.count16 += tally.count16;
+            total.error += tally.error;
+        }
+    }
+
+    AtomicUnicodeHistogram::auh_t::report rep;
+    rep.reserve(totals.size());
+    for (auto& it : totals) rep.emplace_back(it.first, it.second);
+    std::sort(rep.begin(), rep.end(), AtomicUnicodeHistogram::rank_order);
+    histogram_keys += rep.size();
+
+    const std::filesystem::path fname = outdir / name;
+    std::ofstream of(fname, std::ios_base::binary | std::ios_base::trunc);
+    if (!of.is_open()) throw std::runtime_error("shard_merge: cannot create " + fname.string());
+    for (const auto& e : rep) of << e; // the keys were escaped when they were written, and escaping them again does nothing
+    of.close();
+    if (of.fail()) throw std::runtime_error("shard_merge: cannot write " + fname.string());
+}
@@ -0,0 +1,77 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * shard_merge - combines the outputs of a sharded scan into the layout of a scan done on one node.
+ *
+ * A sharded scan splits one input into byte ranges (scanner_config::shard_t::assign()) and scans each
+ * range in a run of its own, on as many nodes as there are shards, each with its own outdir. Feature
+ * offsets are those of the whole input, so nothing needs to be shifted. At shutdown each shard writes
+ * a manifest to its outdir:
+ *
+ *     # be13_api shard manifest 2
+ *     shard 1 4 16777216 33554432 67108864
+ *     input /cases/image.raw
+ *     feature email.txt
+ *     histogram email_domain_histogram.txt
+ *
+ * which says which shard it was (id, count, start, end, and the size of the input), what was scanned,
+ * and which of its files are feature files and histograms. shard_merge reads the manifests of every
+ * shard, checks that the shards are all of the same scan and cover the whole input, and then writes
+ * into its outdir:
+ *
+ * - each feature file, with the banner of the first shard that has it, and the features of every shard
+ *   in offset order. The shards are taken in order and each one's features are sorted by offset (stably,
+ *   so the features of one page keep their order), so only one shard's file is in memory at a time;
+ * - each histogram, with the counts of every shard added together and ranked as a histogram is.
+ *
+ * Compressed feature files are not merged; shard the scan without feature_file_compression.
+ */
+
+#ifndef SHARD_MERGE_H
+#define SHARD_MERGE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "scanner_config.h"
+
+class shard_merge {
+public:
+    static inline const std::string MANIFEST = "shard_manifest.txt";
+    static inline const std::string HEADER = "# be13_api shard manifest 2";
+
+    struct manifest_t {
+        scanner_config::shard_t shard{};
+        std::string input_fname{};
+        std::vector<std::string> feature_files{};   // file names in the shard's outdir
+        std::vector<std::string> histogram_files{};
+        void write(const std::filesystem::path& dir) const;       // throws std::runtime_error
+        static manifest_t read(const std::filesystem::path& dir); // throws std::runtime_error
+    };
+
+    /* Reads and checks the manifests in the shards' outdirs, given in any order; throws std::runtime_error */
+    explicit shard_merge(const std::vector<std::filesystem::path>& shard_dirs);
+    void merge(const std::filesystem::path& outdir); // throws std::runtime_error
+
+    uint64_t get_features_merged() const { return features_merged; }
+    uint64_t get_histogram_keys() const { return histogram_keys; }
+    static uint64_t line_offset(std::string_view line); // the input offset that a feature line starts with
+
+private:
+    struct shard_dir_t {
+        std::filesystem::path dir{};
+        manifest_t manifest{};
+    };
+    std::vector<shard_dir_t> shards{}; // in shard order
+    uint64_t features_merged{0};
+    uint64_t histogram_keys{0};
+
+    void merge_feature_file(const std::string& name, const std::filesystem::path& outdir);
+    void merge_histogram(const std::string& name, const std::filesystem::path& outdir);
+};
+
+#endif
@@ -0,0 +1,75 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * spsc_ring - a bounded, lock-free ring buffer for exactly one producer thread and one consumer thread.
+ *
+ * The capacity is rounded up to a power of 2. head (the next slot to pop) is only written by the consumer
+ * and tail (the next slot to push) only by the producer, each on its own cache line; each side also keeps
+ * a cached copy of the other's index, so that it only reads the shared one when the ring looks full or
+ * empty.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+template <class T> class spsc_ring {
+public:
+    explicit spsc_ring(size_t capacity) {
+        if (capacity == 0) throw std::invalid_argument("spsc_ring: capacity must be >0");
+        size_t n = 1;
+        while (n < capacity) n <<= 1;
+        slots.resize(n);
+        mask = n - 1;
+    }
+    size_t capacity() const { return mask + 1; }
+    size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+
+    /* producer only; false if the ring is full */
+    bool try_push(T&& v) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - producer_head > mask) {
+            producer_head = head.load(std::memory_order_acquire);
+            if (t - producer_head > mask) return false;
+        }
+        slots[t & mask] = std::move(v);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    bool try_push(const T& v) {
+        T copy(v);
+        return try_push(std::move(copy));
+    }
+
+    /* consumer only; false if the ring is empty */
+    bool try_pop(T& out) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == consumer_tail) {
+            consumer_tail = tail.load(std::memory_order_acquire);
+            if (h == consumer_tail) return false;
+        }
+        out = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    std::vector<T> slots{};
+    size_t mask{0};
+    alignas(64) std::atomic<size_t> head{0}; // written by the consumer
+    size_t consumer_tail{0};                 // the consumer's copy of tail
+    alignas(64) std::atomic<size_t> tail{0}; // written by the producer
+    size_t producer_head{0};                 // the producer's copy of head
+};
+
+#endif
@@ -26,7 +26,9 @@
 #include <functional>
 #include <iostream>
 #include <random>
+#include <set>
 #include <string>
+#include <thread>
 
 #include "atomic_unicode_histogram.h"
 #include "sbuf.h"
@@ -172,6 +174,157 @@ TEST_CASE("atomic_map", "[atomic]") {
     REQUIRE(am["three"] == 3);
 }
 
+#include "concurrent_map.h"
+TEST_CASE("concurrent_map", "[atomic]") {
+    concurrent_map<std::string, int> cm;
+    REQUIRE(cm.insert("one", 1) == true);
+    REQUIRE(cm.insert("one", 10) == false); // not replaced
+    REQUIRE(cm.find("one").value() == 1);
+    REQUIRE(cm.find("two").has_value() == false);
+    cm.insert_or_assign("one", 11);
+    REQUIRE(cm.find("one").value() == 11);
+    REQUIRE(cm.upsert("two", [](int& v) { v += 2; }) == true);
+    REQUIRE(cm.upsert("two", [](int& v) { v += 2; }) == false);
+    int seen = 0;
+    REQUIRE(cm.visit("two", [&seen](const int& v) { seen = v; }) == true);
+    REQUIRE(seen == 4);
+    REQUIRE(cm.visit("three", [&seen](const int& v) { seen = v; }) == false);
+    REQUIRE(cm.size() == 2);
+    REQUIRE(cm.erase("one") == true);
+    REQUIRE(cm.erase("one") == false);
+    REQUIRE(cm.size() == 1);
+
+    /* Counting from many threads */
+    cm.clear();
+    REQUIRE(cm.empty());
+    const int THREADS = 8;
+    const int KEYS = 1000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.push_back(std::thread([&cm] {
+            for (int i = 0; i < KEYS * 10; i++) cm.upsert(std::to_string(i % KEYS), [](int& v) { v++; });
+        }));
+    }
+    for (auto& t : threads) t.join();
+    REQUIRE(cm.size() == KEYS);
+    auto snap = cm.sorted_snapshot();
+    REQUIRE(snap.size() == KEYS);
+    REQUIRE(std::is_sorted(snap.begin(), snap.end()));
+    int bad = 0;
+    for (const auto& it : snap) {
+        if (it.second != THREADS * 10) bad++;
+    }
+    REQUIRE(bad == 0);
+    auto taken = cm.take();
+    REQUIRE(taken.size() == KEYS);
+    REQUIRE(cm.size() == 0);
+
+    concurrent_set<std::string> cs;
+    REQUIRE(cs.insert("a") == true);
+    REQUIRE(cs.insert("a") == false);
+    REQUIRE(cs.check_for_presence_and_insert("a") == true);
+    REQUIRE(cs.check_for_presence_and_insert("b") == false);
+    REQUIRE(cs.contains("b"));
+    REQUIRE(cs.size() == 2);
+    REQUIRE(cs.snapshot().size() == 2);
+    REQUIRE(cs.erase("a") == true);
+    REQUIRE(cs.contains("a") == false);
+}
+
+/****************************************************************
+ * digest_set.h
+ */
+#include "digest_set.h"
+#include "histogram_run.h"
+TEST_CASE("digest_set", "[atomic]") {
+    std::mt19937_64 rng(13);
+    std::vector<digest_set::digest_t> digests;
+    for (int i = 0; i < 10000; i++) { digests.push_back(digest_set::digest_t{rng(), rng()}); }
+
+    digest_set ds;
+    REQUIRE(ds.get_mode() == digest_set::EXACT);
+    int found = 0;
+    for (const auto& it : digests) { found += ds.check_for_presence_and_insert(it); }
+    REQUIRE(found == 0);
+    for (const auto& it : digests) { found += ds.contains(it); }
+    REQUIRE(found == 10000);
+    REQUIRE(ds.size() == 10000);
+    REQUIRE(ds.contains(digest_set::digest_t{}) == false);
+    REQUIRE(ds.check_for_presence_and_insert(digest_set::digest_t{}) == false);
+    REQUIRE(ds.check_for_presence_and_insert(digest_set::digest_t{}) == true);
+    REQUIRE(ds.size() == 10001);
+    REQUIRE(ds.false_positive_rate() == 0.0);
+    REQUIRE_THROWS_AS(ds.set_bounded(1024), std::runtime_error);
+
+    /* A hex digest and its binary form are the same digest */
+    const uint8_t sha1_bytes[20] = {0xd3, 0x48, 0x6a, 0xe9, 0x13, 0x6e, 0x78, 0x56, 0xbc, 0x42,
+                                    0x21, 0x23, 0x85, 0xea, 0x79, 0x70, 0x94, 0x47, 0x58, 0x02};
+    REQUIRE(digest_set::from_hex(hello_sha1) == digest_set::from_bytes(sha1_bytes, sizeof(sha1_bytes)));
+    REQUIRE_THROWS_AS(digest_set::from_hex("xyz"), std::runtime_error);
+
+    /* Concurrent inserts of overlapping digests: every digest is reported new exactly once */
+    digest_set ds2;
+    std::atomic<int> reported_new{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&] {
+            for (const auto& it : digests) {
+                if (ds2.check_for_presence_and_insert(it) == false) reported_new++;
+            }
+        }));
+    }
+    for (auto& it : threads) { it.join(); }
+    REQUIRE(reported_new == 10000);
+    REQUIRE(ds2.size() == 10000);
+
+    /* Bounded mode at 16 bits per digest has no false negatives and few false positives */
+    digest_set ds3;
+    ds3.set_bounded(10000 * 2);
+    REQUIRE(ds3.get_mode() == digest_set::BOUNDED);
+    REQUIRE(ds3.bytes() <= 10000 * 2);
+    for (const auto& it : digests) { ds3.insert(it); }
+    found = 0;
+    for (const auto& it : digests) { found += ds3.contains(it); }
+    REQUIRE(found == 10000);
+    int false_positives = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (ds3.contains(digest_set::digest_t{rng(), rng()})) false_positives++;
+    }
+    REQUIRE(false_positives < 50);
+    REQUIRE(ds3.false_positive_rate() > 0.0);
+    REQUIRE(ds3.false_positive_rate() < 0.005);
+    REQUIRE_THROWS_AS(ds3.save(NamedTemporaryDirectory() / "bounded.digests"), std::runtime_error);
+
+    /* Saved and attached: the saved digests are found in the file, new ones go in memory */
+    const std::filesystem::path fname = NamedTemporaryDirectory() / "set.digests";
+    ds.save(fname);
+    REQUIRE(std::filesystem::file_size(fname) == digest_set::FILE_HEADER_SIZE + 10001 * 16);
+    digest_set ds4;
+    ds4.attach(fname);
+    REQUIRE(ds4.attached_size() == 10001);
+    REQUIRE(ds4.bytes() == 0);
+    found = 0;
+    for (const auto& it : digests) { found += ds4.check_for_presence_and_insert(it); }
+    REQUIRE(found == 10000);
+    REQUIRE(ds4.contains(digest_set::digest_t{}));
+    const digest_set::digest_t extra{rng(), rng()};
+    REQUIRE(ds4.check_for_presence_and_insert(extra) == false);
+    REQUIRE(ds4.size() == 10002);
+    ds4.save(fname); // replaces the attached file
+    digest_set ds5;
+    ds5.attach(fname);
+    REQUIRE(ds5.attached_size() == 10002);
+    REQUIRE(ds5.contains(extra));
+    REQUIRE(ds5.contains(digest_set::digest_t{rng(), rng()}) == false);
+    REQUIRE_THROWS_AS(ds5.attach(fname), std::runtime_error);
+    {
+        std::ofstream os(fname, std::ios::binary | std::ios::trunc);
+        os << "not a digest set";
+    }
+    digest_set ds6;
+    REQUIRE_THROWS_AS(ds6.attach(fname), std::runtime_error);
+}
+
 /****************************************************************
  * histogram_def.h
  */
@@ -199,6 +352,39 @@ TEST_CASE("histogram_def 8-bit regular expression functions", "[histogram_def]")
     REQUIRE(s1 == "abcde");
 };
 
+TEST_CASE("histogram_def UTF-8 fast path", "[histogram_def]") {
+    /* The UTF-8 path gives the same answers as the UTF-32 path */
+    const std::vector<std::string> keys{"Hello World", "ABC123def", "", "\xc3\x89" "cole 42 \xc3\xa9" "t\xc3\xa9",
+                                        "\xe2\x82\xac" "100", "no digits", "MiXeD\tTAB"};
+    const std::vector<std::string> patterns{"", "([a-z]+)", "^(..)"};
+    int bad = 0;
+    int checked = 0;
+    for (int fl = 0; fl < 4; fl++) {
+        for (const auto& pattern : patterns) {
+            for (const std::string require : {"", "d4"}) {
+                histogram_def d("h", "f", pattern, require, "", histogram_def::flags_t(fl & 1, fl & 2));
+                for (const auto& key : keys) {
+                    std::string s8, s32;
+                    const bool m8 = d.match(key, &s8);
+                    const bool m32 = d.match(convert_utf8_to_utf32(key), &s32);
+                    if (m8 != m32 || s8 != s32) bad++;
+                    checked++;
+                }
+            }
+        }
+    }
+    REQUIRE(checked == 4 * 3 * 2 * 7);
+    REQUIRE(bad == 0);
+
+    std::string s;
+    histogram_def lower("h", "f", "", "", "", histogram_def::flags_t(true, false));
+    REQUIRE(lower.match("HeLLo", &s));
+    REQUIRE(s == "hello");
+    histogram_def numeric("h", "f", "", "", "", histogram_def::flags_t(false, true));
+    REQUIRE(numeric.match("\xe2\x82\xac" "1,000.50", &s));
+    REQUIRE(s == "100050");
+}
+
 /****************************************************************
  * atomic_unicode_histogram.h
  */
@@ -311,6 +497,133 @@ TEST_CASE("Third AtomicUnicodeHistogram test", "[histogram]") {
     }
 }
 
+TEST_CASE("concurrent AtomicUnicodeHistogram", "[histogram]") {
+    /* More distinct keys than fit in a thread's table, so the tables are merged while the others add */
+    histogram_def d1("name", "feature_file", "(.*)", "", "suffix1", histogram_def::flags_t());
+    AtomicUnicodeHistogram h(d1);
+    const int KEYS = AtomicUnicodeHistogram::LOCAL_KEYS * 3;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&h, t, KEYS]() {
+            for (int i = 0; i < KEYS * 2; i++) { h.add(std::to_string((i * 7 + t) % KEYS)); }
+        });
+    }
+    for (auto& it : threads) { it.join(); }
+    REQUIRE(h.size() == size_t(KEYS));
+    AtomicUnicodeHistogram::FrequencyReportVector f = h.makeReport();
+    REQUIRE(f.size() == size_t(KEYS));
+    int bad = 0;
+    for (const auto& it : f) {
+        if (it.value.count != 16) bad++;
+    }
+    REQUIRE(bad == 0);
+    for (size_t i = 1; i < f.size(); i++) {
+        if (f[i].key < f[i - 1].key) bad++; // equal counts are in key order
+    }
+    REQUIRE(bad == 0);
+    h.clear();
+    REQUIRE(h.size() == 0);
+    h.add("again");
+    REQUIRE(h.makeReport().at(0).value.count == 1);
+}
+
+TEST_CASE("AtomicUnicodeHistogram topN", "[histogram]") {
+    histogram_def d1("name", "feature_file", "(.*)", "", "", histogram_def::flags_t());
+    AtomicUnicodeHistogram h(d1);
+    for (int i = 0; i < 5000; i++) {
+        for (int j = 0; j <= i % 97; j++) h.add("k" + std::to_string(i));
+    }
+    const AtomicUnicodeHistogram::FrequencyReportVector all = h.makeReport(0);
+    REQUIRE(all.size() == 5000);
+    int bad = 0;
+    for (size_t topN : {1, 10, 97, 1000, 4999, 5000, 6000}) {
+        const AtomicUnicodeHistogram::FrequencyReportVector top = h.makeReport(topN);
+        if (top.size() != std::min(topN, all.size())) bad++;
+        for (size_t i = 0; i < top.size(); i++) {
+            if (top[i] != all[i]) bad++;
+        }
+    }
+    REQUIRE(bad == 0);
+
+    /* takeReport() gives the same elements, and empties the histogram */
+    AtomicUnicodeHistogram::FrequencyReportVector taken;
+    h.takeReport(100, [&taken](const AtomicUnicodeHistogram::auh_t::AMReportElement& e) { taken.push_back(e); });
+    REQUIRE(taken.size() == 100);
+    for (size_t i = 0; i < taken.size(); i++) {
+        if (taken[i] != all[i]) bad++;
+    }
+    REQUIRE(bad == 0);
+    REQUIRE(h.size() == 0);
+    REQUIRE(h.bytes() == sizeof(h));
+}
+
+TEST_CASE("approximate AtomicUnicodeHistogram", "[histogram]") {
+    /* 20 frequent keys among 200,000 that occur once */
+    std::map<std::string, uint64_t> truth;
+    heavy_hitters hh(100);
+    for (int i = 0; i < 200000; i++) {
+        const std::string rare = "rare" + std::to_string(i);
+        hh.add(rare, 1, 0);
+        truth[rare]++;
+        if (i % 10 == 0) {
+            const std::string heavy = "heavy" + std::to_string(i % 200 / 10);
+            hh.add(heavy, 1, 0);
+            truth[heavy]++;
+        }
+    }
+    REQUIRE(hh.size() == 100);
+    REQUIRE(hh.total() == 220000);
+    int bad = 0;
+    int heavy_found = 0;
+    for (const auto& e : hh.entries()) {
+        if (e.count < truth[e.key]) bad++;           // count is an upper bound ...
+        if (e.count - e.error > truth[e.key]) bad++; // ... and count - error a lower bound
+        if (e.key.substr(0, 5) == "heavy") {
+            heavy_found++;
+            if (e.count != 1000) bad++; // the sketch has no collisions at this size
+        }
+    }
+    REQUIRE(bad == 0);
+    REQUIRE(heavy_found == 20);
+    REQUIRE_THROWS_AS(heavy_hitters(0), std::invalid_argument);
+
+    /* The same through a histogram, from several threads, in fixed memory */
+    histogram_def::flags_t flags;
+    flags.approximate = 100;
+    histogram_def d1("name", "feature_file", "(.*)", "", "", flags);
+    AtomicUnicodeHistogram h(d1);
+    REQUIRE(h.approximate());
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&h, t]() {
+            for (int i = t; i < 200000; i += 4) {
+                h.add("rare" + std::to_string(i));
+                if (i % 10 == 0) h.add("heavy" + std::to_string(i % 200 / 10));
+            }
+        });
+    }
+    for (auto& it : threads) { it.join(); }
+    const size_t full = h.bytes();
+    h.add("one more");
+    REQUIRE(h.size() == 100);
+    REQUIRE(h.bytes() < full + 1024);
+    REQUIRE(h.take_sorted().empty()); // never spilled
+    const AtomicUnicodeHistogram::FrequencyReportVector top = h.makeReport(20);
+    REQUIRE(top.size() == 20);
+    for (const auto& it : top) {
+        if (it.key.substr(0, 5) != "heavy" || it.value.count < 1000 || it.value.count - it.value.error > 1000) bad++;
+    }
+    REQUIRE(bad == 0);
+    const AtomicUnicodeHistogram::FrequencyReportVector all = h.makeReport(0);
+    REQUIRE(all.size() == 100);
+    REQUIRE(all.back().value.error > 0);
+    std::ostringstream ss;
+    ss << all.back();
+    REQUIRE(ss.str().find("\t(error<=") != std::string::npos);
+    h.clear();
+    REQUIRE(h.size() == 0);
+}
+
 /****************************************************************
  * hash_t.h
  */
@@ -333,6 +646,124 @@ TEST_CASE("sha1", "[hash]") {
     REQUIRE(hash_func(reinterpret_cast<const uint8_t*>(hello8), strlen(hello8)) == hello_sha1);
 }
 
+/* The fast dedup hash must not depend on alignment, and must see every byte and the length */
+#include "fast_hash.h"
+TEST_CASE("fast_hash", "[hash]") {
+    std::vector<uint8_t> data(1000);
+    std::mt19937 rng(6);
+    for (auto& it : data) { it = rng(); }
+
+    hash128_t h0 = fast_hash128(data.data(), data.size());
+    REQUIRE(h0 == fast_hash128(data.data(), data.size()));
+    REQUIRE(h0.hexdigest().size() == 32);
+    REQUIRE(h0 != fast_hash128(data.data(), data.size(), 1)); // seeded
+
+    /* Same bytes at every alignment give the same hash */
+    for (size_t offset = 1; offset < 8; offset++) {
+        std::vector<uint8_t> copy(data.size() + offset);
+        memcpy(copy.data() + offset, data.data(), data.size());
+        REQUIRE(fast_hash128(copy.data() + offset, data.size()) == h0);
+    }
+    /* Every length and every flipped byte changes the hash */
+    std::set<std::string> seen;
+    for (size_t len = 0; len <= 100; len++) { seen.insert(fast_hash128(data.data(), len).hexdigest()); }
+    REQUIRE(seen.size() == 101);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] ^= 1;
+        REQUIRE(fast_hash128(data.data(), data.size()) != h0);
+        data[i] ^= 1;
+    }
+    /* Trailing zeros are not the same as a shorter buffer */
+    const uint8_t zeros[16]{};
+    REQUIRE(fast_hash128(zeros, 3) != fast_hash128(zeros, 4));
+
+    sbuf_t sb(hello8);
+    REQUIRE(sb.fast_hash() == fast_hash128(reinterpret_cast<const uint8_t*>(hello8), strlen(hello8)));
+    REQUIRE(sb.has_hash() == false); // the fast hash doesn't compute the SHA1
+}
+
+TEST_CASE("sbuf_digests", "[hash]") {
+    /* Larger than one chunk, and not a multiple of the block size */
+    auto* sbuf = sbuf_t::sbuf_malloc(pos0_t(), 200 * 1000 + 7);
+    std::mt19937 rng(7);
+    for (size_t i = 0; i < sbuf->bufsize; i++) { sbuf->wbuf(i, rng()); }
+    const uint8_t* buf = sbuf->get_buf();
+
+    fast_hasher fh;
+    fh.update(buf, fast_hasher::BLOCK * 100);
+    fh.update(buf + fast_hasher::BLOCK * 100, sbuf->bufsize - fast_hasher::BLOCK * 100);
+    REQUIRE(fh.digest() == fast_hash128(buf, sbuf->bufsize));
+    REQUIRE_THROWS_AS(fh.update(buf, 1), std::runtime_error); // already had a partial block
+
+    REQUIRE(sbuf->has_digest(sbuf_t::DIGEST_SHA256) == false);
+    sbuf->compute_digests(sbuf_t::DIGEST_MD5 | sbuf_t::DIGEST_SHA1 | sbuf_t::DIGEST_SHA256 | sbuf_t::DIGEST_FAST);
+    REQUIRE(sbuf->has_hash());
+    REQUIRE(sbuf->hexdigest(sbuf_t::DIGEST_MD5) == dfxml::md5_generator::hash_buf(buf, sbuf->bufsize).hexdigest());
+    REQUIRE(sbuf->hash() == dfxml::sha1_generator::hash_buf(buf, sbuf->bufsize).hexdigest());
+    REQUIRE(sbuf->hexdigest(sbuf_t::DIGEST_SHA256) ==
+            dfxml::sha256_generator::hash_buf(buf, sbuf->bufsize).hexdigest());
+    REQUIRE(sbuf->fast_hash() == fast_hash128(buf, sbuf->bufsize));
+    REQUIRE(sbuf_t::digest_algorithm_for_name("SHA-256") == sbuf_t::DIGEST_SHA256);
+    REQUIRE(sbuf_t::digest_algorithm_for_name("crc32") == sbuf_t::DIGEST_NONE);
+
+    /* A slice of the whole buffer shares the digests; a smaller one does not */
+    sbuf_t whole = sbuf->slice(0);
+    REQUIRE(whole.has_hash());
+    REQUIRE(whole.hash() == sbuf->hash());
+    sbuf_t part = sbuf->slice(1);
+    REQUIRE(part.has_hash() == false);
+    REQUIRE(part.hash() == dfxml::sha1_generator::hash_buf(buf + 1, sbuf->bufsize - 1).hexdigest());
+    delete sbuf;
+}
+
+/* The original byte-at-a-time ngram search, for comparison */
+static size_t reference_ngram_size(const sbuf_t& sbuf, size_t max_ngram) {
+    for (size_t ngram_size = 1; ngram_size < max_ngram; ngram_size++) {
+        bool ngram_match = true;
+        for (size_t i = ngram_size; i < sbuf.pagesize && ngram_match; i++) {
+            if (sbuf[i % ngram_size] != sbuf[i]) ngram_match = false;
+        }
+        if (ngram_match) return ngram_size;
+    }
+    return 0;
+}
+
+TEST_CASE("sbuf_classify", "[sbuf]") {
+    std::mt19937 rng(8);
+    size_t mismatches = 0;
+    for (size_t len : {0, 1, 2, 5, 64, 65, 100, 4096}) {
+        for (size_t period = 1; period <= 12; period++) {
+            auto* sbuf = sbuf_t::sbuf_malloc(pos0_t(), len);
+            for (size_t i = 0; i < len; i++) { sbuf->wbuf(i, i < period ? rng() % 4 : (*sbuf)[i - period]); }
+            if (len > 70 && period == 3) sbuf->wbuf(len - 1, 0xff); // periodic except at the end
+            for (size_t max_ngram : {1, 2, 5, 10, 13}) {
+                if (sbuf->find_ngram_size(max_ngram) != reference_ngram_size(*sbuf, max_ngram)) mismatches++;
+            }
+            delete sbuf;
+        }
+    }
+    REQUIRE(mismatches == 0);
+
+    auto* zeros = sbuf_t::sbuf_malloc(pos0_t(), 1000);
+    for (size_t i = 0; i < zeros->bufsize; i++) { zeros->wbuf(i, 0); }
+    auto pc = zeros->classify_page(10);
+    REQUIRE(pc.constant);
+    REQUIRE(pc.all_zero);
+    REQUIRE(pc.ngram_size == 1);
+    REQUIRE(zeros->slice(0).classify_page(10).all_zero); // shared with the whole slice
+
+    zeros->wbuf(999, 'A'); // writing resets the cached classification
+    pc = zeros->classify_page(10);
+    REQUIRE(pc.constant == false);
+    REQUIRE(pc.all_zero == false);
+    REQUIRE(pc.ngram_size == 0);
+    delete zeros;
+
+    sbuf_t hello(hello8);
+    REQUIRE(hello.classify_page(10).ngram_size == 0);
+    REQUIRE(hello.classify_page(10).constant == false);
+}
+
 /****************************************************************
  * feature_recorder.h
  */
@@ -384,6 +815,30 @@ TEST_CASE("fname in outdir", "[feature_recorder]") {
     std::filesystem::path p2(n2);
     REQUIRE(p2.filename() == "test_bar_1.txt");
 
+    /* The numbering starts after the files already there, and each thread gets its own file */
+    {
+        std::ofstream os(sc.outdir / "test_baz_41.txt");
+    }
+    std::vector<std::thread> threads;
+    std::mutex Mnames;
+    std::set<std::string> names;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&]() {
+            for (int i = 0; i < 25; i++) {
+                std::filesystem::path fname;
+                const int fd = fr.create_next_in_outdir("baz", fname);
+                close(fd);
+                const std::lock_guard<std::mutex> lock(Mnames);
+                names.insert(fname.filename().string());
+            }
+        });
+    }
+    for (auto& it : threads) { it.join(); }
+    REQUIRE(names.size() == 100);
+    REQUIRE(names.count("test_baz_42.txt") == 1);
+    REQUIRE(names.count("test_baz_141.txt") == 1);
+    REQUIRE(names.count("test_baz.txt") == 0);
+
     fr.carve_mode = feature_recorder_def::CARVE_ALL;
 
     /* check carving */
@@ -411,6 +866,152 @@ TEST_CASE("fname in outdir", "[feature_recorder]") {
 
 }
 
+TEST_CASE("async_carving", "[feature_recorder]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    flags.async_carving = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+
+    /* an "image" to carve from, so that the data can be copied by the kernel */
+    const size_t N = 2500; // spans three thousands directories
+    const size_t LEN = 512;
+    const std::filesystem::path image = sc.outdir / "image.raw";
+    {
+        std::ofstream os(image, std::ios::binary);
+        for (size_t i = 0; i < N * LEN; i++) os.put(char(i % LEN < 8 ? (i / LEN) >> (8 * (i % LEN)) : i * 7)); // unique blocks
+    }
+    sbuf_t* map = sbuf_t::map_file(image);
+    {
+        feature_recorder_set fs(flags, sc);
+        feature_recorder& fr = fs.create_feature_recorder("carved");
+        fr.carve_mode = feature_recorder_def::CARVE_ALL;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&fr, map, t]() {
+                for (size_t i = t; i < N; i += 4) {
+                    const sbuf_t slice(*map, i * LEN, LEN);
+                    fr.carve(slice, ".bin");
+                }
+            });
+        }
+        for (auto& it : threads) { it.join(); }
+        auto hbuf = sbuf_t("Header\n");
+        auto mem = sbuf_t("[record 001][record 002]");
+        const std::string rec = fr.carve(hbuf, mem, ".rec");
+        fs.feature_recorders_shutdown();
+        REQUIRE(fs.get_carve_writer().files_written() == N + 1);
+        REQUIRE(fs.get_carve_writer().zero_copy_bytes() == N * LEN);
+        REQUIRE(fs.get_carve_writer().directories_created() == 3);
+        std::ifstream in(sc.outdir / rec, std::ios::binary);
+        REQUIRE(std::string(std::istreambuf_iterator<char>(in), {}) == "Header\n[record 001][record 002]");
+    }
+    size_t bad = 0;
+    size_t files = 0;
+    for (const auto& it : std::filesystem::recursive_directory_iterator(sc.outdir / "carved")) {
+        if (!it.is_regular_file() || it.path().extension() != ".bin") continue;
+        const std::string stem = it.path().stem().string();
+        const size_t offset = std::stoull(stem.substr(stem.rfind('-') + 1));
+        std::ifstream in(it.path(), std::ios::binary);
+        const std::string contents(std::istreambuf_iterator<char>(in), {});
+        if (contents != map->substr(offset, LEN)) bad++;
+        files++;
+    }
+    REQUIRE(files == N);
+    REQUIRE(bad == 0);
+    delete map;
+}
+
+TEST_CASE("carve_index", "[feature_recorder]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    const std::filesystem::path index = sc.outdir / "carved.digests";
+    auto sbuf1 = sbuf_t("Hello World! This is carved.");
+    auto sbuf2 = sbuf_t("A different object.");
+
+    /* The index is shared by the feature recorders of a set */
+    {
+        feature_recorder_set fs(flags, sc);
+        fs.use_carve_index(index);
+        feature_recorder& fr1 = fs.create_feature_recorder("carve1");
+        feature_recorder& fr2 = fs.create_feature_recorder("carve2");
+        REQUIRE(fr1.carve(sbuf1, ".bin") != feature_recorder::CACHED);
+        REQUIRE(fr2.carve(sbuf1, ".bin") == feature_recorder::CACHED);
+        fs.feature_recorders_shutdown();
+        REQUIRE(fs.carve_index.size() == 1);
+    }
+    REQUIRE(std::filesystem::exists(index));
+
+    /* and lasts from one run to the next */
+    sc.outdir = NamedTemporaryDirectory();
+    {
+        feature_recorder_set fs(flags, sc);
+        fs.use_carve_index(index);
+        REQUIRE(fs.carve_index.attached_size() == 1);
+        feature_recorder& fr1 = fs.create_feature_recorder("carve1");
+        REQUIRE(fr1.carve(sbuf1, ".bin") == feature_recorder::CACHED);
+        REQUIRE(fr1.carve(sbuf2, ".bin") != feature_recorder::CACHED);
+        fs.feature_recorders_shutdown();
+    }
+    size_t files = 0;
+    for (const auto& it : std::filesystem::recursive_directory_iterator(sc.outdir / "carve1")) {
+        if (it.is_regular_file() && it.path().extension() == ".bin") files++;
+    }
+    REQUIRE(files == 1);
+    digest_set ds;
+    ds.attach(index);
+    REQUIRE(ds.attached_size() == 2);
+}
+
+#include "alert_writer.h"
+#include "word_and_context_list.h"
+TEST_CASE("alert_list", "[feature_recorder]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    word_and_context_list alerts;
+    alerts.add_fc("bad@example.com", "");
+    alerts.add_regex("^evil");
+    {
+        feature_recorder_set fs(flags, sc);
+        fs.set_alert_list(&alerts);
+        feature_recorder& fr = fs.create_feature_recorder("email");
+        fr.write(pos0_t("", 10), "good@example.com", "context");
+        fr.write(pos0_t("", 20), "bad@example.com", "context");
+        fr.write(pos0_t("1-GZIP", 30), "evil@example.com", "context");
+        fs.feature_recorders_shutdown();
+        REQUIRE(fr.features_written == 3); // alerts are still written to the feature file
+    }
+    auto lines = getLines(sc.outdir / alert_writer::FILENAME);
+    REQUIRE(lines.size() == 2);
+    REQUIRE(lines[0] == "20\tbad@example.com\temail");
+    REQUIRE(lines[1] == "1-GZIP-30\tevil@example.com\temail");
+
+    /* Hits are written in batches, in the order they were found */
+    const std::filesystem::path fname = sc.outdir / "many.txt";
+    const size_t count = alert_writer::NOTIFY_HITS * 3 + 5;
+    {
+        alert_writer aw(fname);
+        for (size_t i = 0; i < count; i++) aw.enqueue(pos0_t("", i), "bad@example.com", "email");
+        aw.drain();
+        REQUIRE(aw.hits_written() == count);
+        REQUIRE(aw.batches_written() >= 1);
+        REQUIRE(aw.batches_written() <= count);
+        aw.enqueue(pos0_t("", count), "bad@example.com", "email"); // written by the destructor
+    }
+    lines = getLines(fname);
+    REQUIRE(lines.size() == count + 1);
+    int bad = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (lines[i] != std::to_string(i) + "\tbad@example.com\temail") bad++;
+    }
+    REQUIRE(bad == 0);
+    REQUIRE_THROWS_AS(alert_writer(sc.outdir / "no-such-dir" / "x.txt"), std::runtime_error);
+}
+
 /****************************************************************
  * feature_recorder_set.h
  *
@@ -468,6 +1069,493 @@ TEST_CASE("write_features", "[feature_recorder_set]") {
     REQUIRE( lines[2] == "n=1\t100");
 }
 
+TEST_CASE("histogram_spill", "[feature_recorder_set]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    const int KEYS = 5000;
+    {
+        feature_recorder_set fs(flags, sc);
+        fs.histogram_memory_limit = 64 * 1024; // much less than the histogram needs
+        feature_recorder& fr = fs.create_feature_recorder("spill");
+        fs.histogram_add(histogram_def("spill", "spill", "(.*)", "", "keys", histogram_def::flags_t()));
+        fs.histogram_add(histogram_def("spill", "spill", "([0-9])$", "", "last", histogram_def::flags_t()));
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 3; t++) {
+            threads.emplace_back([&fr, t]() {
+                pos0_t p;
+                for (int i = 0; i < KEYS; i++) { fr.write(p + i, "key" + std::to_string((i * 13 + t * 101) % KEYS), ""); }
+            });
+        }
+        for (auto& it : threads) { it.join(); }
+        REQUIRE(fs.histogram_memory <= fs.histogram_memory_limit + AtomicUnicodeHistogram::LOCAL_KEYS * 300);
+        const auto runs = fr.histogram_runs(*fr.histograms[0]);
+        REQUIRE(runs.size() > 1);
+        REQUIRE(std::filesystem::exists(runs[0]));
+        fs.feature_recorders_shutdown();
+        fs.histograms_generate();
+        REQUIRE(fr.histograms[0]->size() == 0); // all of it was merged from the runs
+        REQUIRE(fs.histogram_memory == fr.histograms[1]->bytes() - sizeof(AtomicUnicodeHistogram));
+        REQUIRE(std::filesystem::exists(runs[0]) == false);
+    }
+    std::vector<std::string> lines = getLines(sc.outdir / "spill_keys.txt");
+    REQUIRE(lines.size() == size_t(KEYS));
+    int bad = 0;
+    for (const auto& it : lines) {
+        if (it.substr(0, 4) != "n=3\t") bad++;
+    }
+    REQUIRE(bad == 0);
+    lines = getLines(sc.outdir / "spill_last.txt");
+    REQUIRE(lines.size() == 10);
+    REQUIRE(lines[0] == "n=1500\t0");
+    REQUIRE(lines[9] == "n=1500\t9");
+    for (const auto& it : std::filesystem::directory_iterator(sc.outdir)) {
+        if (it.path().filename().string().find("_run") != std::string::npos) bad++;
+    }
+    REQUIRE(bad == 0);
+}
+
+TEST_CASE("histogram_merge", "[feature_recorder_set]") {
+    /* More runs than are merged at once, and more tallies than fit in the merge memory */
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    feature_recorder_set fs(flags, sc);
+    feature_recorder& fr = fs.create_feature_recorder("merge");
+    fs.histogram_add(histogram_def("merge", "merge", "(.*)", "", "h", histogram_def::flags_t()));
+    AtomicUnicodeHistogram& h = *fr.histograms[0];
+    const size_t RUNS = histogram_run::MAX_FAN_IN * 2 + 5;
+    for (size_t r = 0; r < RUNS; r++) {
+        for (size_t i = 0; i <= r % 20; i++) h.add("k" + std::to_string(i)); // k{i} is in 20-i of every 20 runs
+        h.add("unique" + std::to_string(r));
+        REQUIRE(fr.histogram_spill(h));
+    }
+    REQUIRE(fr.histogram_spill(h) == false);
+    h.add("k0");
+    fr.histogram_merge(h, 1024);
+    std::vector<std::string> lines = getLines(sc.outdir / "merge_h.txt");
+    REQUIRE(lines.size() == 20 + RUNS);
+    REQUIRE(lines[0] == "n=" + std::to_string(RUNS + 1) + "\tk0");
+    REQUIRE(lines[19] == "n=" + std::to_string(RUNS / 20) + "\tk19");
+    REQUIRE(lines[20] == "n=1\tunique0");
+    REQUIRE(lines[21] == "n=1\tunique1");
+    size_t bad = 0;
+    for (const auto& it : std::filesystem::directory_iterator(sc.outdir)) {
+        if (it.path().filename() != "merge_h.txt" && it.path().filename().string().substr(0, 8) == "merge_h_") bad++;
+    }
+    REQUIRE(bad == 0);
+}
+
+TEST_CASE("buffered_writes", "[feature_recorder_set]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    flags.buffered_writes = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    const int THREADS = 4;
+    const int LINES = 20000;
+    {
+        feature_recorder_set fs(flags, sc);
+        feature_recorder& fr = fs.create_feature_recorder("buffered");
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.emplace_back([&fr, t]() {
+                for (int i = 0; i < LINES; i++) {
+                    fr.write(pos0_t("", t * LINES + i), "feature" + std::to_string(t), "context" + std::to_string(i));
+                }
+            });
+        }
+        for (auto& it : threads) { it.join(); }
+        fs.feature_recorders_shutdown(); // writes the partly-filled buffers
+        REQUIRE(getLines(sc.outdir / "buffered.txt").size() > size_t(THREADS * LINES));
+    }
+
+    /* Every line is whole, and each thread's lines are in order */
+    std::vector<int> next(THREADS, 0);
+    size_t features = 0;
+    size_t bad = 0;
+    for (const auto& line : getLines(sc.outdir / "buffered.txt")) {
+        if (line.size() > 0 && line[0] == '#') continue;
+        const size_t tab1 = line.find('\t');
+        const size_t tab2 = line.find('\t', tab1 + 1);
+        if (tab2 == std::string::npos) {
+            bad++;
+            continue;
+        }
+        const int t = std::stoi(line.substr(tab1 + 8, tab2 - tab1 - 8));
+        if (line.substr(tab2 + 1) != "context" + std::to_string(next[t]) ||
+            std::stoll(line.substr(0, tab1)) != t * LINES + next[t]) {
+            bad++;
+        }
+        next[t]++;
+        features++;
+    }
+    REQUIRE(bad == 0);
+    REQUIRE(features == size_t(THREADS * LINES));
+
+    /* A write that fails when the recorder is deleted is reported, not thrown out of the destructor */
+    if (std::filesystem::exists("/dev/full")) {
+        std::filesystem::create_symlink("/dev/full", sc.outdir / "full.txt");
+        {
+            feature_recorder_set fs(flags, sc);
+            feature_recorder& fr = fs.create_feature_recorder("full");
+            for (int i = 0; i < 2000; i++) fr.write(pos0_t("", i), "feature", std::string(50, 'c'));
+            REQUIRE_THROWS_AS(fs.feature_recorders_shutdown(), std::runtime_error);
+        }
+        {
+            feature_recorder_set fs(flags, sc);
+            feature_recorder& fr = fs.create_feature_recorder("full");
+            for (int i = 0; i < 2000; i++) fr.write(pos0_t("", i), "feature", std::string(50, 'c'));
+        }
+    }
+}
+
+#include "histogram_engine.h"
+TEST_CASE("deferred_histograms", "[feature_recorder_set]") {
+    REQUIRE(histogram_engine::feature_field("0\tfoo\tbar") == "foo");
+    REQUIRE(histogram_engine::feature_field("100-GZIP-5\tfoo\r") == "foo");
+    REQUIRE(histogram_engine::feature_field("# comment\tnot\tthis").empty());
+    REQUIRE(histogram_engine::feature_field("no tab").empty());
+
+    /* The same histograms, made as features are written and made from the feature files afterwards */
+    const int N = 30000;
+    std::map<std::string, std::vector<std::string>> made;
+    for (bool deferred : {false, true}) {
+        for (auto codec : {frame_codec::NONE, frame_codec::GZIP}) {
+            if (!frame_codec::available(codec)) continue;
+            feature_recorder_set::flags_t flags;
+            flags.no_alert = true;
+            flags.deferred_histograms = deferred;
+            scanner_config sc;
+            sc.outdir = NamedTemporaryDirectory();
+            feature_recorder_set fs(flags, sc);
+            fs.feature_file_compression = codec;
+            feature_recorder& fr = fs.create_feature_recorder("email");
+            fs.histogram_add(histogram_def("email", "email", "@(.*)", "", "domain", histogram_def::flags_t(true, false)));
+            fs.histogram_add(histogram_def("email", "email", "", "", "", histogram_def::flags_t()));
+            REQUIRE(fr.histograms_deferred() == deferred);
+            for (int i = 0; i < N; i++) {
+                fr.write(pos0_t("", i), "user" + std::to_string(i % 1000) + "@Example" + std::to_string(i % 7) + ".com",
+                         "context");
+            }
+            if (deferred) REQUIRE(fr.histograms[0]->size() == 0); // nothing is counted during the scan
+            fs.feature_recorders_shutdown();
+            fs.histograms_generate();
+            for (const std::string name : {"email_domain.txt", "email.txt"}) {
+                std::vector<std::string> lines = getLines(sc.outdir / name);
+                if (name == "email.txt") { // the feature file is also email.txt if it is not compressed
+                    lines.erase(std::remove_if(lines.begin(), lines.end(),
+                                               [](const std::string& l) { return l.substr(0, 2) != "n="; }),
+                                lines.end());
+                }
+                const std::string k = name + (deferred ? "d" : "") + frame_codec::name(codec);
+                made[k] = lines;
+                REQUIRE(made[k] == made[name + frame_codec::name(codec)]);
+            }
+        }
+    }
+    REQUIRE(made["email_domain.txtnone"].size() == 7);
+    REQUIRE(made["email_domain.txtnone"][0].substr(0, 7) == "n=4286\t");
+}
+
+TEST_CASE("histogram_engine", "[histogram]") {
+    const std::filesystem::path fname = std::filesystem::path(NamedTemporaryDirectory()) / "f.txt";
+    {
+        std::ofstream of(fname);
+        of << "# banner\n";
+        for (int i = 0; i < 10000; i++) of << i << "\tkey" << (i % 37) << "\tcontext\n";
+        of << "10000\tkey0"; // no newline at the end
+    }
+    histogram_def d("h", "f", "", "", "", histogram_def::flags_t());
+    AtomicUnicodeHistogram h(d);
+    std::atomic<int> calls{0};
+    {
+        histogram_engine engine(4);
+        engine.range_bytes = 1000; // many pieces
+        engine.after_piece = [&calls]() { calls++; };
+        engine.add_file(fname, {&h});
+        engine.wait();
+        REQUIRE(engine.features() == 10001);
+        REQUIRE(engine.pieces() > 100);
+        REQUIRE(calls == int(engine.pieces()));
+    }
+    const auto rep = h.makeReport();
+    REQUIRE(rep.size() == 37);
+    int bad = 0;
+    for (const auto& it : rep) {
+        if (it.value.count != (it.key == "key0" ? 272u : (std::stoi(it.key.substr(3)) < 10000 % 37 ? 271u : 270u))) bad++;
+    }
+    REQUIRE(bad == 0);
+}
+
+TEST_CASE("compressed_features", "[feature_recorder_set]") {
+    REQUIRE(frame_codec::detect(reinterpret_cast<const uint8_t*>("\x1f\x8b"), 2) == frame_codec::GZIP);
+    REQUIRE(frame_codec::codec_for_name("zstd") == frame_codec::ZSTD);
+    REQUIRE_THROWS_AS(frame_codec::codec_for_name("rar"), std::invalid_argument);
+    if (!frame_codec::available(frame_codec::GZIP)) return;
+
+    /* Concatenated frames decompress as one stream */
+    const std::string a = frame_codec::compress(frame_codec::GZIP, "hello ", 6);
+    const std::string b = frame_codec::compress(frame_codec::GZIP, "world", 5);
+    REQUIRE(frame_codec::decompress(frame_codec::GZIP, (a + b).data(), a.size() + b.size()) == "hello world");
+
+    /* A frame cut short anywhere is corrupt, not a shorter text */
+    for (const auto codec : {frame_codec::GZIP, frame_codec::ZSTD, frame_codec::LZ4}) {
+        if (!frame_codec::available(codec)) continue;
+        std::string text;
+        for (int i = 0; i < 2000; i++) text += "line " + std::to_string(i * 7919 % 1000) + "\n";
+        const std::string frame = frame_codec::compress(codec, text.data(), text.size());
+        const std::string two = frame + frame;
+        REQUIRE(frame_codec::decompress(codec, two.data(), two.size()) == text + text);
+        int bad = 0;
+        for (size_t cut = 0; cut < two.size(); cut++) {
+            if (cut == frame.size()) continue; // one whole frame
+            try {
+                frame_codec::decompress(codec, two.data(), cut);
+                bad++;
+            } catch (const std::runtime_error&) {}
+        }
+        REQUIRE(bad == 0);
+    }
+
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    const size_t N = 50000; // several frames
+    {
+        feature_recorder_set fs(flags, sc);
+        fs.feature_file_compression = frame_codec::GZIP;
+        feature_recorder& fr = fs.create_feature_recorder("compressed");
+        for (size_t i = 0; i < N; i++) {
+            fr.write(pos0_t((i % 2) ? "100-GZIP" : "", i), "feature" + std::to_string(i), "context");
+        }
+        fs.feature_recorders_shutdown();
+    }
+    const auto fname = sc.outdir / "compressed.txt.gz";
+    REQUIRE(std::filesystem::exists(fname));
+    REQUIRE(std::filesystem::file_size(fname) < N * 20);
+
+    FeatureReader reader(fname);
+    REQUIRE(reader.get_codec() == frame_codec::GZIP);
+    REQUIRE(reader.frame_count() > 2);
+    size_t count = 0;
+    size_t bad = 0;
+    while (auto f = reader.next()) {
+        if (f->feature != "feature" + std::to_string(f->pos.offset) || f->context != "context" ||
+            f->pos.path != ((f->pos.offset % 2) ? "100-GZIP" : "")) {
+            bad++;
+        }
+        count++;
+    }
+    REQUIRE(bad == 0);
+    REQUIRE(count == N);
+
+    /* Frames can be read on their own */
+    size_t frame_features = 0;
+    for (size_t i = 0; i < reader.frame_count(); i++) { frame_features += reader.read_frame(i).size(); }
+    REQUIRE(frame_features == N);
+    REQUIRE_THROWS_AS(reader.read_frame(reader.frame_count()), std::out_of_range);
+
+    /* Without the frame index, the file is still readable */
+    std::filesystem::remove(fname.string() + FeatureReader::FRAMES_EXTENSION);
+    FeatureReader reader2(fname);
+    REQUIRE(reader2.frame_count() == 0);
+    count = 0;
+    while (reader2.next()) count++;
+    REQUIRE(count == N);
+
+    auto f = FeatureReader::parse_line("1000-GZIP-20\tfoo\tbar");
+    REQUIRE(f);
+    REQUIRE(f->pos.path == "1000-GZIP");
+    REQUIRE(f->pos.offset == 20);
+    REQUIRE(f->feature == "foo");
+    REQUIRE(f->context == "bar");
+    REQUIRE(!FeatureReader::parse_line("# comment"));
+}
+
+TEST_CASE("offset_index", "[feature_recorder_set]") {
+    const size_t N = 20000;
+    for (int mode = 0; mode < 3; mode++) { // unbuffered, buffered, compressed
+        if (mode == 2 && !frame_codec::available(frame_codec::GZIP)) break;
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.offset_index = true;
+        flags.buffered_writes = mode == 1;
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        {
+            feature_recorder_set fs(flags, sc);
+            if (mode == 2) fs.feature_file_compression = frame_codec::GZIP;
+            feature_recorder& fr = fs.create_feature_recorder("indexed");
+            for (size_t i = 0; i < N; i++) {
+                fr.write(pos0_t((i % 7) ? "" : "100-GZIP", i * 10), "feature" + std::to_string(i), "context");
+            }
+            fs.feature_recorders_shutdown();
+        }
+        const auto fname = sc.outdir / (mode == 2 ? "indexed.txt.gz" : "indexed.txt");
+        const auto idx_size = std::filesystem::file_size(fname.string() + FeatureReader::INDEX_EXTENSION);
+        REQUIRE(idx_size > FeatureReader::INDEX_MAGIC.size() + FeatureReader::INDEX_ENTRY_SIZE); // several blocks
+        REQUIRE((idx_size - FeatureReader::INDEX_MAGIC.size()) % FeatureReader::INDEX_ENTRY_SIZE == 0);
+
+        std::vector<std::string> all; // imageOffset \t feature, in file order
+        {
+            FeatureReader reader(fname);
+            while (auto f = reader.next()) all.push_back(std::to_string(f->pos.imageOffset()) + "\t" + f->feature);
+        }
+        REQUIRE(all.size() == N);
+        auto expected = [&all](uint64_t start, uint64_t end) {
+            std::vector<std::string> ret;
+            for (const auto& it : all) {
+                const uint64_t offset = std::stoull(it);
+                if (offset >= start && offset < end) ret.push_back(it);
+            }
+            return ret;
+        };
+        auto got = [](const std::vector<Feature>& features) {
+            std::vector<std::string> ret;
+            for (const auto& f : features) ret.push_back(std::to_string(f.pos.imageOffset()) + "\t" + f.feature);
+            return ret;
+        };
+
+        for (int pass = 0; pass < 2; pass++) { // with the index, then without it
+            FeatureReader reader(fname);
+            REQUIRE(reader.has_index() == (pass == 0));
+            REQUIRE(got(reader.read_range(0, 50)) == expected(0, 50));
+            REQUIRE(got(reader.read_range(100, 101)) == expected(100, 101));
+            REQUIRE(got(reader.read_range(123450, 150000)) == expected(123450, 150000));
+            REQUIRE(reader.read_range(N * 10, N * 20).empty());
+
+            reader.seek(pos0_t("", 180000));
+            std::vector<std::string> after;
+            while (auto f = reader.next()) after.push_back(std::to_string(f->pos.imageOffset()) + "\t" + f->feature);
+            REQUIRE(after == expected(180000, UINT64_MAX));
+            reader.seek(pos0_t("", 0)); // seeking again starts over
+            size_t count = 0;
+            while (reader.next()) count++;
+            REQUIRE(count == N);
+            std::filesystem::remove(fname.string() + FeatureReader::INDEX_EXTENSION);
+        }
+    }
+}
+
+#include "feature_recorder_sql.h"
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
+static int64_t sql_int(sqlite3* db, const std::string& sql) {
+    sqlite3_stmt* stmt = nullptr;
+    REQUIRE(sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK);
+    REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+    const int64_t ret = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+TEST_CASE("sql_features", "[feature_recorder_set]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    flags.record_files = false;
+    flags.record_sql = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    const int THREADS = 4;
+    const int N = 50000; // more than a transaction
+    {
+        feature_recorder_set fs(flags, sc);
+        feature_recorder& fr = fs.create_feature_recorder("sqlfeat");
+        fs.histogram_add(histogram_def("sqlfeat", "sqlfeat", "([0-9]+)", "", "digits", histogram_def::flags_t()));
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.emplace_back([&fr, t]() {
+                for (int i = 0; i < N; i++) {
+                    fr.write(pos0_t("", uint64_t(t) * N + i), "f" + std::to_string(i % 10), "ctx");
+                }
+            });
+        }
+        for (auto& it : threads) { it.join(); }
+        fs.feature_recorders_shutdown();
+        fs.histograms_generate();
+    }
+    sqlite3* db = nullptr;
+    REQUIRE(sqlite3_open((sc.outdir / besql_writer::DB_FILENAME).c_str(), &db) == SQLITE_OK);
+    REQUIRE(sql_int(db, "SELECT COUNT(*) FROM f_sqlfeat") == THREADS * N);
+    REQUIRE(sql_int(db, "SELECT COUNT(DISTINCT offset) FROM f_sqlfeat") == THREADS * N);
+    REQUIRE(sql_int(db, "SELECT COUNT(*) FROM f_sqlfeat WHERE feature_utf8='f7' AND context_eutf8='ctx'") ==
+            THREADS * N / 10);
+    REQUIRE(sql_int(db, "SELECT COUNT(*) FROM h_sqlfeat_digits") == 10);
+    REQUIRE(sql_int(db, "SELECT count FROM h_sqlfeat_digits WHERE feature_utf8='3'") == THREADS * N / 10);
+    REQUIRE(sql_int(db, "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND tbl_name='f_sqlfeat'") == 3);
+    sqlite3_close(db);
+
+    /* A failed insert loses its rows and fails the producers that come after it, rather than hanging them */
+    {
+        besql_writer w(sc.outdir / "failing.sqlite");
+        const uint32_t t = w.create_table("gone");
+        REQUIRE(sqlite3_open((sc.outdir / "failing.sqlite").c_str(), &db) == SQLITE_OK);
+        REQUIRE(sqlite3_exec(db, "DROP TABLE f_gone", nullptr, nullptr, nullptr) == SQLITE_OK);
+        sqlite3_close(db);
+        for (unsigned i = 0; i < besql_writer::ROWS_PER_INSERT * 3 + 5; i++) w.enqueue(t, pos0_t("", i), "f", "c");
+        REQUIRE_THROWS_AS(w.drain(), std::runtime_error);
+        REQUIRE_THROWS_AS(w.enqueue(t, pos0_t("", 0), "f", "c"), std::runtime_error);
+        REQUIRE(w.rows_written() == 0);
+    }
+}
+#endif
+
+#include "feature_recorder_columnar.h"
+TEST_CASE("columnar_features", "[feature_recorder_set]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    flags.record_files = false;
+    flags.record_columnar = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    const std::filesystem::path fname = sc.outdir / "columnar.fcol";
+    const size_t N = 150000; // more than one block
+    {
+        feature_recorder_set fs(flags, sc);
+        feature_recorder& fr = fs.create_feature_recorder("columnar");
+        for (size_t i = 0; i < N; i++) {
+            const pos0_t pos = (i % 3 == 0) ? pos0_t("1000-GZIP", i) : pos0_t("", i);
+            fr.write(pos, "feature" + std::to_string(i), (i % 2) ? "context" + std::to_string(i) : "");
+        }
+        fr.flush();
+        feature_columnar_reader partial(fname); // no index yet, so the blocks are walked
+        REQUIRE(partial.has_index() == false);
+        REQUIRE(partial.size() == N);
+    }
+
+    feature_columnar_reader reader(fname);
+    REQUIRE(reader.get_name() == "columnar");
+    REQUIRE(reader.has_index());
+    REQUIRE(reader.size() == N);
+    auto ft = reader.at(99999);
+    REQUIRE(ft.path == "1000-GZIP");
+    REQUIRE(ft.offset == 99999);
+    REQUIRE(ft.feature == "feature99999");
+    REQUIRE(ft.context == "context99999");
+    REQUIRE(reader.at(4).pos_str() == "4");
+    REQUIRE(reader.at(4).context == "");
+    REQUIRE_THROWS_AS(reader.at(N), std::out_of_range);
+
+    size_t in_range = 0;
+    reader.for_each_in_range(1000, 1999, [&in_range](const feature_columnar_reader::feature_t&) { in_range++; });
+    REQUIRE(in_range == 1000);
+
+    /* The text conversion is what feature_recorder_file would have written */
+    const std::filesystem::path txt = sc.outdir / "columnar.txt";
+    feature_columnar_reader::convert_to_text(fname, txt);
+    auto lines = getLines(txt);
+    REQUIRE(lines.size() == N + 2);
+    REQUIRE(lines[2] == "1000-GZIP-0\tfeature0");
+    REQUIRE(lines[3] == "1\tfeature1\tcontext1");
+    REQUIRE(lines[5] == "1000-GZIP-3\tfeature3\tcontext3");
+    REQUIRE(feature_recorder::extract_feature(lines[5]) == "feature3");
+
+    REQUIRE_THROWS_AS(feature_columnar_reader(txt), std::runtime_error);
+}
+
 /****************************************************************
  * char_class.h
  */
@@ -486,6 +1574,58 @@ TEST_CASE("char_class", "[char_class]") {
     REQUIRE(c.range_g_z == 0);
     REQUIRE(c.range_G_Z == 0);
     REQUIRE(c.range_0_9 == 1);
+
+    /* byte_counts() counts the same as a byte at a time, at every length and alignment */
+    std::vector<uint8_t> data(100003);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (i * 2654435761u) >> 13;
+    size_t bad = 0;
+    for (size_t len : {size_t(0), size_t(7), size_t(255), size_t(256), size_t(4099), data.size() - 1}) {
+        uint64_t counts[256]{}, expected[256]{};
+        byte_counts(data.data() + 1, len, counts);
+        for (size_t i = 0; i < len; i++) expected[data[i + 1]]++;
+        if (memcmp(counts, expected, sizeof(counts)) != 0) bad++;
+        CharClass one, all;
+        for (size_t i = 0; i < len; i++) one.add(data[i + 1]);
+        all.add(data.data() + 1, len);
+        if (one.range_0_9 != all.range_0_9 || one.range_A_Fi != all.range_A_Fi || one.range_g_z != all.range_g_z ||
+            one.range_G_Z != all.range_G_Z) {
+            bad++;
+        }
+    }
+    REQUIRE(bad == 0);
+
+    /* Entropy is 0 for a constant buffer and 8 when every value is equally common */
+    std::vector<uint8_t> every(256 * 16);
+    for (size_t i = 0; i < every.size(); i++) every[i] = i;
+    REQUIRE(byte_profile_t(every.data(), every.size()).entropy == Approx(8.0));
+    REQUIRE(byte_profile_t(every.data(), every.size()).looks_random());
+    const byte_profile_t zeros(std::vector<uint8_t>(1000).data(), 1000);
+    REQUIRE(zeros.entropy == 0);
+    REQUIRE(zeros.zero == 1000);
+    const std::string text("The quick brown fox\tjumps over the lazy dog.\r\n");
+    const byte_profile_t tp(reinterpret_cast<const uint8_t*>(text.data()), text.size());
+    REQUIRE(tp.looks_text());
+    REQUIRE(tp.looks_random() == false);
+    REQUIRE(tp.total == text.size());
+    REQUIRE(tp.classes.range_G_Z == 1);
+
+    /* An sbuf's profiles are computed once, over its page */
+    auto sbuf = sbuf_t::map_file(tests_dir() / "random.dat");
+    const auto& blocks = sbuf->block_profiles();
+    REQUIRE(blocks.size() == (sbuf->pagesize + sbuf_t::PROFILE_BLOCK - 1) / sbuf_t::PROFILE_BLOCK);
+    size_t random_blocks = 0, bytes = 0;
+    for (const auto& b : blocks) {
+        if (b.looks_random()) random_blocks++;
+        bytes += b.len;
+    }
+    REQUIRE(random_blocks == blocks.size());
+    REQUIRE(bytes == sbuf->pagesize);
+    const byte_profile_t& profile = sbuf->byte_profile(); // made with the blocks
+    REQUIRE(&profile == &sbuf->byte_profile());
+    REQUIRE(profile.total == sbuf->pagesize);
+    REQUIRE(profile.looks_random());
+    REQUIRE(byte_profile_t(sbuf->get_buf(), sbuf->pagesize).entropy == Approx(profile.entropy));
+    delete sbuf;
 }
 
 /****************************************************************
@@ -512,6 +1652,26 @@ TEST_CASE("pos0_t", "[feature_recorder]") {
     REQUIRE(p1 > p0);
     REQUIRE(p0 != p1);
     REQUIRE(p1 == p2);
+
+    /* Paths are interned: equal paths share one entry, and slices share their parent's */
+    REQUIRE(p0.same_path(p2));
+    REQUIRE(&(p0 + 10).path == &p0.path);
+    REQUIRE((p0 - 300).offset == 0);
+    const pos0_t copy(p0);
+    REQUIRE(copy.depth == 3);
+    REQUIRE(copy.str() == "10000-hello-200-bar-300");
+    REQUIRE(pos0_t("", 5).str() == "5");
+    REQUIRE(pos0_t().same_path(pos0_t("", 7)));
+    const size_t interned = pos0_t::interned_count();
+    {
+        pos0_t gz = p0 + "GZIP";
+        REQUIRE(gz.path == "10000-hello-200-bar-300-GZIP");
+        REQUIRE(gz.depth == copy.depth + 2);
+        REQUIRE(pos0_t::interned_count() == interned + 1);
+        REQUIRE((gz + 5 + "BASE64").path == "10000-hello-200-bar-300-GZIP-5-BASE64");
+    }
+    REQUIRE(pos0_t::interned_count() == interned);
+    REQUIRE(p0.shift(5).path == "10005-hello-200-bar");
 }
 
 /****************************************************************
@@ -538,6 +1698,66 @@ TEST_CASE("test regex_vector", "[regex]") {
 
     REQUIRE(rv.search_all("before check2 after", &found) == true);
     REQUIRE(found == "check2");
+    REQUIRE(rv.search_all("THING", &found) == true); // push_back() patterns ignore case
+    REQUIRE(found == "THING");
+}
+
+#include "regex_engine.h"
+TEST_CASE("regex_engine", "[regex]") {
+    regex_engine re;
+    REQUIRE(re.add("ab+c", false) == 0);
+    REQUIRE(re.add("(x)\\1", false) == 1); // a back-reference: std::regex only
+    REQUIRE(re.add("b", true) == 2);
+    REQUIRE_THROWS_AS(re.add("(unbalanced", false), std::regex_error);
+    REQUIRE(re.size() == 3);
+
+    size_t which = 0, offset = 0, len = 0;
+    REQUIRE(re.search("no match here", &which) == false);
+    REQUIRE(re.search("--abbbc--", &which, &offset, &len) == true);
+    REQUIRE(which == 0);
+    REQUIRE(offset == 2);
+    REQUIRE(len == 5);
+    REQUIRE(re.search("..xx..", &which, &offset, &len) == true);
+    REQUIRE(which == 1);
+    REQUIRE(offset == 2);
+    REQUIRE(len == 2);
+    REQUIRE(re.search("xx B abc", &which, &offset, &len) == true); // the lowest-numbered pattern wins
+    REQUIRE(which == 0);
+    REQUIRE(re.search("xx B", &which, &offset, &len) == true);
+    REQUIRE(which == 1);
+    REQUIRE(re.search("B", &which, &offset, &len) == true);
+    REQUIRE(which == 2);
+
+    /* bytes that are not UTF-8 match as they do with std::regex */
+    regex_engine bytes;
+    bytes.add("\\xff+", false);
+    REQUIRE(bytes.search(std::string("a\xff\xff" "b"), nullptr, &offset, &len) == true);
+    REQUIRE(offset == 1);
+    REQUIRE(len == 2);
+
+    /* the same answers as std::regex on a range of probes */
+    const std::vector<std::string> pats{"[0-9]{3}-[0-9]{4}", "foo|bar", "^start", "end$", "a.c"};
+    regex_engine all;
+    for (const auto& p : pats) all.add(p, false);
+    const std::vector<std::string> probes{"call 555-1234 now", "a foo", "barn", "start here", "not start",
+                                          "the end", "end.", "abc", "a\nc", ""};
+    int bad = 0;
+    for (const auto& probe : probes) {
+        bool expected = false;
+        size_t expected_which = 0;
+        std::smatch m;
+        for (size_t i = 0; i < pats.size(); i++) {
+            if (std::regex_search(probe, m, std::regex(pats[i]))) {
+                expected = true;
+                expected_which = i;
+                break;
+            }
+        }
+        const bool found = all.search(probe, &which, &offset, &len);
+        if (found != expected) bad++;
+        if (found && expected && (which != expected_which || probe.substr(offset, len) != m.str())) bad++;
+    }
+    REQUIRE(bad == 0);
 }
 
 /****************************************************************
@@ -649,6 +1869,198 @@ TEST_CASE("malloc_sbuf", "[sbuf]") {
     delete sb2;
 }
 
+TEST_CASE("sbuf_view", "[sbuf]") {
+    std::vector<uint8_t> data(64);
+    std::mt19937 rng(13);
+    for (auto& it : data) { it = rng(); }
+    sbuf_t sb(pos0_t(), data.data(), data.size());
+    REQUIRE_THROWS_AS(sb.view(60, 5), sbuf_t::range_exception_t);
+    REQUIRE_THROWS_AS(sb.view(65, 0), sbuf_t::range_exception_t);
+    REQUIRE(sb.view(64, 0).size() == 0);
+
+    /* The unchecked readers agree with the checked ones */
+    const auto v = sb.view(8, 48);
+    size_t mismatches = 0;
+    for (size_t i = 0; i + 8 <= v.size(); i++) {
+        if (v.u8(i) != sb.get8u(8 + i)) mismatches++;
+        if (v.u16(i) != sb.get16u(8 + i) || v.u16BE(i) != sb.get16uBE(8 + i)) mismatches++;
+        if (v.u32(i) != sb.get32u(8 + i) || v.u32BE(i) != sb.get32uBE(8 + i)) mismatches++;
+        if (v.u64(i) != sb.get64u(8 + i) || v.u64BE(i) != sb.get64uBE(8 + i)) mismatches++;
+        if (v.i32(i, sbuf_t::BO_BIG_ENDIAN) != sb.get32iBE(8 + i)) mismatches++;
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(v.subview(4, 8).u32(0) == sb.get32u(12));
+    REQUIRE_THROWS_AS(v.subview(40, 9), sbuf_t::range_exception_t);
+
+    uint16_t units[4];
+    v.copy16(2, 4, units, sbuf_t::BO_BIG_ENDIAN);
+    REQUIRE(units[3] == sb.get16uBE(8 + 2 + 6));
+
+    /* "Aé€😀" with an unpaired surrogate, then a NUL, in UTF-16LE */
+    const uint8_t u16[] = {'A', 0, 0xe9, 0, 0xac, 0x20, 0x3d, 0xd8, 0x00, 0xde, 0x00, 0xd8, 'z', 0, 0, 0, 'q', 0};
+    sbuf_t ub(pos0_t(), u16, sizeof(u16));
+    REQUIRE(ub.view().utf16_to_utf8(0, 9) == "A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\xef\xbf\xbdz" + std::string(1, '\0') + "q");
+    REQUIRE(ub.view().utf16_to_utf8(0, 9, sbuf_t::BO_LITTLE_ENDIAN, true) ==
+            "A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\xef\xbf\xbdz");
+
+    std::wstring ws;
+    ub.getUTF16(0, ws);
+    REQUIRE(ws.size() == 7);
+    REQUIRE(ws[2] == 0x20ac);
+    ub.getUTF16(2, 3, sbuf_t::BO_BIG_ENDIAN, ws);
+    REQUIRE(ws.size() == 3);
+    REQUIRE(ws[0] == 0xe900);
+    REQUIRE(ws[1] == 0xac20);
+}
+
+TEST_CASE("utf16_shadow", "[sbuf]") {
+    /* The same "Aé€😀", unpaired surrogate, "z", NUL, "q" as above, with ASCII runs either side and a trailing odd byte */
+    std::string u16;
+    for (const char ch : std::string("hello ")) u16 += std::string(1, ch) + std::string(1, '\0');
+    u16 += std::string("A\0\xe9\0\xac\x20\x3d\xd8\x00\xde\x00\xd8z\0\0\0q\0", 18);
+    for (const char ch : std::string(" world")) u16 += std::string(1, ch) + std::string(1, '\0');
+    u16 += "!";
+    auto sb = sbuf_t::sbuf_malloc(pos0_t("BASE64", 1000), u16);
+    const auto& sh = sb->utf16_shadow();
+    REQUIRE(&sh == &sb->utf16_shadow()); // cached
+    const std::string utf8 = sh.sbuf->asString();
+    REQUIRE(utf8 == "hello A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\xef\xbf\xbdz" + std::string(1, '\0') + "q world");
+    REQUIRE(utf8 == sb->view().utf16_to_utf8(0, sb->bufsize / 2));
+    REQUIRE(sh.sbuf->pos0 == sb->pos0);
+    REQUIRE(sh.sbuf->pagesize == utf8.size());
+    REQUIRE(sh.offset_of(0) == 0);
+    REQUIRE(sh.offset_of(utf8.find('A')) == 12);
+    REQUIRE(sh.offset_of(utf8.find('A') + 2) == 14); // the second byte of é
+    REQUIRE(sh.offset_of(utf8.find("\xf0")) == 18);
+    REQUIRE(sh.offset_of(utf8.find('z')) == 24);
+    REQUIRE(sh.offset_of(utf8.find('q')) == 28);
+    REQUIRE(sh.pos0_of(utf8.find("world")) == pos0_t("BASE64", 1000 + 32));
+    REQUIRE(sh.spans.size() == 6); // "hello A", é, €, 😀, the surrogate and "z\0q world"
+    const sbuf_t* whole = sb->new_slice(0, sb->bufsize);
+    REQUIRE(&whole->utf16_shadow() == &sh); // shared with a slice of all of it
+    delete whole;
+
+    /* The page ends where the page's code units do, and random data agrees with the scalar conversion */
+    std::mt19937 rng(54);
+    for (const bool simd : {true, false}) {
+        unicode_simd_enable(simd);
+        auto rb = sbuf_t::sbuf_malloc(pos0_t(), 4096, 2048);
+        for (size_t i = 0; i < rb->bufsize; i++) rb->wbuf(i, i % 5 ? "abc de"[rng() % 6] : rng() % 3 ? 0 : rng());
+        const auto& rs = rb->utf16_shadow();
+        REQUIRE(rs.sbuf->asString() == rb->view().utf16_to_utf8(0, rb->bufsize / 2));
+        REQUIRE(rs.sbuf->pagesize == rb->view().utf16_to_utf8(0, 1024).size());
+        size_t bad = 0;
+        for (size_t i = 0; i < rs.sbuf->bufsize; i++) {
+            const size_t off = rs.offset_of(i);
+            if (off % 2 || off >= rb->bufsize || (rs.sbuf->get8u(i) < 0x80 && rs.sbuf->get8u(i) != rb->get8u(off))) bad++;
+        }
+        REQUIRE(bad == 0);
+        delete rb;
+    }
+    unicode_simd_enable(true);
+    delete sb;
+
+    /* A write resets the profiles and the shadow as well as the digests */
+    auto wb = sbuf_t::sbuf_malloc(pos0_t(), std::string("a\0b\0c\0d\0", 8));
+    REQUIRE(wb->utf16_shadow().sbuf->asString() == "abcd");
+    REQUIRE(wb->byte_profile().counts['a'] == 1);
+    REQUIRE(wb->block_profiles().at(0).zero == 4);
+    wb->wbuf(0, 'z');
+    wb->wbuf(1, 'z');
+    REQUIRE(wb->utf16_shadow().sbuf->asString() == wb->view().utf16_to_utf8(0, wb->bufsize / 2));
+    REQUIRE(wb->utf16_shadow().sbuf->asString() != "abcd");
+    REQUIRE(wb->byte_profile().counts['a'] == 0);
+    REQUIRE(wb->byte_profile().counts['z'] == 2);
+    REQUIRE(wb->block_profiles().at(0).zero == 3);
+    delete wb;
+}
+
+TEST_CASE("sbuf_release", "[sbuf]") {
+    const int count0 = sbuf_t::sbuf_count;
+    auto* parent = sbuf_t::sbuf_malloc(pos0_t(), std::string("abcdefghijklmnopqrstuvwxyz"));
+    REQUIRE(parent->reference_count() == 1);
+    sbuf_t* child = parent->new_slice(10, 5);
+    sbuf_t* grandchild = child->new_slice(1, 2); // references the owner of the memory
+    REQUIRE(parent->reference_count() == 3);
+    REQUIRE_THROWS_AS(parent->realloc(5), std::runtime_error);
+
+    /* The parent outlives its creator's reference; the last child frees it, from another thread */
+    parent->release();
+    REQUIRE(sbuf_t::sbuf_count == count0 + 3);
+    REQUIRE(child->asString() == "klmno");
+    std::thread t([child] { delete child; });
+    t.join();
+    REQUIRE(sbuf_t::sbuf_count == count0 + 2);
+    REQUIRE(grandchild->asString() == "lm");
+    delete grandchild;
+    REQUIRE(sbuf_t::sbuf_count == count0);
+
+    /* Moving a slice moves its reference */
+    auto* sb = sbuf_t::sbuf_malloc(pos0_t(), std::string("hello"));
+    {
+        sbuf_t a = sb->slice(1);
+        sbuf_t b(std::move(a));
+        REQUIRE(sb->children == 1);
+        REQUIRE(b.asString() == "ello");
+    }
+    REQUIRE(sb->children == 0);
+    sb->release();
+    REQUIRE(sbuf_t::sbuf_count == count0);
+}
+
+TEST_CASE("sbuf_pool", "[sbuf]") {
+    REQUIRE(sbuf_pool::size_class(100) == 0);
+    REQUIRE(sbuf_pool::size_class(1024) == 1024);
+    REQUIRE(sbuf_pool::size_class(100 * 1000) == 128 * 1024);
+    REQUIRE(sbuf_pool::size_class(sbuf_pool::MAX_POOLED + 1) == 0);
+
+    sbuf_pool::set_enabled(true);
+    sbuf_pool::trim();
+    auto* sb = sbuf_t::sbuf_malloc(pos0_t(), 100 * 1000);
+    void* mem = sb->malloc_buf();
+    delete sb;
+    REQUIRE(sbuf_pool::get_stats().bytes_cached == 128 * 1024);
+
+    /* The buffer and the sbuf_t come back from this thread's cache */
+    const auto before = sbuf_pool::get_stats();
+    sb = sbuf_t::sbuf_malloc(pos0_t(), 70 * 1000);
+    REQUIRE(sb->malloc_buf() == mem);
+    REQUIRE(sbuf_pool::get_stats().buffer_hits == before.buffer_hits + 1);
+    REQUIRE(sbuf_pool::get_stats().object_hits == before.object_hits + 1);
+
+    /* Shrinking keeps the buffer pooled, at the smaller size class */
+    sb->wbuf(0, 'x');
+    sb = sb->realloc(3000);
+    REQUIRE(sb->bufsize == 3000);
+    REQUIRE((*sb)[0] == 'x');
+    delete sb;
+    REQUIRE(sbuf_pool::get_stats().bytes_cached == 4096);
+
+    /* A thread's cache goes to the depot when it exits, where other threads can reuse it */
+    sbuf_pool::trim();
+    void* thread_mem = nullptr;
+    std::thread t([&thread_mem] {
+        auto* tsb = sbuf_t::sbuf_malloc(pos0_t(), 20000);
+        thread_mem = tsb->malloc_buf();
+        delete tsb;
+    });
+    t.join();
+    REQUIRE(sbuf_pool::get_stats().bytes_cached == 32 * 1024);
+    sb = sbuf_t::sbuf_malloc(pos0_t(), 30000);
+    REQUIRE(sb->malloc_buf() == thread_mem);
+    delete sb;
+    sbuf_pool::trim();
+    REQUIRE(sbuf_pool::get_stats().bytes_cached == 0);
+
+    /* Disabled, everything is malloc and free */
+    sbuf_pool::set_enabled(false);
+    const auto disabled = sbuf_pool::get_stats();
+    delete sbuf_t::sbuf_malloc(pos0_t(), 100 * 1000);
+    REQUIRE(sbuf_pool::get_stats().bytes_cached == 0);
+    REQUIRE(sbuf_pool::get_stats().buffer_misses == disabled.buffer_misses);
+    sbuf_pool::set_enabled(true);
+}
+
 TEST_CASE("map_file", "[sbuf]") {
     std::string tempdir = get_tempdir();
     std::ofstream os;
@@ -669,6 +2081,162 @@ TEST_CASE("map_file", "[sbuf]") {
     delete sb1p;
 }
 
+/* Every match, by brute force */
+static std::vector<multi_pattern::hit_t> naive_find_all(const multi_pattern& mp, const std::string& text,
+                                                        size_t page_len, bool icase) {
+    std::vector<multi_pattern::hit_t> hits;
+    auto eq = [icase](char a, char b) { return icase ? tolower(a) == tolower(b) : a == b; };
+    for (size_t off = 0; off < page_len && off < text.size(); off++) {
+        for (uint32_t id = 0; id < mp.size(); id++) {
+            const std::string& p = mp.pattern(id);
+            if (off + p.size() <= text.size() && std::equal(p.begin(), p.end(), text.begin() + off, eq)) {
+                hits.push_back(multi_pattern::hit_t{off, p.size(), id});
+            }
+        }
+    }
+    return hits;
+}
+
+TEST_CASE("multi_pattern", "[sbuf]") {
+    std::mt19937 rng(12);
+    size_t mismatches = 0;
+    for (bool icase : {false, true}) {
+        for (unsigned int trial = 0; trial < 20; trial++) {
+            /* A small alphabet, so patterns overlap and nest */
+            multi_pattern mp(icase);
+            const char* alphabet = (trial % 4 == 0) ? "aB" : "abcAB\xff";
+            const size_t alen = strlen(alphabet);
+            for (unsigned int i = 0; i < 1 + trial * 5; i++) {
+                std::string p;
+                for (size_t j = 0, len = 1 + rng() % 6; j < len; j++) { p.push_back(alphabet[rng() % alen]); }
+                mp.add(p);
+            }
+            mp.compile();
+            std::string text;
+            for (size_t j = 0; j < 500; j++) { text.push_back(alphabet[rng() % alen]); }
+            sbuf_t sbuf(pos0_t(), reinterpret_cast<const uint8_t*>(text.data()), text.size());
+            if (!(sbuf.find_all(mp) == naive_find_all(mp, text, text.size(), icase))) mismatches++;
+            auto* margin = sbuf_t::sbuf_new(pos0_t(), sbuf.get_buf(), 400, 300); // 300 bytes of page, 100 of margin
+            if (!(margin->find_all(mp) == naive_find_all(mp, text.substr(0, 400), 300, icase))) mismatches++;
+            delete margin;
+        }
+    }
+    REQUIRE(mismatches == 0);
+
+    multi_pattern mp;
+    REQUIRE(mp.add("he") == 0);
+    REQUIRE(mp.add("she") == 1);
+    REQUIRE(mp.add("hers") == 2);
+    REQUIRE(mp.add("he") == 0);
+    REQUIRE_THROWS_AS(mp.add(""), std::runtime_error);
+    std::vector<multi_pattern::hit_t> hits;
+    REQUIRE_THROWS_AS(mp.search(reinterpret_cast<const uint8_t*>("ushers"), 6, 6, hits), std::runtime_error);
+    mp.compile();
+    REQUIRE_THROWS_AS(mp.add("his"), std::runtime_error);
+    mp.search(reinterpret_cast<const uint8_t*>("ushers"), 6, 6, hits);
+    REQUIRE(hits.size() == 3);
+    REQUIRE(hits[0] == multi_pattern::hit_t{1, 3, 1}); // she
+    REQUIRE(hits[1] == multi_pattern::hit_t{2, 2, 0}); // he
+    REQUIRE(hits[2] == multi_pattern::hit_t{2, 4, 2}); // hers
+}
+
+/****************************************************************
+ * sbuf_stream.h
+ */
+#include "sbuf_stream.h"
+struct test_header_t {
+    enum kind_t : uint16_t { KIND_A = 1, KIND_B = 0x0200 };
+    uint32_t version{0};
+    char magic[4]{};
+    uint16_t count{0};
+    kind_t kind{KIND_A};
+    int64_t when{0};
+};
+using test_header_layout = sbuf_record<test_header_t, sbuf_field<&test_header_t::version>,
+                                       sbuf_field<&test_header_t::magic>, sbuf_skip<2>,
+                                       sbuf_field<&test_header_t::count, sbuf_t::BO_BIG_ENDIAN>,
+                                       sbuf_field<&test_header_t::kind>, sbuf_field<&test_header_t::when>>;
+
+TEST_CASE("sbuf_record", "[sbuf]") {
+    static_assert(test_header_layout::size == 22);
+    std::vector<uint8_t> data(100);
+    std::mt19937 rng(14);
+    for (auto& it : data) { it = rng(); }
+    memcpy(data.data() + 4, "SCCA", 4);
+    sbuf_t sb(pos0_t(), data.data(), data.size());
+
+    /* A record decodes to the same values as reading the fields one at a time */
+    sbuf_stream ss(sb);
+    test_header_t h = ss.get_record<test_header_layout>();
+    REQUIRE(ss.tell() == 22);
+    REQUIRE(h.version == sb.get32u(0));
+    REQUIRE(memcmp(h.magic, "SCCA", 4) == 0);
+    REQUIRE(h.count == sb.get16uBE(10));
+    REQUIRE(h.kind == sb.get16u(12));
+    REQUIRE(h.when == sb.get64i(14));
+
+    auto hs = test_header_layout::decode_array(sb, 1, 3, 25);
+    REQUIRE(hs.size() == 3);
+    REQUIRE(hs[2].when == sb.get64i(1 + 50 + 14));
+    REQUIRE(ss.get_records<test_header_layout>(3).size() == 3);
+    REQUIRE(ss.tell() == 88);
+
+    /* One bounds check for the whole record */
+    REQUIRE_THROWS_AS(test_header_layout::decode(sb, 79), sbuf_t::range_exception_t);
+    REQUIRE_THROWS_AS(test_header_layout::decode_array(sb, 0, 5, 22), sbuf_t::range_exception_t);
+    REQUIRE_THROWS_AS(ss.get_record<test_header_layout>(), sbuf_t::range_exception_t);
+}
+
+/****************************************************************
+ * image_reader.h
+ */
+#include "image_reader.h"
+TEST_CASE("image_reader", "[sbuf]") {
+    std::filesystem::path fname = get_tempdir() + "/image.raw";
+    std::vector<uint8_t> data(3 * 4096 + 1000);
+    for (size_t i = 0; i < data.size(); i++) { data[i] = i * 7 + i / 256; }
+    std::ofstream os(fname, std::ios::binary);
+    os.write(reinterpret_cast<const char*>(data.data()), data.size());
+    os.close();
+
+    for (unsigned int prefetch_depth : {0, 1, 3}) {
+        for (bool direct_io : {false, true}) {
+            image_reader::config_t config;
+            config.pagesize = 4096;
+            config.marginsize = 4096;
+            config.prefetch_depth = prefetch_depth;
+            config.direct_io = direct_io;
+            config.numa_placement = prefetch_depth == 1; // binding only moves pages; the data is the same
+            image_reader reader(fname, config);
+            REQUIRE(reader.get_size() == data.size());
+            uint64_t offset = 0;
+            size_t mismatches = 0;
+            while (sbuf_t* sbuf = reader.next()) {
+                REQUIRE(sbuf->pos0.offset == offset);
+                REQUIRE(sbuf->pagesize == std::min(size_t(4096), data.size() - offset));
+                REQUIRE(sbuf->bufsize == std::min(size_t(8192), data.size() - offset));
+                if (memcmp(sbuf->get_buf(), data.data() + offset, sbuf->bufsize) != 0) mismatches++;
+                offset += sbuf->pagesize;
+                delete sbuf;
+            }
+            REQUIRE(mismatches == 0);
+            REQUIRE(offset == data.size());
+            REQUIRE(reader.get_pages_read() == 4);
+            REQUIRE(reader.next() == nullptr);
+        }
+    }
+
+    /* The destructor frees pages that were read ahead but never taken */
+    image_reader::config_t config;
+    config.pagesize = 1024;
+    config.prefetch_depth = 2;
+    {
+        image_reader reader(fname, config);
+        delete reader.next();
+    }
+    REQUIRE_THROWS_AS(image_reader(get_tempdir() + "/no-such-image.raw", config), std::filesystem::filesystem_error);
+}
+
 /****************************************************************
  * scanner_config.h:
  * holds the name=value configurations for all scanners.
@@ -775,7 +2343,11 @@ TEST_CASE("run", "[scanner]") {
 
     scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
     ss.add_scanner(scan_sha1_test);
+    ss.add_find_pattern("world");
     ss.apply_scanner_commands();
+    REQUIRE(ss.get_find_list().is_compiled());
+    REQUIRE(ss.get_find_list().size() == 1);
+    REQUIRE_THROWS_AS(ss.add_find_pattern("hello"), std::runtime_error); // the find list is compiled
 
     /* Make sure scanner is enabled */
     std::stringstream s2;
@@ -835,17 +2407,1762 @@ TEST_CASE("run", "[scanner]") {
     REQUIRE(lines.size() == 1);
 }
 
-/****************************************************************
- *  word_and_context_list.h
- */
-#include "word_and_context_list.h"
-TEST_CASE("word_and_context_list", "[feature_recorder]") {
-    REQUIRE(word_and_context_list::rstrcmp("aaaa1", "bbbb0") < 0);
-    REQUIRE(word_and_context_list::rstrcmp("aaaa1", "aaaa1") == 0);
-    REQUIRE(word_and_context_list::rstrcmp("bbbb0", "aaaa1") > 0);
+#include "dfxml_log.h"
+#include "dfxml_cpp/src/dfxml_writer.h"
+TEST_CASE("dfxml_log", "[scanner]") {
+    const std::filesystem::path dir(NamedTemporaryDirectory());
+    const std::string fname = (dir / "log.xml").string();
+    const int THREADS = 4;
+    const int ENTRIES = 5000;
+    {
+        dfxml_writer writer(fname, false);
+        dfxml_log dlog(writer);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.push_back(std::thread([&dlog, t] {
+                for (int i = 0; i < ENTRIES; i++) dlog.write("log", std::to_string(t) + ":" + std::to_string(i));
+            }));
+        }
+        for (auto& t : threads) t.join();
+        REQUIRE(dlog.entries() == THREADS * ENTRIES);
+        dlog.flush();
+        REQUIRE(dlog.flushes() >= 1);
+
+        /* Only the sbufs no deeper than log_depth are logged, and only when there is a writer */
+        scanner_config sc;
+        sc.outdir = dir;
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        sbuf_t top("top");
+        REQUIRE(ss.log_enabled(top) == false);
+        ss.set_dfxml_writer(&writer);
+        REQUIRE(ss.log_enabled(top) == true);
+        const uint8_t* b = reinterpret_cast<const uint8_t*>("x");
+        REQUIRE(ss.log_enabled(sbuf_t(pos0_t("1-GZIP", 0), b, 1)) == true);
+        REQUIRE(ss.log_enabled(sbuf_t(pos0_t("1-GZIP-0-BASE64", 0), b, 1)) == false);
+    }
+    /* Each thread's entries are in order */
+    std::vector<int> next(THREADS, 0);
+    int bad = 0;
+    int count = 0;
+    for (const auto& line : getLines(fname)) {
+        if (line.rfind("<log t='", 0) != 0) continue;
+        const size_t gt = line.find('>');
+        const size_t colon = line.find(':', gt);
+        const int t = std::stoi(line.substr(gt + 1, colon - gt - 1));
+        const int i = std::stoi(line.substr(colon + 1));
+        if (i != next[t]++) bad++;
+        count++;
+    }
+    REQUIRE(bad == 0);
+    REQUIRE(count == THREADS * ENTRIES);
 }
 
-/****************************************************************
+/* The memory counters are kept as the memory is allocated and freed */
+TEST_CASE("memory_stats", "[scanner]") {
+    const uint64_t malloced0 = sbuf_t::malloced_memory.bytes();
+    auto sb = sbuf_t::sbuf_malloc(pos0_t(), 10000);
+    REQUIRE(sb->memory_bytes() >= 10000);
+    REQUIRE(sbuf_t::malloced_memory.bytes() == malloced0 + sb->memory_bytes());
+    REQUIRE(sbuf_t::malloced_memory.high_water() >= malloced0 + 10000);
+    sb = sb->realloc(100);
+    REQUIRE(sbuf_t::malloced_memory.bytes() == malloced0 + sb->memory_bytes());
+    const sbuf_t* child = sb->new_slice(10, 10);
+    REQUIRE(child->memory_bytes() == 0); // shares its parent's memory
+    delete child;
+    delete sb;
+    REQUIRE(sbuf_t::malloced_memory.bytes() == malloced0);
+
+    const uint64_t mapped0 = sbuf_t::mapped_memory.bytes();
+    auto mapped = sbuf_t::map_file(tests_dir() / "random.dat");
+    REQUIRE(sbuf_t::mapped_memory.bytes() == mapped0 + mapped->bufsize);
+    delete mapped;
+    REQUIRE(sbuf_t::mapped_memory.bytes() == mapped0);
+
+    word_and_context_list stop;
+    REQUIRE(stop.bytes() == 0);
+    stop.add_fc("feature", "before feature after");
+    const size_t one = stop.bytes();
+    REQUIRE(one > 0);
+    stop.add_fc("a much longer feature than fits in a std::string", "");
+    REQUIRE(stop.bytes() > one);
+
+    digest_set ds;
+    REQUIRE(ds.bytes() == 0);
+    ds.insert(digest_set::from_hex(hello_sha1));
+    REQUIRE(ds.bytes() > 0);
+
+    /* The scanner_set reports all of them, and writes them to the DFXML file at shutdown */
+    const std::filesystem::path dir(NamedTemporaryDirectory());
+    const std::string fname = (dir / "memory.xml").string();
+    {
+        dfxml_writer writer(fname, false);
+        scanner_config sc;
+        sc.outdir = dir;
+        sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+        scanner_set ss(sc, feature_recorder_set::flags_t(), &writer);
+        ss.add_scanner(scan_sha1_test);
+        ss.apply_scanner_commands();
+        ss.phase_scan();
+        REQUIRE(ss.get_memory_stats().seen_set == 0);
+        ss.process_sbuf(sbuf_t::sbuf_malloc(pos0_t(), std::string(hello8)));
+        const auto ms = ss.get_memory_stats();
+        REQUIRE(ms.seen_set == ss.seen_set.bytes());
+        REQUIRE(ms.seen_set > 0);
+        REQUIRE(ms.stop_list == 0); // there is none
+        REQUIRE(ms.histograms_high_water >= ms.histograms); // the threads' local tables are not counted
+        REQUIRE(ms.sbuf_malloced == sbuf_t::malloced_memory.bytes());
+        ss.shutdown();
+    }
+    int found = 0;
+    for (const auto& line : getLines(fname)) {
+        if (line.find("<memory_stats>") != std::string::npos) found++;
+        if (line.find("<seen_set>") != std::string::npos) found++;
+    }
+    REQUIRE(found == 2);
+}
+
+/****************************************************************
+ * page_cache.h
+ * The features of pages scanned by earlier runs, replayed instead of scanning the pages again.
+ */
+#include "page_cache.h"
+TEST_CASE("page_cache", "[scanner]") {
+    const std::filesystem::path cache_dir(NamedTemporaryDirectory());
+    const std::filesystem::path cache_file = cache_dir / "pages.idx";
+    auto page = [](int content, uint64_t offset) {
+        return sbuf_t::sbuf_malloc(pos0_t("", offset), std::string("cached page ") + std::to_string(content) + " " + hello8);
+    };
+    struct result_t {
+        uint64_t replayed{0};
+        std::vector<std::string> features{};
+        std::vector<std::string> histogram{};
+    };
+    /* Scans contents[i] at offset i*4096 */
+    auto scan = [&](const std::vector<int>& contents, bool use_cache, unsigned int threads, const std::string& config) {
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        if (use_cache) sc.page_cache_file = cache_file;
+        if (!config.empty()) sc.set_config("page_cache_test", config);
+        sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner(scan_sha1_test);
+        ss.apply_scanner_commands();
+        ss.phase_scan();
+        ss.launch_workers(threads);
+        for (size_t i = 0; i < contents.size(); i++) ss.schedule_sbuf(page(contents[i], i * 4096));
+        ss.shutdown();
+        result_t r;
+        r.replayed = ss.get_pages_replayed();
+        for (const auto& line : getLines((sc.outdir / "sha1_bufs.txt").string())) {
+            if (!line.empty() && line[0] != '#') r.features.push_back(line);
+        }
+        std::sort(r.features.begin(), r.features.end());
+        r.histogram = getLines((sc.outdir / "sha1_bufs_first5.txt").string());
+        return r;
+    };
+
+    const result_t first = scan({0, 1, 2, 3, 4, 5}, true, 0, "");
+    REQUIRE(first.replayed == 0);
+    REQUIRE(first.features.size() == 6);
+    {
+        page_cache pc(cache_file);
+        REQUIRE(pc.attached_size() == 6);
+    }
+
+    /* A re-acquisition: the same pages at other offsets, and some new ones */
+    const std::vector<int> second_contents{9, 5, 4, 3, 8, 2, 1, 0};
+    for (unsigned int threads : {0, 3}) {
+        const result_t second = scan(second_contents, true, threads, "");
+        const result_t fresh = scan(second_contents, false, threads, "");
+        REQUIRE(second.replayed == (threads == 0 ? 6 : 8)); // the second pass also has 9 and 8
+        REQUIRE(second.features == fresh.features);
+        REQUIRE(second.histogram == fresh.histogram);
+    }
+
+    /* A different configuration does not use what another one recorded */
+    REQUIRE(scan({0, 1, 2}, true, 0, "other").replayed == 0);
+    REQUIRE(scan({0, 1, 2}, true, 0, "other").replayed == 3);
+
+    std::ofstream(cache_file, std::ios::trunc) << "not a page cache";
+    REQUIRE_THROWS_AS(page_cache(cache_file), std::runtime_error);
+}
+
+/****************************************************************
+ * scan_journal.h
+ * Checkpoints of the pages that were scanned, so that an interrupted scan can be resumed.
+ */
+#include "scan_journal.h"
+TEST_CASE("scan_journal", "[scanner]") {
+    /* Only what was committed is loaded; a checkpoint that was not finished is cut off */
+    const std::filesystem::path jdir(NamedTemporaryDirectory());
+    const std::filesystem::path jname = jdir / scan_journal::FILENAME;
+    {
+        scan_journal j(jname);
+        REQUIRE(j.resumed() == false);
+        j.page_done(0);
+        j.page_done(100);
+        j.checkpoint({{"email", 5}});
+        j.page_done(200); // never committed
+        REQUIRE(j.checkpoints() == 1);
+    }
+    {
+        std::ofstream of(jname, std::ios_base::app);
+        of << "page 300\nlength email 9\ncommit"; // the process died while writing this
+    }
+    {
+        scan_journal j(jname);
+        REQUIRE(j.resumed() == true);
+        REQUIRE(j.checkpoints() == 1);
+        REQUIRE(j.completed_pages() == 2);
+        REQUIRE(j.page_completed(0));
+        REQUIRE(j.page_completed(100));
+        REQUIRE(j.page_completed(200) == false);
+        REQUIRE(j.page_completed(300) == false);
+        uint64_t len = 0;
+        REQUIRE(j.committed_length("email", len));
+        REQUIRE(len == 5);
+        REQUIRE(j.committed_length("url", len) == false);
+    }
+    REQUIRE(getLines(jname.string()).size() == 5);
+
+    /* A scan that stops after a checkpoint is resumed in the same outdir */
+    auto page = [](int i) {
+        return sbuf_t::sbuf_malloc(pos0_t("", i * 4096), std::string("page ") + std::to_string(i) + " " + hello8);
+    };
+    auto make_config = [](const std::filesystem::path& outdir) {
+        scanner_config sc;
+        sc.outdir = outdir;
+        sc.journal_file = scan_journal::FILENAME;
+        sc.checkpoint_seconds = 3600; // only the explicit checkpoints
+        sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+        return sc;
+    };
+    const std::filesystem::path dir1(NamedTemporaryDirectory());
+    const std::filesystem::path dir2(NamedTemporaryDirectory());
+    {
+        const scanner_config sc = make_config(dir1);
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner(scan_sha1_test);
+        ss.apply_scanner_commands();
+        ss.phase_scan();
+        ss.process_sbuf(page(0));
+        ss.process_sbuf(page(1));
+        ss.checkpoint();
+        ss.process_sbuf(page(2)); // its feature may or may not have reached the file
+        /* What a crash would leave behind */
+        std::filesystem::copy(dir1, dir2, std::filesystem::copy_options::recursive |
+                                                std::filesystem::copy_options::overwrite_existing);
+        ss.shutdown();
+    }
+    {
+        const scanner_config sc = make_config(dir2);
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner(scan_sha1_test);
+        ss.apply_scanner_commands();
+        ss.phase_scan();
+        for (int i = 0; i < 4; i++) ss.process_sbuf(page(i));
+        REQUIRE(ss.get_pages_skipped() == 2);
+        ss.shutdown();
+    }
+    std::set<std::string> features;
+    size_t count = 0;
+    for (const auto& line : getLines((dir2 / "sha1_bufs.txt").string())) {
+        if (line.empty() || line[0] == '#') continue;
+        features.insert(line);
+        count++;
+    }
+    REQUIRE(count == 4);
+    REQUIRE(features.size() == 4);
+}
+
+/****************************************************************
+ * shard_merge.h
+ * A scan split into byte ranges, and the merge of the shards' outputs.
+ */
+#include "shard_merge.h"
+TEST_CASE("shard_merge", "[scanner]") {
+    /* The shards cover the input in whole pages */
+    const uint64_t SIZE = 10 * 4096 + 100;
+    uint64_t next = 0;
+    for (unsigned int id = 0; id < 3; id++) {
+        const auto s = scanner_config::shard_t::assign(SIZE, 3, id, 4096);
+        REQUIRE(s.start == next);
+        REQUIRE(s.start % 4096 == 0);
+        REQUIRE(s.end > s.start);
+        next = s.end;
+    }
+    REQUIRE(next == SIZE);
+    REQUIRE_THROWS_AS(scanner_config::shard_t::assign(SIZE, 3, 3, 4096), std::invalid_argument);
+    REQUIRE(scanner_config::shard_t().contains(SIZE)); // not sharded
+
+    /* An image_reader reads only its shard's pages, the last one with its margin */
+    const std::filesystem::path image = std::filesystem::path(get_tempdir()) / "shard_image.raw";
+    {
+        std::ofstream os(image, std::ios::binary);
+        os << std::string(SIZE, 'x');
+    }
+    const auto middle = scanner_config::shard_t::assign(SIZE, 3, 1, 4096);
+    image_reader::config_t config;
+    config.pagesize = 4096;
+    config.marginsize = 1000;
+    config.start = middle.start;
+    config.end = middle.end;
+    image_reader reader(image, config);
+    uint64_t offset = middle.start;
+    while (sbuf_t* sbuf = reader.next()) {
+        REQUIRE(sbuf->pos0.offset == offset);
+        REQUIRE(sbuf->bufsize == 4096 + 1000);
+        offset += sbuf->pagesize;
+        delete sbuf;
+    }
+    REQUIRE(offset == middle.end);
+
+    /* A scan in three shards merges into what a scan on one node writes */
+    const int PAGES = 12;
+    auto page = [](int i) {
+        return sbuf_t::sbuf_malloc(pos0_t("", i * 4096), std::string("shard page ") + std::to_string(i) + " " + hello8);
+    };
+    auto scan = [&](const std::filesystem::path& outdir, const scanner_config::shard_t& shard) {
+        scanner_config sc;
+        sc.outdir = outdir;
+        sc.shard = shard;
+        sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner(scan_sha1_test);
+        ss.apply_scanner_commands();
+        ss.phase_scan();
+        for (int i = PAGES - 1; i >= 0; i--) ss.process_sbuf(page(i)); // out of order, and every shard is offered every page
+        ss.shutdown();
+        return ss.get_pages_skipped();
+    };
+    const std::filesystem::path whole(NamedTemporaryDirectory());
+    REQUIRE(scan(whole, scanner_config::shard_t()) == 0);
+    REQUIRE(std::filesystem::exists(whole / shard_merge::MANIFEST) == false);
+
+    std::vector<std::filesystem::path> dirs;
+    uint64_t skipped = 0;
+    for (unsigned int id = 0; id < 3; id++) {
+        dirs.push_back(NamedTemporaryDirectory());
+        skipped += scan(dirs.back(), scanner_config::shard_t::assign(PAGES * 4096, 3, id, 4096));
+        const auto m = shard_merge::manifest_t::read(dirs.back());
+        REQUIRE(m.shard.id == id);
+        REQUIRE(std::count(m.feature_files.begin(), m.feature_files.end(), "sha1_bufs.txt") == 1);
+        REQUIRE(m.histogram_files == std::vector<std::string>{"sha1_bufs_first5.txt"});
+    }
+    REQUIRE(skipped == 2 * PAGES);
+
+    std::vector<std::filesystem::path> two_shards(dirs.begin(), dirs.begin() + 2);
+    REQUIRE_THROWS_AS(shard_merge(two_shards), std::runtime_error);
+    const auto last = shard_merge::manifest_t::read(dirs[2]);
+    auto short_last = last;
+    short_last.shard.end -= 4096; // the shards don't reach the end of the input
+    short_last.write(dirs[2]);
+    REQUIRE_THROWS_AS(shard_merge(dirs), std::runtime_error);
+    last.write(dirs[2]);
+    const std::filesystem::path merged(NamedTemporaryDirectory());
+    shard_merge sm({dirs[2], dirs[0], dirs[1]});
+    REQUIRE_THROWS_AS(sm.merge(dirs[0]), std::runtime_error);
+    sm.merge(merged);
+    REQUIRE(sm.get_features_merged() == PAGES);
+
+    auto features = [](const std::filesystem::path& fname) {
+        std::vector<std::string> ret;
+        for (const auto& line : getLines(fname.string())) {
+            if (!line.empty() && line[0] != '#') ret.push_back(line);
+        }
+        return ret;
+    };
+    const auto merged_features = features(merged / "sha1_bufs.txt");
+    REQUIRE(merged_features.size() == PAGES);
+    size_t bad = 0;
+    for (int i = 0; i < PAGES; i++) {
+        if (shard_merge::line_offset(merged_features[i]) != uint64_t(i) * 4096) bad++;
+    }
+    REQUIRE(bad == 0);
+    auto sorted = [](std::vector<std::string> v) {
+        std::sort(v.begin(), v.end());
+        return v;
+    };
+    REQUIRE(sorted(merged_features) == sorted(features(whole / "sha1_bufs.txt")));
+    REQUIRE(getLines((merged / "sha1_bufs_first5.txt").string()) == getLines((whole / "sha1_bufs_first5.txt").string()));
+    for (const auto& line : getLines((merged / "sha1_bufs.txt").string())) {
+        REQUIRE(line.rfind("# Shard: ", 0) != 0);
+    }
+}
+
+/****************************************************************
+ * thread_pool.h:
+ * The work-stealing thread pool used by the scanner_set.
+ */
+#include "thread_pool.h"
+TEST_CASE("thread_pool", "[thread_pool]") {
+    std::atomic<int> count{0};
+    {
+        thread_pool tp(4);
+        REQUIRE(tp.worker_count() == 4);
+        /* Each task submits a child from the worker, which lands on that worker's deque */
+        for (int i = 0; i < 1000; i++) {
+            tp.submit([&tp, &count] {
+                count++;
+                tp.submit([&count] { count++; });
+            });
+        }
+        tp.wait_idle();
+        REQUIRE(count == 2000);
+        REQUIRE(tp.get_tasks_executed() == 2000);
+        REQUIRE(tp.get_pending() == 0);
+
+        /* Exceptions that escape a task are rethrown in the waiting thread */
+        tp.submit([] { throw std::runtime_error("task failed"); });
+        REQUIRE_THROWS_AS(tp.wait_idle(), std::runtime_error);
+        tp.join();
+        REQUIRE(tp.worker_count() == 0);
+        REQUIRE_THROWS_AS(tp.submit([] {}), std::runtime_error);
+    }
+    REQUIRE_THROWS_AS(thread_pool(0), std::runtime_error);
+}
+
+/* A scanner that splits each sbuf in half and recurses on both halves.
+ * The halves share the parent's memory, so the parent must outlive them.
+ */
+std::atomic<uint64_t> split_test_calls{0};
+void scan_split_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        auto info = new scanner_params::scanner_info(scan_split_test, "split_test");
+        info->pathPrefix = "SPLIT";
+        info->scanner_flags.recurse = true;
+        info->scanner_flags.scan_ngram_buffer = true;
+        info->scanner_flags.scan_seen_before = true;
+        sp.info = info;
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN) {
+        split_test_calls++;
+        size_t half = sp.sbuf->bufsize / 2;
+        if (half > 0) {
+            sp.recurse(sp.sbuf->new_slice(0, half));
+            sp.recurse(sp.sbuf->new_slice(half, sp.sbuf->bufsize - half));
+        }
+    }
+}
+
+TEST_CASE("run_threaded", "[scanner]") {
+    /* 256 bytes splits into 511 sbufs */
+    for (unsigned int workers : {0, 1, 4}) {
+        scanner_config sc;
+        sc.outdir = get_tempdir();
+        sc.push_scanner_command(std::string("split_test"), scanner_config::scanner_command::ENABLE);
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner(scan_split_test);
+        ss.apply_scanner_commands();
+        ss.launch_workers(workers);
+        REQUIRE(ss.get_worker_count() == (ss.debug_flags.debug_no_threads ? 0 : workers));
+        if (ss.get_worker_count() > 0) { REQUIRE_THROWS_AS(ss.launch_workers(workers), std::runtime_error); }
+
+        split_test_calls = 0;
+        ss.phase_scan();
+        for (int page = 0; page < 4; page++) {
+            auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", page * 256), 256);
+            for (size_t i = 0; i < sbufp->bufsize; i++) { sbufp->wbuf(i, i + page); }
+            ss.schedule_sbuf(sbufp);
+        }
+        ss.join();
+        REQUIRE(split_test_calls == 4 * 511);
+        ss.shutdown();
+        REQUIRE(ss.get_scanner_stats()["split_test"].calls == 4 * 511); // merged over the worker shards
+    }
+}
+
+/* Each page unpacks into 64 small children, which the batch scanner gets in batches */
+void scan_unpack_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_unpack_test, "unpack_test");
+        sp.info->pathPrefix = "UNPACK";
+        sp.info->scanner_flags.recurse = true;
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN && sp.sbuf->depth() == 0) {
+        for (size_t i = 0; i < 64; i++) {
+            auto child = sbuf_t::sbuf_malloc(sp.sbuf->pos0 + "UNPACK", 16);
+            for (size_t j = 0; j < child->bufsize; j++) child->wbuf(j, sp.sbuf->pos0.offset / 256 * 64 + i + j * 7);
+            sp.recurse(child);
+        }
+    }
+}
+
+std::atomic<uint64_t> batch_test_calls{0};
+std::atomic<uint64_t> batch_test_sbufs{0};
+std::atomic<uint64_t> batch_test_mixed{0};
+void scan_batch_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_batch_test, "batch_test");
+        sp.info->scanner_flags.scan_batch = true;
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN && sp.sbuf->depth() > 0) {
+        batch_test_calls++;
+        if (sp.batch == nullptr) {
+            batch_test_sbufs++;
+            return;
+        }
+        if (sp.batch->front() != sp.sbuf) batch_test_mixed++;
+        for (const sbuf_t* sbuf : *sp.batch) {
+            if (sbuf->depth() != sp.sbuf->depth()) batch_test_mixed++;
+        }
+        batch_test_sbufs += sp.batch->size();
+    }
+}
+
+std::atomic<uint64_t> unbatched_test_calls{0};
+void scan_unbatched_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_unbatched_test, "unbatched_test");
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN && sp.sbuf->depth() > 0) {
+        if (sp.batch != nullptr) batch_test_mixed++;
+        unbatched_test_calls++;
+    }
+}
+
+TEST_CASE("process_batch", "[scanner]") {
+    for (const size_t batch_max_bytes : {0, 64}) {
+        for (unsigned int workers : {0, 2}) {
+            scanner_config sc;
+            sc.outdir = get_tempdir();
+            sc.batch_max_bytes = batch_max_bytes;
+            sc.batch_max_sbufs = 16;
+            for (const std::string name : {"unpack_test", "batch_test", "unbatched_test"}) {
+                sc.push_scanner_command(name, scanner_config::scanner_command::ENABLE);
+            }
+            scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+            ss.add_scanner(scan_unpack_test);
+            ss.add_scanner(scan_batch_test);
+            ss.add_scanner(scan_unbatched_test);
+            ss.apply_scanner_commands();
+            ss.launch_workers(workers);
+            batch_test_calls = 0;
+            batch_test_sbufs = 0;
+            batch_test_mixed = 0;
+            unbatched_test_calls = 0;
+            ss.phase_scan();
+            for (int page = 0; page < 4; page++) {
+                auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", page * 256), 256);
+                for (size_t i = 0; i < sbufp->bufsize; i++) { sbufp->wbuf(i, i + page); }
+                ss.schedule_sbuf(sbufp);
+            }
+            ss.join();
+            REQUIRE(batch_test_sbufs == 4 * 64);
+            REQUIRE(unbatched_test_calls == 4 * 64); // the other scanners are called on every sbuf either way
+            REQUIRE(batch_test_mixed == 0);
+            REQUIRE(batch_test_calls == (batch_max_bytes ? 4 * 64 / 16 : 4 * 64));
+            ss.shutdown();
+            const auto stats = ss.get_scanner_stats();
+            REQUIRE(stats.at("batch_test").calls == 4 + 4 * 64); // one for each sbuf, batched or not
+            REQUIRE(stats.at("batch_test").bytes == 4 * 256 + 4 * 64 * 16);
+            REQUIRE(stats.at("unbatched_test").calls == 4 + 4 * 64);
+        }
+    }
+}
+
+/* Children over a buffer that the scanner reuses, which can't wait until it returns */
+void scan_reuse_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_reuse_test, "reuse_test");
+        sp.info->pathPrefix = "REUSE";
+        sp.info->scanner_flags.recurse = true;
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN && sp.sbuf->depth() == 0) {
+        uint8_t buf[16];
+        for (uint8_t i = 0; i < 32; i++) {
+            for (uint8_t j = 0; j < sizeof(buf); j++) buf[j] = i + j * j; // not an ngram
+            sp.recurse(new sbuf_t(sp.sbuf->pos0 + "REUSE", buf, sizeof(buf)));
+        }
+    }
+}
+
+std::atomic<uint32_t> reuse_seen{0};
+std::atomic<int> reuse_bad{0};
+void scan_reuse_check(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_reuse_check, "reuse_check");
+        sp.info->scanner_flags.scan_batch = true;
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN && sp.sbuf->depth() > 0) {
+        if (sp.batch != nullptr) reuse_bad++; // batched
+        for (size_t i = 1; i < sp.sbuf->bufsize; i++) {
+            if (sp.sbuf->get8u(i) != uint8_t(sp.sbuf->get8u(0) + i * i)) reuse_bad++;
+        }
+        reuse_seen |= 1u << sp.sbuf->get8u(0);
+    }
+}
+
+TEST_CASE("batch_owned_memory", "[scanner]") {
+    /* Neither batches nor the workers may take such a child past recurse() */
+    for (const size_t batch_max_bytes : {0, 64}) {
+        for (const unsigned int workers : {0, 2}) {
+            scanner_config sc;
+            sc.outdir = get_tempdir();
+            sc.batch_max_bytes = batch_max_bytes;
+            for (const std::string name : {"reuse_test", "reuse_check"}) {
+                sc.push_scanner_command(name, scanner_config::scanner_command::ENABLE);
+            }
+            scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+            ss.add_scanner(scan_reuse_test);
+            ss.add_scanner(scan_reuse_check);
+            ss.apply_scanner_commands();
+            reuse_seen = 0;
+            reuse_bad = 0;
+            ss.phase_scan();
+            ss.launch_workers(workers);
+            auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", 0), 256);
+            for (size_t i = 0; i < sbufp->bufsize; i++) { sbufp->wbuf(i, i); }
+            ss.schedule_sbuf(sbufp);
+            ss.join();
+            REQUIRE(reuse_bad == 0);
+            REQUIRE(reuse_seen == 0xffffffffu);
+            ss.shutdown();
+        }
+    }
+}
+
+/****************************************************************
+ * numa.h:
+ * NUMA topology, worker placement and node-local pages.
+ */
+#include "numa.h"
+TEST_CASE("numa", "[thread_pool]") {
+    REQUIRE(numa_topology::parse_cpulist("0-3,8,10-11\n") == std::vector<unsigned int>{0, 1, 2, 3, 8, 10, 11});
+    REQUIRE(numa_topology::parse_cpulist("").empty());
+    REQUIRE_THROWS_AS(numa_topology::parse_cpulist("3-1"), std::invalid_argument);
+    REQUIRE_THROWS_AS(numa_topology::parse_cpulist("a,b"), std::invalid_argument);
+
+    /* A two-node host with a memory-only third node, which is left out */
+    std::filesystem::path dir = NamedTemporaryDirectory();
+    for (const auto& it : std::vector<std::pair<std::string, std::string>>{
+             {"node1", "2-3"}, {"node0", "0-1"}, {"node2", ""}}) {
+        std::filesystem::create_directory(dir / it.first);
+        std::ofstream(dir / it.first / "cpulist") << it.second << "\n";
+    }
+    std::filesystem::create_directory(dir / "power");
+    numa_topology t = numa_topology::from_sysfs(dir);
+    REQUIRE(t.node_count() == 2);
+    REQUIRE(t.nodes[0].id == 0);
+    REQUIRE(t.nodes[1].cpus == std::vector<unsigned int>{2, 3});
+    REQUIRE(t.node_index_of_cpu(3) == 1);
+    REQUIRE(numa_topology::from_sysfs(dir / "missing").node_count() == 1);
+    REQUIRE(numa_topology::system().node_count() >= 1);
+
+    /* Workers alternate between the nodes, then move on to the nodes' next CPUs */
+    REQUIRE(t.place_worker(0).cpu == 0);
+    REQUIRE(t.place_worker(1).cpu == 2);
+    REQUIRE(t.place_worker(1).node == 1);
+    REQUIRE(t.place_worker(2).cpu == 1);
+    REQUIRE(t.place_worker(5).cpu == 2); // more workers than CPUs share them
+    REQUIRE(numa_topology::page_node(3 * 4096, 4096, 2) == 1);
+    REQUIRE(numa_topology::page_node(3 * 4096, 4096, 1) == 0);
+
+    /* Both nodes on cpu 0, which every host has: tasks submitted to either node all run, on a worker of some node */
+    numa_topology fake;
+    fake.nodes = {numa_topology::node_t{0, {0}}, numa_topology::node_t{1, {0}}};
+    {
+        thread_pool tp(4, &fake);
+        REQUIRE(tp.node_count() == 2);
+        REQUIRE(tp.is_pinned());
+        REQUIRE(tp.get_worker_cpu(3) == 0);
+        REQUIRE(tp.current_node() == -1);
+        std::atomic<int> count{0}, bad_node{0};
+        for (int i = 0; i < 1000; i++) {
+            tp.submit([&tp, &count, &bad_node] {
+                const int node = tp.current_node();
+                if (node < 0 || node > 1) bad_node++;
+                count++;
+            }, i % 3 - 1);
+        }
+        tp.wait_idle();
+        REQUIRE(count == 1000);
+        REQUIRE(bad_node == 0);
+    }
+
+    /* A scan with placement finds the same as one without */
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    sc.numa_placement = true;
+    sc.push_scanner_command(std::string("split_test"), scanner_config::scanner_command::ENABLE);
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    ss.add_scanner(scan_split_test);
+    ss.apply_scanner_commands();
+    ss.launch_workers(2);
+    split_test_calls = 0;
+    ss.phase_scan();
+    for (int page = 0; page < 4; page++) {
+        auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", page * 256), 256);
+        for (size_t i = 0; i < sbufp->bufsize; i++) { sbufp->wbuf(i, i + page); }
+        ss.schedule_sbuf(sbufp);
+    }
+    ss.join();
+    REQUIRE(split_test_calls == 4 * 511);
+    ss.shutdown();
+}
+
+/* With a memory budget, no more than the budget is ever queued */
+TEST_CASE("admission_control", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    sc.push_scanner_command(std::string("split_test"), scanner_config::scanner_command::ENABLE);
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    ss.add_scanner(scan_split_test);
+    ss.apply_scanner_commands();
+    ss.launch_workers(2);
+    ss.set_max_bytes_in_flight(512);
+    REQUIRE(ss.get_max_bytes_in_flight() == 512);
+
+    split_test_calls = 0;
+    ss.phase_scan();
+    for (int page = 0; page < 16; page++) {
+        auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", page * 256), 256);
+        for (size_t i = 0; i < sbufp->bufsize; i++) { sbufp->wbuf(i, i + page); }
+        ss.schedule_sbuf(sbufp);
+        REQUIRE(ss.get_bytes_in_flight() <= 512);
+    }
+    ss.join();
+    REQUIRE(split_test_calls == 16 * 511);
+    REQUIRE(ss.get_bytes_in_flight() == 0);
+    REQUIRE(ss.get_bytes_in_flight_high_water() <= 512);
+    REQUIRE(ss.get_bytes_in_flight_high_water() >= 256);
+    ss.shutdown();
+}
+
+/* The dispatch plan only calls the scanners that want each class of sbuf */
+/* A scanner that runs until it is cancelled, then tries to recurse */
+std::atomic<uint64_t> slow_test_calls{0};
+std::atomic<uint64_t> slow_test_cancelled{0};
+void scan_slow_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_slow_test, "slow_test");
+        sp.info->scanner_flags.scan_seen_before = true;
+        return;
+    }
+    if (sp.phase != scanner_params::PHASE_SCAN) return;
+    slow_test_calls++;
+    if (sp.depth > 0) return;
+    const auto t0 = std::chrono::steady_clock::now();
+    while (!sp.cancelled() && std::chrono::steady_clock::now() - t0 < std::chrono::seconds(10)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (sp.cancelled()) slow_test_cancelled++;
+    sp.recurse(sp.sbuf->new_slice(0, sp.sbuf->bufsize / 2)); // dropped if cancelled
+}
+
+TEST_CASE("time_budget", "[scanner]") {
+    /* Without a budget there is nothing to cancel the scanner, so only run it with budgets */
+    for (int page_budget : {0, 1}) {
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        sc.push_scanner_command(std::string("slow_test"), scanner_config::scanner_command::ENABLE);
+        sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+        if (page_budget) {
+            sc.sbuf_budget_ms = 30;
+        } else {
+            sc.scanner_budgets_ms["slow_test"] = 30;
+        }
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner(scan_slow_test);
+        ss.add_scanner(scan_sha1_test);
+        ss.apply_scanner_commands();
+        ss.phase_scan();
+        slow_test_calls = 0;
+        slow_test_cancelled = 0;
+        const auto t0 = std::chrono::steady_clock::now();
+        ss.process_sbuf(sbuf_t::sbuf_malloc(pos0_t("", 4096), std::string("a page that takes too long\n")));
+        REQUIRE(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5));
+        REQUIRE(slow_test_calls == 1);     // the child was dropped
+        REQUIRE(slow_test_cancelled == 1);
+        REQUIRE(ss.get_timeouts() == 1);
+        const auto stats = ss.get_scanner_stats();
+        if (!page_budget) {
+            REQUIRE(stats.at("slow_test").timeouts == 1);
+            REQUIRE(stats.at("sha1_test").calls == 1); // the other scanners were not cancelled
+        }
+        ss.shutdown();
+
+        auto lines = getLines(sc.outdir / "alerts.txt");
+        size_t found = 0;
+        for (const auto& line : lines) {
+            if (line.find("4096\t" + std::string(page_budget ? "sbuf_budget" : "scanner=slow_test") + "\t<timeout>budget_ms=30") == 0) {
+                found++;
+            }
+        }
+        REQUIRE(found == 1);
+    }
+
+    /* A scanner with no budget is never cancelled */
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+    sc.scanner_budgets_ms["slow_test"] = 1;
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    ss.add_scanner(scan_sha1_test);
+    ss.apply_scanner_commands();
+    ss.phase_scan();
+    auto sbuf = sbuf_t::sbuf_malloc(pos0_t("", 0), std::string("hello"));
+    scanner_params sp(ss, scanner_params::PHASE_SCAN, sbuf, scanner_params::PrintOptions(), nullptr);
+    REQUIRE(sp.cancelled() == false);
+    ss.process_sbuf(sbuf);
+    ss.shutdown();
+    REQUIRE(ss.get_timeouts() == 0);
+    REQUIRE(scan_watchdog::tick_for(30 * 1000 * 1000) == std::chrono::microseconds(7500));
+    REQUIRE(scan_watchdog::tick_for(0) == std::chrono::milliseconds(1));
+}
+
+/* A scanner that wants neither random-looking nor text pages */
+std::atomic<uint64_t> profile_test_calls{0};
+void scan_profile_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        auto info = new scanner_params::scanner_info(scan_profile_test, "profile_test");
+        info->scanner_flags.skip_random = true;
+        info->scanner_flags.skip_text = true;
+        sp.info = info;
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN) profile_test_calls++;
+}
+
+TEST_CASE("dispatch_plan", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+    sc.push_scanner_command(std::string("split_test"), scanner_config::scanner_command::ENABLE);
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    ss.add_scanner(scan_sha1_test);
+    ss.add_scanner(scan_split_test);
+    ss.apply_scanner_commands();
+    feature_recorder& fr = ss.named_feature_recorder("sha1_bufs");
+
+    split_test_calls = 0;
+    ss.phase_scan();
+    /* A constant buffer is an ngram buffer, which only split_test wants */
+    auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", 0), 64);
+    for (size_t i = 0; i < sbufp->bufsize; i++) { sbufp->wbuf(i, 0); }
+    ss.process_sbuf(sbufp);
+    REQUIRE(split_test_calls == 127);
+    REQUIRE(fr.features_written == 0);
+
+    /* Hello world! is not an ngram; sha1_test sees it once, split_test sees it and its 22 pieces.
+     * Some of the pieces (single letters) repeat, but split_test also wants data seen before.
+     */
+    ss.process_sbuf(new sbuf_t(hello8));
+    REQUIRE(split_test_calls == 127 + 23);
+    REQUIRE(fr.features_written == 1);
+    ss.shutdown();
+
+    /* Every call was accounted for */
+    auto stats = ss.get_scanner_stats();
+    REQUIRE(stats["split_test"].calls == 127 + 23);
+    REQUIRE(stats["split_test"].bytes == 64 * 7 + 12 * 4 + 8);
+    REQUIRE(stats["split_test"].features == 0);
+    REQUIRE(stats["sha1_test"].calls == 1);
+    REQUIRE(stats["sha1_test"].bytes == 12);
+    REQUIRE(stats["sha1_test"].features == 1);
+    auto detail = ss.get_scanner_stats_detail();
+    REQUIRE(detail.size() == 2); // everything was at depth 0
+    REQUIRE(detail.begin()->first.path == "");
+
+    REQUIRE(ss.seen_set.size() == 7 + 20); // repeated pieces only count once
+
+    /* Calls below the top are charged by depth and path */
+    {
+        scanner_config sc4;
+        sc4.outdir = NamedTemporaryDirectory();
+        sc4.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+        scanner_set ss4(sc4, feature_recorder_set::flags_t(), nullptr);
+        ss4.add_scanner(scan_sha1_test);
+        ss4.apply_scanner_commands();
+        ss4.phase_scan();
+        ss4.process_sbuf(sbuf_t::sbuf_malloc(pos0_t("1000-GZIP-300-BASE64", 0), std::string("first nested")));
+        ss4.process_sbuf(sbuf_t::sbuf_malloc(pos0_t("1000-GZIP-300-BASE64", 20), std::string("second nested")));
+        ss4.process_sbuf(sbuf_t::sbuf_malloc(pos0_t("1000-GZIP", 0), std::string("only gzipped once")));
+        ss4.process_sbuf(sbuf_t::sbuf_malloc(pos0_t("", 0), std::string("at the top level")));
+        ss4.shutdown();
+        auto detail4 = ss4.get_scanner_stats_detail();
+        REQUIRE(detail4.size() == 3);
+        REQUIRE(detail4[scanner_set::stats_key_t{scan_sha1_test, 3, "GZIP-BASE64"}].calls == 2);
+        REQUIRE(detail4[scanner_set::stats_key_t{scan_sha1_test, 3, "GZIP-BASE64"}].bytes == 12 + 13);
+        REQUIRE(detail4[scanner_set::stats_key_t{scan_sha1_test, 1, "GZIP"}].calls == 1);
+        REQUIRE(detail4[scanner_set::stats_key_t{scan_sha1_test, 0, ""}].calls == 1);
+    }
+
+    /* The dedup hash is configurable, and the SHA1 unless the fast hash is asked for */
+    scanner_config sc2;
+    REQUIRE(sc2.dedup_hash_algorithm == "sha1");
+    sc2.dedup_hash_algorithm = "fast";
+    REQUIRE_NOTHROW(scanner_set(sc2, feature_recorder_set::flags_t(), nullptr));
+    sc2.dedup_hash_algorithm = "sha1";
+    REQUIRE_NOTHROW(scanner_set(sc2, feature_recorder_set::flags_t(), nullptr));
+    sc2.dedup_hash_algorithm = "md4";
+    REQUIRE_THROWS_AS(scanner_set(sc2, feature_recorder_set::flags_t(), nullptr), std::runtime_error);
+
+    REQUIRE(scanner_set::stats_path(pos0_t("1000-GZIP-300-BASE64", 30)) == "GZIP-BASE64");
+    REQUIRE(scanner_set::stats_path(pos0_t("", 30)) == "");
+
+    /* Scanners can ask not to be run on random-looking or text pages */
+    scanner_config sc3;
+    sc3.outdir = NamedTemporaryDirectory();
+    sc3.push_scanner_command(std::string("profile_test"), scanner_config::scanner_command::ENABLE);
+    scanner_set ss3(sc3, feature_recorder_set::flags_t(), nullptr);
+    ss3.add_scanner(scan_profile_test);
+    ss3.apply_scanner_commands();
+    ss3.phase_scan();
+    profile_test_calls = 0;
+    ss3.process_sbuf(sbuf_t::map_file(tests_dir() / "random.dat"));
+    ss3.process_sbuf(sbuf_t::sbuf_malloc(pos0_t("", 0), std::string("plain text is skipped too\n")));
+    REQUIRE(profile_test_calls == 0);
+    std::vector<uint8_t> binary(4096);
+    for (size_t i = 0; i < binary.size(); i++) binary[i] = i % 7 == 0 ? 0xff : i % 3;
+    ss3.process_sbuf(new sbuf_t(pos0_t("", 0), binary.data(), binary.size()));
+    REQUIRE(profile_test_calls == 1);
+    ss3.shutdown();
+}
+
+/* Scanners that are only called on sbufs that contain one of their prefilters */
+std::vector<std::vector<multi_pattern::hit_t>> prefilter_test_hits{};
+void scan_prefilter_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_prefilter_test, "prefilter_test");
+        sp.info->prefilters = {"PK\x03\x04", "%PDF"};
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN) {
+        REQUIRE(sp.prefilter_hits != nullptr);
+        prefilter_test_hits.push_back(*sp.prefilter_hits);
+    }
+}
+
+std::atomic<uint64_t> prefilter_pdf_calls{0};
+void scan_prefilter_pdf(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_prefilter_pdf, "prefilter_pdf");
+        sp.info->prefilters = {"%PDF"};
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN) prefilter_pdf_calls++;
+}
+
+TEST_CASE("prefilters", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    for (const auto& name : {"prefilter_test", "prefilter_pdf", "sha1_test"}) {
+        sc.push_scanner_command(std::string(name), scanner_config::scanner_command::ENABLE);
+    }
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    ss.add_scanner(scan_prefilter_test);
+    ss.add_scanner(scan_prefilter_pdf);
+    ss.add_scanner(scan_sha1_test);
+    ss.apply_scanner_commands();
+    ss.phase_scan();
+    prefilter_test_hits.clear();
+    prefilter_pdf_calls = 0;
+
+    /* Neither magic number */
+    ss.process_sbuf(sbuf_t::sbuf_malloc(pos0_t("", 0), std::string("nothing to see here")));
+    REQUIRE(prefilter_test_hits.size() == 0);
+    REQUIRE(prefilter_pdf_calls == 0);
+
+    /* Both, with the hits in order of offset and numbered by the scanner's own prefilters */
+    std::string page(200, '.');
+    page.replace(10, 4, "%PDF");
+    page.replace(100, 4, std::string("PK\x03\x04", 4));
+    ss.process_sbuf(sbuf_t::sbuf_malloc(pos0_t("", 4096), page));
+    REQUIRE(prefilter_test_hits.size() == 1);
+    REQUIRE(prefilter_test_hits[0].size() == 2);
+    REQUIRE(prefilter_test_hits[0][0] == multi_pattern::hit_t{10, 4, 1});
+    REQUIRE(prefilter_test_hits[0][1] == multi_pattern::hit_t{100, 4, 0});
+    REQUIRE(prefilter_pdf_calls == 1);
+
+    /* Only PK, and only in the margin */
+    std::string margin(200, '.');
+    for (size_t i = 0; i < margin.size(); i++) margin[i] = 'a' + i % 26; // not an ngram buffer
+    margin.replace(20, 4, std::string("PK\x03\x04", 4));
+    auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", 8192), margin.size(), 12);
+    for (size_t i = 0; i < margin.size(); i++) sbufp->wbuf(i, margin[i]);
+    ss.process_sbuf(sbufp);
+    REQUIRE(prefilter_test_hits.size() == 1);
+    margin[0] = '!';                 // not seen before
+    sbufp = sbuf_t::sbuf_malloc(pos0_t("", 12288), margin.size(), 30);
+    for (size_t i = 0; i < margin.size(); i++) sbufp->wbuf(i, margin[i]);
+    ss.process_sbuf(sbufp);
+    REQUIRE(prefilter_test_hits.size() == 2);
+    REQUIRE(prefilter_test_hits[1] == std::vector<multi_pattern::hit_t>{{20, 4, 0}});
+    REQUIRE(prefilter_pdf_calls == 1);
+
+    /* Scanners without prefilters are called on everything */
+    REQUIRE(ss.get_scanner_stats().at("sha1_test").calls == 4);
+    ss.shutdown();
+}
+
+/****************************************************************
+ * scanner_manifest.h
+ * Plugins' scanners registered from a manifest, and initialized only when enabled.
+ */
+#include "scanner_manifest.h"
+std::atomic<int> manifest_test_inits{0};
+std::atomic<int> manifest_test_enables{0};
+void scan_manifest_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        manifest_test_inits++;
+        int depth = 3;
+        sp.ss.sc.get_config("manifest_test_depth", &depth, "how deep to look");
+        sp.info = new scanner_params::scanner_info(scan_manifest_test, "manifest_test");
+        sp.info->author = "a b\\c";
+        sp.info->scanner_flags.default_enabled = false;
+        sp.info->scanner_flags.init_when_enabled = true;
+        feature_recorder_def::flags_t flags;
+        flags.no_context = true;
+        sp.info->feature_defs.push_back(feature_recorder_def("manifest_test", flags));
+        sp.info->histogram_defs.push_back(
+            histogram_def("manifest_test", "manifest_test", "([a-z]+)", "", "words", histogram_def::flags_t(true, false)));
+        sp.info->prefilters = {std::string("\x00- \n", 4), "-"};
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_ENABLED) manifest_test_enables++;
+}
+
+TEST_CASE("scanner_manifest", "[scanner]") {
+    REQUIRE(scanner_manifest::unescape(scanner_manifest::escape("")) == "");
+    REQUIRE(scanner_manifest::escape("-") != "-");
+    const std::string bytes("\\x41 \t\xff\x00-", 9);
+    REQUIRE(scanner_manifest::escape(bytes).find_first_of(" \t") == std::string::npos);
+    REQUIRE(scanner_manifest::unescape(scanner_manifest::escape(bytes)) == bytes);
+
+    std::filesystem::path dir = NamedTemporaryDirectory();
+    std::filesystem::path plugin = dir / "scan_manifest_test.so";
+    std::ofstream(plugin) << "version 1";
+    manifest_test_inits = 0;
+    manifest_test_enables = 0;
+    auto make_config = [&dir](bool enable) {
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        sc.plugin_manifest_dir = dir / "manifests";
+        if (enable) sc.push_scanner_command(std::string("manifest_test"), scanner_config::scanner_command::ENABLE);
+        return sc;
+    };
+
+    /* The first run initializes the scanner and writes its manifest */
+    std::string help;
+    {
+        scanner_config sc = make_config(false); // the feature_recorder_set keeps a reference to it
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner_from(scan_manifest_test, plugin);
+        REQUIRE(manifest_test_inits == 1);
+        help = ss.sc.help();
+        REQUIRE(help.find("how deep to look") != std::string::npos);
+        REQUIRE(std::filesystem::exists(
+            scanner_manifest::path_for(dir / "manifests", scanner_manifest::plugin_key(plugin))));
+    }
+
+    /* The next one registers it from the manifest; disabled, it is never initialized */
+    {
+        scanner_config sc = make_config(false); // the feature_recorder_set keeps a reference to it
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner_from(scan_manifest_test, plugin);
+        REQUIRE(manifest_test_inits == 1);
+        REQUIRE(ss.sc.help() == help);
+        REQUIRE(ss.get_scanner_by_name("manifest_test") == scan_manifest_test);
+        REQUIRE(ss.is_scanner_enabled("manifest_test") == false);
+        ss.apply_scanner_commands();
+        REQUIRE(manifest_test_inits == 1);
+        REQUIRE(manifest_test_enables == 0);
+        REQUIRE(ss.named_feature_recorder("manifest_test").def.flags.no_context);
+    }
+
+    /* Enabled, it gets its PHASE_INIT and then PHASE_ENABLED, and its help is not added twice */
+    {
+        scanner_config sc = make_config(true);
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner_from(scan_manifest_test, plugin);
+        ss.apply_scanner_commands();
+        REQUIRE(manifest_test_inits == 2);
+        REQUIRE(manifest_test_enables == 1);
+        REQUIRE(ss.sc.help() == help);
+    }
+
+    /* What the manifest holds is what the scanner registered */
+    std::string manifest_help;
+    std::unique_ptr<scanner_params::scanner_info> info(scanner_manifest::read(
+        scanner_manifest::path_for(dir / "manifests", scanner_manifest::plugin_key(plugin)), scan_manifest_test,
+        manifest_help));
+    REQUIRE(info);
+    REQUIRE(info->author == "a b\\c");
+    REQUIRE(info->scanner_flags.default_enabled == false);
+    REQUIRE(info->scanner_flags.init_when_enabled);
+    REQUIRE(info->prefilters == std::vector<std::string>{std::string("\x00- \n", 4), "-"});
+    REQUIRE(info->histogram_defs.at(0).pattern == "([a-z]+)");
+    REQUIRE(info->histogram_defs.at(0).require == "");
+    REQUIRE(info->histogram_defs.at(0).flags.lowercase);
+    REQUIRE(help.find(manifest_help) != std::string::npos);
+
+    /* A changed plugin is initialized again */
+    std::ofstream(plugin) << "version 2";
+    {
+        scanner_config sc = make_config(false); // the feature_recorder_set keeps a reference to it
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner_from(scan_manifest_test, plugin);
+        REQUIRE(manifest_test_inits == 3);
+    }
+    {
+        scanner_config sc = make_config(false); // the feature_recorder_set keeps a reference to it
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        REQUIRE_THROWS_AS(ss.add_scanner_file((dir / "scan_missing.so").string()), std::exception);
+        REQUIRE_THROWS_AS(ss.add_scanner_directory(dir.string()), std::runtime_error); // not a shared library
+        ss.add_scanner_directory((dir / "manifests").string());                       // no plugins
+        REQUIRE(ss.get_enabled_scanners().empty());
+    }
+}
+
+/* PHASE_ENABLED is sent to one scanner at a time unless they set init_parallel */
+std::atomic<int> init_serial_active{0};
+std::atomic<int> init_serial_most{0};
+std::atomic<int> init_serial_calls{0};
+template <int N> void scan_init_serial_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_init_serial_test<N>, "init_serial_test" + std::to_string(N));
+        sp.info->scanner_flags.init_when_enabled = true;
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_ENABLED) {
+        const int active = ++init_serial_active;
+        for (int most = init_serial_most; active > most && !init_serial_most.compare_exchange_weak(most, active);) {}
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        init_serial_active--;
+        init_serial_calls++;
+    }
+}
+
+TEST_CASE("send_phase_enabled", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    sc.push_scanner_command(scanner_config::scanner_command::ALL_SCANNERS, scanner_config::scanner_command::ENABLE);
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    ss.add_scanner(scan_init_serial_test<1>);
+    ss.add_scanner(scan_init_serial_test<2>);
+    ss.add_scanner(scan_init_serial_test<3>);
+    ss.apply_scanner_commands();
+    REQUIRE(init_serial_calls == 3);
+    REQUIRE(init_serial_most == 1);
+}
+
+/****************************************************************
+ * alloc_profile.h
+ * Allocations charged to the scanners and feature recorders that made them.
+ */
+#include "alloc_profile.h"
+void scan_alloc_test(struct scanner_params& sp) {
+    if (sp.phase == scanner_params::PHASE_INIT) {
+        sp.info = new scanner_params::scanner_info(scan_alloc_test, "alloc_test");
+        sp.info->feature_defs.push_back(feature_recorder_def("alloc_test"));
+        return;
+    }
+    if (sp.phase == scanner_params::PHASE_SCAN) {
+        for (int i = 0; i < 3; i++) delete sbuf_t::sbuf_malloc(sp.sbuf->pos0, 1000);
+        sp.named_feature_recorder("alloc_test").write(sp.sbuf->pos0, "feature", "");
+    }
+}
+
+TEST_CASE("alloc_profile", "[scanner]") {
+    const uint32_t tag = alloc_profile::intern("alloc_profile_tag");
+    REQUIRE(tag != 0);
+    REQUIRE(alloc_profile::intern("alloc_profile_tag") == tag);
+    const alloc_profile::counts_t total0 = alloc_profile::thread_total();
+    const alloc_profile::counts_t untagged0 = alloc_profile::thread_untagged();
+    alloc_profile::record(100); // not counting
+    REQUIRE(alloc_profile::thread_total() == total0);
+    alloc_profile::enable();
+    {
+        const alloc_profile::tag_scope scope(tag);
+        alloc_profile::record(100);
+    }
+    alloc_profile::disable();
+    REQUIRE(alloc_profile::thread_total() - total0 == alloc_profile::counts_t{1, 100});
+    REQUIRE(alloc_profile::thread_untagged() == untagged0);
+    REQUIRE(alloc_profile::get_tagged().at("alloc_profile_tag") == alloc_profile::counts_t{1, 100});
+
+    for (const bool profile : {true, false}) {
+        const std::filesystem::path dir(NamedTemporaryDirectory());
+        const std::string fname = (dir / "alloc.xml").string();
+        {
+            dfxml_writer writer(fname, false);
+            scanner_config sc;
+            sc.outdir = dir;
+            sc.alloc_profile = profile;
+            sc.push_scanner_command(std::string("alloc_test"), scanner_config::scanner_command::ENABLE);
+            scanner_set ss(sc, feature_recorder_set::flags_t(), &writer);
+            ss.add_scanner(scan_alloc_test);
+            ss.apply_scanner_commands();
+            ss.phase_scan();
+            REQUIRE(alloc_profile::enabled() == profile);
+            ss.process_sbuf(sbuf_t::sbuf_malloc(pos0_t(), std::string(hello8)));
+            const auto st = ss.get_scanner_stats().at("alloc_test");
+            if (profile) {
+                REQUIRE(st.allocs >= 6); // three sbuf_t's and their buffers
+                REQUIRE(st.alloc_bytes >= 3000);
+            } else {
+                REQUIRE(st.allocs == 0);
+                REQUIRE(st.alloc_bytes == 0);
+            }
+            ss.shutdown();
+            REQUIRE(!alloc_profile::enabled());
+        }
+        const auto lines = getLines(fname);
+        const bool found = std::any_of(lines.begin(), lines.end(), [](const std::string& line) {
+            return line.find("alloc_bytes") != std::string::npos;
+        });
+        REQUIRE(found == profile);
+    }
+}
+
+/****************************************************************
+ * metrics_exporter.h
+ * Snapshots of the scan's counters, written while the scan runs.
+ */
+#include "metrics_exporter.h"
+TEST_CASE("metrics", "[scanner]") {
+    for (const std::string fname : {"metrics.prom", "metrics.json"}) {
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        sc.metrics_file = fname;
+        sc.metrics_seconds = 0;         // only at shutdown
+        sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+        sc.push_scanner_command(std::string("split_test"), scanner_config::scanner_command::ENABLE);
+        scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+        ss.add_scanner(scan_sha1_test);
+        ss.add_scanner(scan_split_test);
+        ss.apply_scanner_commands();
+        ss.launch_workers(2);
+        split_test_calls = 0;
+        ss.phase_scan();
+        for (int page = 0; page < 4; page++) {
+            auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", page * 256), 256);
+            for (size_t i = 0; i < sbufp->bufsize; i++) { sbufp->wbuf(i, i + page); }
+            ss.schedule_sbuf(sbufp);
+        }
+        ss.join();
+        const auto m = ss.get_metrics();
+        REQUIRE(m.bytes_depth0 == 1024);
+        REQUIRE(m.sbufs_by_depth.size() == 16);
+        REQUIRE(m.sbufs_by_depth[0] >= 4); // split_test's slices are at the depth of their page
+        uint64_t sbufs = 0;
+        for (const auto it : m.sbufs_by_depth) sbufs += it;
+        REQUIRE(sbufs == split_test_calls);  // split_test is called on every sbuf that is scanned
+        REQUIRE(m.queue_depth == 0);
+        REQUIRE(m.workers == ss.get_worker_count());
+        REQUIRE(m.features.at("sha1_bufs") == uint64_t(ss.named_feature_recorder("sha1_bufs").features_written));
+        REQUIRE(m.seconds > 0);
+        ss.shutdown();
+
+        REQUIRE(std::filesystem::exists(sc.outdir / fname));
+        REQUIRE(!std::filesystem::exists(sc.outdir / (fname + ".tmp")));
+        const auto lines = getLines(sc.outdir / fname);
+        if (metrics_exporter::format_for(fname) == metrics_exporter::PROMETHEUS) {
+            REQUIRE(std::count(lines.begin(), lines.end(), "be13_bytes_total 1024") == 1);
+            REQUIRE(std::count(lines.begin(), lines.end(), "be13_sbufs_total{depth=\"0\"} " + std::to_string(sbufs)) == 1);
+            REQUIRE(std::count(lines.begin(), lines.end(), "# TYPE be13_queue_depth gauge") == 1);
+        } else {
+            REQUIRE(lines.size() == 1);
+            REQUIRE(lines[0].find("{\"uptime_seconds\":") == 0);
+            REQUIRE(lines[0].find(",\"bytes\":1024,") != std::string::npos);
+            REQUIRE(lines[0].find(",\"sbufs\":[" + std::to_string(sbufs) + ",0,") != std::string::npos);
+        }
+    }
+
+    /* Workers launched while the exporter runs, and a scanner_set destroyed without shutdown() */
+    {
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        sc.metrics_file = "metrics.json";
+        sc.metrics_seconds = 1;
+        sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+        auto ss = std::make_unique<scanner_set>(sc, feature_recorder_set::flags_t(), nullptr);
+        ss->add_scanner(scan_sha1_test);
+        ss->apply_scanner_commands();
+        ss->phase_scan();
+        ss->launch_workers(2);
+        auto sbufp = sbuf_t::sbuf_malloc(pos0_t("", 0), 256);
+        for (size_t i = 0; i < sbufp->bufsize; i++) { sbufp->wbuf(i, i); }
+        ss->schedule_sbuf(sbufp);
+        ss->join();
+        ss.reset();
+    }
+
+    /* Rates are over the interval between two snapshots */
+    scanner_set::metrics_t m0, m1;
+    m0.seconds = 1;
+    m0.bytes_depth0 = 100;
+    m0.sbufs_by_depth = {1, 10};
+    m0.features["email"] = 5;
+    m1.seconds = 3;
+    m1.bytes_depth0 = 500;
+    m1.sbufs_by_depth = {3, 50};
+    m1.features["email"] = 25;
+    m1.features["url"] = 4;
+    std::stringstream prom;
+    metrics_exporter::write_prometheus(prom, m1, &m0);
+    REQUIRE(prom.str().find("\nbe13_bytes_per_second 200\n") != std::string::npos);
+    REQUIRE(prom.str().find("\nbe13_sbufs_per_second{depth=\"1\"} 20\n") != std::string::npos);
+    REQUIRE(prom.str().find("\nbe13_features_per_second{recorder=\"email\"} 10\n") != std::string::npos);
+    REQUIRE(prom.str().find("\nbe13_features_per_second{recorder=\"url\"} 2\n") != std::string::npos);
+    std::stringstream json;
+    metrics_exporter::write_json(json, m1, nullptr);
+    REQUIRE(json.str().find("\"bytes_per_second\":0,") != std::string::npos);
+    REQUIRE(json.str().find("\"features\":{\"email\":25,\"url\":4}") != std::string::npos);
+
+    /* The exporter takes snapshots on its own thread */
+    const std::filesystem::path fname = NamedTemporaryDirectory() / "periodic.json";
+    std::atomic<int> taken{0};
+    {
+        metrics_exporter exporter(fname, std::chrono::milliseconds(5), [&taken] {
+            scanner_set::metrics_t m;
+            m.seconds = ++taken;
+            return m;
+        });
+        for (int i = 0; i < 1000 && exporter.get_snapshots() < 2; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        REQUIRE(exporter.get_snapshots() >= 2);
+    }
+    REQUIRE(getLines(fname).at(0).find("{\"uptime_seconds\":" + std::to_string(taken.load()) + ",") == 0);
+}
+
+/****************************************************************
+ * pcap_reader.h
+ */
+#include "pcap_reader.h"
+static void pcap_put32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; i++) out.push_back(char((v >> (8 * i)) & 0xff));
+}
+/* An Ethernet frame carrying an IPv4 TCP header from 10.0.0.1:sport, with an optional 802.1Q tag */
+static std::string pcap_frame(uint16_t sport, bool vlan) {
+    std::string f(12, '\x01');                 // MAC addresses
+    if (vlan) f += std::string("\x81\x00\x00\x05", 4); // VID 5
+    f += std::string("\x08\x00", 2);
+    std::string ip(20, '\0');
+    ip[0] = 0x45;
+    ip[9] = 6;                                 // TCP
+    ip[12] = 10;
+    ip[15] = 1;
+    std::string tcp(20, '\0');
+    tcp[0] = char(sport >> 8);
+    tcp[1] = char(sport & 0xff);
+    return f + ip + tcp;
+}
+static int pcap_test_calls = 0;
+static void pcap_test_handler(void* user, const be13::packet_info& pi) {
+    pcap_test_calls++;
+    if (pi.is_ip4_tcp()) (*static_cast<uint64_t*>(user)) += pi.get_ip4_tcp_sport();
+}
+TEST_CASE("pcap_reader", "[scanner]") {
+    const std::filesystem::path fname = std::filesystem::path(NamedTemporaryDirectory()) / "test.pcap";
+    const int PACKETS = 1000;
+    {
+        std::string pcap;
+        pcap_put32(pcap, pcap_reader::MAGIC_USEC);
+        pcap_put32(pcap, 2 | (4 << 16));
+        pcap_put32(pcap, 0);
+        pcap_put32(pcap, 0);
+        pcap_put32(pcap, 65535);
+        pcap_put32(pcap, DLT_EN10MB);
+        for (int i = 0; i < PACKETS; i++) {
+            const std::string frame = pcap_frame(uint16_t(i), i % 2 == 1);
+            pcap_put32(pcap, 1000 + i);
+            pcap_put32(pcap, 7);
+            pcap_put32(pcap, frame.size());
+            pcap_put32(pcap, frame.size() + 100); // snapped
+            pcap += frame;
+        }
+        pcap_put32(pcap, 2000);
+        pcap_put32(pcap, 0);
+        pcap_put32(pcap, 1000); // runs past the end of the file
+        pcap_put32(pcap, 1000);
+        pcap += "short";
+        std::ofstream of(fname, std::ios::binary);
+        of << pcap;
+    }
+
+    pcap_reader reader(fname);
+    REQUIRE(reader.datalink() == DLT_EN10MB);
+    REQUIRE(reader.get_snaplen() == 65535);
+    REQUIRE(reader.nanosecond() == false);
+    pcap_reader::batch_t batch;
+    REQUIRE(reader.next_batch(batch, 10));
+    REQUIRE(batch.size() == 10);
+    REQUIRE(batch.first_packet == 0);
+    REQUIRE(batch[0].ts.tv_sec == 1000);
+    REQUIRE(batch[0].ts.tv_usec == 7);
+    REQUIRE(batch[0].pcap_hdr->len == batch[0].pcap_hdr->caplen + 100);
+    REQUIRE(batch[0].ip_version() == 4);
+    REQUIRE(batch[0].ip_datalen == 40);
+    REQUIRE(batch[1].vlan() == 5);
+    REQUIRE(batch[1].ip_datalen == 40); // the tag is skipped
+    REQUIRE(batch[3].get_ip4_tcp_sport() == 3);
+    REQUIRE(reader.next_batch(batch, 10));
+    REQUIRE(batch.first_packet == 10);
+
+    /* The rest of the capture, in batches, through the scanner_set */
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    uint64_t sports = 0;
+    ss.add_packet_handler(&sports, pcap_test_handler);
+    REQUIRE(ss.packet_handler_count() == 1);
+    pcap_test_calls = 0;
+    reader.rewind();
+    REQUIRE(reader.run([&ss](const pcap_reader::batch_t& b) { ss.process_packets(b); }) == PACKETS);
+    REQUIRE(pcap_test_calls == PACKETS);
+    REQUIRE(ss.get_packets_processed() == PACKETS);
+    REQUIRE(sports == uint64_t(PACKETS) * (PACKETS - 1) / 2);
+    REQUIRE(reader.packets_read() == PACKETS);
+    REQUIRE(reader.truncated() == true);
+    REQUIRE(reader.next_batch(batch) == false);
+
+    REQUIRE(pcap_reader::ip_offset(DLT_RAW, nullptr, 40) == 0);
+    REQUIRE(pcap_reader::ip_offset(DLT_NULL, nullptr, 44) == 4);
+    const std::string arp = std::string(12, '\0') + std::string("\x08\x06", 2) + std::string(28, '\0');
+    REQUIRE(pcap_reader::ip_offset(DLT_EN10MB, reinterpret_cast<const uint8_t*>(arp.data()), arp.size()) == arp.size());
+    std::ofstream(fname.string() + ".bad") << "not a capture file at all";
+    REQUIRE_THROWS_AS(pcap_reader(fname.string() + ".bad"), std::runtime_error);
+}
+
+/****************************************************************
+ * flow_sharder.h
+ */
+#include "flow_sharder.h"
+#include "spsc_ring.h"
+TEST_CASE("spsc_ring", "[thread_pool]") {
+    spsc_ring<int> ring(5);
+    REQUIRE(ring.capacity() == 8);
+    int v = 0;
+    REQUIRE(ring.try_pop(v) == false);
+    for (int i = 0; i < 8; i++) REQUIRE(ring.try_push(i));
+    REQUIRE(ring.try_push(8) == false);
+    REQUIRE(ring.try_pop(v));
+    REQUIRE(v == 0);
+    REQUIRE(ring.size() == 7);
+
+    /* one producer, one consumer */
+    spsc_ring<uint64_t> r2(64);
+    const uint64_t N = 200000;
+    uint64_t sum = 0;
+    int bad = 0;
+    std::thread consumer([&] {
+        uint64_t expect = 0;
+        uint64_t x;
+        while (expect < N) {
+            if (!r2.try_pop(x)) continue;
+            if (x != expect) bad++;
+            sum += x;
+            expect++;
+        }
+    });
+    for (uint64_t i = 0; i < N; i++) {
+        while (!r2.try_push(i)) {}
+    }
+    consumer.join();
+    REQUIRE(bad == 0);
+    REQUIRE(sum == N * (N - 1) / 2);
+}
+
+/* An IPv4 TCP packet from 10.0.0.a:pa to 10.0.0.b:pb carrying seq */
+static std::string flow_packet(uint8_t a, uint16_t pa, uint8_t b, uint16_t pb, uint32_t seq) {
+    std::string ip(40, '\0');
+    ip[0] = 0x45;
+    ip[9] = 6;
+    ip[12] = 10;
+    ip[15] = char(a);
+    ip[16] = 10;
+    ip[19] = char(b);
+    ip[20] = char(pa >> 8);
+    ip[21] = char(pa & 0xff);
+    ip[22] = char(pb >> 8);
+    ip[23] = char(pb & 0xff);
+    for (int i = 0; i < 4; i++) ip[24 + i] = char((seq >> (24 - 8 * i)) & 0xff);
+    return ip;
+}
+static uint32_t flow_seq(const be13::packet_info& pi) {
+    const uint8_t* p = pi.ip_data + 24;
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+static void flow_test_handler(void* user, const be13::packet_info&) { (*static_cast<std::atomic<int>*>(user))++; }
+TEST_CASE("flow_sharder", "[scanner]") {
+    const std::filesystem::path dir(NamedTemporaryDirectory());
+    const std::filesystem::path fname = dir / "flows.pcap";
+    const int FLOWS = 50;
+    const int PACKETS = 200; // per flow
+    {
+        std::string pcap;
+        pcap_put32(pcap, pcap_reader::MAGIC_USEC);
+        pcap_put32(pcap, 2 | (4 << 16));
+        pcap_put32(pcap, 0);
+        pcap_put32(pcap, 0);
+        pcap_put32(pcap, 65535);
+        pcap_put32(pcap, DLT_RAW);
+        for (int i = 0; i < PACKETS; i++) {
+            for (int f = 0; f < FLOWS; f++) {
+                /* alternate directions; seq counts the flow's packets */
+                const std::string p = (i % 2 == 0) ? flow_packet(1, uint16_t(1000 + f), 2, 80, i)
+                                                   : flow_packet(2, 80, 1, uint16_t(1000 + f), i);
+                pcap_put32(pcap, i);
+                pcap_put32(pcap, 0);
+                pcap_put32(pcap, p.size());
+                pcap_put32(pcap, p.size());
+                pcap += p;
+            }
+        }
+        std::ofstream of(fname, std::ios::binary);
+        of << pcap;
+    }
+
+    /* Per-shard state, touched only by the shard's thread */
+    const size_t SHARDS = 4;
+    struct shard_state {
+        std::map<uint16_t, uint32_t> next; // client port -> next seq
+        int out_of_order{0};
+    };
+    std::vector<shard_state> state(SHARDS);
+    std::atomic<uint64_t> handled{0};
+    std::vector<std::atomic<int>> flow_shard(FLOWS);
+    for (auto& it : flow_shard) it = -1;
+    int moved = 0;
+    std::mutex Mmoved;
+    pcap_reader reader(fname);
+    {
+        flow_sharder sharder(SHARDS, [&](size_t shard, const be13::packet_info& pi) {
+            const bool to_server = pi.get_ip4_tcp_dport() == 80;
+            const uint16_t client = to_server ? pi.get_ip4_tcp_sport() : pi.get_ip4_tcp_dport();
+            shard_state& st = state[shard];
+            if (flow_seq(pi) != st.next[client]) st.out_of_order++;
+            st.next[client] = flow_seq(pi) + 1;
+            int expected = -1;
+            if (!flow_shard[client - 1000].compare_exchange_strong(expected, int(shard)) && expected != int(shard)) {
+                const std::lock_guard<std::mutex> lock(Mmoved);
+                moved++;
+            }
+            handled++;
+        }, 16); // small rings, so that the producer stalls
+        REQUIRE(reader.run([&sharder](const pcap_reader::batch_t& b) { sharder.add(b); }) == FLOWS * PACKETS);
+        sharder.finish();
+        REQUIRE(handled == FLOWS * PACKETS);
+        uint64_t total = 0;
+        for (const auto& st : sharder.stats()) total += st.packets;
+        REQUIRE(total == FLOWS * PACKETS);
+
+        dfxml_writer writer((dir / "stats.xml").string(), false);
+        sharder.dump_stats(writer);
+    }
+    int bad = 0;
+    for (const auto& st : state) bad += st.out_of_order;
+    REQUIRE(bad == 0);
+    REQUIRE(moved == 0);
+    size_t used = 0;
+    for (const auto& st : state) used += st.next.empty() ? 0 : 1;
+    REQUIRE(used > 1); // 50 flows over 4 shards
+    size_t shard_lines = 0;
+    for (const auto& line : getLines((dir / "stats.xml").string())) {
+        if (line.find("<shard id=") != std::string::npos) shard_lines++;
+    }
+    REQUIRE(shard_lines == SHARDS);
+
+    /* Both directions of a flow hash the same */
+    const std::string p1 = flow_packet(1, 1234, 2, 80, 0);
+    const std::string p2 = flow_packet(2, 80, 1, 1234, 0);
+    struct pcap_pkthdr h1 {};
+    h1.caplen = p1.size();
+    const be13::packet_info pi1(DLT_RAW, &h1, reinterpret_cast<const u_char*>(p1.data()));
+    const be13::packet_info pi2(DLT_RAW, &h1, reinterpret_cast<const u_char*>(p2.data()));
+    REQUIRE(flow_sharder::flow_hash(pi1) == flow_sharder::flow_hash(pi2));
+
+    /* The scanner_set can do the same */
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    scanner_set ss(sc, feature_recorder_set::flags_t(), nullptr);
+    std::atomic<int> calls{0};
+    ss.add_packet_handler(&calls, flow_test_handler);
+    reader.rewind();
+    REQUIRE(ss.process_pcap(reader, 3) == FLOWS * PACKETS);
+    REQUIRE(calls == FLOWS * PACKETS);
+    REQUIRE(ss.get_packets_processed() == FLOWS * PACKETS);
+}
+
+/****************************************************************
+ * trace.h
+ * Spans recorded into per-thread rings and written as Chrome trace JSON.
+ */
+#include "trace.h"
+TEST_CASE("trace", "[scanner]") {
+    const uint32_t name = tracer::intern("test span");
+    REQUIRE(tracer::intern("test span") == name);
+    REQUIRE(tracer::intern("other span") != name);
+
+    tracer::disable();
+    { trace_span span(tracer::WRITE, name); }
+    tracer::enable(16);
+    REQUIRE(tracer::events_recorded() == 0);
+    { trace_span span(tracer::WRITE, name); } // recorded once tracing is on
+    REQUIRE(tracer::events_recorded() == 1);
+    REQUIRE(tracer::events_dropped() == 0);
+
+    /* Each thread has its own ring; a full ring overwrites its oldest events */
+    const int THREADS = 4;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.push_back(std::thread([name] {
+            for (int i = 0; i < 20; i++) { trace_span span(tracer::SCANNER, name, i); }
+        }));
+    }
+    for (auto& t : threads) t.join();
+    REQUIRE(tracer::events_recorded() == 1 + THREADS * 20);
+    REQUIRE(tracer::events_dropped() == THREADS * 4);
+
+    std::stringstream ss;
+    tracer::write_chrome_json(ss);
+    const std::string json = ss.str();
+    REQUIRE(json.find("\"traceEvents\"") != std::string::npos);
+    REQUIRE(json.find("\"name\":\"test span\"") != std::string::npos);
+    size_t spans = 0;
+    for (size_t pos = json.find("\"ph\":\"X\""); pos != std::string::npos; pos = json.find("\"ph\":\"X\"", pos + 1)) spans++;
+    REQUIRE(spans == 1 + THREADS * 16);
+    tracer::disable();
+
+    /* The scanner_set traces the scan when trace_file is set */
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    sc.trace_file = "trace.json";
+    sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+    {
+        scanner_set sset(sc, feature_recorder_set::flags_t(), nullptr);
+        sset.add_scanner(scan_sha1_test);
+        sset.apply_scanner_commands();
+        sset.phase_scan();
+        sset.process_sbuf(new sbuf_t(pos0_t(), reinterpret_cast<const uint8_t*>(hello8), strlen(hello8)));
+        sset.shutdown();
+    }
+    REQUIRE(tracer::enabled() == false);
+    std::string trace;
+    for (const auto& line : getLines(sc.outdir / "trace.json")) trace += line;
+    REQUIRE(trace.find("\"cat\":\"sbuf\",\"name\":\"process_sbuf\"") != std::string::npos);
+    REQUIRE(trace.find("\"cat\":\"scanner\",\"name\":\"sha1_test\"") != std::string::npos);
+    REQUIRE(trace.find("\"cat\":\"write\",\"name\":\"sha1_bufs\"") != std::string::npos);
+    REQUIRE(trace.find("\"cat\":\"histogram\"") != std::string::npos);
+}
+
+/****************************************************************
+ *  word_and_context_list.h
+ */
+#include "byte_order.h"
+#include "word_and_context_list.h"
+TEST_CASE("word_and_context_list", "[feature_recorder]") {
+    REQUIRE(word_and_context_list::rstrcmp("aaaa1", "bbbb0") < 0);
+    REQUIRE(word_and_context_list::rstrcmp("aaaa1", "aaaa1") == 0);
+    REQUIRE(word_and_context_list::rstrcmp("bbbb0", "aaaa1") > 0);
+    REQUIRE(word_and_context_list::rstrcmp("xxaaaa1", "aaaa1") == 0); // right-aligned
+    REQUIRE(word_and_context_list::rstrcmp("", "aaaa1") == 0);
+
+    std::string_view before, after;
+    context::extract_before_after("foo", "a foo b foo", before, after);
+    REQUIRE(before == "a ");
+    REQUIRE(after == " b foo");
+    context::extract_before_after("foo", "at the end foo", before, after);
+    REQUIRE(before == "at the end ");
+    REQUIRE(after.empty());
+    context::extract_before_after("foo", "fo", before, after);
+    REQUIRE(before.empty());
+    REQUIRE(after.empty());
+
+    word_and_context_list wl;
+    wl.add_fc("plain@example.com", "");                        // anywhere
+    REQUIRE(wl.add_fc("ctx@example.com", "to: ctx@example.com; cc") == true);
+    REQUIRE(wl.add_fc("ctx@example.com", "to: ctx@example.com; cc") == false); // already present
+    wl.add_regex("^noreply");
+    REQUIRE(wl.size() == 3);
+    REQUIRE(wl.check_feature_context("plain@example.com", "any context at all") == true);
+    REQUIRE(wl.check_feature_context("ctx@example.com", "XXto: ctx@example.com; cc: other") == false);
+    REQUIRE(wl.check_feature_context("ctx@example.com", "mail to: ctx@example.com; cc") == true);
+    REQUIRE(wl.check_feature_context("ctx@example.com", "from: ctx@example.com; cc") == false);
+    REQUIRE(wl.check_feature_context("NoReply@example.com", "whatever") == true); // icase regex
+    REQUIRE(wl.check_feature_context("someone@example.com", "whatever") == false);
+    REQUIRE(wl.check("ctx@example.com", "to: ", "; cc") == true);
+    REQUIRE(wl.check("ctx@example.com", "to: ", "; bcc") == false);
+
+    /* A compiled list gives the same answers */
+    const std::filesystem::path dir(NamedTemporaryDirectory());
+    for (int i = 0; i < 10000; i++) wl.add_fc("user" + std::to_string(i) + "@example.com", "");
+    wl.save(dir / "stop.bin");
+    word_and_context_list cl;
+    REQUIRE(cl.readfile((dir / "stop.bin").string()) == 0);
+    REQUIRE(cl.attached_size() == 10002);
+    REQUIRE(cl.size() == wl.size());
+    REQUIRE(cl.check_feature_context("plain@example.com", "any context at all") == true);
+    REQUIRE(cl.check_feature_context("ctx@example.com", "mail to: ctx@example.com; cc") == true);
+    REQUIRE(cl.check_feature_context("ctx@example.com", "from: ctx@example.com; cc") == false);
+    REQUIRE(cl.check_feature_context("NoReply@example.com", "whatever") == true);
+    REQUIRE(cl.check("ctx@example.com", "to: ", "; bcc") == false);
+    int bad = 0;
+    for (int i = 0; i < 20000; i++) {
+        const std::string f = "user" + std::to_string(i) + "@example.com";
+        if (cl.check_feature_context(f, "") != (i < 10000)) bad++;
+    }
+    REQUIRE(bad == 0);
+    REQUIRE_THROWS_AS(cl.attach(dir / "stop.bin"), std::runtime_error);
+
+    /* Entries added after attaching are saved along with the attached ones */
+    cl.add_fc("late@example.com", "");
+    cl.save(dir / "stop.bin"); // over the attached file
+    word_and_context_list cl2;
+    cl2.attach(dir / "stop.bin");
+    REQUIRE(cl2.attached_size() == 10003);
+    REQUIRE(cl2.check_feature_context("late@example.com", "") == true);
+    REQUIRE(cl2.check_feature_context("user9999@example.com", "") == true);
+
+    {
+        std::ofstream of(dir / "bad.bin");
+        of << "BE13STOP but not really";
+    }
+    word_and_context_list bl;
+    REQUIRE_THROWS_AS(bl.attach(dir / "bad.bin"), std::runtime_error);
+
+    /* Corrupt sizes and offsets are caught when the file is attached, not when it is searched */
+    std::string good;
+    {
+        std::ifstream in(dir / "stop.bin", std::ios::binary);
+        good.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto corrupt = [&](size_t at, uint64_t v, int len) {
+        std::string s = good;
+        put_le(reinterpret_cast<uint8_t*>(&s[at]), v, len);
+        return s;
+    };
+    const size_t entry0 = word_and_context_list::FILE_HEADER_SIZE;
+    const size_t pattern0 = entry0 + 10003 * word_and_context_list::FILE_ENTRY_SIZE;
+    const std::vector<std::string> corrupted{
+        good.substr(0, good.size() - 1),            // truncated
+        corrupt(16, uint64_t(1) << 59, 8),          // an entry count that overflows the table size
+        corrupt(24, uint64_t(1) << 60, 8),          // and a pattern count
+        corrupt(entry0 + 8, good.size(), 8),        // an entry's strings past the arena
+        corrupt(entry0 + 16, 0xffffffff, 4),        // an entry's feature running off the end
+        corrupt(pattern0, uint64_t(1) << 63, 8),    // a pattern past the arena
+        corrupt(pattern0 + 8, 0xffffffff, 4)};
+    for (const auto& it : corrupted) {
+        {
+            std::ofstream of(dir / "corrupt.bin", std::ios::binary | std::ios::trunc);
+            of << it;
+        }
+        word_and_context_list bad_list;
+        REQUIRE_THROWS_AS(bad_list.attach(dir / "corrupt.bin"), std::runtime_error);
+        REQUIRE(bad_list.size() == 0);
+    }
+}
+
+/****************************************************************
  * unicode_escape.h
  * unicode_escape.cpp
  * Our test suite for the utf8 package and our uses of it.
@@ -871,6 +4188,52 @@ TEST_CASE("unicode_escape", "[unicode]") {
     }
     REQUIRE(validateOrEscapeUTF8("backslash=\\", false, true, false) == "backslash=\\x5C");
 
+    /* The printable ASCII fast path, with the bad byte in every position of a word and the tail */
+    REQUIRE(is_printable_ascii("", true));
+    REQUIRE(is_printable_ascii(" ~ hello world, this is printable ~", true));
+    for (size_t pos = 0; pos < 19; pos++) {
+        for (uint8_t bad : {0x00, 0x09, 0x1F, 0x7F, 0x80, 0xC3, 0xFF}) {
+            std::string str(19, 'x');
+            str[pos] = bad;
+            REQUIRE(is_printable_ascii(str, false) == false);
+        }
+        std::string bs(19, 'x');
+        bs[pos] = '\\';
+        REQUIRE(is_printable_ascii(bs, false) == true);
+        REQUIRE(is_printable_ascii(bs, true) == false);
+    }
+    REQUIRE(make_utf8("plain") == "plain");
+    REQUIRE(make_utf8("back\\slash") == "back\\x5Cslash");
+
+    /* The vectorized scans give the same answers as the scalar reference */
+    REQUIRE(convert_utf16_to_utf8(std::string("h\0\xE9\0l\0l\0o\0", 10), true) == "h\xC3\xA9llo");
+    REQUIRE(convert_utf16_to_utf8(std::string("\0h\0i\0\0\0!", 9), false) == "hi!");
+    std::mt19937 rng(18);
+    const std::string alphabet = std::string("abc \\\x7F\x01", 7) + std::string("\0", 1) + U1F601 + "\xC3\xA9\xFF";
+    for (int trial = 0; trial < 200; trial++) {
+        std::string str(rng() % 100, 'x');
+        for (auto& ch : str) {
+            if (rng() % 4 == 0) ch = alphabet[rng() % alphabet.size()];
+        }
+        std::string utf16;
+        for (char ch : str) {
+            utf16.push_back(trial % 2 ? ch : 0);
+            utf16.push_back(trial % 2 ? 0 : ch);
+        }
+        bool le_simd = false, le_scalar = false;
+        unicode_simd_enable(true);
+        const std::string v_simd = validateOrEscapeUTF8(str, true, true, false);
+        const bool u_simd = looks_like_utf16(utf16, le_simd);
+        const std::string c_simd = convert_utf16_to_utf8(utf16, trial % 2);
+        unicode_simd_enable(false);
+        REQUIRE(std::string(unicode_simd_implementation()) == "scalar");
+        REQUIRE(v_simd == validateOrEscapeUTF8(str, true, true, false));
+        REQUIRE(u_simd == looks_like_utf16(utf16, le_scalar));
+        REQUIRE(le_simd == le_scalar);
+        REQUIRE(c_simd == convert_utf16_to_utf8(utf16, trial % 2));
+    }
+    unicode_simd_enable(true);
+
     /* Try some round-trips */
     std::u32string u32s = U"我想玩";
     REQUIRE(convert_utf8_to_utf32(convert_utf32_to_utf8(u32s)) == u32s);
@@ -0,0 +1,176 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include "numa.h"
+#include "thread_pool.h"
+
+/* Which pool and worker the current thread belongs to, if any. */
+static thread_local const thread_pool* tl_pool {nullptr};
+static thread_local size_t tl_worker {0};
+
+thread_pool::thread_pool(unsigned int num_workers, const numa_topology* topology) : pinned(topology != nullptr) {
+    if (num_workers == 0) { throw std::runtime_error("thread_pool: num_workers must be at least 1"); }
+    injection.resize(topology ? topology->node_count() : 1);
+    for (unsigned int i = 0; i < num_workers; i++) {
+        queues.push_back(new worker_queue());
+        const numa_topology::placement_t p = topology ? topology->place_worker(i) : numa_topology::placement_t{};
+        worker_node.push_back(p.node);
+        worker_cpu.push_back(p.cpu);
+    }
+    for (unsigned int i = 0; i < num_workers; i++) { workers.push_back(std::thread(&thread_pool::worker_loop, this, i)); }
+}
+
+thread_pool::~thread_pool() {
+    try {
+        join();
+    } catch (...) {
+        // destructors must not throw; errors should have been collected with join()
+    }
+    for (auto it : queues) { delete it; }
+}
+
+bool thread_pool::is_worker_thread() const { return tl_pool == this; }
+
+int thread_pool::current_node() const { return is_worker_thread() ? static_cast<int>(worker_node[tl_worker]) : -1; }
+
+void thread_pool::submit(task_t task, int node) {
+    if (stopping) { throw std::runtime_error("thread_pool::submit called after join()"); }
+    pending++;
+    if (is_worker_thread()) {
+        const std::lock_guard<std::mutex> lock(queues[tl_worker]->M);
+        queues[tl_worker]->tasks.push_back(std::move(task));
+    } else {
+        const std::lock_guard<std::mutex> lock(M);
+        const size_t n = node >= 0 ? size_t(node) % injection.size() : next_injection++ % injection.size();
+        injection[n].push_back(std::move(task));
+    }
+    /* With nodes, a worker of the task's node may not be the one woken; the others find it when they poll */
+    if (injection.size() > 1) {
+        work_cv.notify_all();
+    } else {
+        work_cv.notify_one();
+    }
+}
+
+bool thread_pool::pop_local(size_t me, task_t& task) {
+    worker_queue& q = *queues[me];
+    const std::lock_guard<std::mutex> lock(q.M);
+    if (q.tasks.empty()) return false;
+    task = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+}
+
+bool thread_pool::pop_injection(size_t node, task_t& task) {
+    const std::lock_guard<std::mutex> lock(M);
+    if (injection[node].empty()) return false;
+    task = std::move(injection[node].front());
+    injection[node].pop_front();
+    return true;
+}
+
+bool thread_pool::pop_any_injection(task_t& task) {
+    for (size_t i = 0; i < injection.size(); i++) {
+        if (pop_injection(i, task)) return true;
+    }
+    return false;
+}
+
+/* Either the workers on our node, or those on the others */
+bool thread_pool::steal(size_t me, bool same_node, task_t& task) {
+    for (size_t i = 1; i < queues.size(); i++) {
+        const size_t victim = (me + i) % queues.size();
+        if ((worker_node[victim] == worker_node[me]) != same_node) continue;
+        worker_queue& q = *queues[victim];
+        const std::lock_guard<std::mutex> lock(q.M);
+        if (q.tasks.empty()) continue;
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        tasks_stolen++;
+        return true;
+    }
+    return false;
+}
+
+bool thread_pool::find_task(task_t& task) {
+    if (is_worker_thread()) {
+        return pop_local(tl_worker, task) || pop_injection(worker_node[tl_worker], task) ||
+               steal(tl_worker, true, task) || (injection.size() > 1 && pop_any_injection(task)) ||
+               steal(tl_worker, false, task);
+    }
+    return pop_any_injection(task);
+}
+
+void thread_pool::run_task(task_t& task) {
+    try {
+        task();
+    } catch (...) {
+        const std::lock_guard<std::mutex> lock(M);
+        if (!first_exception) first_exception = std::current_exception();
+    }
+    tasks_executed++;
+    if (--pending == 0) {
+        const std::lock_guard<std::mutex> lock(M);
+        idle_cv.notify_all();
+    }
+}
+
+void thread_pool::worker_loop(size_t me) {
+    tl_pool = this;
+    tl_worker = me;
+    if (pinned) numa_topology::pin_thread(worker_cpu[me]); // best effort
+    while (true) {
+        task_t task;
+        if (find_task(task)) {
+            run_task(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(M);
+        if (stopping && std::all_of(injection.begin(), injection.end(), [](const auto& q) { return q.empty(); })) break;
+        /* Work pushed onto another worker's deque does not signal us, so poll for things to steal. */
+        work_cv.wait_for(lock, std::chrono::milliseconds(10));
+    }
+}
+
+bool thread_pool::help() {
+    task_t task;
+    if (is_worker_thread()) {
+        if (!pop_local(tl_worker, task)) return false;
+    } else {
+        if (!pop_any_injection(task)) return false;
+    }
+    run_task(task);
+    return true;
+}
+
+void thread_pool::wait_idle() {
+    if (is_worker_thread()) { throw std::runtime_error("thread_pool::wait_idle cannot be called from a worker"); }
+    std::unique_lock<std::mutex> lock(M);
+    idle_cv.wait(lock, [this] { return pending == 0; });
+    if (first_exception) {
+        std::exception_ptr e = first_exception;
+        first_exception = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void thread_pool::join() {
+    if (workers.empty()) return; // already joined
+    std::exception_ptr e{nullptr};
+    try {
+        wait_idle();
+    } catch (...) {
+        e = std::current_exception();
+    }
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    work_cv.notify_all();
+    for (auto& it : workers) { it.join(); }
+    workers.clear();
+    if (e) std::rethrow_exception(e);
+}
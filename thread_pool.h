@@ -0,0 +1,105 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * thread_pool - a small work-stealing thread pool used by the scanner_set.
+ *
+ * Each worker has its own deque of tasks. A worker pushes the tasks it creates onto the back
+ * of its own deque and pops them from the back (depth-first, so that the child sbufs made by
+ * recursive scanners are processed while the parent's memory is still hot). Idle workers steal
+ * from the front of other workers' deques, which is where the oldest (and typically largest)
+ * work lives. Tasks submitted from threads that are not workers go onto a shared injection queue.
+ *
+ * Each deque is protected by its own mutex, so contention is only between a worker and its thieves.
+ *
+ * Given a numa_topology, the workers are pinned to CPUs spread over the nodes, and each node has its own
+ * injection queue. A worker looks for work on its own node (its deque, its node's queue, its node's
+ * other workers) before it looks on the others. See numa.h.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+public:
+    typedef std::function<void()> task_t;
+
+private:
+    struct worker_queue {
+        std::mutex M{};               // protects tasks
+        std::deque<task_t> tasks{};
+    };
+    std::vector<worker_queue*> queues{}; // one per worker
+    std::vector<std::thread> workers{};
+    std::vector<size_t> worker_node{};   // the node of each worker, as an index in the topology
+    std::vector<unsigned int> worker_cpu{}; // the CPU each worker is pinned to, if there is a topology
+    const bool pinned;
+
+    std::mutex M{};                      // protects injection, first_exception and the condition variables
+    std::vector<std::deque<task_t>> injection{}; // tasks submitted by threads that are not workers, by node
+    size_t next_injection{0};            // for tasks submitted without a node
+    std::condition_variable work_cv{};   // signaled when work is submitted or the pool is stopping
+    std::condition_variable idle_cv{};   // signaled when the pool becomes idle
+    std::exception_ptr first_exception{nullptr}; // first exception that escaped a task
+
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> pending{0};        // tasks submitted but not yet completed
+    std::atomic<uint64_t> tasks_executed{0}; // total tasks run
+    std::atomic<uint64_t> tasks_stolen{0};   // tasks taken from another worker's deque
+
+    bool pop_local(size_t me, task_t& task);   // pop from the back of our own deque
+    bool pop_injection(size_t node, task_t& task); // pop from the front of a node's injection queue
+    bool pop_any_injection(task_t& task);      // from the front of any of them
+    bool steal(size_t me, bool same_node, task_t& task); // pop from the front of somebody else's deque
+    bool find_task(task_t& task);              // any of the above, for the calling thread
+    void run_task(task_t& task);               // run and account for a task
+    void worker_loop(size_t me);
+
+public:
+    /* With a topology, the workers are pinned; see place_worker() in numa.h */
+    explicit thread_pool(unsigned int num_workers, const class numa_topology* topology = nullptr);
+    virtual ~thread_pool();
+
+    /* Schedule a task. When called from a worker, the task goes on the worker's own deque. Otherwise it
+     * goes on the injection queue of node (an index in the topology), or of each node in turn if node < 0.
+     */
+    void submit(task_t task, int node = -1);
+
+    /* Run a single pending task on the calling thread, preferring work the caller created.
+     * Returns false if there was nothing to run. Used to help rather than block while waiting.
+     */
+    bool help();
+
+    /* Block until every submitted task (and every task those tasks submitted) has completed.
+     * Rethrows the first exception that escaped a task, if any.
+     */
+    void wait_idle();
+
+    /* Drain the pool and stop the worker threads. The pool cannot be used afterwards. */
+    void join();
+
+    bool is_worker_thread() const;   // true if the calling thread belongs to this pool
+    unsigned int worker_count() const { return workers.size(); }
+    size_t node_count() const { return injection.size(); }
+    int current_node() const;        // the calling worker's node, or -1 if it isn't a worker
+    bool is_pinned() const { return pinned; }
+    unsigned int get_worker_cpu(unsigned int worker) const { return worker_cpu.at(worker); }
+    uint64_t get_pending() const { return pending; }
+    uint64_t get_tasks_executed() const { return tasks_executed; }
+    uint64_t get_tasks_stolen() const { return tasks_stolen; }
+};
+
+#endif
@@ -0,0 +1,167 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "trace.h"
+#include "utils.h"
+
+namespace {
+
+/* One thread's events for one trace. Only the owning thread writes; written is the number of events
+ * recorded, and event i is in events[i & mask] until it is overwritten.
+ */
+struct trace_ring {
+    trace_ring(size_t n, uint32_t tid_, uint64_t generation_) : tid(tid_), generation(generation_) {
+        size_t cap = 1;
+        while (cap < n) cap <<= 1;
+        events.resize(cap);
+        mask = cap - 1;
+    }
+    std::vector<tracer::event_t> events{};
+    size_t mask{0};
+    std::atomic<uint64_t> written{0};
+    const uint32_t tid;
+    const uint64_t generation;
+};
+
+std::mutex Mtracer{}; // protects everything below except generation
+std::vector<std::shared_ptr<trace_ring>> rings{};
+std::vector<std::string> names{};
+std::map<std::string, uint32_t> name_ids{};
+size_t ring_events{tracer::EVENTS_PER_THREAD};
+uint64_t tick0{0};
+std::chrono::steady_clock::time_point steady0{};
+std::atomic<uint64_t> generation{0};
+
+thread_local std::shared_ptr<trace_ring> my_ring{};
+
+trace_ring* new_ring() {
+    const std::lock_guard<std::mutex> lock(Mtracer);
+    my_ring = std::make_shared<trace_ring>(ring_events, rings.size(), generation.load());
+    rings.push_back(my_ring);
+    return my_ring.get();
+}
+
+} // namespace
+
+const char* tracer::category_name(category_t c) {
+    switch (c) {
+    case SBUF: return "sbuf";
+    case SCANNER: return "scanner";
+    case WRITE: return "write";
+    case CARVE: return "carve";
+    case HISTOGRAM: return "histogram";
+    default: return "unknown";
+    }
+}
+
+void tracer::enable(size_t events_per_thread) {
+    const std::lock_guard<std::mutex> lock(Mtracer);
+    if (events_per_thread == 0) throw std::invalid_argument("tracer::enable: events_per_thread must be >0");
+    rings.clear();
+    ring_events = events_per_thread;
+    generation++; // every thread starts a new ring on its next event
+    tick0 = ticks();
+    steady0 = std::chrono::steady_clock::now();
+    on.store(true, std::memory_order_release);
+}
+
+void tracer::disable() { on.store(false, std::memory_order_release); }
+
+uint32_t tracer::intern(const std::string& name) {
+    const std::lock_guard<std::mutex> lock(Mtracer);
+    auto it = name_ids.find(name);
+    if (it != name_ids.end()) return it->second;
+    const uint32_t id = names.size();
+    names.push_back(name);
+    name_ids[name] = id;
+    return id;
+}
+
+void tracer::record(const event_t& ev) {
+    trace_ring* r = my_ring.get();
+    if (r == nullptr || r->generation != generation.load(std::memory_order_relaxed)) r = new_ring();
+    const uint64_t n = r->written.load(std::memory_order_relaxed);
+    r->events[n & r->mask] = ev;
+    r->written.store(n + 1, std::memory_order_release);
+}
+
+uint64_t tracer::events_recorded() {
+    const std::lock_guard<std::mutex> lock(Mtracer);
+    uint64_t count = 0;
+    for (const auto& r : rings) count += r->written.load();
+    return count;
+}
+
+uint64_t tracer::events_dropped() {
+    const std::lock_guard<std::mutex> lock(Mtracer);
+    uint64_t count = 0;
+    for (const auto& r : rings) {
+        const uint64_t w = r->written.load();
+        if (w > r->events.size()) count += w - r->events.size();
+    }
+    return count;
+}
+
+/* Threads may still be recording: each ring is copied, and the events that were overwritten while it
+ * was being copied are left out.
+ */
+void tracer::write_chrome_json(std::ostream& os) {
+    std::vector<std::shared_ptr<trace_ring>> rs;
+    std::vector<std::string> ns;
+    uint64_t t0;
+    std::chrono::steady_clock::time_point s0;
+    {
+        const std::lock_guard<std::mutex> lock(Mtracer);
+        rs = rings;
+        ns = names;
+        t0 = tick0;
+        s0 = steady0;
+    }
+    const double elapsed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - s0).count();
+    const uint64_t elapsed_ticks = ticks() - t0;
+    const double ns_per_tick = (elapsed_ticks > 0 && elapsed_ns > 0) ? elapsed_ns / elapsed_ticks : 1.0;
+    auto usec = [&](uint64_t t) { return t > t0 ? (t - t0) * ns_per_tick / 1000.0 : 0.0; };
+
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    for (const auto& r : rs) {
+        const uint64_t w1 = r->written.load(std::memory_order_acquire);
+        const std::vector<event_t> copy(r->events);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t w2 = r->written.load(std::memory_order_relaxed);
+        const uint64_t cap = copy.size();
+        const uint64_t lo = w2 > cap ? w2 - cap : 0;
+
+        os << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << r->tid
+           << ",\"args\":{\"name\":\"thread " << r->tid << "\"}}";
+        first = false;
+        os << std::fixed << std::setprecision(3);
+        for (uint64_t i = lo; i < w1; i++) {
+            const event_t& ev = copy[i & r->mask];
+            const std::string name = ev.name < ns.size() ? json_escape(ns[ev.name]) : "?";
+            os << ",\n{\"ph\":\"X\",\"cat\":\"" << category_name(ev.cat) << "\",\"name\":\"" << name
+               << "\",\"pid\":1,\"tid\":" << r->tid << ",\"ts\":" << usec(ev.begin)
+               << ",\"dur\":" << (ev.end > ev.begin ? (ev.end - ev.begin) * ns_per_tick / 1000.0 : 0.0)
+               << ",\"args\":{\"arg\":" << ev.arg << ",\"depth\":" << ev.depth << "}}";
+        }
+    }
+    os << "\n]}\n";
+}
+
+void tracer::write_chrome_json(const std::filesystem::path& fname) {
+    std::ofstream of(fname);
+    if (!of.is_open()) throw std::runtime_error("tracer: cannot open " + fname.string());
+    write_chrome_json(of);
+    of.close();
+    if (of.fail()) throw std::runtime_error("tracer: cannot write " + fname.string());
+}
@@ -0,0 +1,111 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * tracer - low-overhead tracing of the hot paths, exported as Chrome/Perfetto trace JSON.
+ *
+ * A trace_span is a scoped timer: it reads the clock when it is created and records a span event when
+ * it is destroyed. The events go into a ring buffer owned by the recording thread, so recording takes no
+ * lock and touches no shared cache line; when a ring is full its oldest events are overwritten (and
+ * counted by events_dropped()). The clock is the TSC on x86 and std::chrono::steady_clock elsewhere;
+ * ticks are converted to time when the trace is written, using steady_clock over the whole trace.
+ *
+ * Tracing is off until enable() is called, and while it is off a trace_span costs one relaxed load.
+ * scanner_set turns it on when scanner_config::trace_file is set and writes the trace at shutdown;
+ * the file can be opened with chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Span names are interned: intern() takes a lock, so callers intern names once (at construction or when
+ * a plan is built) and pass the id.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class tracer {
+public:
+    static inline const size_t EVENTS_PER_THREAD = 65536;
+
+    /* What the span is; also determines what arg means */
+    enum category_t : uint8_t {
+        SBUF = 0,      // scanner_set::process_sbuf(); arg is the bufsize
+        SCANNER = 1,   // one scanner call; arg is the bufsize
+        WRITE = 2,     // feature_recorder::write(); arg is the feature size
+        CARVE = 3,     // feature_recorder::carve(); arg is the data size
+        HISTOGRAM = 4, // a histogram being flushed or merged; arg is its estimated bytes
+        CATEGORIES = 5
+    };
+    static const char* category_name(category_t c);
+
+    struct event_t {
+        uint64_t begin{0}; // ticks
+        uint64_t end{0};
+        uint64_t arg{0};
+        uint32_t name{0};  // see intern()
+        uint16_t depth{0}; // sbuf depth, for SBUF and SCANNER
+        category_t cat{SBUF};
+    };
+
+    static bool enabled() { return on.load(std::memory_order_relaxed); }
+    static void enable(size_t events_per_thread = EVENTS_PER_THREAD); // discards any previous trace
+    static void disable();                                            // keeps the trace for writing
+
+    static uint32_t intern(const std::string& name);
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+    static void record(const event_t& ev);
+
+    static uint64_t events_recorded(); // including the dropped ones
+    static uint64_t events_dropped();  // overwritten before they could be written
+    static void write_chrome_json(std::ostream& os);
+    static void write_chrome_json(const std::filesystem::path& fname); // throws std::runtime_error
+
+private:
+    static inline std::atomic<bool> on{false};
+};
+
+/* Records a span from construction to destruction, if tracing was on when it was constructed */
+class trace_span {
+public:
+    trace_span(tracer::category_t cat, uint32_t name, uint64_t arg = 0, uint16_t depth = 0) {
+        if (tracer::enabled()) {
+            ev.cat = cat;
+            ev.name = name;
+            ev.arg = arg;
+            ev.depth = depth;
+            ev.begin = tracer::ticks();
+            active = true;
+        }
+    }
+    ~trace_span() {
+        if (active) {
+            ev.end = tracer::ticks();
+            tracer::record(ev);
+        }
+    }
+    void set_arg(uint64_t arg) { ev.arg = arg; }
+
+private:
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+    tracer::event_t ev{};
+    bool active{false};
+};
+
+#endif
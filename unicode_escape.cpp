@@ -27,13 +27,227 @@
 #include <cassert>
 //#include <cstdint>
 #include <cstdio>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define UNICODE_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define UNICODE_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 #include "unicode_escape.h"
 #include "utf8.h"
 
+/**************** VECTORIZED SCANNING ****************
+ * Each kernel only measures a run of input that the scalar code below would handle trivially,
+ * so the output is the same whichever kernel runs:
+ *
+ * passthrough_run - bytes that validateOrEscapeUTF8() copies unchanged (0x20..0x7F, less backslash)
+ * count_nuls      - NUL bytes at even and odd offsets, for looks_like_utf16()
+ * utf16_ascii_run - UTF-16 code units 0x01..0x7F, written out as single bytes
+ */
+namespace {
+size_t passthrough_run_scalar(const uint8_t* p, size_t len, bool escape_backslash) {
+    size_t i = 0;
+    while (i < len && p[i] >= 0x20 && p[i] < 0x80 && !(escape_backslash && p[i] == '\\')) i++;
+    return i;
+}
+
+void count_nuls_scalar(const uint8_t* p, size_t len, uint32_t& even, uint32_t& odd) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        if (p[i] == 0) even++;
+        if (p[i + 1] == 0) odd++;
+    }
+}
+
+size_t utf16_ascii_run_scalar(const uint8_t* p, size_t units, bool little_endian, char* out) {
+    size_t i = 0;
+    for (; i < units; i++) {
+        const uint8_t lo = little_endian ? p[2 * i] : p[2 * i + 1];
+        const uint8_t hi = little_endian ? p[2 * i + 1] : p[2 * i];
+        if (hi != 0 || lo == 0 || lo >= 0x80) break;
+        out[i] = lo;
+    }
+    return i;
+}
+
+#ifdef UNICODE_SIMD_X86
+__attribute__((target("sse2"))) size_t passthrough_run_sse2(const uint8_t* p, size_t len, bool escape_backslash) {
+    const __m128i space_less_1 = _mm_set1_epi8(0x1f);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i ok = _mm_cmpgt_epi8(v, space_less_1); // signed, so bytes >= 0x80 fail
+        if (escape_backslash) ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, backslash), ok);
+        const unsigned int mask = _mm_movemask_epi8(ok);
+        if (mask != 0xffff) return i + __builtin_ctz(~mask);
+    }
+    return i + passthrough_run_scalar(p + i, len - i, escape_backslash);
+}
+
+__attribute__((target("avx2"))) size_t passthrough_run_avx2(const uint8_t* p, size_t len, bool escape_backslash) {
+    const __m256i space_less_1 = _mm256_set1_epi8(0x1f);
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i ok = _mm256_cmpgt_epi8(v, space_less_1);
+        if (escape_backslash) ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, backslash), ok);
+        const uint32_t mask = _mm256_movemask_epi8(ok);
+        if (mask != 0xffffffff) return i + __builtin_ctz(~mask);
+    }
+    return i + passthrough_run_sse2(p + i, len - i, escape_backslash);
+}
+
+__attribute__((target("sse2"))) void count_nuls_sse2(const uint8_t* p, size_t len, uint32_t& even, uint32_t& odd) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        even += __builtin_popcount(mask & 0x5555);
+        odd += __builtin_popcount(mask & 0xaaaa);
+    }
+    count_nuls_scalar(p + i, len - i, even, odd);
+}
+
+__attribute__((target("avx2"))) void count_nuls_avx2(const uint8_t* p, size_t len, uint32_t& even, uint32_t& odd) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        const uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        even += __builtin_popcount(mask & 0x55555555);
+        odd += __builtin_popcount(mask & 0xaaaaaaaa);
+    }
+    count_nuls_sse2(p + i, len - i, even, odd);
+}
+
+__attribute__((target("sse2"))) size_t utf16_ascii_run_sse2(const uint8_t* p, size_t units, bool little_endian,
+                                                              char* out) {
+    const __m128i not_ascii = _mm_set1_epi16(static_cast<short>(0xff80));
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= units; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2 * i));
+        if (!little_endian) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        const __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi16(v, zero), _mm_cmpeq_epi16(_mm_and_si128(v, not_ascii), zero));
+        if (_mm_movemask_epi8(ok) != 0xffff) break;
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(v, v));
+    }
+    return i + utf16_ascii_run_scalar(p + 2 * i, units - i, little_endian, out + i);
+}
+#endif
+
+#ifdef UNICODE_SIMD_NEON
+size_t passthrough_run_neon(const uint8_t* p, size_t len, bool escape_backslash) {
+    const int8x16_t space_less_1 = vdupq_n_s8(0x1f);
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const uint8x16_t v = vld1q_u8(p + i);
+        uint8x16_t ok = vcgtq_s8(vreinterpretq_s8_u8(v), space_less_1);
+        if (escape_backslash) ok = vbicq_u8(ok, vceqq_u8(v, backslash));
+        if (vminvq_u8(ok) != 0xff) break;
+    }
+    return i + passthrough_run_scalar(p + i, len - i, escape_backslash);
+}
+
+void count_nuls_neon(const uint8_t* p, size_t len, uint32_t& even, uint32_t& odd) {
+    size_t i = 0;
+    while (i + 32 <= len) {
+        /* Lanes count down from 0 by one per NUL; 255 blocks at most, so they can't wrap */
+        uint8x16_t e = vdupq_n_u8(0), o = vdupq_n_u8(0);
+        for (unsigned int n = 0; n < 255 && i + 32 <= len; n++, i += 32) {
+            const uint8x16x2_t v = vld2q_u8(p + i);
+            e = vsubq_u8(e, vceqzq_u8(v.val[0]));
+            o = vsubq_u8(o, vceqzq_u8(v.val[1]));
+        }
+        even += vaddlvq_u8(e);
+        odd += vaddlvq_u8(o);
+    }
+    count_nuls_scalar(p + i, len - i, even, odd);
+}
+
+size_t utf16_ascii_run_neon(const uint8_t* p, size_t units, bool little_endian, char* out) {
+    size_t i = 0;
+    for (; i + 16 <= units; i += 16) {
+        const uint8x16x2_t v = vld2q_u8(p + 2 * i);
+        const uint8x16_t lo = little_endian ? v.val[0] : v.val[1];
+        const uint8x16_t hi = little_endian ? v.val[1] : v.val[0];
+        const uint8x16_t ok = vandq_u8(vandq_u8(vceqzq_u8(hi), vtstq_u8(lo, lo)), vcltq_u8(lo, vdupq_n_u8(0x80)));
+        if (vminvq_u8(ok) != 0xff) break;
+        vst1q_u8(reinterpret_cast<uint8_t*>(out + i), lo);
+    }
+    return i + utf16_ascii_run_scalar(p + 2 * i, units - i, little_endian, out + i);
+}
+#endif
+
+struct unicode_kernels_t {
+    const char* name;
+    size_t (*passthrough_run)(const uint8_t*, size_t, bool);
+    void (*count_nuls)(const uint8_t*, size_t, uint32_t&, uint32_t&);
+    size_t (*utf16_ascii_run)(const uint8_t*, size_t, bool, char*);
+};
+
+const unicode_kernels_t scalar_kernels{"scalar", passthrough_run_scalar, count_nuls_scalar, utf16_ascii_run_scalar};
+
+const unicode_kernels_t& best_kernels() {
+#if defined(UNICODE_SIMD_X86)
+    static const unicode_kernels_t avx2{"avx2", passthrough_run_avx2, count_nuls_avx2, utf16_ascii_run_sse2};
+    static const unicode_kernels_t sse2{"sse2", passthrough_run_sse2, count_nuls_sse2, utf16_ascii_run_sse2};
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    static const bool has_sse2 = __builtin_cpu_supports("sse2");
+    if (has_avx2) return avx2;
+    if (has_sse2) return sse2;
+#elif defined(UNICODE_SIMD_NEON)
+    static const unicode_kernels_t neon{"neon", passthrough_run_neon, count_nuls_neon, utf16_ascii_run_neon};
+    return neon;
+#endif
+    return scalar_kernels;
+}
+
+std::atomic<bool> simd_enabled{true};
+
+const unicode_kernels_t& kernels() { return simd_enabled ? best_kernels() : scalar_kernels; }
+} // namespace
+
+void unicode_simd_enable(bool enable) { simd_enabled = enable; }
+const char* unicode_simd_implementation() { return kernels().name; }
+
+size_t utf16_ascii_run(const uint8_t* p, size_t units, bool little_endian, char* out) {
+    return kernels().utf16_ascii_run(p, units, little_endian, out);
+}
+
+bool is_printable_ascii(std::string_view str, bool reject_backslash) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    const char* p = str.data();
+    size_t len = str.size();
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        /* The high bit of a byte is set in bad if that byte is < 0x20, >= 0x7F or a backslash */
+        uint64_t bad = ((w - ones * 0x20) & ~w) | ((w + ones * (0x7F - 0x7E)) | w);
+        if (reject_backslash) {
+            const uint64_t bs = w ^ (ones * '\\');
+            bad |= (bs - ones) & ~bs;
+        }
+        if (bad & highs) return false;
+    }
+    for (; len > 0; p++, len--) {
+        const uint8_t ch = *p;
+        if (ch < 0x20 || ch >= 0x7F || (reject_backslash && ch == '\\')) return false;
+    }
+    return true;
+}
+
 /**************** BULK_EXTRACTOR 1.0 CODE ****************/
 std::string hexesc(unsigned char ch) {
     char buf[10];
@@ -100,8 +314,21 @@ std::string validateOrEscapeUTF8(const std::string& input, bool escape_bad_utf8,
     }
 
     // validate or escape input
+    const auto passthrough_run = kernels().passthrough_run;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(input.data());
+    const size_t first_run = passthrough_run(data, input.size(), escape_backslash);
+    if (first_run == input.size()) return input; // nothing to escape; the common case
+
     std::string output;
+    output.reserve(input.size() + 16);
     for (std::string::size_type i = 0; i < input.length();) {
+        /* copy printable ASCII a vector at a time */
+        const size_t run = i == 0 ? first_run : passthrough_run(data + i, input.size() - i, escape_backslash);
+        if (run > 0) {
+            output.append(input, i, run);
+            i += run;
+            continue;
+        }
         uint8_t ch = (uint8_t)input.at(i);
 
         // utf8 1 byte prefix (0xxx xxxx)
@@ -185,6 +412,7 @@ std::string validateOrEscapeUTF8(const std::string& input, bool escape_bad_utf8,
 
 /* static */
 bool looks_like_utf16(const std::string& str, bool& little_endian) {
+    if (str.size() < 2) return false;
     if ((uint8_t)str[0] == 0xff && (uint8_t)str[1] == 0xfe) {
         little_endian = true;
         return true; // begins with FFFE
@@ -196,11 +424,7 @@ bool looks_like_utf16(const std::string& str, bool& little_endian) {
     /* If none of the even characters are NULL and some of the odd characters are NULL, it's UTF-16 */
     uint32_t even_null_count = 0;
     uint32_t odd_null_count = 0;
-    for (size_t i = 0; i + 1 < str.size(); i += 2) {
-        if (str[i] == 0) even_null_count++;
-        if (str[i + 1] == 0) odd_null_count++;
-        /* TODO: Should we look for FFFE or FEFF and act accordingly ? */
-    }
+    kernels().count_nuls(reinterpret_cast<const uint8_t*>(str.data()), str.size(), even_null_count, odd_null_count);
     if (even_null_count == 0 && odd_null_count > 1) {
         little_endian = true;
         return true;
@@ -218,25 +442,38 @@ bool looks_like_utf16(const std::string& str, bool& little_endian) {
  */
 /* static */
 std::string convert_utf16_to_utf8(const std::string& key, bool little_endian) {
-    /* re-image this string as UTF16*/
-    std::u16string utf16;
-    for (size_t i = 0; i < key.size(); i += 2) {
-        if (little_endian)
-            utf16.push_back(key[i] | (key[i + 1] << 8));
-        else
-            utf16.push_back(key[i] << 8 | (key[i + 1]));
-    }
-    /* Now convert it to a UTF-8;
-     * set tempKey to be the utf-8 string that will be erased.
+    /* Runs of ASCII are converted a vector at a time. Everything else is re-imaged as UTF16 and
+     * converted by the utf8 package. A trailing odd byte is a code unit with the other byte 0.
+     * NULs are dropped.
      */
-    std::string tempKey;
-    utf8::utf16to8(utf16.begin(), utf16.end(), std::back_inserter(tempKey));
-    /* Erase any nulls if present */
-    while (tempKey.size() > 0) {
-        size_t nullpos = tempKey.find('\000');
-        if (nullpos == std::string::npos) break;
-        tempKey.erase(nullpos, 1);
+    const auto utf16_ascii_run = kernels().utf16_ascii_run;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(key.data());
+    const size_t units = (key.size() + 1) / 2;
+    auto unit = [&](size_t i) -> uint16_t {
+        const uint16_t b0 = p[2 * i];
+        const uint16_t b1 = 2 * i + 1 < key.size() ? p[2 * i + 1] : 0;
+        return little_endian ? (b0 | b1 << 8) : (b0 << 8 | b1);
+    };
+
+    std::string tempKey(3 * units, '\0'); // a code unit is at most 3 bytes of UTF-8
+    size_t out = 0;
+    std::u16string utf16;
+    for (size_t i = 0; i < units;) {
+        const size_t run = utf16_ascii_run(p + 2 * i, (key.size() - 2 * i) / 2, little_endian, &tempKey[out]);
+        i += run;
+        out += run;
+        if (i == units) break;
+        uint16_t u = unit(i);
+        if (u < 0x80) { // a NUL, or the trailing odd byte
+            if (u != 0) tempKey[out++] = u;
+            i++;
+            continue;
+        }
+        utf16.clear();
+        for (; i < units && (u = unit(i)) >= 0x80; i++) { utf16.push_back(u); }
+        out = utf8::utf16to8(utf16.begin(), utf16.end(), tempKey.begin() + out) - tempKey.begin();
     }
+    tempKey.resize(out);
     return tempKey;
 }
 
@@ -247,6 +484,7 @@ std::string convert_utf16_to_utf8(const std::string& key) {
 }
 
 std::string make_utf8(const std::string& str) {
+    if (is_printable_ascii(str, true)) return str; // cannot be UTF-16 and needs no escaping
     try {
         return convert_utf16_to_utf8(str);
     } catch (const utf8::invalid_utf16&) { return validateOrEscapeUTF8(str, true, true, true); }
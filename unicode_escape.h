@@ -8,12 +8,13 @@
 #define UNICODE_ESCAPE_H
 
 #include <codecvt>
-//#include <cstdint>
+#include <cstdint>
 #include <cstring>
 #include <cwctype>
 #include <iostream>
 #include <locale>
 #include <string>
+#include <string_view>
 
 #include "utf8.h"
 
@@ -41,6 +42,24 @@ struct unicode {
     static const uint16_t BOM = 0xFEFF;
 };
 
+/* True if every byte is printable ASCII (0x20..0x7E), optionally excluding backslash.
+ * Such a string is already valid UTF-8 that needs no escaping, so callers can skip validateOrEscapeUTF8().
+ * Checks 8 bytes at a time.
+ */
+bool is_printable_ascii(std::string_view str, bool reject_backslash);
+
+/* validateOrEscapeUTF8(), looks_like_utf16() and convert_utf16_to_utf8() scan with SSE2/AVX2 (chosen at
+ * run time) or NEON where available, and fall back to the byte-at-a-time code, which is the reference.
+ * unicode_simd_enable(false) forces the scalar code, so the two can be compared.
+ */
+void unicode_simd_enable(bool enable);
+const char* unicode_simd_implementation(); // "avx2", "sse2", "neon" or "scalar"
+
+/* Copies the run of UTF-16 code units 0x01..0x7F at the start of p, of at most units, to out as ASCII, a vector at a
+ * time. Returns the length of the run.
+ */
+size_t utf16_ascii_run(const uint8_t* p, size_t units, bool little_endian, char* out);
+
 /* Create safe UTF8 from unsafe UTF8.
  * if validate is true and the others are false, throws an exception with bad UTF8.
  */
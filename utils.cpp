@@ -128,3 +128,22 @@ std::vector<std::string> split(const std::string& s, char delim) {
     std::vector<std::string> elems;
     return split(s, delim, elems);
 }
+
+/* For a JSON string: quotes, backslashes and control characters are escaped */
+std::string json_escape(const std::string& s) {
+    std::string ret;
+    for (const char ch : s) {
+        const unsigned char c = static_cast<unsigned char>(ch);
+        if (c == '"' || c == '\\') {
+            ret.push_back('\\');
+            ret.push_back(ch);
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            ret += buf;
+        } else {
+            ret.push_back(ch);
+        }
+    }
+    return ret;
+}
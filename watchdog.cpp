@@ -0,0 +1,93 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "sbuf.h"
+#include "watchdog.h"
+
+scan_watchdog::scope::scope(scan_watchdog& w, const sbuf_t& sbuf, const std::string* scanner, uint64_t budget_ns)
+    : slot(w.get_slot()), saved(tl_current), call(tl_current) {
+    call.sbuf = &sbuf;
+    call.scanner = scanner;
+    call.budget_ns = budget_ns;
+    call.start = std::chrono::steady_clock::now();
+    call.deadline = call.start + std::chrono::nanoseconds(budget_ns);
+    {
+        const std::lock_guard<std::mutex> lock(slot.M);
+        call.outer = slot.top;
+        slot.top = &call;
+    }
+    tl_current = &call.token;
+}
+
+scan_watchdog::scope::~scope() {
+    tl_current = saved;
+    const std::lock_guard<std::mutex> lock(slot.M);
+    slot.top = call.outer;
+}
+
+bool scan_watchdog::scope::overran() const {
+    const std::lock_guard<std::mutex> lock(slot.M);
+    return call.overran;
+}
+
+/* The calling thread's slot, cached so that the watchdog's mutex is only taken on a thread's first call */
+static thread_local uint64_t tl_slot_owner{0};
+static thread_local void* tl_slot{nullptr};
+
+scan_watchdog::slot_t& scan_watchdog::get_slot() {
+    if (tl_slot_owner != instance_id) {
+        const std::lock_guard<std::mutex> lock(M);
+        auto& slot = slots[std::this_thread::get_id()];
+        if (slot == nullptr) slot = std::make_unique<slot_t>();
+        tl_slot = slot.get();
+        tl_slot_owner = instance_id;
+    }
+    return *static_cast<slot_t*>(tl_slot);
+}
+
+std::chrono::nanoseconds scan_watchdog::tick_for(uint64_t smallest_budget_ns) {
+    const uint64_t lo = 1000 * 1000, hi = 100 * 1000 * 1000;
+    return std::chrono::nanoseconds(std::clamp<uint64_t>(smallest_budget_ns / 4, lo, hi));
+}
+
+scan_watchdog::scan_watchdog(std::chrono::nanoseconds tick_, overrun_callback_t callback_)
+    : tick(tick_), callback(callback_), thread(&scan_watchdog::run, this) {}
+
+scan_watchdog::~scan_watchdog() {
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void scan_watchdog::run() {
+    std::unique_lock<std::mutex> lock(M);
+    while (!cv.wait_for(lock, tick, [this] { return stopping; })) {
+        /* What overran is copied while the calls are locked, and reported after they are unlocked, so that
+         * the callback can write features without holding up the threads that it reports on.
+         */
+        const auto now = std::chrono::steady_clock::now();
+        std::vector<overrun_t> found;
+        for (const auto& it : slots) {
+            const std::lock_guard<std::mutex> slot_lock(it.second->M);
+            for (call_t* c = it.second->top; c != nullptr; c = c->outer) {
+                if (c->overran || now < c->deadline) continue;
+                c->overran = true;
+                c->token.cancel();
+                const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - c->start).count();
+                found.push_back(overrun_t{c->sbuf->pos0, c->scanner ? *c->scanner : "", c->budget_ns, elapsed});
+            }
+        }
+        if (found.empty()) continue;
+        overruns += found.size();
+        lock.unlock();
+        for (const auto& it : found) callback(it);
+        lock.lock();
+    }
+}
@@ -0,0 +1,127 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * \file
+ * scan_watchdog - time budgets for scanner calls and top-level pages, with cooperative cancellation.
+ *
+ * One adversarial page can keep a scanner busy for minutes. With scanner_config::scanner_budget_ms
+ * (or scanner_budgets_ms for one scanner) or scanner_config::sbuf_budget_ms set, scanner_set makes a
+ * budgeted call (a scope) around every scanner call or top-level page. The scope is on the calling
+ * thread's stack and is linked into that thread's slot, so registering one takes an uncontended lock.
+ *
+ * A watchdog thread wakes every tick and looks at every thread's open calls. A call that has run past
+ * its deadline is reported once to the overrun callback (scanner_set writes it to the alert recorder,
+ * with the sbuf's pos0) and its cancel_token is cancelled. Scanners see the token as
+ * scanner_params::cancelled(); a scanner that loops over its sbuf should check it and return early.
+ * Cancelling a call cancels the calls nested in it on the same thread, so the children that a scanner
+ * recursed into are cancelled too, and scanner_params::recurse() drops new children of a cancelled call.
+ * Nothing is interrupted: a scanner that never checks runs to completion, but is still reported.
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "pos0.h"
+
+class cancel_token {
+public:
+    explicit cancel_token(const cancel_token* outer_ = nullptr) : outer(outer_) {}
+    bool cancelled() const { return flag.load(std::memory_order_relaxed) || (outer && outer->cancelled()); }
+    void cancel() { flag.store(true, std::memory_order_relaxed); }
+
+private:
+    cancel_token(const cancel_token&) = delete;
+    cancel_token& operator=(const cancel_token&) = delete;
+    const cancel_token* const outer; // the call this one is nested in, on the same thread
+    std::atomic<bool> flag{false};
+};
+
+class scan_watchdog {
+    scan_watchdog(const scan_watchdog&) = delete;
+    scan_watchdog& operator=(const scan_watchdog&) = delete;
+
+public:
+    /* A call that ran past its deadline */
+    struct overrun_t {
+        pos0_t pos0{};
+        std::string scanner{}; // empty for a top-level page's budget
+        uint64_t budget_ns{0};
+        uint64_t elapsed_ns{0};
+    };
+    typedef std::function<void(const overrun_t&)> overrun_callback_t;
+
+private:
+    struct call_t {
+        const class sbuf_t* sbuf{nullptr};
+        const std::string* scanner{nullptr};
+        uint64_t budget_ns{0};
+        std::chrono::steady_clock::time_point start{};
+        std::chrono::steady_clock::time_point deadline{};
+        bool overran{false};       // protected by the slot's M
+        call_t* outer{nullptr};
+        cancel_token token;
+        explicit call_t(const cancel_token* outer_token) : token(outer_token) {}
+    };
+    struct slot_t {
+        std::mutex M{};        // the owner thread and the watchdog; protects the calls
+        call_t* top{nullptr};  // innermost open call
+    };
+
+public:
+    /* One budgeted call, open while the scope is alive. sbuf and scanner must outlive it. */
+    class scope {
+    public:
+        scope(scan_watchdog& w, const class sbuf_t& sbuf, const std::string* scanner, uint64_t budget_ns);
+        ~scope();
+        const cancel_token& token() const { return call.token; }
+        bool overran() const;  // the watchdog reported this call
+
+    private:
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+        slot_t& slot;
+        const cancel_token* const saved;
+        call_t call;
+    };
+
+    /* The innermost open call's token on the calling thread, or nullptr */
+    static const cancel_token* current() { return tl_current; }
+
+    /* Starts the watchdog thread, which wakes every tick */
+    scan_watchdog(std::chrono::nanoseconds tick, overrun_callback_t callback);
+    ~scan_watchdog();              // stops the thread; no scope may still be open
+    uint64_t get_overruns() const { return overruns; }
+
+    /* A tick that notices an overrun of the smallest budget soon enough; between 1ms and 100ms */
+    static std::chrono::nanoseconds tick_for(uint64_t smallest_budget_ns);
+
+private:
+    static inline thread_local const cancel_token* tl_current{nullptr};
+
+    inline static std::atomic<uint64_t> instance_counter{0};
+    const uint64_t instance_id{++instance_counter}; // identifies this watchdog in thread-local caches
+    slot_t& get_slot();                             // the calling thread's slot
+
+    const std::chrono::nanoseconds tick;
+    const overrun_callback_t callback;
+    std::mutex M{};                                 // protects slots, stopping and cv
+    std::map<std::thread::id, std::unique_ptr<slot_t>> slots{};
+    bool stopping{false};
+    std::condition_variable cv{};
+    std::atomic<uint64_t> overruns{0};
+    std::thread thread;                             // started last
+    void run();
+};
+
+#endif
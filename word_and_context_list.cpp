@@ -5,11 +5,26 @@
 
 #include "config.h"
 #include <cinttypes>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <tuple>
 
+#include "byte_order.h"
+#include "fast_hash.h"
+#include "sbuf.h"
 #include "word_and_context_list.h"
 
-void word_and_context_list::add_regex(const std::string& pat) { patterns.push_back(pat); }
+word_and_context_list::~word_and_context_list() {}
+
+/* An estimate of the heap a string uses beyond the std::string itself (short strings are stored inside it) */
+static size_t heap_bytes(const std::string& s) { return s.size() < sizeof(std::string) ? 0 : s.size() + 1; }
+
+void word_and_context_list::add_regex(const std::string& pat) {
+    patterns.push_back(pat);
+    memory_bytes += sizeof(std::string) + heap_bytes(pat);
+}
 
 /**
  * Insert a feature and context, but only if not already present.
@@ -20,14 +35,31 @@ bool word_and_context_list::add_fc(const std::string& f, const std::string& c) {
 
     if (c.size() > 0 && context_set.find(c) != context_set.end()) return false; // already present
     context_set.insert(c);                                                      // now we've seen it.
-    fcmap.insert(std::pair<std::string, context>(f, ctx));
+    memory_bytes += sizeof(std::string) + heap_bytes(c) + 2 * sizeof(void*);     // the set's node
+    insert(std::move(ctx));
     return true;
 }
 
+void word_and_context_list::insert(context&& ctx) {
+    contexts.push_back(std::move(ctx));
+    const context& c = contexts.back();
+    fcmap.emplace(std::string_view(c.feature), &c);
+    memory_bytes += sizeof(context) + heap_bytes(c.feature) + heap_bytes(c.before) + heap_bytes(c.after) +
+                    sizeof(stopmap_t::value_type) + 2 * sizeof(void*);
+}
+
 /** returns 0 if success, -1 if fail. */
 int word_and_context_list::readfile(const std::string& filename) {
     std::ifstream i(filename.c_str());
     if (!i.is_open()) return -1;
+    char magic[8]{};
+    i.read(magic, sizeof(magic));
+    if (i.gcount() == sizeof(magic) && memcmp(magic, FILE_MAGIC, sizeof(magic)) == 0) {
+        attach(filename);
+        return 0;
+    }
+    i.clear();
+    i.seekg(0);
     printf("Reading context stop list %s\n", filename.c_str());
     std::string line;
     uint64_t total_context = 0;
@@ -37,7 +69,7 @@ int word_and_context_list::readfile(const std::string& filename) {
         line_counter++;
         if (line.size() == 0) continue;
         if (line[0] == '#') continue; // it's a comment
-        if ((*line.end()) == '\r') { line.erase(line.end()); /* remove the last character if it is a \r */ }
+        if (line.back() == '\r') { line.pop_back(); /* remove the last character if it is a \r */ }
         if (line.size() == 0) continue; // no line content
         ++features_read;
 
@@ -64,7 +96,7 @@ int word_and_context_list::readfile(const std::string& filename) {
             patterns.push_back(line);
         } else {
             // Otherwise, add it as a feature with no context
-            fcmap.insert(std::pair<std::string, context>(line, context(line)));
+            insert(context(line));
         }
     }
     std::cout << "Stop list read.\n";
@@ -76,29 +108,205 @@ int word_and_context_list::readfile(const std::string& filename) {
 }
 
 /** check() is threadsafe. */
-bool word_and_context_list::check(const std::string& probe, const std::string& before, const std::string& after) const {
+bool word_and_context_list::check(std::string_view probe, std::string_view before, std::string_view after) const {
     /* First check literals, because they are faster */
-    for (stopmap_t::const_iterator it = fcmap.find(probe); it != fcmap.end(); it++) {
-        if ((rstrcmp((*it).second.before, before) == 0) && (rstrcmp((*it).second.after, after) == 0) &&
-            ((*it).second.feature == probe)) {
-            return true;
-        }
-    }
+    if (check_literals(probe, nullptr, before, after)) return true;
 
     /* Now check the patterns; do this second because it is more expensive */
     return patterns.search_all(probe, nullptr);
 };
 
-bool word_and_context_list::check_feature_context(const std::string& probe, const std::string& context) const {
-    std::string before;
-    std::string after;
-    context::extract_before_after(probe, context, before, after);
-    return check(probe, before, after);
+/* The same as check() with the context split, but the context is only split if it is needed */
+bool word_and_context_list::check_feature_context(std::string_view probe, std::string_view context) const {
+    if (check_literals(probe, &context, std::string_view(), std::string_view())) return true;
+    return patterns.search_all(probe, nullptr);
+}
+
+bool word_and_context_list::check_literals(std::string_view probe, const std::string_view* ctx,
+                                           std::string_view before, std::string_view after) const {
+    bool split = ctx == nullptr;
+    auto matches = [&](std::string_view b, std::string_view a) {
+        if (b.empty() && a.empty()) return true; // matches any context
+        if (!split) {
+            context::extract_before_after(probe, *ctx, before, after);
+            split = true;
+        }
+        return rstrcmp(b, before) == 0 && rstrcmp(a, after) == 0;
+    };
+    const auto range = fcmap.equal_range(probe);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (matches(it->second->before, it->second->after)) return true;
+    }
+    if (attached_count == 0) return false;
+
+    /* The Bloom filter, then a binary search for the first entry with the probe's hash */
+    const hash128_t h = fast_hash128(reinterpret_cast<const uint8_t*>(probe.data()), probe.size());
+    for (unsigned int k = 0; k < BLOOM_HASHES; k++) {
+        const uint64_t bit = (h.lo + k * (h.hi | 1)) & (attached_bloom_bits - 1);
+        if ((attached_bloom[bit >> 3] & (1 << (bit & 7))) == 0) return false;
+    }
+    size_t lo = 0;
+    size_t hi = attached_count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (get_le(attached_entries + mid * FILE_ENTRY_SIZE, 8) < h.hi) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < attached_count && get_le(attached_entries + lo * FILE_ENTRY_SIZE, 8) == h.hi; lo++) {
+        const entry_view e = attached_entry(lo);
+        if (e.feature == probe && matches(e.before, e.after)) return true;
+    }
+    return false;
+}
+
+/****************************************************************
+ *** Compiled lists
+ ****************************************************************/
+
+/* An entry is the feature's hash, the offset of its strings in the arena and the lengths of the feature,
+ * before and after, which follow each other there.
+ */
+word_and_context_list::entry_view word_and_context_list::attached_entry(size_t i) const {
+    const uint8_t* p = attached_entries + i * FILE_ENTRY_SIZE;
+    const char* s = attached_arena + get_le(p + 8, 8);
+    const size_t flen = get_le(p + 16, 4);
+    const size_t blen = get_le(p + 20, 4);
+    const size_t alen = get_le(p + 24, 4);
+    return entry_view{std::string_view(s, flen), std::string_view(s + flen, blen),
+                      std::string_view(s + flen + blen, alen)};
+}
+
+void word_and_context_list::attach(const std::filesystem::path& fname) {
+    if (attached) { throw std::runtime_error("word_and_context_list::attach: a file is already attached"); }
+    std::unique_ptr<sbuf_t> map;
+    try {
+        map.reset(sbuf_t::map_file(fname));
+    } catch (const std::exception& e) {
+        throw std::runtime_error("word_and_context_list::attach: cannot map " + fname.string() + ": " + e.what());
+    }
+    const uint8_t* buf = map->get_buf();
+    const uint64_t len = map->bufsize;
+    auto bad = [&fname](const std::string& why) {
+        return std::runtime_error("word_and_context_list::attach: " + fname.string() + " is not a compiled list: " + why);
+    };
+    if (len < FILE_HEADER_SIZE || memcmp(buf, FILE_MAGIC, 8) != 0) throw bad("no header");
+    if (get_le(buf + 8, 4) != FILE_VERSION || get_le(buf + 12, 4) != FILE_ENTRY_SIZE) throw bad("wrong version");
+
+    /* The file is mapped and trusted nowhere else, so every size and offset in it is checked here. Each
+     * count is checked against what is left of the file before it is multiplied, so nothing overflows.
+     */
+    const uint64_t count = get_le(buf + 16, 8);
+    const uint64_t npatterns = get_le(buf + 24, 8);
+    const uint64_t bloom_bytes = get_le(buf + 32, 8);
+    const uint64_t arena_size = get_le(buf + 40, 8);
+    uint64_t left = len - FILE_HEADER_SIZE;
+    if (count > left / FILE_ENTRY_SIZE) throw bad("truncated entries");
+    left -= count * FILE_ENTRY_SIZE;
+    if (npatterns > left / 16) throw bad("truncated patterns");
+    left -= npatterns * 16;
+    if (bloom_bytes == 0 || (bloom_bytes & (bloom_bytes - 1)) != 0 || bloom_bytes > left) throw bad("bad Bloom filter");
+    left -= bloom_bytes;
+    if (arena_size != left) throw bad("wrong length");
+
+    const uint64_t bloom_at = FILE_HEADER_SIZE + count * FILE_ENTRY_SIZE + npatterns * 16;
+    const uint8_t* entries = buf + FILE_HEADER_SIZE;
+    for (uint64_t i = 0; i < count; i++) {
+        const uint8_t* p = entries + i * FILE_ENTRY_SIZE;
+        const uint64_t at = get_le(p + 8, 8);
+        const uint64_t strings = get_le(p + 16, 4) + get_le(p + 20, 4) + get_le(p + 24, 4); // can't overflow
+        if (at > arena_size || strings > arena_size - at) throw bad("entry " + std::to_string(i) + " is outside the strings");
+    }
+    const char* arena = reinterpret_cast<const char*>(buf + bloom_at + bloom_bytes);
+    std::vector<std::string> regexes;
+    for (uint64_t i = 0; i < npatterns; i++) {
+        const uint8_t* p = entries + count * FILE_ENTRY_SIZE + i * 16;
+        const uint64_t at = get_le(p, 8);
+        const uint64_t plen = get_le(p + 8, 4);
+        if (at > arena_size || plen > arena_size - at) throw bad("pattern " + std::to_string(i) + " is outside the strings");
+        regexes.push_back(std::string(arena + at, plen));
+    }
+    for (const auto& it : regexes) patterns.push_back(it);
+    attached_entries = entries;
+    attached_bloom = buf + bloom_at;
+    attached_bloom_bits = bloom_bytes * 8;
+    attached_arena = arena;
+    attached_count = count;
+    attached = std::move(map);
+}
+
+/* Written to a temporary file that is renamed over fname, so fname can be the attached file */
+void word_and_context_list::save(const std::filesystem::path& fname) const {
+    struct item_t {
+        uint64_t hash;
+        uint64_t bloom;
+        entry_view e;
+        bool operator<(const item_t& b) const {
+            return std::tie(hash, e.feature, e.before, e.after) < std::tie(b.hash, b.e.feature, b.e.before, b.e.after);
+        }
+        bool operator==(const item_t& b) const {
+            return hash == b.hash && e.feature == b.e.feature && e.before == b.e.before && e.after == b.e.after;
+        }
+    };
+    std::vector<item_t> items;
+    items.reserve(contexts.size() + attached_count);
+    auto add = [&items](const entry_view& e) {
+        const hash128_t h = fast_hash128(reinterpret_cast<const uint8_t*>(e.feature.data()), e.feature.size());
+        items.push_back(item_t{h.hi, h.lo, e});
+    };
+    for (const auto& it : contexts) add(entry_view{it.feature, it.before, it.after});
+    for (size_t i = 0; i < attached_count; i++) add(attached_entry(i));
+    std::sort(items.begin(), items.end());
+    items.erase(std::unique(items.begin(), items.end()), items.end());
+    const std::vector<std::string>& regexes = patterns.get_regex_strings();
+
+    uint64_t bloom_bytes = 8;
+    while (bloom_bytes * 8 < items.size() * BLOOM_BITS_PER_ENTRY) bloom_bytes <<= 1;
+    std::vector<uint8_t> head(FILE_HEADER_SIZE + items.size() * FILE_ENTRY_SIZE + regexes.size() * 16 + bloom_bytes);
+    uint8_t* bloom = head.data() + head.size() - bloom_bytes;
+    std::string arena;
+    for (size_t i = 0; i < items.size(); i++) {
+        const item_t& it = items[i];
+        uint8_t* p = head.data() + FILE_HEADER_SIZE + i * FILE_ENTRY_SIZE;
+        put_le(p, it.hash, 8);
+        put_le(p + 8, arena.size(), 8);
+        put_le(p + 16, it.e.feature.size(), 4);
+        put_le(p + 20, it.e.before.size(), 4);
+        put_le(p + 24, it.e.after.size(), 4);
+        arena.append(it.e.feature).append(it.e.before).append(it.e.after);
+        for (unsigned int k = 0; k < BLOOM_HASHES; k++) {
+            const uint64_t bit = (it.bloom + k * (it.hash | 1)) & (bloom_bytes * 8 - 1);
+            bloom[bit >> 3] |= 1 << (bit & 7);
+        }
+    }
+    for (size_t i = 0; i < regexes.size(); i++) {
+        uint8_t* p = head.data() + FILE_HEADER_SIZE + items.size() * FILE_ENTRY_SIZE + i * 16;
+        put_le(p, arena.size(), 8);
+        put_le(p + 8, regexes[i].size(), 4);
+        arena.append(regexes[i]);
+    }
+    memcpy(head.data(), FILE_MAGIC, 8);
+    put_le(head.data() + 8, FILE_VERSION, 4);
+    put_le(head.data() + 12, FILE_ENTRY_SIZE, 4);
+    put_le(head.data() + 16, items.size(), 8);
+    put_le(head.data() + 24, regexes.size(), 8);
+    put_le(head.data() + 32, bloom_bytes, 8);
+    put_le(head.data() + 40, arena.size(), 8);
+
+    const std::filesystem::path tmp = fname.string() + ".tmp";
+    std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+    os.write(reinterpret_cast<const char*>(head.data()), head.size());
+    os.write(arena.data(), arena.size());
+    os.close();
+    if (!os) { throw std::runtime_error("word_and_context_list::save: cannot write " + tmp.string()); }
+    std::filesystem::rename(tmp, fname);
 }
 
 void word_and_context_list::dump() {
     std::cout << "dump context list:\n";
-    for (auto const& it : fcmap) { std::cout << it.first << " = " << it.second << "\n"; }
+    for (auto const& it : fcmap) { std::cout << it.first << " = " << *it.second << "\n"; }
     std::cout << "dump RE list:\n";
     patterns.dump(std::cout);
 }
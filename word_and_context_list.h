@@ -20,6 +20,17 @@
  * The stop list contains is a map of features that are stopped.
  * For each feature, there may be no context or a list of context.
  * If there is no context and the feature is in the list,
+ *
+ * Checking is done on string_views and allocates nothing: the features are hashed, the context is only
+ * split into before and after if the feature is in the list with a context, and the regular expressions
+ * (all scanned at once by a regex_engine) are only tried if the feature is not in the list.
+ *
+ * Compiled lists: save() writes the list in a binary form that attach() maps and uses where it lies, so a
+ * list of tens of millions of entries loads at once and is shared by every process through the page cache.
+ * readfile() attaches a file in this form rather than parsing it. The file has a FILE_HEADER_SIZE header,
+ * the entries as FILE_ENTRY_SIZE records sorted by a 64-bit hash of the feature (for a binary search),
+ * the regular expressions, a Bloom filter of the features in front of the search, and the strings.
+ * All numbers are little-endian, whatever the host.
  */
 
 /*
@@ -28,31 +39,41 @@
  */
 
 #include <algorithm>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <map> // brings in map and multimap
 #include <set>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 
+#include <filesystem>
+#include <memory>
+
 #include "regex_vector.h"
 
 class context {
 public:
+    /* The text of ctx before and after the first place feature occurs in it; both empty if it doesn't */
+    static void extract_before_after(std::string_view feature, std::string_view ctx, std::string_view& before,
+                                     std::string_view& after) {
+        const size_t i = feature.empty() ? std::string_view::npos : ctx.find(feature);
+        if (i == std::string_view::npos) {
+            before = std::string_view(); // can't be done
+            after = std::string_view();
+            return;
+        }
+        before = ctx.substr(0, i);
+        after = ctx.substr(i + feature.size());
+    }
     static void extract_before_after(const std::string& feature, const std::string& ctx, std::string& before,
                                      std::string& after) {
-        if (feature.size() <= ctx.size()) {
-            /* The most simple algorithm is a sliding window */
-            for (size_t i = 0; i < ctx.size() - feature.size(); i++) {
-                if (ctx.substr(i, feature.size()) == feature) {
-                    before = ctx.substr(0, i);
-                    after = ctx.substr(i + feature.size());
-                    return;
-                }
-            }
-        }
-        before.clear(); // can't be done
-        after.clear();
+        std::string_view b, a;
+        extract_before_after(std::string_view(feature), std::string_view(ctx), b, a);
+        before = b;
+        after = a;
     }
 
     // constructors to make a context with nothing before or after, with just a context, or with all three
@@ -80,45 +101,69 @@ inline bool operator==(const class context& a, const class context& b) {
  */
 class word_and_context_list {
 private:
-    typedef std::unordered_multimap<std::string, context> stopmap_t;
+    std::deque<context> contexts{}; // every entry; a deque, so that the views of their features stay valid
+    typedef std::unordered_multimap<std::string_view, const context*> stopmap_t;
     stopmap_t fcmap; // maps features to contexts; for finding them
 
     typedef std::unordered_set<std::string> stopset_t;
     stopset_t context_set; // presence of a pair in fcmap
 
     regex_vector patterns;
+    void insert(context&& ctx);
+    size_t memory_bytes{0}; // estimated memory used by the entries in memory; kept by insert() and add_regex()
+
+    /* the attached file */
+    std::unique_ptr<class sbuf_t> attached{}; // mapped
+    const uint8_t* attached_entries{nullptr};
+    size_t attached_count{0};
+    const uint8_t* attached_bloom{nullptr};
+    uint64_t attached_bloom_bits{0};          // a power of 2
+    const char* attached_arena{nullptr};
+    struct entry_view {
+        std::string_view feature, before, after;
+    };
+    entry_view attached_entry(size_t i) const;
+
+    /* the literal entries for probe match; ctx is split into before and after only if it is needed */
+    bool check_literals(std::string_view probe, const std::string_view* ctx, std::string_view before,
+                        std::string_view after) const;
 
 public:
+    static inline const char FILE_MAGIC[9] = "BE13STOP";
+    static inline const uint32_t FILE_VERSION = 1;
+    static inline const size_t FILE_HEADER_SIZE = 64;
+    static inline const size_t FILE_ENTRY_SIZE = 32;
+    static inline const unsigned int BLOOM_HASHES = 7;
+    static inline const unsigned int BLOOM_BITS_PER_ENTRY = 10; // about 1% false positives
+
     /**
      * rstrcmp is like strcmp, except it compares std::strings right-aligned
      * and only compares the minimum sized std::string of the two.
      */
-    static int rstrcmp(const std::string& a, const std::string& b);
+    static int rstrcmp(std::string_view a, std::string_view b);
 
     word_and_context_list() : fcmap(), context_set(), patterns() {}
-    size_t size() { return fcmap.size() + patterns.size(); }
+    ~word_and_context_list();
+    size_t size() { return fcmap.size() + attached_count + patterns.size(); }
+    size_t bytes() const { return memory_bytes; } // not counting an attached file, which is mapped
     void add_regex(const std::string& pat);                  // not threadsafe
     bool add_fc(const std::string& f, const std::string& c); // not threadsafe
     int readfile(const std::string& fname);                  // not threadsafe
+    void attach(const std::filesystem::path& fname);         // a saved list; once only; throws std::runtime_error
+    void save(const std::filesystem::path& fname) const;     // everything in the list; throws std::runtime_error
+    size_t attached_size() const { return attached_count; }
 
     // return true if the probe with context is in the list or in the stopmap
-    bool check(const std::string& probe, const std::string& before, const std::string& after) const; // threadsafe
-    bool check_feature_context(const std::string& probe, const std::string& context) const;          // threadsafe
+    bool check(std::string_view probe, std::string_view before, std::string_view after) const; // threadsafe
+    bool check_feature_context(std::string_view probe, std::string_view context) const;        // threadsafe
     void dump();
 };
 
 /* like strcmp, but runs in reverse */
-inline int word_and_context_list::rstrcmp(const std::string& a, const std::string& b) {
-    size_t alen = a.size();
-    size_t blen = b.size();
-    size_t len = alen < blen ? alen : blen;
-    for (size_t i = 0; i < len; i++) {
-        size_t apos = alen - len + i;
-        size_t bpos = blen - len + i;
-        if (a[apos] < b[bpos]) return -1;
-        if (a[apos] > b[bpos]) return 1;
-    }
-    return 0;
+inline int word_and_context_list::rstrcmp(std::string_view a, std::string_view b) {
+    const size_t len = std::min(a.size(), b.size());
+    const int r = memcmp(a.data() + a.size() - len, b.data() + b.size() - len, len);
+    return r < 0 ? -1 : (r > 0 ? 1 : 0);
 }
 
 #endif